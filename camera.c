@@ -4,6 +4,7 @@
 static const float MAX_VERTICAL_ANGLE = 85.0f;
 
 static void normalize_angles(Camera *camera);
+static void camera_update_orientation(Camera *camera);
 
 int camera_init(Camera *camera) {
   camera->pos[0] = 0.0;
@@ -16,18 +17,29 @@ int camera_init(Camera *camera) {
   camera->far_plane = 2500.0f;
   camera->viewport_aspect_ratio = 4.0f/3.0f;
   camera->gdegrees_rotated = 0.0;
+  camera->dirty = CAMERA_DIRTY_ALL;
+  camera_update(camera);
   return STATUS_OK;
 }
 
 void camera_offset_position(Camera *camera, vec3 offset) {
   glm_vec3_add(camera->pos, offset, camera->pos);
+  camera->dirty |= CAMERA_DIRTY_VIEW;
 }
 
 void camera_orientation(Camera *camera, mat4 m) {
-  float vertrad = glm_rad(camera->vertical_angle);
-  float horizrad = glm_rad(camera->horizontal_angle);
-  glm_rotate_make(m, vertrad, (vec3){1.0,0.0,0.0});
-  glm_rotate(m, horizrad, (vec3){0.0,1.0,0.0});
+  camera_update_orientation(camera);
+  glm_mat4_copy(camera->orientation, m);
+}
+
+void camera_update_orientation(Camera *camera) {
+  if (camera->dirty & CAMERA_DIRTY_ORIENTATION) {
+    float vertrad = glm_rad(camera->vertical_angle);
+    float horizrad = glm_rad(camera->horizontal_angle);
+    glm_rotate_make(camera->orientation, vertrad, (vec3){1.0,0.0,0.0});
+    glm_rotate(camera->orientation, horizrad, (vec3){0.0,1.0,0.0});
+    camera->dirty &= ~CAMERA_DIRTY_ORIENTATION;
+  }
 }
 
 void camera_offset_orientation(Camera *camera, float upAngle, float rightAngle) {
@@ -50,34 +62,35 @@ void camera_lookat(Camera *camera, vec3 position) {
   normalize_angles(camera);
 }
 
+/*
+ * The orientation is a pure rotation, so its inverse is its transpose and 
+ * the camera's basis vectors are the rows of the orientation.
+ */
 void camera_forward(Camera *camera, vec3 result) {
-  vec4 forward;
-  mat4 orientation;
+  mat4 *o = &camera->orientation;
 
-  camera_orientation(camera, orientation);
-  glm_mat4_inv(orientation, orientation);
-  glm_mat4_mulv(orientation, (vec4){0,0,-1,1}, forward);
-  glm_vec3(forward, result);
+  camera_update_orientation(camera);
+  result[0] = -(*o)[0][2];
+  result[1] = -(*o)[1][2];
+  result[2] = -(*o)[2][2];
 }
 
 void camera_right(Camera *camera, vec3 result) {
-  vec4 right;
-  mat4 orientation;
+  mat4 *o = &camera->orientation;
 
-  camera_orientation(camera, orientation);
-  glm_mat4_inv(orientation, orientation);
-  glm_mat4_mulv(orientation, (vec4){1,0,0,1}, right);
-  glm_vec3(right, result);
+  camera_update_orientation(camera);
+  result[0] = (*o)[0][0];
+  result[1] = (*o)[1][0];
+  result[2] = (*o)[2][0];
 }
 
 void camera_up(Camera *camera, vec3 result) {
-  vec4 up;
-  mat4 orientation;
+  mat4 *o = &camera->orientation;
 
-  camera_orientation(camera, orientation);
-  glm_mat4_inv(orientation, orientation);
-  glm_mat4_mulv(orientation, (vec4){0,1,0,1}, up);
-  glm_vec3(up, result);
+  camera_update_orientation(camera);
+  result[0] = (*o)[0][1];
+  result[1] = (*o)[1][1];
+  result[2] = (*o)[2][1];
 }
 
 void camera_pos(Camera *camera, mat4 result) {
@@ -99,35 +112,65 @@ void normalize_angles(Camera *camera) {
 
   camera->horizontal_angle = horiz;
   camera->vertical_angle = vert;
+  camera->dirty |= CAMERA_DIRTY_ORIENTATION | CAMERA_DIRTY_VIEW;
 }
 
 
 void camera_get_matrix(Camera *camera, mat4 result) {
-  mat4 v;
-  camera_projection(camera, result);
-  camera_view(camera, v);
-  glm_mat4_mul(result, v, result);
+  camera_update(camera);
+  glm_mat4_copy(camera->viewproj, result);
 }
 
 void camera_projection(Camera *camera, mat4 result) {
-  glm_perspective(
-      glm_rad(camera->field_of_view), 
-      camera->viewport_aspect_ratio, 
-      camera->near_plane, 
-      camera->far_plane, 
-      result
-      );
+  camera_update(camera);
+  glm_mat4_copy(camera->projection, result);
 }
 
 void camera_view(Camera *camera, mat4 result) {
+  camera_update(camera);
+  glm_mat4_copy(camera->view, result);
+}
+
+/*
+ * Recomputes whatever the dirty bits say is stale. Called once a frame 
+ * after input has moved the camera; the getters call it too, so they 
+ * never return stale data, but it does nothing if the camera didn't move.
+ */
+void camera_update(Camera *camera) {
   vec3 npos;
   mat4 translate;
 
+  if (!camera->dirty)
+    return;
+  if (camera->dirty & CAMERA_DIRTY_PROJECTION) {
+    glm_perspective(
+        glm_rad(camera->field_of_view), 
+        camera->viewport_aspect_ratio, 
+        camera->near_plane, 
+        camera->far_plane, 
+        camera->projection
+        );
+  }
+  camera_update_orientation(camera);
   npos[0] = -camera->pos[0];
   npos[1] = -camera->pos[1];
   npos[2] = -camera->pos[2];
-  camera_orientation(camera, result);
   glm_translate_make(translate, npos);	
-  glm_mat4_mul(result, translate, result);
+  glm_mat4_mul(camera->orientation, translate, camera->view);
+  glm_mat4_mul(camera->projection, camera->view, camera->viewproj);
+  glm_frustum_planes(camera->viewproj, camera->frustum);
+  camera->dirty = 0;
+}
+
+/*
+ * Tests a world space bounding box against the cached frustum planes.
+ */
+bool camera_box_visible(Camera *camera, vec3 min, vec3 max) {
+  vec3 box[2];
+
+  camera_update(camera);
+  glm_vec3_copy(min, box[0]);
+  glm_vec3_copy(max, box[1]);
+  return glm_aabb_frustum(box, camera->frustum);
 }
 
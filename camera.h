@@ -2,9 +2,20 @@
 #define __camera_h__
 
 #include <cglm/cglm.h>
+#include <stdbool.h>
+
+#define CAMERA_DIRTY_ORIENTATION 0x1
+#define CAMERA_DIRTY_VIEW 0x2
+#define CAMERA_DIRTY_PROJECTION 0x4
+#define CAMERA_DIRTY_ALL 0x7
 
 typedef struct Camera Camera;
 
+/*
+ * Matrices and frustum planes are cached and only recomputed by 
+ * camera_update when something they depend on changed. Code changing the 
+ * fields directly has to set the matching dirty bits.
+ */
 struct Camera {
 	vec3 pos;
 	float horizontal_angle;
@@ -15,6 +26,12 @@ struct Camera {
 	float viewport_aspect_ratio;
 	float gdegrees_rotated;
 	float scrolly;
+	unsigned dirty;
+	mat4 orientation;
+	mat4 view;
+	mat4 projection;
+	mat4 viewproj;
+	vec4 frustum[6];
 };
 
 extern int camera_init(Camera *camera);
@@ -29,6 +46,8 @@ extern void camera_pos(Camera *camera, mat4 result);
 extern void camera_get_matrix(Camera *camera, mat4 result);
 extern void camera_projection(Camera *camera, mat4 result);
 extern void camera_view(Camera *camera, mat4 result);
+extern void camera_update(Camera *camera);
+extern bool camera_box_visible(Camera *camera, vec3 min, vec3 max);
 
 #endif
 
@@ -0,0 +1,501 @@
+#include "collision.h"
+#include "common/log.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+static unsigned s_coll_hash(const int key[3]);
+static coll_cell_s *s_coll_cell_get(coll_grid_s *grid, const int key[3], bool create);
+static void s_coll_cell_range(coll_grid_s *grid, vec3 min, vec3 max, int cmin[3], int cmax[3]);
+static bool s_coll_is_oversized(coll_body_s *body);
+static bool s_coll_is_dynamic(coll_body_s *body);
+static void s_coll_body_add(coll_grid_s *grid, coll_body_s *body);
+static int s_coll_update_groups(coll_grid_s *grid, PointerVector *groups);
+static void s_coll_grid_insert(coll_grid_s *grid, coll_body_s *body);
+static void s_coll_grid_remove(coll_grid_s *grid, coll_body_s *body);
+static void s_coll_body_move(coll_grid_s *grid, coll_body_s *body);
+static void s_coll_query(coll_grid_s *grid, coll_body_s *a);
+static void s_coll_test(coll_grid_s *grid, coll_body_s *a, coll_body_s *b);
+static void s_coll_resolve(coll_body_s *a, coll_body_s *b, vec3 c, vec3 q, float r, float dist2);
+static void s_coll_add_transforms(coll_grid_s *grid, Model *m, float *transforms, size_t count);
+static int s_coll_space_reset(PointerVector **space);
+static void s_coll_space_free(PointerVector **space);
+static void s_pointer_vector_remove(PointerVector *pv, void *p);
+
+coll_grid_s *coll_grid_new(float cellSize) {
+	coll_grid_s *grid = calloc(1, sizeof *grid);
+	if (!grid) {
+		log_error("failed to allocate memory for collision grid");
+		return NULL;
+	}
+	if (cellSize <= 0.0f)
+		cellSize = COLL_DEFAULT_CELL_SIZE;
+	grid->cellSize = cellSize;
+	grid->invCellSize = 1.0f / cellSize;
+	pointer_vector_init(&grid->bodies);
+	pointer_vector_init(&grid->oversized);
+	return grid;
+}
+
+void coll_grid_free(coll_grid_s *grid) {
+	size_t i;
+
+	if (!grid)
+		return;
+	for (i = 0; i < COLL_GRID_TABLE_SIZE; i++) {
+		coll_cell_s *cell = grid->table[i], *next;
+		while (cell) {
+			next = cell->next;
+			pointer_vector_free(&cell->bodies);
+			free(cell);
+			cell = next;
+		}
+	}
+	for (i = 0; i < grid->bodies.size; i++) {
+		coll_body_s *body = grid->bodies.buffer[i];
+		if (body->inst) {
+			body->inst->collisionBody = NULL;
+			s_coll_space_free(&body->inst->collision_space);
+			s_coll_space_free(&body->inst->gravity_space);
+		}
+		free(body);
+	}
+	pointer_vector_free(&grid->bodies);
+	pointer_vector_free(&grid->oversized);
+	free(grid);
+}
+
+/*
+ * Picks a cell size of about twice the average instance extent, so most
+ * bodies overlap no more than 8 cells.
+ */
+float coll_suggest_cell_size(Level *level) {
+	size_t i, j, k, n = 0;
+	double total = 0.0;
+	vec3 min, max;
+	PointerVector *groups[] = {&level->instances, &level->dynamics};
+
+	for (k = 0; k < 2; k++) {
+		for (i = 0; i < groups[k]->size; i++) {
+			InstanceGroup *ig = groups[k]->buffer[i];
+			for (j = 0; j < ig->instances.size; j++) {
+				Instance *inst = ig->instances.buffer[j];
+				instance_get_aabb(inst, min, max);
+				total += fmaxf(max[0] - min[0], fmaxf(max[1] - min[1], max[2] - min[2]));
+				n++;
+			}
+		}
+	}
+	if (!n || total <= 0.0)
+		return COLL_DEFAULT_CELL_SIZE;
+	return 2.0 * total / n;
+}
+
+/*
+ * Range geometry never moves, so the instances expanded when the level was
+ * loaded are kept in the grid as static bodies.
+ */
+void coll_grid_add_ranges(coll_grid_s *grid, Level *level) {
+	size_t i, j;
+
+	for (i = 0; i < level->ranges.size; i++) {
+		RangeRoot *rangeRoot = level->ranges.buffer[i];
+		s_coll_add_transforms(grid, rangeRoot->m, rangeRoot->expanded, rangeRoot->nexpanded);
+		for (j = 0; j < rangeRoot->baked.size; j++) {
+			LazyInstance *li = rangeRoot->baked.buffer[j];
+			s_coll_add_transforms(grid, li->model, li->baked, li->nbaked);
+		}
+	}
+	log_debug("collision grid has %zu bodies, cell size %f", grid->bodies.size, grid->cellSize);
+}
+
+/*
+ * Adds a body per transform, laid out as position, scale and rotation the
+ * way baked and expanded ranges are.
+ */
+void s_coll_add_transforms(coll_grid_s *grid, Model *m, float *transforms, size_t count) {
+	size_t i;
+	versor q;
+
+	for (i = 0; i < count; i++) {
+		float *pos = &transforms[i * BOB_BAKED_STRIDE];
+		coll_body_s *body = calloc(1, sizeof *body);
+		if (!body) {
+			log_error("failed to allocate memory for collision body");
+			return;
+		}
+		euler_to_quat(pos + 6, q);
+		model_get_aabb(m, pos, pos + 3, q, body->min, body->max);
+		s_coll_body_add(grid, body);
+		s_coll_grid_insert(grid, body);
+	}
+}
+
+/*
+ * Runs once per physics step: moves every instance body to the cells it
+ * now covers, skipping bodies whose cell range didn't change, then queries
+ * the neighbourhood of each moving body. Broadphase neighbours are stored
+ * in gravity_space and narrowphase hits in collision_space.
+ */
+void coll_update(Level *level) {
+	size_t i, j;
+	coll_grid_s *grid = level->collisionGrid;
+
+	if (!grid)
+		return;
+	grid->tests = 0;
+	grid->hits = 0;
+
+	if (s_coll_update_groups(grid, &level->instances) < 0 
+			|| s_coll_update_groups(grid, &level->dynamics) < 0)
+		return;
+
+	/* only instances in dynamics ever move */
+	for (i = 0; i < level->dynamics.size; i++) {
+		InstanceGroup *ig = level->dynamics.buffer[i];
+		for (j = 0; j < ig->instances.size; j++) {
+			Instance *inst = ig->instances.buffer[j];
+			if (s_coll_is_dynamic(inst->collisionBody))
+				s_coll_query(grid, inst->collisionBody);
+		}
+	}
+}
+
+int s_coll_update_groups(coll_grid_s *grid, PointerVector *groups) {
+	size_t i, j;
+
+	for (i = 0; i < groups->size; i++) {
+		InstanceGroup *ig = groups->buffer[i];
+		for (j = 0; j < ig->instances.size; j++) {
+			Instance *inst = ig->instances.buffer[j];
+			if (s_coll_space_reset(&inst->collision_space) < 0
+					|| s_coll_space_reset(&inst->gravity_space) < 0)
+				return -1;
+			if (!inst->collisionBody) {
+				coll_body_s *body = calloc(1, sizeof *body);
+				if (!body) {
+					log_error("failed to allocate memory for collision body");
+					return -1;
+				}
+				body->inst = inst;
+				inst->collisionBody = body;
+				s_coll_body_add(grid, body);
+			}
+			s_coll_body_move(grid, inst->collisionBody);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Bodies of streamed instances leave the grid when their cell is unloaded.
+ */
+void coll_remove_instance(coll_grid_s *grid, Instance *inst) {
+	coll_body_s *body = inst->collisionBody, *last;
+
+	if (!grid || !body)
+		return;
+	if (body->isInGrid)
+		s_coll_grid_remove(grid, body);
+	last = grid->bodies.buffer[--grid->bodies.size];
+	grid->bodies.buffer[body->index] = last;
+	last->index = body->index;
+	inst->collisionBody = NULL;
+	free(body);
+	/* the instance goes back to a pool that's freed with the level, its spaces wouldn't be */
+	s_coll_space_free(&inst->collision_space);
+	s_coll_space_free(&inst->gravity_space);
+}
+
+/*
+ * Bodies remember their place in grid->bodies so they can be removed 
+ * without searching for them.
+ */
+void s_coll_body_add(coll_grid_s *grid, coll_body_s *body) {
+	body->index = grid->bodies.size;
+	pointer_vector_add(&grid->bodies, body);
+}
+
+unsigned s_coll_hash(const int key[3]) {
+	unsigned h = (unsigned)key[0] * 73856093u
+		^ (unsigned)key[1] * 19349663u
+		^ (unsigned)key[2] * 83492791u;
+	return h & (COLL_GRID_TABLE_SIZE - 1);
+}
+
+coll_cell_s *s_coll_cell_get(coll_grid_s *grid, const int key[3], bool create) {
+	unsigned h = s_coll_hash(key);
+	coll_cell_s *cell;
+
+	for (cell = grid->table[h]; cell; cell = cell->next) {
+		if (cell->key[0] == key[0] && cell->key[1] == key[1] && cell->key[2] == key[2])
+			return cell;
+	}
+	if (!create)
+		return NULL;
+	cell = malloc(sizeof *cell);
+	if (!cell) {
+		log_error("failed to allocate memory for collision cell");
+		return NULL;
+	}
+	cell->key[0] = key[0];
+	cell->key[1] = key[1];
+	cell->key[2] = key[2];
+	pointer_vector_init(&cell->bodies);
+	cell->next = grid->table[h];
+	grid->table[h] = cell;
+	return cell;
+}
+
+void s_coll_cell_range(coll_grid_s *grid, vec3 min, vec3 max, int cmin[3], int cmax[3]) {
+	int k;
+
+	for (k = 0; k < 3; k++) {
+		cmin[k] = (int)floorf(min[k] * grid->invCellSize);
+		cmax[k] = (int)floorf(max[k] * grid->invCellSize);
+	}
+}
+
+bool s_coll_is_oversized(coll_body_s *body) {
+	size_t span = 1;
+	int k;
+
+	for (k = 0; k < 3; k++) {
+		span *= (size_t)(body->cellMax[k] - body->cellMin[k]) + 1;
+		if (span > COLL_MAX_CELL_SPAN)
+			return true;
+	}
+	return false;
+}
+
+/* sleeping bodies don't move, so they pair up like static ones */
+bool s_coll_is_dynamic(coll_body_s *body) {
+	return body->inst && !body->inst->isStatic && !body->inst->isSleeping;
+}
+
+void s_coll_grid_insert(coll_grid_s *grid, coll_body_s *body) {
+	int key[3];
+
+	s_coll_cell_range(grid, body->min, body->max, body->cellMin, body->cellMax);
+	body->isInGrid = true;
+	if (s_coll_is_oversized(body)) {
+		pointer_vector_add(&grid->oversized, body);
+		return;
+	}
+	for (key[0] = body->cellMin[0]; key[0] <= body->cellMax[0]; key[0]++) {
+		for (key[1] = body->cellMin[1]; key[1] <= body->cellMax[1]; key[1]++) {
+			for (key[2] = body->cellMin[2]; key[2] <= body->cellMax[2]; key[2]++) {
+				coll_cell_s *cell = s_coll_cell_get(grid, key, true);
+				if (cell)
+					pointer_vector_add(&cell->bodies, body);
+			}
+		}
+	}
+}
+
+void s_coll_grid_remove(coll_grid_s *grid, coll_body_s *body) {
+	int key[3];
+
+	body->isInGrid = false;
+	if (s_coll_is_oversized(body)) {
+		s_pointer_vector_remove(&grid->oversized, body);
+		return;
+	}
+	for (key[0] = body->cellMin[0]; key[0] <= body->cellMax[0]; key[0]++) {
+		for (key[1] = body->cellMin[1]; key[1] <= body->cellMax[1]; key[1]++) {
+			for (key[2] = body->cellMin[2]; key[2] <= body->cellMax[2]; key[2]++) {
+				coll_cell_s *cell = s_coll_cell_get(grid, key, false);
+				if (cell)
+					s_pointer_vector_remove(&cell->bodies, body);
+			}
+		}
+	}
+}
+
+void s_coll_body_move(coll_grid_s *grid, coll_body_s *body) {
+	int cmin[3], cmax[3];
+
+	instance_get_aabb(body->inst, body->min, body->max);
+	s_coll_cell_range(grid, body->min, body->max, cmin, cmax);
+	if (body->isInGrid
+			&& cmin[0] == body->cellMin[0] && cmin[1] == body->cellMin[1] && cmin[2] == body->cellMin[2]
+			&& cmax[0] == body->cellMax[0] && cmax[1] == body->cellMax[1] && cmax[2] == body->cellMax[2])
+		return;
+	if (body->isInGrid)
+		s_coll_grid_remove(grid, body);
+	s_coll_grid_insert(grid, body);
+}
+
+/*
+ * Every pair involving a moving body is tested exactly once: pairs of
+ * moving bodies are owned by the body at the lower address, and a pair
+ * sharing several cells is only tested in the cell at the low corner of
+ * the overlap of their cell ranges.
+ */
+void s_coll_query(coll_grid_s *grid, coll_body_s *a) {
+	size_t i;
+	int k, key[3];
+
+	if (s_coll_is_oversized(a)) {
+		for (i = 0; i < grid->bodies.size; i++) {
+			coll_body_s *b = grid->bodies.buffer[i];
+			if (b == a)
+				continue;
+			if (s_coll_is_dynamic(b) && s_coll_is_oversized(b) && (uintptr_t)b < (uintptr_t)a)
+				continue;
+			s_coll_test(grid, a, b);
+		}
+		return;
+	}
+
+	for (key[0] = a->cellMin[0]; key[0] <= a->cellMax[0]; key[0]++) {
+		for (key[1] = a->cellMin[1]; key[1] <= a->cellMax[1]; key[1]++) {
+			for (key[2] = a->cellMin[2]; key[2] <= a->cellMax[2]; key[2]++) {
+				coll_cell_s *cell = s_coll_cell_get(grid, key, false);
+				if (!cell)
+					continue;
+				for (i = 0; i < cell->bodies.size; i++) {
+					coll_body_s *b = cell->bodies.buffer[i];
+					if (b == a)
+						continue;
+					if (s_coll_is_dynamic(b) && (uintptr_t)b < (uintptr_t)a)
+						continue;
+					for (k = 0; k < 3; k++) {
+						int lo = a->cellMin[k] > b->cellMin[k] ? a->cellMin[k] : b->cellMin[k];
+						if (lo != key[k])
+							break;
+					}
+					if (k == 3)
+						s_coll_test(grid, a, b);
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < grid->oversized.size; i++) {
+		coll_body_s *b = grid->oversized.buffer[i];
+		if (!s_coll_is_dynamic(b))
+			s_coll_test(grid, a, b);
+	}
+}
+
+/*
+ * Narrowphase treats the moving body a as a sphere enclosed by its box
+ * and tests it against the box of b.
+ */
+void s_coll_test(coll_grid_s *grid, coll_body_s *a, coll_body_s *b) {
+	int k;
+	vec3 c, q;
+	float r = 0.0f, dist2 = 0.0f;
+
+	grid->tests++;
+	for (k = 0; k < 3; k++) {
+		if (a->max[k] < b->min[k] || a->min[k] > b->max[k])
+			return;
+	}
+	if (b->inst) {
+		pointer_vector_add(a->inst->gravity_space, b->inst);
+		pointer_vector_add(b->inst->gravity_space, a->inst);
+	}
+
+	for (k = 0; k < 3; k++) {
+		float d;
+		c[k] = 0.5f * (a->min[k] + a->max[k]);
+		r = fmaxf(r, 0.5f * (a->max[k] - a->min[k]));
+		q[k] = fminf(fmaxf(c[k], b->min[k]), b->max[k]);
+		d = c[k] - q[k];
+		dist2 += d * d;
+	}
+	if (dist2 > r * r)
+		return;
+
+	grid->hits++;
+	if (b->inst) {
+		pointer_vector_add(a->inst->collision_space, b->inst);
+		pointer_vector_add(b->inst->collision_space, a->inst);
+	}
+	if (!s_coll_is_dynamic(b))
+		s_coll_resolve(a, b, c, q, r, dist2);
+}
+
+/*
+ * Pushes a moving body out of static geometry along the contact normal
+ * and removes the part of its velocity heading into the surface.
+ */
+void s_coll_resolve(coll_body_s *a, coll_body_s *b, vec3 c, vec3 q, float r, float dist2) {
+	int k, axis = 0;
+	float depth, vn;
+	vec3 n = {0, 0, 0}, offset;
+	Instance *inst = a->inst;
+
+	if (dist2 > 1e-12f) {
+		float dist = sqrtf(dist2);
+		glm_vec3_sub(c, q, n);
+		glm_vec3_scale(n, 1.0f / dist, n);
+		depth = r - dist;
+	}
+	else {
+		/* center is inside the box, leave through the nearest face */
+		float best = INFINITY, sign = 1.0f;
+		for (k = 0; k < 3; k++) {
+			float lo = c[k] - b->min[k], hi = b->max[k] - c[k];
+			if (lo < best) {
+				best = lo;
+				axis = k;
+				sign = -1.0f;
+			}
+			if (hi < best) {
+				best = hi;
+				axis = k;
+				sign = 1.0f;
+			}
+		}
+		n[axis] = sign;
+		depth = best + r;
+	}
+
+	glm_vec3_scale(n, depth, offset);
+	glm_vec3_add(inst->pos, offset, inst->pos);
+	glm_vec3_add(a->min, offset, a->min);
+	glm_vec3_add(a->max, offset, a->max);
+
+	vn = glm_vec3_dot(inst->velocity, n);
+	if (vn < 0.0f) {
+		glm_vec3_scale(n, vn, offset);
+		glm_vec3_sub(inst->velocity, offset, inst->velocity);
+	}
+}
+
+int s_coll_space_reset(PointerVector **space) {
+	if (!*space) {
+		*space = malloc(sizeof **space);
+		if (!*space) {
+			log_error("failed to allocate memory for collision space");
+			return -1;
+		}
+		pointer_vector_init(*space);
+	}
+	else {
+		(*space)->size = 0;
+	}
+	return 0;
+}
+
+void s_coll_space_free(PointerVector **space) {
+	if (!*space)
+		return;
+	pointer_vector_free(*space);
+	free(*space);
+	*space = NULL;
+}
+
+void s_pointer_vector_remove(PointerVector *pv, void *p) {
+	size_t i;
+
+	for (i = 0; i < pv->size; i++) {
+		if (pv->buffer[i] == p) {
+			pv->buffer[i] = pv->buffer[--pv->size];
+			return;
+		}
+	}
+}
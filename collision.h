@@ -0,0 +1,53 @@
+#ifndef __collision_h__
+#define __collision_h__
+
+#include "models.h"
+
+/* buckets in the spatial hash, must be a power of two */
+#define COLL_GRID_TABLE_SIZE 4096
+/* bodies covering more cells than this are tested against every body */
+#define COLL_MAX_CELL_SPAN 64
+#define COLL_DEFAULT_CELL_SIZE 16.0f
+
+typedef struct coll_body_s coll_body_s;
+typedef struct coll_cell_s coll_cell_s;
+typedef struct coll_grid_s coll_grid_s;
+
+/*
+ * A collidable box. Bodies of instances follow the instance around,
+ * bodies without an instance are static level geometry baked from ranges.
+ */
+struct coll_body_s {
+	Instance *inst;
+	size_t index;
+	vec3 min;
+	vec3 max;
+	int cellMin[3];
+	int cellMax[3];
+	bool isInGrid;
+};
+
+struct coll_cell_s {
+	int key[3];
+	PointerVector bodies;
+	coll_cell_s *next;
+};
+
+struct coll_grid_s {
+	float cellSize;
+	float invCellSize;
+	coll_cell_s *table[COLL_GRID_TABLE_SIZE];
+	PointerVector bodies;
+	PointerVector oversized;
+	size_t tests;
+	size_t hits;
+};
+
+extern coll_grid_s *coll_grid_new(float cellSize);
+extern void coll_grid_free(coll_grid_s *grid);
+extern float coll_suggest_cell_size(Level *level);
+extern void coll_grid_add_ranges(coll_grid_s *grid, Level *level);
+extern void coll_update(Level *level);
+extern void coll_remove_instance(coll_grid_s *grid, Instance *inst);
+
+#endif
@@ -1,6 +1,36 @@
 #ifndef __constants_h__
 #define __constants_h__
 
+/* floats per mesh vertex: x, y, z, u, v */
+#define BOB_VERTEX_STRIDE 5
+
+/* 
+ * user_version of level databases made from the current schema.sql. The 
+ * level compiler upgrades older databases before writing to them.
+ */
+#define BOB_SCHEMA_VERSION 3
+
+/* floats per baked lazy instance: x, y, z, scalex, scaley, scalez, rotx, roty, rotz */
+#define BOB_BAKED_STRIDE 9
+
+/*
+ * Per-frame uniform block shared by every program, bound once at 
+ * BOB_FRAME_BINDING. camera is the view-projection matrix, named after 
+ * the uniform it replaces so shader bodies need no changes. The level 
+ * compiler injects the declaration in place of "uniform mat4 camera;".
+ */
+#define BOB_FRAME_BINDING 0
+#define BOB_FRAME_BLOCK_NAME "Frame"
+#define BOB_FRAME_BLOCK_LAYOUT "layout(std140)"
+#define BOB_FRAME_BLOCK \
+  "uniform " BOB_FRAME_BLOCK_NAME " {\n" \
+  "  mat4 view;\n" \
+  "  mat4 projection;\n" \
+  "  mat4 camera;\n" \
+  "  vec4 cameraPos;\n" \
+  "  float time;\n" \
+  "};"
+
 typedef enum {
   BOB_VERTEX_SHADER,
   BOB_TESS_EVAL_SHADER,
@@ -10,5 +40,29 @@ typedef enum {
   BOB_COMPUTE_SHADER
 } bob_shader_e ;
 
-#endif
+/* 
+ * Primitive type of a mesh. Triangle strips come first so that meshes 
+ * written before the column existed keep the old behavior.
+ */
+typedef enum {
+  BOB_DRAW_TRIANGLE_STRIP,
+  BOB_DRAW_TRIANGLES,
+  BOB_DRAW_TRIANGLE_FAN,
+  BOB_DRAW_LINES,
+  BOB_DRAW_LINE_STRIP,
+  BOB_DRAW_LINE_LOOP,
+  BOB_DRAW_POINTS
+} bob_draw_e;
+
+/*
+ * Integration scheme used by a level. Semi-implicit Euler is what the 
+ * engine always did and stays the default; the other two are second 
+ * order and symplectic, so orbits stay stable at larger timesteps.
+ */
+typedef enum {
+  BOB_INTEGRATOR_SEMI_IMPLICIT_EULER,
+  BOB_INTEGRATOR_VELOCITY_VERLET,
+  BOB_INTEGRATOR_LEAPFROG
+} bob_integrator_e;
 
+#endif
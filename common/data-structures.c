@@ -133,6 +133,70 @@ int char_add_d(CharBuf *b, double d) {
 	return STATUS_OK;
 }
 
+/*
+ * Appends the shortest decimal string that reads back as exactly d. Values 
+ * with at most 9 fraction digits are formatted by hand straight into the 
+ * buffer, anything else falls back to the shortest of %.15g, %.16g, %.17g.
+ */
+int char_add_g(CharBuf *b, double d) {
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+	};
+	char digits[32], *dptr;
+	size_t olen = b->size, insert = olen, len, bsize = b->buf_size;
+	unsigned long long m;
+	double scaled;
+	int k, prec;
+	char *buffer = b->buffer;
+
+	if (olen && buffer[olen - 1] == '\0')
+		insert = olen - 1;
+
+	len = 0;
+	for (k = 0; k < sizeof pow10 / sizeof *pow10; k++) {
+		scaled = (d < 0 ? -d : d) * pow10[k];
+		if (!(scaled < 9007199254740992.0))
+			break;
+		m = (unsigned long long)(scaled + 0.5);
+		if ((d < 0 ? -(double)m : (double)m) / pow10[k] != d)
+			continue;
+		dptr = &digits[sizeof digits];
+		do {
+			*--dptr = '0' + m % 10;
+			m /= 10;
+			if (--k == 0)
+				*--dptr = '.';
+		} while (m || k >= 0);
+		if (d < 0)
+			*--dptr = '-';
+		len = &digits[sizeof digits] - dptr;
+		memmove(digits, dptr, len);
+		break;
+	}
+	if (!len) {
+		for (prec = 15; prec <= 17; prec++) {
+			len = snprintf(digits, sizeof digits, "%.*g", prec, d);
+			if (strtod(digits, NULL) == d)
+				break;
+		}
+	}
+
+	if (insert + len + 1 > bsize) {
+		do {
+			bsize *= 2;
+		} while (insert + len + 1 > bsize);
+		buffer = realloc(buffer, bsize);
+		if (!buffer)
+			return STATUS_OUT_OF_MEMORY;
+		b->buffer = buffer;
+		b->buf_size = bsize;
+	}
+	memcpy(&buffer[insert], digits, len);
+	buffer[insert + len] = '\0';
+	b->size = insert + len + 1;
+	return STATUS_OK;
+}
+
 char char_popback_c(CharBuf *b) {
 	char *p = &b->buffer[b->size - 1];	
 	char c = *p;
@@ -178,9 +242,73 @@ void float_buf_free(FloatBuf *b) {
   b->buffer = NULL;
 }
 
+void arena_init(Arena *a) {
+	a->blocks = NULL;
+	a->bytes = 0;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+	ArenaBlock *block = a->blocks;
+	size_t align = sizeof(max_align_t);
+	void *p;
+
+	size = (size + align - 1) & ~(align - 1);
+	if (!block || block->size - block->used < size) {
+		size_t bsize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof *block + bsize);
+		if (!block)
+			return NULL;
+		block->size = bsize;
+		block->used = 0;
+		/* an oversized block goes behind the current one so its free space isn't lost */
+		if (a->blocks && bsize > ARENA_BLOCK_SIZE) {
+			block->next = a->blocks->next;
+			a->blocks->next = block;
+		}
+		else {
+			block->next = a->blocks;
+			a->blocks = block;
+		}
+		a->bytes += bsize;
+	}
+	p = (char *)block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+void *arena_calloc(Arena *a, size_t size) {
+	void *p = arena_alloc(a, size);
+
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+char *arena_dup_str(Arena *a, const char *src) {
+	size_t len = strlen(src);
+	char *dupstr = arena_alloc(a, len + 1);
+
+	if (dupstr)
+		memcpy(dupstr, src, len + 1);
+	return dupstr;
+}
+
+void arena_free(Arena *a) {
+	ArenaBlock *block = a->blocks, *next;
+
+	while (block) {
+		next = block->next;
+		free(block);
+		block = next;
+	}
+	a->blocks = NULL;
+	a->bytes = 0;
+}
+
 int pointer_vector_init(PointerVector *vp) {
 	vp->size = 0;
 	vp->buf_size = INIT_VECTOR_BUF_SIZE;
+	vp->arena = NULL;
 	
 	void **buffer = malloc(INIT_VECTOR_BUF_SIZE * sizeof(*buffer));
 	if (!buffer)
@@ -190,13 +318,34 @@ int pointer_vector_init(PointerVector *vp) {
 	return STATUS_OK;
 }
 
+int pointer_vector_init_arena(PointerVector *vp, Arena *a) {
+	vp->size = 0;
+	vp->buf_size = INIT_VECTOR_BUF_SIZE;
+	vp->arena = a;
+
+	void **buffer = arena_alloc(a, INIT_VECTOR_BUF_SIZE * sizeof(*buffer));
+	if (!buffer)
+		return STATUS_OUT_OF_MEMORY;
+	vp->buffer = buffer;
+
+	return STATUS_OK;
+}
+
 int pointer_vector_add(PointerVector *vp, void *p) {
 	size_t buf_size = vp->buf_size;
 	void **buffer = vp->buffer;
 
 	if (vp->size == buf_size) {
 		buf_size *= 2;
-		buffer = realloc(buffer, buf_size * sizeof(*buffer));
+		if (vp->arena) {
+			/* the old buffer is only reclaimed with the arena */
+			buffer = arena_alloc(vp->arena, buf_size * sizeof(*buffer));
+			if (buffer)
+				memcpy(buffer, vp->buffer, vp->size * sizeof(*buffer));
+		}
+		else {
+			buffer = realloc(buffer, buf_size * sizeof(*buffer));
+		}
 		if (!buffer)
 			return STATUS_OUT_OF_MEMORY;
 		vp->buf_size = buf_size;
@@ -217,7 +366,8 @@ int pointer_vector_add_if_not_exists(PointerVector *pv, void *p) {
 }
 
 void pointer_vector_free(PointerVector *vp) {
-  free(vp->buffer);
+  if (!vp->arena)
+    free(vp->buffer);
   vp->buffer = NULL;
 }
 
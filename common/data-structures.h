@@ -3,14 +3,18 @@
 
 #include <GL/glew.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #define INIT_CHAR_BUF_SIZE 256
 #define INIT_FLOAT_BUF_SIZE 128
 #define INIT_VECTOR_BUF_SIZE 16
 #define MAP_TABLE_SIZE 53
+#define ARENA_BLOCK_SIZE 65536
 
 typedef struct CharBuf CharBuf;
 typedef struct FloatBuf FloatBuf;
+typedef struct ArenaBlock ArenaBlock;
+typedef struct Arena Arena;
 typedef struct PointerVector PointerVector;
 typedef struct PointerList PointerList;
 typedef struct StrMapEntry StrMapEntry;
@@ -30,10 +34,28 @@ struct FloatBuf {
   GLfloat *buffer;
 };
 
+/*
+ * Memory released all at once. Allocations are carved out of blocks of
+ * ARENA_BLOCK_SIZE bytes, larger ones get a block of their own.
+ */
+struct ArenaBlock {
+	ArenaBlock *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+struct Arena {
+	ArenaBlock *blocks;
+	size_t bytes;
+};
+
+/* vectors initialized with an arena grow inside it and are freed with it */
 struct PointerVector {
 	size_t size;
 	size_t buf_size;
 	void **buffer;
+	Arena *arena;
 };
 
 struct PointerList {
@@ -69,6 +91,7 @@ extern int char_add_c(CharBuf *b, char c);
 extern int char_add_s(CharBuf *b, const char *s);
 extern int char_add_i(CharBuf *b, int i);
 extern int char_add_d(CharBuf *b, double d);
+extern int char_add_g(CharBuf *b, double d);
 extern char char_popback_c(CharBuf *b);
 extern void char_buf_free(CharBuf *b);
 
@@ -76,7 +99,14 @@ extern int float_buf_init(FloatBuf *b);
 extern int float_add_f(FloatBuf *b, GLfloat f);
 extern void float_buf_free(FloatBuf *b);
 
+extern void arena_init(Arena *a);
+extern void *arena_alloc(Arena *a, size_t size);
+extern void *arena_calloc(Arena *a, size_t size);
+extern char *arena_dup_str(Arena *a, const char *src);
+extern void arena_free(Arena *a);
+
 extern int pointer_vector_init(PointerVector *pv);
+extern int pointer_vector_init_arena(PointerVector *pv, Arena *a);
 extern int pointer_vector_add(PointerVector *pv, void *p);
 extern int pointer_vector_add_if_not_exists(PointerVector *pv, void *p);
 extern void pointer_vector_free(PointerVector *pv);
@@ -0,0 +1,71 @@
+#include "pack.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Converts a float to IEEE 754 binary16, rounding to nearest even.
+ * Values too large for a half become infinity, values too small 
+ * flush through the subnormal range to zero.
+ */
+GLhalf pack_half(float f) {
+  uint32_t u, sign, mant, rem, halfway;
+  int32_t exp, shift;
+  GLhalf h;
+
+  memcpy(&u, &f, sizeof u);
+  sign = (u >> 16) & 0x8000;
+  exp = (int32_t)((u >> 23) & 0xff) - 127 + 15;
+  mant = u & 0x7fffff;
+
+  if (((u >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  if (exp >= 31)
+    return sign | 0x7c00;
+  if (exp <= 0) {
+    if (exp < -10)
+      return sign;
+    mant |= 0x800000;
+    shift = 14 - exp;
+    h = mant >> shift;
+    rem = mant & ((1u << shift) - 1);
+    halfway = 1u << (shift - 1);
+    if (rem > halfway || (rem == halfway && (h & 1)))
+      h++;
+    return sign | h;
+  }
+  h = (exp << 10) | (mant >> 13);
+  rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+    h++;
+  return sign | h;
+}
+
+float unpack_half(GLhalf h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t u;
+  float f;
+
+  if (exp == 0) {
+    if (!mant) {
+      u = sign;
+    }
+    else {
+      exp = 127 - 15 + 1;
+      while (!(mant & 0x400)) {
+        mant <<= 1;
+        exp--;
+      }
+      u = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+  }
+  else if (exp == 31) {
+    u = sign | 0x7f800000 | (mant << 13);
+  }
+  else {
+    u = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+  }
+  memcpy(&f, &u, sizeof f);
+  return f;
+}
@@ -0,0 +1,9 @@
+#ifndef __pack_h__
+#define __pack_h__
+
+#include <GL/glew.h>
+
+extern GLhalf pack_half(float f);
+extern float unpack_half(GLhalf h);
+
+#endif
@@ -5,30 +5,48 @@
 #include "glprogram.h"
 #include "models.h"
 #include "physics.h"
+#include "collision.h"
 #include "lazy_instance_engine.h"
 #include "loadlevel.h"
+#include "indirect.h"
+#include "stream.h"
+#include "occlusion.h"
+#include "sim.h"
 #include <cglm/cglm.h>
+#include <math.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include <float.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
-static void level_render(GLFWwindow *window, Level *level);
+static void level_render(GLFWwindow *window, Level *level, const sim_snapshot_s *snap, 
+    double time);
+static void render_items_collect(Level *level);
+static void render_item_add(Level *level, Model *m, InstanceGroup *ig, RangeRoot *rangeRoot);
+static int render_item_cmp(const void *a, const void *b);
+static void render_transparent(Level *level);
+static int transparent_cmp(const void *a, const void *b);
 static void render_instance_group(Level *level, InstanceGroup *ig, Camera *camera);
+static void render_model_begin(Model *m, Camera *camera);
+static void render_model_end(Level *level, Model *m);
 
 static void render_instance(Instance *instance, Camera *camera);
-static void render_instance2(Level *level, Instance *instance, mat4 cmatrix, GLint camera_handle, 
-    GLint model_handle, GLint tex_handle);
+static void render_instance2(Level *level, Instance *instance);
+static void render_snapshot(Level *level, const sim_snapshot_s *snap, double time);
 static void render_range_root(Level *level, RangeRoot *rangeRoot, Camera *camera);
-static void render_range(Level *level, Range *range, Camera *camera, Model *m, GLint model_handle, GLint camera_handle, GLint tex_handle, mat4 cmatrix);
-static void render_lazy_instance(Level *level, LazyInstance *li, Range *range, mat4 cmatrix, GLint camera_handle,
-    GLint model_handle, GLint tex_handle) ;
 static void update(GLFWwindow *window, Camera *camera, float secondsElapsed);
-static Instance *spawn_instance(Level *level);
-
-static void buffered_render(Level *level, Model *m, vec3 pos, vec3 scale);
+static void spawn_instance(sim_s *sim, Camera *camera);
+
+static void frame_ubo_init(Level *level);
+static void frame_ubo_update(Level *level, float time);
+static void buffered_render(Level *level, Model *m, vec3 pos, vec3 scale, vec3 rotation);
+static void buffered_render_stage(Level *level, Model *m, vec3 pos, vec3 scale, versor q);
+static void buffered_render_transparent(Level *level, Model *m, float dist, vec3 pos, 
+    vec3 scale, versor q);
+static void buffered_render_flush(Level *level, Model *m);
 static void buffered_render_finalize(Level *level, Model *m);
 
 /** callbacks **/
@@ -74,19 +92,28 @@ void bob_start(void) {
 
 	glEnable(GL_DEPTH_TEST);
 	glDepthFunc(GL_LESS);
-	glEnable(GL_BLEND);
+	/* blending is only enabled while transparent models are drawn */
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL );
 
 	bob_db_s *bdb = bob_loaddb("level/test.db");
 
-	Level *blvl = bob_loadlevel(bdb, "hello");
+	Level *level = bob_loadlevel(bdb, "hello");
+	if (!level)
+		exit(EXIT_FAILURE);
+	/* draw with this level's batches even if another level was loaded after it */
+	indirect_bind(level);
 
-	Level level = *blvl;
-	level.t0 = glfwGetTime();
+	level->t0 = glfwGetTime();
 	PointerVector pvt = gen_instances_test1();
 
-	camera_init(&level.camera);
+	camera_init(&level->camera);
+	frame_ubo_init(level);
+
+	/* from here on physics runs on its own thread */
+	sim_s *sim = sim_new(level);
+	if (!sim || sim_start(sim) < 0)
+		exit(EXIT_FAILURE);
 
 	GLenum glError = glGetError();
 	if (glError != GL_NO_ERROR) {
@@ -98,14 +125,14 @@ void bob_start(void) {
 
 	while (!glfwWindowShouldClose(window)) {
 		double currTime = glfwGetTime();
-		float dt = currTime - level.t0;
+		float dt = currTime - level->t0;
 
 		glfwPollEvents();
 		glClearColor(0, 0, 0, 1);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		if(glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS && !debounce) {
-			spawn_instance(&level);
+			spawn_instance(sim, &level->camera);
 			debounce++;
 		}
 		else if(debounce > 10) {
@@ -118,11 +145,15 @@ void bob_start(void) {
     if (!debounce)
       log_debug("dt: %f", 1/dt);
 
-		update(window, &level.camera, dt);
-		phys_compute_force(&level);
-		phys_update_position(&level);
+		update(window, &level->camera, dt);
+		camera_update(&level->camera);
+		sim_lock(sim);
+		stream_update(level->stream, level);
+		sim_unlock(sim);
+		occlusion_update(level->occlusion, level);
+		frame_ubo_update(level, currTime);
 
-		level_render(window, &level);
+		level_render(window, level, sim_acquire(sim), currTime);
 
 		glfwSwapBuffers(window);
 
@@ -131,57 +162,175 @@ void bob_start(void) {
 			log_error("OpenGL Error: %d", error);
 			exit(1);
 		}
-		level.t0 = currTime;
+		level->t0 = currTime;
 	
 	}
+	sim_free(sim);
+	bob_unloadlevel(bdb, level);
 	glfwDestroyWindow(window);
 	glfwTerminate();
 	exit(EXIT_SUCCESS);
 }
 
-void level_render(GLFWwindow *window, Level *level) {
-	int i;
+/*
+ * Opaque models are drawn first, nearest first so early depth testing 
+ * rejects what's behind them. Moving instances come from the latest 
+ * simulation snapshot. Transparent instances are only collected along the 
+ * way and drawn last.
+ */
+void level_render(GLFWwindow *window, Level *level, const sim_snapshot_s *snap, 
+    double time) {
+	size_t i;
+
+	render_items_collect(level);
+	for (i = 0; i < level->nrenderItems; i++) {
+		RenderItem *item = &level->renderItems[i];
+		if (item->group)
+			render_instance_group(level, item->group, &level->camera);
+		else
+			render_range_root(level, item->rangeRoot, &level->camera);
+	}
+	render_snapshot(level, snap, time);
+
+	/* models drawn indirectly were only staged above */
+	indirect_submit(level);
+	render_transparent(level);
+}
+
+/*
+ * Lists the instance groups and range roots of the level ordered by the 
+ * nearest instance of their model drawn last frame, which is close enough 
+ * to front to back without sorting instances.
+ */
+void render_items_collect(Level *level) {
+	size_t i;
 
+	level->nrenderItems = 0;
 	for (i = 0; i < level->instances.size; i++) {
 		InstanceGroup *ig = level->instances.buffer[i];
-    render_instance_group(level, ig, &level->camera);
+		render_item_add(level, ig->model, ig, NULL);
 	}
-
 	for (i = 0; i < level->ranges.size; i++) {
-    RangeRoot *rangeRoot = level->ranges.buffer[i];
-    render_range_root(level, rangeRoot, &level->camera);
+		RangeRoot *rangeRoot = level->ranges.buffer[i];
+		render_item_add(level, rangeRoot->m, NULL, rangeRoot);
+	}
+	/* a model can have both a group and a range root, so it's rolled over in two passes */
+	for (i = 0; i < level->nrenderItems; i++) {
+		Model *m = level->renderItems[i].model;
+		m->lastNearest = m->nearest;
+	}
+	for (i = 0; i < level->nrenderItems; i++)
+		level->renderItems[i].model->nearest = FLT_MAX;
+	qsort(level->renderItems, level->nrenderItems, sizeof *level->renderItems, render_item_cmp);
+}
+
+void render_item_add(Level *level, Model *m, InstanceGroup *ig, RangeRoot *rangeRoot) {
+	if (level->nrenderItems == level->renderItemsCap) {
+		size_t cap = level->renderItemsCap ? level->renderItemsCap * 2 : 16;
+		RenderItem *items = realloc(level->renderItems, cap * sizeof *items);
+		if (!items) {
+			log_error("failed to allocate memory for render items");
+			return;
+		}
+		level->renderItems = items;
+		level->renderItemsCap = cap;
 	}
+	RenderItem *item = &level->renderItems[level->nrenderItems++];
+	item->model = m;
+	item->group = ig;
+	item->rangeRoot = rangeRoot;
+}
+
+int render_item_cmp(const void *a, const void *b) {
+	const RenderItem *ia = a, *ib = b;
+	float da = ia->model->lastNearest, db = ib->model->lastNearest;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Draws the transparent instances collected this frame back to front with 
+ * blending on and depth writes off, one buffered batch per run of 
+ * instances of the same model.
+ */
+void render_transparent(Level *level) {
+	size_t i;
+	Model *m = NULL;
+
+	if (!level->ntransparent)
+		return;
+	qsort(level->transparent, level->ntransparent, sizeof *level->transparent, transparent_cmp);
+
+	glEnable(GL_BLEND);
+	glDepthMask(GL_FALSE);
+	for (i = 0; i < level->ntransparent; i++) {
+		TransparentInstance *ti = &level->transparent[i];
+		if (ti->model != m) {
+			if (m)
+				render_model_end(level, m);
+			m = ti->model;
+			render_model_begin(m, &level->camera);
+		}
+		buffered_render_stage(level, m, ti->pos, ti->scale, ti->rotation);
+	}
+	render_model_end(level, m);
+	glDepthMask(GL_TRUE);
+	glDisable(GL_BLEND);
+
+	level->ntransparent = 0;
+}
+
+int transparent_cmp(const void *a, const void *b) {
+	const TransparentInstance *ta = a, *tb = b;
+
+	return (ta->dist < tb->dist) - (ta->dist > tb->dist);
 }
 
 void render_instance_group(Level *level, InstanceGroup *ig, Camera *camera) {
   int i;
-
-  mat4 cmatrix;
   Model *m = ig->model;
-  GLint program, camera_handle, model_handle, tex_handle;
+  bool direct = !m->slot && !m->transparent;
+
+  if (direct)
+    render_model_begin(m, camera);
 
-  program = m->program->handle;
+  for (i = 0; i < ig->instances.size; i++) {
+    Instance *inst = ig->instances.buffer[i];
+    render_instance2(level, inst);
+  }
 
-  camera_get_matrix(camera, cmatrix);
+  if (direct)
+    render_model_end(level, m);
+}
+
+/*
+ * Binds the state needed to draw a model one buffered batch at a time, 
+ * used for opaque models that aren't drawn indirectly and for transparent 
+ * ones.
+ */
+void render_model_begin(Model *m, Camera *camera) {
+  mat4 cmatrix;
+  GLint program = m->program->handle, camera_handle, tex_handle;
 
   glUseProgram(program);
 
-  model_handle = glGetUniformLocation(program, "model");
   camera_handle = glGetUniformLocation(program, "camera");
   tex_handle = glGetUniformLocation(program, "tex");
 
-	glUniformMatrix4fv(camera_handle, 1, false, (const GLfloat *)cmatrix);
+  /* shaders compiled before the Frame block was injected declare camera themselves */
+	if (camera_handle != -1) {
+		camera_get_matrix(camera, cmatrix);
+		glUniformMatrix4fv(camera_handle, 1, false, (const GLfloat *)cmatrix);
+	}
 
+	glUniform1i(tex_handle, 0);
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, tex_handle); 
+	glBindTexture(GL_TEXTURE_2D, m->texture->handle);
 
 	glBindVertexArray(m->vao);
+}
 
-  for (i = 0; i < ig->instances.size; i++) {
-    Instance *inst = ig->instances.buffer[i];
-    render_instance2(level, inst, cmatrix, camera_handle, model_handle, tex_handle);
-  }
-
+void render_model_end(Level *level, Model *m) {
   buffered_render_finalize(level, m);
 
   glBindVertexArray(0);
@@ -210,11 +359,12 @@ void render_instance(Instance *instance, Camera *camera) {
 	glBindTexture(GL_TEXTURE_2D, m->texture->handle); 
 
 	glUniformMatrix4fv(model_handle, 1, false, (const GLfloat *)mmatrix);
-	glUniformMatrix4fv(camera_handle, 1, false, (const GLfloat *)cmatrix);
+	if (camera_handle != -1)
+		glUniformMatrix4fv(camera_handle, 1, false, (const GLfloat *)cmatrix);
 	glUniform1i(tex_handle, 0);
 
 	glBindVertexArray(m->vao);
-	glDrawArrays(m->drawType, m->drawStart, m->drawCount);
+	model_draw_instanced(m, 1);
 
 	glBindVertexArray(0);
 	glBindTexture(GL_TEXTURE_2D, 0); 
@@ -222,90 +372,69 @@ void render_instance(Instance *instance, Camera *camera) {
 	glUseProgram(0);
 }
 
-void render_instance2(Level *level, Instance *instance, mat4 cmatrix, GLint camera_handle, 
-    GLint model_handle, GLint tex_handle) {
+void render_instance2(Level *level, Instance *instance) {
   Model *m = instance->model;
 
-	glUniform1i(tex_handle, 0);
+  buffered_render(level, m, instance->pos, instance->scale, instance->rotation);
+}
 
-  buffered_render(level, m, instance->pos, instance->scale);
+/*
+ * Draws the moving instances one tick behind the simulation, interpolated 
+ * between the positions the latest tick started and ended at, so motion 
+ * stays smooth whatever the frame rate.
+ */
+void render_snapshot(Level *level, const sim_snapshot_s *snap, double time) {
+  size_t i, j;
+  vec3 pos, scale, rotation;
+  float alpha = 1.0f;
+
+  if (snap->tick > 0.0)
+    alpha = glm_clamp((time - snap->time) / snap->tick, 0.0f, 1.0f);
+
+  for (i = 0; i < snap->nruns; i++) {
+    const sim_run_s *run = &snap->runs[i];
+    Model *m = run->model;
+    bool direct = !m->slot && !m->transparent;
+
+    if (direct)
+      render_model_begin(m, &level->camera);
+    for (j = run->first; j < run->first + run->count; j++) {
+      glm_vec3_lerp((float *)snap->prevPos[j], (float *)snap->pos[j], alpha, pos);
+      glm_vec3_copy((float *)snap->scale[j], scale);
+      glm_vec3_copy((float *)snap->rotation[j], rotation);
+      buffered_render(level, m, pos, scale, rotation);
+    }
+    if (direct)
+      render_model_end(level, m);
+  }
 }
 
+/*
+ * Draws what the level's ranges generated with the model of rangeRoot this 
+ * frame, followed by its baked ranges.
+ */
 void render_range_root(Level *level, RangeRoot *rangeRoot, Camera *camera) {
-  int i;
+  size_t i, j;
   Model *m = rangeRoot->m;
-  mat4 cmatrix;
-  GLint program = m->program->handle, camera_handle, model_handle, tex_handle;
-
-  camera_get_matrix(camera, cmatrix);
-  glUseProgram(program);
+  bool direct = !m->slot && !m->transparent;
 
-  camera_handle = glGetUniformLocation(program, "camera");
-  model_handle = glGetUniformLocation(program, "model");
-  tex_handle = glGetUniformLocation(program, "tex");
-
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, tex_handle); 
+  if (direct)
+    render_model_begin(m, camera);
 
-  glBindVertexArray(m->vao);
-
-	glUniformMatrix4fv(camera_handle, 1, false, (const GLfloat *)cmatrix);
-
-  for (i = 0; i < rangeRoot->ranges.size; i++) {
-    Range *currRange = rangeRoot->ranges.buffer[i]; 
-    render_range(level, currRange, camera, m, model_handle, camera_handle, tex_handle, cmatrix);
+  for (i = 0; i < rangeRoot->nexpanded; i++) {
+    float *expanded = &rangeRoot->expanded[i * BOB_BAKED_STRIDE];
+    buffered_render(level, m, expanded, expanded + 3, expanded + 6);
   }
-
-  buffered_render_finalize(level, m);
-
-  glBindVertexArray(0);
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glUseProgram(0);
-}
-
-void render_range(Level *level, Range *range, Camera *camera, Model *m, GLint model_handle, GLint camera_handle, GLint tex_handle, mat4 cmatrix) {
-  int i;
-
-  for (range->currval = 0; range->currval < range->steps; range->currval++) {
-    for (i = 0; i < range->lazyinstances.size; i++) {
-      LazyInstance *li = range->lazyinstances.buffer[i];
-      render_lazy_instance(level, li, range, cmatrix, camera_handle, model_handle, tex_handle);
-    }
-    if (range->child) {
-      render_range(level, range->child, camera, m, model_handle, camera_handle, tex_handle, cmatrix);
+  for (i = 0; i < rangeRoot->baked.size; i++) {
+    LazyInstance *li = rangeRoot->baked.buffer[i];
+    for (j = 0; j < li->nbaked; j++) {
+      float *baked = &li->baked[j * BOB_BAKED_STRIDE];
+      buffered_render(level, m, baked, baked + 3, baked + 6);
     }
   }
-}
-
-void render_lazy_instance(Level *level, LazyInstance *li, Range *range, mat4 cmatrix, GLint camera_handle,
-    GLint model_handle, GLint tex_handle) {
-	Instance instance;	
 
-	instance.model = li->model;
-	instance.isSubjectToGravity = li->isSubjectToGravity;
-	instance.isStatic = li->isStatic;
-	instance.collision_space = li->collision_space;
-	instance.mass = li->mass;
-	instance.gravity_space = li->gravity_space;
-	instance.impulse = li->impulse;
-
-	float posx = lazy_epxression_compute(range, li->px);
-	float posy = lazy_epxression_compute(range, li->py);
-	float posz = lazy_epxression_compute(range, li->pz);
-
-	instance.pos[0] = posx;
-	instance.pos[1] = posy;
-	instance.pos[2] = posz;
-
-  float scalex = lazy_epxression_compute(range, li->scalex);
-	float scaley = lazy_epxression_compute(range, li->scaley);
-	float scalez = lazy_epxression_compute(range, li->scalez);
-
-	instance.scale[0] = scalex;
-	instance.scale[1] = scaley;
-	instance.scale[2] = scalez;
-
-	render_instance2(level, &instance, cmatrix, camera_handle, model_handle, tex_handle);
+  if (direct)
+    render_model_end(level, m);
 }
 
 void update(GLFWwindow *window, Camera *camera, float secondsElapsed) {
@@ -343,71 +472,128 @@ void update(GLFWwindow *window, Camera *camera, float secondsElapsed) {
 
 }
 
-Instance *spawn_instance(Level *level) {
-	Instance *inst = malloc(sizeof *inst);
-	if (!inst) {
-		log_error("memory error");
-		exit(1);
-	}
-	PointerVector *pv = &level->instances;
-	Instance *template = pv->buffer[0];
-
-	inst->pos[0] = level->camera.pos[0];
-	inst->pos[1] = level->camera.pos[1];
-	inst->pos[2] = level->camera.pos[2];
-
-	inst->mass = 10;
-	inst->scale[0] = 10;
-	inst->scale[1] = 10;
-	inst->scale[2] = 10;
-	inst->rotation[0] = 2;
-	inst->rotation[1] = 0;
-	inst->rotation[2] = 0;
-	inst->isSubjectToGravity = true;
-	inst->isStatic = false;
-	inst->model = template->model;
-	inst->impulse = NULL;
-
-	glm_vec3_zero(inst->velocity);
-	glm_vec3_zero(inst->acceleration);
-	glm_vec3_zero(inst->force);
-
-	phys_impulse_s *imp = phys_impulse_new(0.01);
-	camera_forward(&level->camera, imp->force);
-	glm_vec3_scale(imp->force, 1E4, imp->force);
-	phys_add_impulse(inst, imp);
-
-	instance_group_add(pv, template->model, inst);
-	pointer_vector_add(&level->gravityObjects, inst);
-	return inst;
+/*
+ * Spawning is left to the simulation thread, which owns every moving 
+ * instance.
+ */
+void spawn_instance(sim_s *sim, Camera *camera) {
+	sim_event_s event;
+
+	event.type = SIM_EVENT_SPAWN;
+	glm_vec3_copy(camera->pos, event.pos);
+	camera_forward(camera, event.dir);
+	if (!sim_push(sim, &event))
+		log_error("simulation input queue full, dropping spawn");
+}
+
+void frame_ubo_init(Level *level) {
+  glGenBuffers(1, &level->frameUbo);
+  glBindBuffer(GL_UNIFORM_BUFFER, level->frameUbo);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), NULL, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, BOB_FRAME_BINDING, level->frameUbo);
+}
+
+/*
+ * Uploads the camera once a frame for every program sharing the Frame block.
+ */
+void frame_ubo_update(Level *level, float time) {
+  FrameBlock frame;
+  Camera *camera = &level->camera;
+
+  camera_update(camera);
+  glm_mat4_copy(camera->view, frame.view);
+  glm_mat4_copy(camera->projection, frame.projection);
+  glm_mat4_copy(camera->viewproj, frame.viewproj);
+  glm_vec4(camera->pos, 1.0f, frame.cameraPos);
+  frame.time = time;
+  glBindBuffer(GL_UNIFORM_BUFFER, level->frameUbo);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof frame, &frame);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+/*
+ * Culls an instance and hands it to the indirect batch of its model, the 
+ * render buffer or, for transparent models, the list drawn at the end of 
+ * the frame.
+ */
+void buffered_render(Level *level, Model *m, vec3 pos, vec3 scale, vec3 rotation) {
+  vec3 min, max, center;
+  versor q;
+  float dist;
+
+  euler_to_quat(rotation, q);
+  model_get_aabb(m, pos, scale, q, min, max);
+  if (!camera_box_visible(&level->camera, min, max) || occlusion_box_hidden(level->occlusion, min, max))
+    return;
+
+  glm_vec3_center(min, max, center);
+  dist = glm_vec3_distance2(center, level->camera.pos);
+  if (dist < m->nearest)
+    m->nearest = dist;
+
+  if (m->transparent)
+    buffered_render_transparent(level, m, dist, pos, scale, q);
+  else
+    buffered_render_stage(level, m, pos, scale, q);
 }
 
-void buffered_render(Level *level, Model *m, vec3 pos, vec3 scale) {
+void buffered_render_stage(Level *level, Model *m, vec3 pos, vec3 scale, versor q) {
   RenderBuffer *rb = &level->renderBuffer;
 
-  glm_vec3_copy(pos, rb->buffer[rb->pos]);
-  glm_vec3_copy(scale, rb->buffer[RENDER_BUFFER_SIZE + rb->pos]);
+  if (m->slot) {
+    indirect_stage(m->slot, pos, scale, q);
+    return;
+  }
+
+  glm_vec3_copy(pos, rb->position[rb->pos]);
+  glm_vec3_copy(scale, rb->scale[rb->pos]);
+  glm_vec4_copy(q, rb->rotation[rb->pos]);
 
   rb->pos++;
 
   if (rb->pos == RENDER_BUFFER_SIZE ) {
-    glBindBuffer(GL_ARRAY_BUFFER, m->pvbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(rb->buffer), &rb->buffer[0], GL_DYNAMIC_COPY);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glDrawArraysInstanced(m->drawType, m->drawStart, m->drawCount, RENDER_BUFFER_SIZE);
-    rb->pos = 0;
+    buffered_render_flush(level, m);
   }
 }
 
-void buffered_render_finalize(Level *level, Model *m) {
+void buffered_render_transparent(Level *level, Model *m, float dist, vec3 pos, 
+    vec3 scale, versor q) {
+  if (level->ntransparent == level->transparentCap) {
+    size_t cap = level->transparentCap ? level->transparentCap * 2 : RENDER_BUFFER_SIZE;
+    TransparentInstance *transparent = realloc(level->transparent, cap * sizeof *transparent);
+    if (!transparent) {
+      log_error("failed to allocate memory for transparent instances");
+      return;
+    }
+    level->transparent = transparent;
+    level->transparentCap = cap;
+  }
+  TransparentInstance *ti = &level->transparent[level->ntransparent++];
+  ti->model = m;
+  ti->dist = dist;
+  glm_vec3_copy(pos, ti->pos);
+  glm_vec3_copy(scale, ti->scale);
+  glm_vec4_copy(q, ti->rotation);
+}
+
+void buffered_render_flush(Level *level, Model *m) {
   RenderBuffer *rb = &level->renderBuffer;
+
+  instance_attrib_pack(rb->packed, rb->position, rb->scale, rb->rotation, rb->pos);
   glBindBuffer(GL_ARRAY_BUFFER, m->pvbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(rb->buffer), &rb->buffer[0], GL_DYNAMIC_COPY);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(rb->packed), NULL, GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, rb->pos * sizeof *rb->packed, rb->packed);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glDrawArraysInstanced(m->drawType, m->drawStart, m->drawCount, rb->pos);
+  model_draw_instanced(m, rb->pos);
   rb->pos = 0;
 }
 
+void buffered_render_finalize(Level *level, Model *m) {
+  if (level->renderBuffer.pos)
+    buffered_render_flush(level, m);
+}
+
 void error_callback(int error, const char* description)
 {
 	fprintf(stderr, "Error: %s\n", description);
@@ -1,6 +1,7 @@
 #include "common/log.h"
 #include "glprogram.h"
 #include "common/errcodes.h"
+#include "common/constants.h"
 #include <stdio.h>
 #include <string.h>
 #include <setjmp.h>
@@ -9,6 +10,7 @@
 static void print_png_version(void);
 static int load_png(Png *png, const char *file_path);
 static GLenum gl_map_color_type(png_byte color_type);
+static void gl_bind_frame_block(GLuint phandle);
 
 
 int gl_create_program_t1(GlProgram *program, GlShader *vertex_shader, GlShader *fragment_shader) {
@@ -46,6 +48,7 @@ int gl_create_program_t1(GlProgram *program, GlShader *vertex_shader, GlShader *
 		}
 	}
 
+	gl_bind_frame_block(phandle);
 	program->handle = phandle;
 
 	return STATUS_OK;
@@ -89,10 +92,28 @@ int gl_create_program(GlProgram *program, PointerVector shaders) {
 			return STATUS_GL_ERR;
 		}
 	}
+	gl_bind_frame_block(phandle);
 	program->handle = phandle;
 	return STATUS_OK;
 }
 
+void gl_delete_program(GlProgram *program) {
+	glDeleteProgram(program->handle);
+	program->handle = 0;
+}
+
+/*
+ * Points the program's per-frame uniform block, if it uses it, at the
+ * binding the frame's uniform buffer is bound to. GLSL 400 can't declare 
+ * the binding itself.
+ */
+void gl_bind_frame_block(GLuint phandle) {
+	GLuint index = glGetUniformBlockIndex(phandle, BOB_FRAME_BLOCK_NAME);
+
+	if (index != GL_INVALID_INDEX)
+		glUniformBlockBinding(phandle, index, BOB_FRAME_BINDING);
+}
+
 GLint gl_shader_attrib(GlProgram *program, const GLchar *attrib_name) {
 	GLint attrib = glGetAttribLocation(program->handle, attrib_name);
 	if (attrib == -1) {
@@ -287,6 +308,8 @@ int load_png(Png *png, const char *file_path) {
 void gl_delete_texture(GlTexture *texture) {
 	glDeleteTextures(1, &texture->handle);
 	free(texture->png.data);
+	texture->handle = 0;
+	texture->png.data = NULL;
 }
 
 GLenum gl_map_color_type(png_byte color_type) {
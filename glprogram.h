@@ -38,6 +38,8 @@ extern int gl_create_program_t1(GlProgram *program, GlShader *vertex_shader, GlS
 
 extern int gl_create_program(GlProgram *program, PointerVector shaders);
 
+extern void gl_delete_program(GlProgram *program);
+
 extern GLint gl_shader_attrib(GlProgram *program, const GLchar *attrib_name);
 
 extern int gl_load_shader(GlShader *shader, GLenum shader_type, const char *src, const char *name);
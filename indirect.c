@@ -0,0 +1,388 @@
+#include "indirect.h"
+#include "loadlevel.h"
+#include "common/log.h"
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void s_indirect_collect(PointerVector *models, Model *m);
+static DrawBatch *s_indirect_batch_get(Level *level, Model *m);
+static int s_indirect_batch_add(DrawBatch *batch, Model *m);
+static void s_indirect_batch_upload(DrawBatch *batch);
+static GLsizeiptr s_indirect_buffer_size(GLenum target, GLuint buffer);
+static int s_indirect_batch_cmp(const void *a, const void *b);
+static void s_indirect_batch_submit(Level *level, DrawBatch *batch);
+
+/*
+ * Multi-draw indirect needs GL 4.3, or its extension together with
+ * base instances so each command can find its own instance attributes.
+ */
+bool indirect_supported(void) {
+	return GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+}
+
+/*
+ * Groups every model drawn by the level into batches and builds their
+ * shared buffers. Models left out keep a NULL slot and are drawn one
+ * group at a time. Returns -1 on allocation failure.
+ */
+int indirect_build(Level *level) {
+	int i;
+	PointerVector models;
+
+	pointer_vector_init_arena(&level->batches, &level->arena);
+	if (!indirect_supported()) {
+		log_info("multi-draw indirect unsupported, drawing each model separately");
+		return 0;
+	}
+
+	pointer_vector_init(&models);
+	for (i = 0; i < level->instances.size; i++) {
+		InstanceGroup *ig = level->instances.buffer[i];
+		s_indirect_collect(&models, ig->model);
+	}
+	for (i = 0; i < level->dynamics.size; i++) {
+		InstanceGroup *ig = level->dynamics.buffer[i];
+		s_indirect_collect(&models, ig->model);
+	}
+	for (i = 0; i < level->ranges.size; i++) {
+		RangeRoot *rangeRoot = level->ranges.buffer[i];
+		s_indirect_collect(&models, rangeRoot->m);
+	}
+
+	for (i = 0; i < models.size; i++) {
+		Model *m = models.buffer[i];
+		DrawBatch *batch = s_indirect_batch_get(level, m);
+		if (!batch || s_indirect_batch_add(batch, m) < 0) {
+			pointer_vector_free(&models);
+			return -1;
+		}
+	}
+	pointer_vector_free(&models);
+
+	for (i = 0; i < level->batches.size; i++) {
+		DrawBatch *batch = level->batches.buffer[i];
+		s_indirect_batch_upload(batch);
+		log_info("indirect batch %d: %zu models", i, batch->nslots);
+	}
+	return 0;
+}
+
+/*
+ * Models are shared by every level loaded from the same database but each
+ * level batches them its own way, so the models' slots are pointed at the 
+ * level's batches before it's drawn if another level was loaded since.
+ */
+void indirect_bind(Level *level) {
+	size_t i, j;
+
+	for (i = 0; i < level->models.size; i++) {
+		Model *m = level->models.buffer[i];
+		m->slot = NULL;
+	}
+	for (i = 0; i < level->batches.size; i++) {
+		DrawBatch *batch = level->batches.buffer[i];
+		for (j = 0; j < batch->nslots; j++)
+			batch->slots[j].model->slot = &batch->slots[j];
+	}
+}
+
+void indirect_free(Level *level) {
+	size_t i, j;
+
+	for (i = 0; i < level->batches.size; i++) {
+		DrawBatch *batch = level->batches.buffer[i];
+		for (j = 0; j < batch->nslots; j++) {
+			DrawSlot *slot = &batch->slots[j];
+			if (slot->model->slot == slot)
+				slot->model->slot = NULL;
+			free(slot->position);
+			free(slot->scale);
+			free(slot->rotation);
+		}
+		glDeleteVertexArrays(1, &batch->vao);
+		glDeleteBuffers(1, &batch->vbo);
+		glDeleteBuffers(1, &batch->ebo);
+		glDeleteBuffers(1, &batch->ibo);
+		glDeleteBuffers(1, &batch->cbo);
+		free(batch->slots);
+		free(batch->elements);
+		free(batch->packed);
+		free(batch);
+	}
+	level->batches.size = 0;
+}
+
+void s_indirect_collect(PointerVector *models, Model *m) {
+	int i;
+
+	/* transparent instances are sorted across models, so they can't share a batch */
+	if (!m || !m->vao || !m->vertexStride || !m->program || m->transparent)
+		return;
+	for (i = 0; i < models->size; i++) {
+		if (models->buffer[i] == m)
+			return;
+	}
+	pointer_vector_add(models, m);
+}
+
+DrawBatch *s_indirect_batch_get(Level *level, Model *m) {
+	int i;
+	GLenum indexType = m->ebo ? m->indexType : GL_NONE;
+
+	for (i = 0; i < level->batches.size; i++) {
+		DrawBatch *batch = level->batches.buffer[i];
+		if (batch->program == m->program && batch->texture == m->texture &&
+				batch->drawType == m->drawType && batch->indexType == indexType &&
+				batch->vertexStride == m->vertexStride)
+			return batch;
+	}
+	DrawBatch *batch = calloc(1, sizeof *batch);
+	if (!batch) {
+		log_error("failed to allocate memory for indirect batch");
+		return NULL;
+	}
+	batch->program = m->program;
+	batch->texture = m->texture;
+	batch->drawType = m->drawType;
+	batch->indexType = indexType;
+	batch->vertexStride = m->vertexStride;
+	pointer_vector_add(&level->batches, batch);
+	return batch;
+}
+
+int s_indirect_batch_add(DrawBatch *batch, Model *m) {
+	DrawSlot *slots;
+	void *cmds;
+
+	slots = realloc(batch->slots, (batch->nslots + 1) * sizeof *slots);
+	if (!slots) {
+		log_error("failed to allocate memory for indirect draw slots");
+		return -1;
+	}
+	batch->slots = slots;
+	cmds = realloc(batch->elements, (batch->nslots + 1) * sizeof *batch->elements);
+	if (!cmds) {
+		log_error("failed to allocate memory for indirect draw commands");
+		return -1;
+	}
+	batch->elements = cmds;
+	memset(&slots[batch->nslots], 0, sizeof *slots);
+	slots[batch->nslots].model = m;
+	batch->nslots++;
+	return 0;
+}
+
+/*
+ * Copies the meshes of the batch's models into its shared buffers and
+ * records the vertex array. Slots are handed out to the models only now
+ * that the slot array won't move anymore.
+ */
+void s_indirect_batch_upload(DrawBatch *batch) {
+	size_t i;
+	GLsizeiptr vsize = 0, isize = 0, size;
+	GLsizeiptr indexSize = batch->indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+
+	for (i = 0; i < batch->nslots; i++) {
+		DrawSlot *slot = &batch->slots[i];
+		Model *m = slot->model;
+		slot->baseVertex = vsize / batch->vertexStride;
+		vsize += s_indirect_buffer_size(GL_ARRAY_BUFFER, m->vbo);
+		if (batch->indexType != GL_NONE) {
+			slot->first = isize / indexSize + m->drawStart;
+			isize += s_indirect_buffer_size(GL_ELEMENT_ARRAY_BUFFER, m->ebo);
+		}
+		else {
+			slot->first = slot->baseVertex + m->drawStart;
+		}
+		m->slot = slot;
+	}
+
+	glGenVertexArrays(1, &batch->vao);
+	glBindVertexArray(batch->vao);
+
+	glGenBuffers(1, &batch->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, batch->vbo);
+	glBufferData(GL_ARRAY_BUFFER, vsize, NULL, GL_STATIC_DRAW);
+	for (i = 0; i < batch->nslots; i++) {
+		Model *m = batch->slots[i].model;
+		size = s_indirect_buffer_size(GL_COPY_READ_BUFFER, m->vbo);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER, 0,
+				(GLintptr)batch->slots[i].baseVertex * batch->vertexStride, size);
+	}
+	bob_vertex_attribs(batch->program, batch->vertexStride);
+
+	if (batch->indexType != GL_NONE) {
+		glGenBuffers(1, &batch->ebo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->ebo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, isize, NULL, GL_STATIC_DRAW);
+		for (i = 0; i < batch->nslots; i++) {
+			DrawSlot *slot = &batch->slots[i];
+			size = s_indirect_buffer_size(GL_COPY_READ_BUFFER, slot->model->ebo);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ELEMENT_ARRAY_BUFFER, 0,
+					(GLintptr)(slot->first - slot->model->drawStart) * indexSize, size);
+		}
+	}
+
+	glGenBuffers(1, &batch->ibo);
+	glBindBuffer(GL_ARRAY_BUFFER, batch->ibo);
+	bob_instance_attribs(batch->program);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &batch->cbo);
+}
+
+/*
+ * Binds buffer to target and returns its size in bytes.
+ */
+GLsizeiptr s_indirect_buffer_size(GLenum target, GLuint buffer) {
+	GLint size = 0;
+
+	glBindBuffer(target, buffer);
+	glGetBufferParameteriv(target, GL_BUFFER_SIZE, &size);
+	return size;
+}
+
+/*
+ * Stages one instance of the slot's model for this frame's submission.
+ */
+void indirect_stage(DrawSlot *slot, vec3 pos, vec3 scale, versor rotation) {
+	if (slot->size == slot->cap) {
+		size_t cap = slot->cap ? slot->cap * 2 : RENDER_BUFFER_SIZE;
+		vec3 *position = realloc(slot->position, cap * sizeof *position);
+		if (!position) {
+			log_error("failed to allocate memory for staged instances");
+			return;
+		}
+		slot->position = position;
+		vec3 *scales = realloc(slot->scale, cap * sizeof *scales);
+		if (!scales) {
+			log_error("failed to allocate memory for staged instances");
+			return;
+		}
+		slot->scale = scales;
+		versor *rotations = realloc(slot->rotation, cap * sizeof *rotations);
+		if (!rotations) {
+			log_error("failed to allocate memory for staged instances");
+			return;
+		}
+		slot->rotation = rotations;
+		slot->cap = cap;
+	}
+	glm_vec3_copy(pos, slot->position[slot->size]);
+	glm_vec3_copy(scale, slot->scale[slot->size]);
+	glm_vec4_copy(rotation, slot->rotation[slot->size]);
+	slot->size++;
+}
+
+/*
+ * Draws everything staged this frame, one multi-draw call per batch. 
+ * Batches go front to back by the nearest instance staged in them.
+ */
+void indirect_submit(Level *level) {
+	int i;
+	size_t j;
+
+	for (i = 0; i < level->batches.size; i++) {
+		DrawBatch *batch = level->batches.buffer[i];
+		batch->nearest = FLT_MAX;
+		for (j = 0; j < batch->nslots; j++) {
+			if (batch->slots[j].size && batch->slots[j].model->nearest < batch->nearest)
+				batch->nearest = batch->slots[j].model->nearest;
+		}
+	}
+	qsort(level->batches.buffer, level->batches.size, sizeof *level->batches.buffer, s_indirect_batch_cmp);
+	for (i = 0; i < level->batches.size; i++)
+		s_indirect_batch_submit(level, level->batches.buffer[i]);
+}
+
+int s_indirect_batch_cmp(const void *a, const void *b) {
+	const DrawBatch *ba = *(DrawBatch * const *)a, *bb = *(DrawBatch * const *)b;
+
+	return (ba->nearest > bb->nearest) - (ba->nearest < bb->nearest);
+}
+
+void s_indirect_batch_submit(Level *level, DrawBatch *batch) {
+	size_t i, total = 0;
+	GLsizei ncmds = 0;
+	GLint program = batch->program->handle, camera_handle, tex_handle;
+	mat4 cmatrix;
+
+	for (i = 0; i < batch->nslots; i++)
+		total += batch->slots[i].size;
+	if (!total)
+		return;
+
+	if (total > batch->cap) {
+		InstanceAttrib *packed = realloc(batch->packed, total * sizeof *packed);
+		if (!packed) {
+			log_error("failed to allocate memory for packed instances");
+			for (i = 0; i < batch->nslots; i++)
+				batch->slots[i].size = 0;
+			return;
+		}
+		batch->packed = packed;
+		batch->cap = total;
+	}
+
+	total = 0;
+	for (i = 0; i < batch->nslots; i++) {
+		DrawSlot *slot = &batch->slots[i];
+		Model *m = slot->model;
+		if (!slot->size)
+			continue;
+		instance_attrib_pack(batch->packed + total, slot->position, slot->scale,
+				slot->rotation, slot->size);
+		if (batch->indexType != GL_NONE) {
+			DrawElementsIndirectCommand *cmd = &batch->elements[ncmds++];
+			cmd->count = m->drawCount;
+			cmd->instanceCount = slot->size;
+			cmd->firstIndex = slot->first;
+			cmd->baseVertex = slot->baseVertex;
+			cmd->baseInstance = total;
+		}
+		else {
+			DrawArraysIndirectCommand *cmd = &batch->arrays[ncmds++];
+			cmd->count = m->drawCount;
+			cmd->instanceCount = slot->size;
+			cmd->first = slot->first;
+			cmd->baseInstance = total;
+		}
+		total += slot->size;
+		slot->size = 0;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, batch->ibo);
+	glBufferData(GL_ARRAY_BUFFER, total * sizeof *batch->packed, batch->packed, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batch->cbo);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, ncmds * (batch->indexType != GL_NONE ?
+				sizeof *batch->elements : sizeof *batch->arrays), batch->elements, GL_STREAM_DRAW);
+
+	glUseProgram(program);
+	camera_handle = glGetUniformLocation(program, "camera");
+	tex_handle = glGetUniformLocation(program, "tex");
+	if (camera_handle != -1) {
+		camera_get_matrix(&level->camera, cmatrix);
+		glUniformMatrix4fv(camera_handle, 1, false, (const GLfloat *)cmatrix);
+	}
+	glUniform1i(tex_handle, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, batch->texture ? batch->texture->handle : 0);
+
+	glBindVertexArray(batch->vao);
+	if (batch->indexType != GL_NONE)
+		glMultiDrawElementsIndirect(batch->drawType, batch->indexType, NULL, ncmds, 0);
+	else
+		glMultiDrawArraysIndirect(batch->drawType, NULL, ncmds, 0);
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glUseProgram(0);
+}
@@ -0,0 +1,77 @@
+#ifndef __indirect_h__
+#define __indirect_h__
+
+#include "models.h"
+
+typedef struct DrawArraysIndirectCommand DrawArraysIndirectCommand;
+typedef struct DrawElementsIndirectCommand DrawElementsIndirectCommand;
+typedef struct DrawBatch DrawBatch;
+
+/* command layouts read by glMultiDraw*Indirect */
+struct DrawArraysIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint first;
+	GLuint baseInstance;
+};
+
+struct DrawElementsIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
+/*
+ * A model's place in its batch's shared buffers and the instances staged
+ * for it this frame. first is in vertices for array meshes and in indices
+ * for indexed ones.
+ */
+struct DrawSlot {
+	Model *model;
+	GLuint first;
+	GLint baseVertex;
+	size_t size;
+	size_t cap;
+	vec3 *position;
+	vec3 *scale;
+	versor *rotation;
+};
+
+/*
+ * Models that can be drawn with one multi-draw call: they share a program,
+ * a texture, a primitive type and a vertex layout. Their meshes are copied
+ * into one vertex (and element) buffer and the instances of all of them
+ * are uploaded to one instance buffer each frame.
+ */
+struct DrawBatch {
+	GlProgram *program;
+	GlTexture *texture;
+	GLenum drawType;
+	GLenum indexType;
+	GLsizei vertexStride;
+	GLuint vao;
+	GLuint vbo;
+	GLuint ebo;
+	GLuint ibo;
+	GLuint cbo;
+	float nearest;
+	size_t nslots;
+	DrawSlot *slots;
+	size_t cap;
+	InstanceAttrib *packed;
+	union {
+		DrawArraysIndirectCommand *arrays;
+		DrawElementsIndirectCommand *elements;
+	};
+};
+
+extern bool indirect_supported(void);
+extern int indirect_build(Level *level);
+extern void indirect_bind(Level *level);
+extern void indirect_free(Level *level);
+extern void indirect_stage(DrawSlot *slot, vec3 pos, vec3 scale, versor rotation);
+extern void indirect_submit(Level *level);
+
+#endif
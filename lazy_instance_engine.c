@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define LZTOK_LEX_LEN 64
 typedef struct lztok_s lztok_s;
@@ -31,6 +34,62 @@ struct lztok_list_s {
 	lztok_s *tail;
 };
 
+typedef enum {
+	LZOP_CONST,
+	LZOP_VAR,
+	LZOP_ADD,
+	LZOP_SUB,
+	LZOP_MUL,
+	LZOP_DIV,
+	LZOP_NEG
+} lzop_e;
+
+typedef struct lznode_s lznode_s;
+typedef struct lzdag_s lzdag_s;
+
+/* 
+ * A distinct subexpression of a range. depth is how many parents up the 
+ * range of a variable is and a and b are the nodes of the operands. 
+ * Uniform nodes only depend on constants and the iterators of the ranges 
+ * around the range, so they have one value for a whole block.
+ */
+struct lznode_s {
+	lzop_e op;
+	float value;
+	int depth;
+	int a;
+	int b;
+	bool uniform;
+	/* some lazy instance field is this node, so its column is always written */
+	bool field;
+};
+
+/* 
+ * Nodes of a range being compiled, hash consed through an open addressed 
+ * table of node indices plus one. requested counts every node asked for,
+ * shared or not.
+ */
+struct lzdag_s {
+	lznode_s *nodes;
+	size_t nnodes;
+	size_t cap;
+	int *table;
+	size_t tableSize;
+	size_t requested;
+	bool ok;
+};
+
+/*
+ * Every distinct subexpression of the lazy instances of a range, operands
+ * first. Nodes that vary within a block get a column, the others a value.
+ */
+struct lazy_dag_s {
+	size_t nnodes;
+	lznode_s *nodes;
+	float *values;
+	float (*columns)[LAZY_BLOCK];
+};
+
 static void lz_add_tok(lztok_list_s *list, char *lexeme, lztok_type_e type);
 static void lz_toklist_free(lztok_list_s *list);
 static lztok_list_s lex(char *src);
@@ -44,6 +103,31 @@ static void p_term_(lztok_s **t, float *term, Range *range);
 static float p_factor(lztok_s **t, Range *range);
 static int lookup_iterator_value(const char var, Range *range);
 
+static int c_expression(lztok_s **t, lzdag_s *dag, Range *range);
+static int c_expression_(lztok_s **t, lzdag_s *dag, int left, Range *range);
+static int c_term(lztok_s **t, lzdag_s *dag, Range *range);
+static int c_term_(lztok_s **t, lzdag_s *dag, int left, Range *range);
+static int c_factor(lztok_s **t, lzdag_s *dag, Range *range);
+static int lookup_iterator_depth(const char var, Range *range);
+static int lz_node(lzdag_s *dag, lzop_e op, float value, int depth, int a, int b);
+static int lz_intern(lzdag_s *dag, const lznode_s *node);
+static unsigned lz_node_hash(const lznode_s *node);
+static int lz_dag_grow(lzdag_s *dag);
+static void lz_dag_free(lzdag_s *dag);
+static float lz_fold(lzop_e op, float a, float b);
+
+static int lazy_expression_compile(lzdag_s *dag, Range *range, const char *src);
+static int lazy_range_compile(Level *level, Range *range, size_t iterations);
+static lazy_dag_s *lazy_dag_new(Arena *arena, lzdag_s *dag);
+static void lazy_dag_uniforms(lazy_dag_s *dag, Range *range);
+static void lazy_dag_columns(lazy_dag_s *dag, int base);
+static void lazy_block_fill(float *out, float value);
+static void lazy_block_iota(float *out, float base);
+static void lazy_block_negate(float *out, const float *a);
+static void lazy_block_binary(lzop_e op, float *out, const float *a, const float *b);
+static void lazy_block_binary_imm(lzop_e op, float *out, const float *a, float b);
+static void lazy_range_expand(Range *range, size_t outer);
+
 float lazy_epxression_compute(Range *range, char *src) {
 	char *nsrc = bob_dup_str(src);
 	lztok_list_s toklist = lex(nsrc);
@@ -53,6 +137,349 @@ float lazy_epxression_compute(Range *range, char *src) {
 	return result;
 }
 
+/*
+ * Compiles the expressions of every range of the level and lays out the 
+ * range roots' expanded arrays: each lazy instance gets one transform per
+ * iteration of its range and the ranges around it.
+ */
+int lazy_ranges_compile(Level *level) {
+	size_t i, iterations;
+	Range *range;
+
+	for (i = 0; i < level->rangeTrees.size; i++) {
+		iterations = 1;
+		for (range = level->rangeTrees.buffer[i]; range; range = range->child) {
+			iterations *= range->steps > 0 ? range->steps : 0;
+			if (lazy_range_compile(level, range, iterations) < 0)
+				return -1;
+		}
+	}
+	for (i = 0; i < level->ranges.size; i++) {
+		RangeRoot *rangeRoot = level->ranges.buffer[i];
+		if (!rangeRoot->nexpanded)
+			continue;
+		rangeRoot->expanded = malloc(rangeRoot->nexpanded * BOB_BAKED_STRIDE * sizeof *rangeRoot->expanded);
+		if (!rangeRoot->expanded) {
+			log_error("failed to allocate memory for expanded range instances");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Compiles every field of every lazy instance of range into one DAG, so a
+ * subexpression repeated across fields or instances is evaluated once per
+ * iteration.
+ */
+int lazy_range_compile(Level *level, Range *range, size_t iterations) {
+	size_t i, k;
+	lzdag_s dag = {NULL, 0, 0, NULL, 0, 0, true};
+
+	for (i = 0; i < range->lazyinstances.size; i++) {
+		LazyInstance *li = range->lazyinstances.buffer[i];
+		char *src[BOB_BAKED_STRIDE] = {
+			li->px, li->py, li->pz, 
+			li->scalex, li->scaley, li->scalez, 
+			li->rotx, li->roty, li->rotz
+		};
+		if (li->baked)
+			continue;
+		for (k = 0; k < BOB_BAKED_STRIDE; k++) {
+			li->fields[k] = lazy_expression_compile(&dag, range, src[k]);
+			if (li->fields[k] < 0) {
+				lz_dag_free(&dag);
+				return -1;
+			}
+			dag.nodes[li->fields[k]].field = true;
+		}
+		li->first = li->root->nexpanded;
+		li->root->nexpanded += iterations;
+	}
+	if (!dag.nnodes)
+		return 0;
+#ifndef NDEBUG
+	size_t varying = 0;
+	for (i = 0; i < dag.nnodes; i++)
+		varying += !dag.nodes[i].uniform;
+	log_debug("range %d: %zu subexpressions, %zu distinct (%.2fx shared), %zu evaluated per iteration", 
+			range->id, dag.requested, dag.nnodes, (double)dag.requested / dag.nnodes, varying);
+#endif
+	range->dag = lazy_dag_new(&level->arena, &dag);
+	lz_dag_free(&dag);
+	return range->dag ? 0 : -1;
+}
+
+/*
+ * Adds src to the DAG of range and returns its node, resolving iterator 
+ * variables to the ranges declaring them. Constant subexpressions are 
+ * folded. Expressions that fail to compile evaluate to 0.
+ */
+int lazy_expression_compile(lzdag_s *dag, Range *range, const char *src) {
+	int node;
+	lztok_s *t;
+	char *nsrc = bob_dup_str(src);
+
+	if (!nsrc) {
+		log_error("failed to allocate memory for lazy expression");
+		return -1;
+	}
+	lztok_list_s toklist = lex(nsrc);
+	t = toklist.head;
+	node = c_expression(&t, dag, range);
+	if (t->type != LZTYPE_EOF)
+		log_error("Syntax Error: Expected end of expression, but got %s", t->lexeme);
+	lz_toklist_free(&toklist);
+	free(nsrc);
+
+	if (!dag->ok)
+		return -1;
+	return node < 0 ? lz_node(dag, LZOP_CONST, 0.0, 0, -1, -1) : node;
+}
+
+/*
+ * Copies a compiled DAG into the arena along with the values and columns
+ * its evaluation writes.
+ */
+lazy_dag_s *lazy_dag_new(Arena *arena, lzdag_s *dag) {
+	size_t i;
+	lazy_dag_s *ldag = arena_alloc(arena, sizeof *ldag);
+
+	if (ldag) {
+		ldag->nnodes = dag->nnodes;
+		ldag->nodes = arena_alloc(arena, dag->nnodes * sizeof *ldag->nodes);
+		ldag->values = arena_alloc(arena, dag->nnodes * sizeof *ldag->values);
+		ldag->columns = arena_alloc(arena, dag->nnodes * sizeof *ldag->columns);
+	}
+	if (!ldag || !ldag->nodes || !ldag->values || !ldag->columns) {
+		log_error("failed to allocate memory for lazy expression DAG");
+		return NULL;
+	}
+	memcpy(ldag->nodes, dag->nodes, dag->nnodes * sizeof *ldag->nodes);
+	for (i = 0; i < ldag->nnodes; i++)
+		ldag->values[i] = ldag->nodes[i].value;
+	return ldag;
+}
+
+/*
+ * Evaluates every range of the level into the range roots of the models
+ * it draws. Each range tree is walked once however many models share it,
+ * and each range's DAG is evaluated a column of iterations at a time, 
+ * the fields of each lazy instance then being interleaved into its 
+ * output in one sequential pass. The loader expands the ranges once after
+ * compiling them; call it again only after changing a range's parameters.
+ */
+void lazy_ranges_expand(Level *level) {
+	size_t i;
+
+	for (i = 0; i < level->rangeTrees.size; i++)
+		lazy_range_expand(level->rangeTrees.buffer[i], 0);
+}
+
+/*
+ * outer is the iteration of the ranges around range, counted the way its 
+ * lazy instances' slices are laid out.
+ */
+void lazy_range_expand(Range *range, size_t outer) {
+	size_t i, j, k, n;
+	int base;
+	lazy_dag_s *dag = range->dag;
+
+	if (dag) {
+		lazy_dag_uniforms(dag, range);
+		for (base = 0; base < range->steps; base += LAZY_BLOCK) {
+			n = range->steps - base < LAZY_BLOCK ? range->steps - base : LAZY_BLOCK;
+			lazy_dag_columns(dag, base);
+			for (i = 0; i < range->lazyinstances.size; i++) {
+				LazyInstance *li = range->lazyinstances.buffer[i];
+				const float *columns[BOB_BAKED_STRIDE];
+				if (li->baked)
+					continue;
+				for (k = 0; k < BOB_BAKED_STRIDE; k++)
+					columns[k] = dag->columns[li->fields[k]];
+				float *row = &li->root->expanded[(li->first + outer * range->steps + base) * BOB_BAKED_STRIDE];
+				for (j = 0; j < n; j++) {
+					for (k = 0; k < BOB_BAKED_STRIDE; k++)
+						*row++ = columns[k][j];
+				}
+			}
+		}
+	}
+	if (range->child) {
+		for (range->currval = 0; range->currval < range->steps; range->currval++)
+			lazy_range_expand(range->child, outer * range->steps + range->currval);
+	}
+}
+
+/*
+ * Evaluates the uniform nodes, once for all the blocks of an iteration of
+ * the ranges around range. Uniform fields are spread over their columns.
+ */
+void lazy_dag_uniforms(lazy_dag_s *dag, Range *range) {
+	size_t i;
+	int d;
+	Range *r;
+
+	for (i = 0; i < dag->nnodes; i++) {
+		lznode_s *node = &dag->nodes[i];
+		if (!node->uniform)
+			continue;
+		switch (node->op) {
+			case LZOP_CONST:
+				break;
+			case LZOP_VAR:
+				for (r = range, d = node->depth; d; d--)
+					r = r->parent;
+				dag->values[i] = (float)r->currval;
+				break;
+			case LZOP_NEG:
+				dag->values[i] = -dag->values[node->a];
+				break;
+			default:
+				dag->values[i] = lz_fold(node->op, dag->values[node->a], dag->values[node->b]);
+				break;
+		}
+		if (node->field)
+			lazy_block_fill(dag->columns[i], dag->values[i]);
+	}
+}
+
+/*
+ * Evaluates the nodes that vary within a block for iterations 
+ * [base, base + LAZY_BLOCK) of the range.
+ */
+void lazy_dag_columns(lazy_dag_s *dag, int base) {
+	size_t i;
+
+	for (i = 0; i < dag->nnodes; i++) {
+		lznode_s *node = &dag->nodes[i];
+		float *out = dag->columns[i];
+		if (node->uniform)
+			continue;
+		switch (node->op) {
+			case LZOP_VAR:
+				lazy_block_iota(out, (float)base);
+				break;
+			case LZOP_NEG:
+				lazy_block_negate(out, dag->columns[node->a]);
+				break;
+			default:
+				if (dag->nodes[node->b].uniform) {
+					lazy_block_binary_imm(node->op, out, dag->columns[node->a], dag->values[node->b]);
+				}
+				else if (dag->nodes[node->a].uniform) {
+					lazy_block_fill(out, dag->values[node->a]);
+					lazy_block_binary(node->op, out, out, dag->columns[node->b]);
+				}
+				else {
+					lazy_block_binary(node->op, out, dag->columns[node->a], dag->columns[node->b]);
+				}
+				break;
+		}
+	}
+}
+
+void lazy_block_fill(float *out, float value) {
+	int i;
+#ifdef __SSE2__
+	__m128 v = _mm_set1_ps(value);
+	for (i = 0; i < LAZY_BLOCK; i += 4)
+		_mm_store_ps(out + i, v);
+#else
+	for (i = 0; i < LAZY_BLOCK; i++)
+		out[i] = value;
+#endif
+}
+
+void lazy_block_iota(float *out, float base) {
+	int i;
+#ifdef __SSE2__
+	__m128 v = _mm_add_ps(_mm_set1_ps(base), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+	__m128 step = _mm_set1_ps(4.0f);
+	for (i = 0; i < LAZY_BLOCK; i += 4) {
+		_mm_store_ps(out + i, v);
+		v = _mm_add_ps(v, step);
+	}
+#else
+	for (i = 0; i < LAZY_BLOCK; i++)
+		out[i] = base + i;
+#endif
+}
+
+void lazy_block_negate(float *out, const float *a) {
+	int i;
+#ifdef __SSE2__
+	__m128 zero = _mm_setzero_ps();
+	for (i = 0; i < LAZY_BLOCK; i += 4)
+		_mm_store_ps(out + i, _mm_sub_ps(zero, _mm_load_ps(a + i)));
+#else
+	for (i = 0; i < LAZY_BLOCK; i++)
+		out[i] = -a[i];
+#endif
+}
+
+/*
+ * out = a op b, elementwise. out may be a.
+ */
+void lazy_block_binary(lzop_e op, float *out, const float *a, const float *b) {
+	int i;
+#ifdef __SSE2__
+	switch (op) {
+		case LZOP_ADD:
+			for (i = 0; i < LAZY_BLOCK; i += 4)
+				_mm_store_ps(out + i, _mm_add_ps(_mm_load_ps(a + i), _mm_load_ps(b + i)));
+			break;
+		case LZOP_SUB:
+			for (i = 0; i < LAZY_BLOCK; i += 4)
+				_mm_store_ps(out + i, _mm_sub_ps(_mm_load_ps(a + i), _mm_load_ps(b + i)));
+			break;
+		case LZOP_MUL:
+			for (i = 0; i < LAZY_BLOCK; i += 4)
+				_mm_store_ps(out + i, _mm_mul_ps(_mm_load_ps(a + i), _mm_load_ps(b + i)));
+			break;
+		case LZOP_DIV:
+			for (i = 0; i < LAZY_BLOCK; i += 4)
+				_mm_store_ps(out + i, _mm_div_ps(_mm_load_ps(a + i), _mm_load_ps(b + i)));
+			break;
+		default:
+			break;
+	}
+#else
+	for (i = 0; i < LAZY_BLOCK; i++)
+		out[i] = lz_fold(op, a[i], b[i]);
+#endif
+}
+
+void lazy_block_binary_imm(lzop_e op, float *out, const float *a, float b) {
+	int i;
+#ifdef __SSE2__
+	__m128 v = _mm_set1_ps(b);
+	switch (op) {
+		case LZOP_ADD:
+			for (i = 0; i < LAZY_BLOCK; i += 4)
+				_mm_store_ps(out + i, _mm_add_ps(_mm_load_ps(a + i), v));
+			break;
+		case LZOP_SUB:
+			for (i = 0; i < LAZY_BLOCK; i += 4)
+				_mm_store_ps(out + i, _mm_sub_ps(_mm_load_ps(a + i), v));
+			break;
+		case LZOP_MUL:
+			for (i = 0; i < LAZY_BLOCK; i += 4)
+				_mm_store_ps(out + i, _mm_mul_ps(_mm_load_ps(a + i), v));
+			break;
+		case LZOP_DIV:
+			for (i = 0; i < LAZY_BLOCK; i += 4)
+				_mm_store_ps(out + i, _mm_div_ps(_mm_load_ps(a + i), v));
+			break;
+		default:
+			break;
+	}
+#else
+	for (i = 0; i < LAZY_BLOCK; i++)
+		out[i] = lz_fold(op, a[i], b);
+#endif
+}
+
 lztok_list_s lex(char *src) {
 	char bck;
 	char *fptr = src, *bptr;
@@ -274,4 +701,263 @@ int lookup_iterator_value(const char var, Range *range) {
 	return range->currval;
 }
 
+/*
+ * The c_ functions follow the p_ ones but build DAG nodes instead of 
+ * evaluating, so compiled expressions keep the same precedence and the 
+ * same unary minus applying to the rest of the expression. They return 
+ * the node of what they parsed, -1 on syntax errors.
+ */
+int c_expression(lztok_s **t, lzdag_s *dag, Range *range) {
+	int node;
+	lztok_s *op;
+
+	switch ((*t)->type) {
+		case LZTYPE_NUM:
+		case LZTYPE_IDENT:
+		case LZTYPE_LPAREN:
+			node = c_term(t, dag, range);
+			return c_expression_(t, dag, node, range);
+		case LZTYPE_ADDOP:
+			op = *t;
+			*t = (*t)->next;
+			node = c_expression(t, dag, range);
+			if (*op->lexeme == '-')
+				node = lz_node(dag, LZOP_NEG, 0.0, 0, node, -1);
+			return node;
+		default:
+			log_error(
+					"Syntax Error: expected number, +, -, '(', or variable reference, but got %s", 
+					(*t)->lexeme);
+			return -1;
+	}
+}
+
+int c_expression_(lztok_s **t, lzdag_s *dag, int left, Range *range) {
+	int term;
+	lztok_s *op;
+
+	if ((*t)->type == LZTYPE_ADDOP) {
+		op = *t;
+		*t = (*t)->next;
+		term = c_term(t, dag, range);
+		left = lz_node(dag, *op->lexeme == '+' ? LZOP_ADD : LZOP_SUB, 0.0, 0, left, term);
+		return c_expression_(t, dag, left, range);
+	}
+	return left;
+}
+
+int c_term(lztok_s **t, lzdag_s *dag, Range *range) {
+	int factor;
+
+	switch ((*t)->type) {
+		case LZTYPE_NUM:
+		case LZTYPE_IDENT:
+		case LZTYPE_LPAREN:
+			factor = c_factor(t, dag, range);
+			return c_term_(t, dag, factor, range);
+		default:
+			log_error("Syntax Error: expected number variable reference, or '(', but got %s", 
+					(*t)->lexeme);
+			return -1;
+	}
+}
+
+int c_term_(lztok_s **t, lzdag_s *dag, int left, Range *range) {
+	int factor;
+	lztok_s *op;
+
+	if ((*t)->type == LZTYPE_MULOP) {
+		op = *t;
+		*t = (*t)->next;
+		factor = c_factor(t, dag, range);
+		left = lz_node(dag, *op->lexeme == '*' ? LZOP_MUL : LZOP_DIV, 0.0, 0, left, factor);
+		return c_term_(t, dag, left, range);
+	}
+	return left;
+}
+
+int c_factor(lztok_s **t, lzdag_s *dag, Range *range) {
+	int node, depth;
+
+	switch ((*t)->type) {
+		case LZTYPE_NUM:
+			node = lz_node(dag, LZOP_CONST, atof((*t)->lexeme), 0, -1, -1);
+			*t = (*t)->next;
+			return node;
+		case LZTYPE_IDENT:
+			depth = lookup_iterator_depth(*(*t)->lexeme, range);
+			if (depth < 0)
+				node = lz_node(dag, LZOP_CONST, -1.0, 0, -1, -1);
+			else
+				node = lz_node(dag, LZOP_VAR, 0.0, depth, -1, -1);
+			*t = (*t)->next;
+			return node;
+		case LZTYPE_LPAREN:
+			*t = (*t)->next;
+			node = c_expression(t, dag, range);
+			if ((*t)->type == LZTYPE_RPAREN) {
+				*t = (*t)->next;
+			} else {
+				log_error("Syntax Error: expected ')' but got %s", (*t)->lexeme);
+			}
+			return node;
+		default:
+			log_error("Syntax Error: expected number, variable reference, or '(' but got %s", 
+					(*t)->lexeme);
+			return -1;
+	}
+}
+
+int lookup_iterator_depth(const char var, Range *range) {
+	int depth = 0;
+
+	while (range && range->var != var) {
+		range = range->parent;
+		depth++;
+	}
+	if (!range) {
+		log_error("access to undeclared iteraor variable within range %c", var);
+		return -1;
+	}
+	return depth;
+}
+
+/*
+ * Returns the node for op applied to a and b, folding constants and 
+ * reusing the node if the DAG already has it. Operands of commutative 
+ * operators are ordered so a*b and b*a are the same node. Operands that 
+ * failed to parse count as 0.
+ */
+int lz_node(lzdag_s *dag, lzop_e op, float value, int depth, int a, int b) {
+	lznode_s node;
 
+	if (!dag->ok)
+		return -1;
+	dag->requested++;
+	memset(&node, 0, sizeof node);
+	node.op = LZOP_CONST;
+	node.a = node.b = -1;
+	if (op >= LZOP_ADD && op <= LZOP_NEG) {
+		if (a < 0 && (a = lz_intern(dag, &node)) < 0)
+			return -1;
+		if (op != LZOP_NEG && b < 0 && (b = lz_intern(dag, &node)) < 0)
+			return -1;
+	}
+	if (op == LZOP_NEG && dag->nodes[a].op == LZOP_CONST) {
+		node.value = -dag->nodes[a].value;
+		return lz_intern(dag, &node);
+	}
+	if (op >= LZOP_ADD && op <= LZOP_DIV 
+			&& dag->nodes[a].op == LZOP_CONST && dag->nodes[b].op == LZOP_CONST) {
+		node.value = lz_fold(op, dag->nodes[a].value, dag->nodes[b].value);
+		return lz_intern(dag, &node);
+	}
+	if ((op == LZOP_ADD || op == LZOP_MUL) && a > b) {
+		int tmp = a;
+		a = b;
+		b = tmp;
+	}
+	node.op = op;
+	node.value = value;
+	node.depth = depth;
+	node.a = a;
+	node.b = b;
+	return lz_intern(dag, &node);
+}
+
+int lz_intern(lzdag_s *dag, const lznode_s *node) {
+	size_t i;
+	int *slot;
+	lznode_s *added;
+
+	if ((dag->nnodes + 1) * 2 > dag->tableSize && lz_dag_grow(dag) < 0)
+		return -1;
+	for (i = lz_node_hash(node) & (dag->tableSize - 1); dag->table[i]; i = (i + 1) & (dag->tableSize - 1)) {
+		lznode_s *other = &dag->nodes[dag->table[i] - 1];
+		if (other->op == node->op && !memcmp(&other->value, &node->value, sizeof node->value) 
+				&& other->depth == node->depth && other->a == node->a && other->b == node->b)
+			return dag->table[i] - 1;
+	}
+	slot = &dag->table[i];
+
+	if (dag->nnodes == dag->cap) {
+		size_t cap = dag->cap ? dag->cap * 2 : 32;
+		lznode_s *nodes = realloc(dag->nodes, cap * sizeof *nodes);
+		if (!nodes) {
+			log_error("failed to allocate memory for lazy expression");
+			dag->ok = false;
+			return -1;
+		}
+		dag->nodes = nodes;
+		dag->cap = cap;
+	}
+	added = &dag->nodes[dag->nnodes];
+	*added = *node;
+	switch (node->op) {
+		case LZOP_CONST:
+			added->uniform = true;
+			break;
+		case LZOP_VAR:
+			added->uniform = node->depth > 0;
+			break;
+		case LZOP_NEG:
+			added->uniform = dag->nodes[node->a].uniform;
+			break;
+		default:
+			added->uniform = dag->nodes[node->a].uniform && dag->nodes[node->b].uniform;
+			break;
+	}
+	*slot = ++dag->nnodes;
+	return dag->nnodes - 1;
+}
+
+unsigned lz_node_hash(const lznode_s *node) {
+	unsigned h, bits;
+
+	memcpy(&bits, &node->value, sizeof bits);
+	h = node->op;
+	h = h * 31 + bits;
+	h = h * 31 + node->depth;
+	h = h * 31 + node->a;
+	h = h * 31 + node->b;
+	return h ^ (h >> 16);
+}
+
+int lz_dag_grow(lzdag_s *dag) {
+	size_t i, j, size = dag->tableSize ? dag->tableSize * 2 : 64;
+	int *table = calloc(size, sizeof *table);
+
+	if (!table) {
+		log_error("failed to allocate memory for lazy expression");
+		dag->ok = false;
+		return -1;
+	}
+	for (i = 0; i < dag->nnodes; i++) {
+		for (j = lz_node_hash(&dag->nodes[i]) & (size - 1); table[j]; j = (j + 1) & (size - 1));
+		table[j] = i + 1;
+	}
+	free(dag->table);
+	dag->table = table;
+	dag->tableSize = size;
+	return 0;
+}
+
+void lz_dag_free(lzdag_s *dag) {
+	free(dag->nodes);
+	free(dag->table);
+}
+
+float lz_fold(lzop_e op, float a, float b) {
+	switch (op) {
+		case LZOP_ADD:
+			return a + b;
+		case LZOP_SUB:
+			return a - b;
+		case LZOP_MUL:
+			return a * b;
+		case LZOP_DIV:
+			return a / b;
+		default:
+			return a;
+	}
+}
@@ -4,7 +4,14 @@
 #include "common/data-structures.h"
 #include "models.h"
 
+/* rows of a column evaluated at once */
+#define LAZY_BLOCK 64
+
+typedef struct lazy_dag_s lazy_dag_s;
+
 extern float lazy_epxression_compute(Range *range, char *src);
+extern int lazy_ranges_compile(Level *level);
+extern void lazy_ranges_expand(Level *level);
 
 #endif
 
@@ -0,0 +1,100 @@
+#include "cache.h"
+#include "../common/errcodes.h"
+#include <stdlib.h>
+
+static size_t compile_cache_slot(compile_cache_s *cache, uint64_t hash);
+
+int compile_cache_init(compile_cache_s *cache) {
+  cache->size = 0;
+  cache->cap = COMPILE_CACHE_INIT_SIZE;
+  cache->hashes = calloc(cache->cap, sizeof *cache->hashes);
+  cache->ids = malloc(cache->cap * sizeof *cache->ids);
+  if (!cache->hashes || !cache->ids) {
+    compile_cache_free(cache);
+    return STATUS_OUT_OF_MEMORY;
+  }
+  return STATUS_OK;
+}
+
+bool compile_cache_get(compile_cache_s *cache, uint64_t hash, long long *id) {
+  size_t i;
+
+  if (!cache->hashes)
+    return false;
+  if (!hash)
+    hash = 1;
+  i = compile_cache_slot(cache, hash);
+  if (!cache->hashes[i])
+    return false;
+  *id = cache->ids[i];
+  return true;
+}
+
+int compile_cache_put(compile_cache_s *cache, uint64_t hash, long long id) {
+  size_t i, ocap = cache->cap;
+  uint64_t *ohashes = cache->hashes;
+  long long *oids = cache->ids;
+
+  if (!ohashes)
+    return STATUS_OUT_OF_MEMORY;
+  if (!hash)
+    hash = 1;
+  if ((cache->size + 1) * 2 > cache->cap) {
+    cache->cap *= 2;
+    cache->hashes = calloc(cache->cap, sizeof *cache->hashes);
+    cache->ids = malloc(cache->cap * sizeof *cache->ids);
+    if (!cache->hashes || !cache->ids) {
+      free(cache->hashes);
+      free(cache->ids);
+      cache->hashes = ohashes;
+      cache->ids = oids;
+      cache->cap = ocap;
+      return STATUS_OUT_OF_MEMORY;
+    }
+    for (i = 0; i < ocap; i++) {
+      if (ohashes[i]) {
+        size_t j = compile_cache_slot(cache, ohashes[i]);
+        cache->hashes[j] = ohashes[i];
+        cache->ids[j] = oids[i];
+      }
+    }
+    free(ohashes);
+    free(oids);
+  }
+  i = compile_cache_slot(cache, hash);
+  if (!cache->hashes[i])
+    cache->size++;
+  cache->hashes[i] = hash;
+  cache->ids[i] = id;
+  return STATUS_OK;
+}
+
+void compile_cache_free(compile_cache_s *cache) {
+  free(cache->hashes);
+  free(cache->ids);
+  cache->hashes = NULL;
+  cache->ids = NULL;
+  cache->size = cache->cap = 0;
+}
+
+/* function: compile_hash ------------------------------------------------------
+ * Folds size bytes of data into a running 64 bit FNV-1a hash.
+ */
+uint64_t compile_hash(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+size_t compile_cache_slot(compile_cache_s *cache, uint64_t hash) {
+  size_t i = hash & (cache->cap - 1);
+
+  while (cache->hashes[i] && cache->hashes[i] != hash)
+    i = (i + 1) & (cache->cap - 1);
+  return i;
+}
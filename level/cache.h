@@ -0,0 +1,33 @@
+#ifndef __cache_h__
+#define __cache_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMPILE_CACHE_INIT_SIZE 256
+
+typedef struct compile_cache_s compile_cache_s;
+
+/*
+ * Content hashes of rows already written to a level database, mapped to the 
+ * ids they were written under. Open addressing, a hash of 0 marks an empty 
+ * slot so real hashes of 0 are stored as 1.
+ */
+struct compile_cache_s {
+  size_t size;
+  size_t cap;
+  uint64_t *hashes;
+  long long *ids;
+};
+
+extern int compile_cache_init(compile_cache_s *cache);
+extern bool compile_cache_get(compile_cache_s *cache, uint64_t hash, long long *id);
+extern int compile_cache_put(compile_cache_s *cache, uint64_t hash, long long id);
+extern void compile_cache_free(compile_cache_s *cache);
+extern uint64_t compile_hash(uint64_t hash, const void *data, size_t size);
+
+/* FNV-1a offset basis, the starting value for compile_hash */
+#define COMPILE_HASH_INIT 14695981039346656037ULL
+
+#endif
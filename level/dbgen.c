@@ -0,0 +1,407 @@
+#include "dbgen.h"
+#include "../common/constants.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *insert_qstr[P_ROW_COUNT] = {
+  [P_ROW_MESH] = "INSERT INTO mesh(name,data,indices,vertexCount,drawType) VALUES(?,?,?,?,?)",
+  [P_ROW_SHADER] = "INSERT INTO shader(type,name,src) VALUES(?,?,?)",
+  [P_ROW_PROGRAM] = "INSERT INTO program DEFAULT VALUES",
+  [P_ROW_PROGRAM_XREF] = "INSERT INTO program_xref(shaderID,programID) VALUES(?,?)",
+  [P_ROW_TEXTURE] = "INSERT INTO texture(path) VALUES(?)",
+  [P_ROW_MODEL] = "INSERT INTO model(meshID,programID,textureID,hasUV,transparent) VALUES(?,?,?,?,?)",
+  [P_ROW_LEVEL] = "INSERT INTO level(name,ambientGravityX,ambientGravityY,ambientGravityZ,integrator,timestep,cellSize) "
+    "VALUES(?,?,?,?,?,?,?)",
+  [P_ROW_CELL] = "INSERT INTO cell(levelID,minX,maxX,minY,maxY,minZ,maxZ,instances) VALUES(?,?,?,?,?,?,?,?)",
+  [P_ROW_INSTANCE] = "INSERT INTO instance(modelID,levelID,vx,vy,vz,scalex,scaley,scalez,mass,isSubjectToGravity,isStatic,"
+    "rotx,roty,rotz,cellID) VALUES(?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)",
+  [P_ROW_RANGE] = "INSERT INTO range(levelID,steps,var,cache,child) VALUES(?,?,?,?,?)",
+  [P_ROW_LAZY_INSTANCE] = "INSERT INTO lazy_instance(modelID,rangeID,vx,vy,vz,scalex,scaley,scalez,mass,isSubjectToGravity,isStatic,"
+    "rotx,roty,rotz,baked) VALUES(?,?,?,?,?,?,?,?,?,?,?,?,?,?,?)"
+};
+
+static const char compile_cache_qstr[] = 
+  "CREATE TABLE IF NOT EXISTS compile_cache (hash INTEGER, type TINYINT, rowID INTEGER, PRIMARY KEY(hash))";
+
+/*
+ * Upgrades indexed by the version they start from, each one ends by setting 
+ * the version it upgrades to. Databases from before user_version was set 
+ * have the original schema.sql and are version 1.
+ */
+static const char *schema_upgrade_qstr[BOB_SCHEMA_VERSION] = {
+  [1] = 
+    "ALTER TABLE mesh ADD COLUMN indices TEXT;"
+    "ALTER TABLE mesh ADD COLUMN vertexCount INTEGER;"
+    "ALTER TABLE mesh ADD COLUMN drawType TINYINT DEFAULT 0;"
+    "ALTER TABLE lazy_instance ADD COLUMN rotx VARCHAR(64) DEFAULT '0';"
+    "ALTER TABLE lazy_instance ADD COLUMN roty VARCHAR(64) DEFAULT '0';"
+    "ALTER TABLE lazy_instance ADD COLUMN rotz VARCHAR(64) DEFAULT '0';"
+    "ALTER TABLE lazy_instance ADD COLUMN baked BLOB;"
+    "ALTER TABLE level ADD COLUMN integrator TINYINT DEFAULT 0;"
+    "ALTER TABLE level ADD COLUMN timestep FLOAT DEFAULT 0;"
+    "ALTER TABLE level ADD COLUMN cellSize FLOAT DEFAULT 0;"
+    /* instance gets a primary key, which takes rebuilding the table */
+    "CREATE TABLE instance_v2 (id INTEGER, modelID INTEGER, levelID INTEGER, vx FLOAT, vy FLOAT, vz FLOAT, "
+    "scalex FLOAT, scaley FLOAT, scalez FLOAT, mass FLOAT, isSubjectToGravity TINYINT, isStatic TINYINT, "
+    "rotx FLOAT DEFAULT 0, roty FLOAT DEFAULT 0, rotz FLOAT DEFAULT 0, cellID INTEGER DEFAULT NULL, PRIMARY KEY(id), "
+    "FOREIGN KEY(modelID) REFERENCES model (id), FOREIGN KEY(levelID) REFERENCES level (id));"
+    "INSERT INTO instance_v2(modelID,levelID,vx,vy,vz,scalex,scaley,scalez,mass,isSubjectToGravity,isStatic) "
+    "SELECT modelID,levelID,vx,vy,vz,scalex,scaley,scalez,mass,isSubjectToGravity,isStatic FROM instance;"
+    "DROP TABLE instance;"
+    "ALTER TABLE instance_v2 RENAME TO instance;"
+    "CREATE VIRTUAL TABLE cell USING rtree(id, minX, maxX, minY, maxY, minZ, maxZ, +levelID INTEGER, +instances INTEGER);"
+    "CREATE INDEX instance_level ON instance(levelID, cellID, modelID);"
+    "CREATE INDEX instance_cell ON instance(cellID) WHERE cellID IS NOT NULL;"
+    "CREATE INDEX lazy_instance_range ON lazy_instance(rangeID);"
+    "CREATE INDEX range_level ON range(levelID);"
+    "CREATE INDEX level_name ON level(name);"
+    "CREATE INDEX program_xref_program ON program_xref(programID, shaderID);"
+    "PRAGMA user_version = 2",
+  [2] = 
+    "ALTER TABLE model ADD COLUMN transparent TINYINT DEFAULT 0;"
+    "PRAGMA user_version = 3"
+};
+
+static bool dbgen_upgrade(dbgen_s *gen);
+static bool dbgen_exec(dbgen_s *gen, const char *sql);
+static bool dbgen_prepare(dbgen_s *gen, const char *sql, sqlite3_stmt **stmt);
+static bool dbgen_load_cache(dbgen_s *gen);
+static bool dbgen_write_row(dbgen_s *gen, p_row_s *row);
+static bool dbgen_replace_level(dbgen_s *gen, p_row_s *row);
+static bool dbgen_step(dbgen_s *gen, sqlite3_stmt *stmt);
+static int dbgen_bind_row(sqlite3_stmt *stmt, p_row_s *row);
+static int dbgen_bind_literal(sqlite3_stmt *stmt, int index, const char *literal);
+static bool dbgen_insert(dbgen_s *gen, p_row_s *row);
+
+/* function: dbgen_open --------------------------------------------------------
+ * Opens the level database at path, which must already have the tables from 
+ * schema.sql, prepares an insert for every kind of row and loads the compile 
+ * cache. The compile_cache table is created if the database predates it and 
+ * databases from an older schema.sql are upgraded.
+ */
+dbgen_s *dbgen_open(const char *path) {
+  int i;
+  dbgen_s *gen = calloc(1, sizeof *gen);
+
+  if (!gen) {
+    perror("Memory allocation error in dbgen_open()");
+    return NULL;
+  }
+  if (sqlite3_open(path, &gen->db) != SQLITE_OK) {
+    fprintf(stderr, "Failed to open level database %s: %s\n", path, sqlite3_errmsg(gen->db));
+    dbgen_close(gen);
+    return NULL;
+  }
+  if (!dbgen_exec(gen, compile_cache_qstr) || !dbgen_upgrade(gen)) {
+    dbgen_close(gen);
+    return NULL;
+  }
+  for (i = 0; i < P_ROW_COUNT; i++) {
+    if (!dbgen_prepare(gen, insert_qstr[i], &gen->insert[i])) {
+      dbgen_close(gen);
+      return NULL;
+    }
+  }
+  if (!dbgen_prepare(gen, "INSERT OR REPLACE INTO compile_cache(hash,type,rowID) VALUES(?,?,?)", &gen->cacheput)
+      || !dbgen_prepare(gen, "SELECT hash,rowID FROM compile_cache", &gen->cacheload)
+      || !dbgen_prepare(gen, "DELETE FROM compile_cache WHERE type=? AND rowID=?", &gen->uncachelevel)
+      || !dbgen_prepare(gen, "SELECT id FROM level WHERE name=?", &gen->levelbyname)
+      || !dbgen_prepare(gen, "UPDATE level SET name=?,ambientGravityX=?,ambientGravityY=?,ambientGravityZ=?,"
+        "integrator=?,timestep=?,cellSize=? WHERE id=?", &gen->levelupdate)
+      || !dbgen_prepare(gen, "DELETE FROM lazy_instance WHERE rangeID IN (SELECT id FROM range WHERE levelID=?)", 
+        &gen->deletelazy)
+      || !dbgen_prepare(gen, "DELETE FROM range WHERE levelID=?", &gen->deleteranges)
+      || !dbgen_prepare(gen, "DELETE FROM instance WHERE levelID=?", &gen->deleteinstances)
+      || !dbgen_prepare(gen, "DELETE FROM cell WHERE levelID=?", &gen->deletecells)
+      || !dbgen_load_cache(gen)) {
+    dbgen_close(gen);
+    return NULL;
+  }
+  return gen;
+}
+
+/* function: dbgen_write -------------------------------------------------------
+ * Writes the rows recorded while parsing a file in a single transaction. 
+ * Ids of written rows are kept on the rows themselves so references are 
+ * bound directly instead of going through temp tables. Nothing is written 
+ * for a file with errors.
+ */
+bool dbgen_write(dbgen_s *gen, p_context_s *context) {
+  size_t i;
+  int type;
+  bool result = true;
+
+  if (context->parse_errors) {
+    fprintf(stderr, "Not writing level database, %d errors\n", context->parse_errors);
+    return false;
+  }
+  tpool_wait(context->pool);
+  if (!dbgen_exec(gen, "BEGIN"))
+    return false;
+  for (type = 0; type < P_ROW_COUNT && result; type++) {
+    for (i = 0; i < context->rows[type].size && result; i++)
+      result = dbgen_write_row(gen, context->rows[type].buffer[i]);
+  }
+  if (result)
+    result = dbgen_exec(gen, "COMMIT");
+  else
+    dbgen_exec(gen, "ROLLBACK");
+  /* ids written in a rolled back transaction must not stay cached */
+  dbgen_load_cache(gen);
+  return result;
+}
+
+void dbgen_close(dbgen_s *gen) {
+  int i;
+
+  if (!gen)
+    return;
+  for (i = 0; i < P_ROW_COUNT; i++)
+    sqlite3_finalize(gen->insert[i]);
+  sqlite3_finalize(gen->cacheput);
+  sqlite3_finalize(gen->cacheload);
+  sqlite3_finalize(gen->uncachelevel);
+  sqlite3_finalize(gen->levelbyname);
+  sqlite3_finalize(gen->levelupdate);
+  sqlite3_finalize(gen->deletelazy);
+  sqlite3_finalize(gen->deleteranges);
+  sqlite3_finalize(gen->deleteinstances);
+  sqlite3_finalize(gen->deletecells);
+  compile_cache_free(&gen->cache);
+  sqlite3_close(gen->db);
+  free(gen);
+}
+
+/* function: dbgen_upgrade -----------------------------------------------------
+ * Runs the upgrades from the database's schema version up to 
+ * BOB_SCHEMA_VERSION in one transaction. A database without tables is left 
+ * alone, preparing the inserts reports it.
+ */
+bool dbgen_upgrade(dbgen_s *gen) {
+  int version = 0;
+  bool hastables = false;
+  sqlite3_stmt *stmt;
+
+  if (!dbgen_prepare(gen, "PRAGMA user_version", &stmt))
+    return false;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    version = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  if (version >= BOB_SCHEMA_VERSION)
+    return true;
+
+  if (!dbgen_prepare(gen, "SELECT 1 FROM sqlite_master WHERE type='table' AND name='instance'", &stmt))
+    return false;
+  hastables = sqlite3_step(stmt) == SQLITE_ROW;
+  sqlite3_finalize(stmt);
+  if (!hastables)
+    return true;
+
+  if (version < 1)
+    version = 1;
+  fprintf(stderr, "Upgrading level database from schema version %d to %d\n", version, BOB_SCHEMA_VERSION);
+  if (!dbgen_exec(gen, "BEGIN"))
+    return false;
+  for (; version < BOB_SCHEMA_VERSION; version++) {
+    if (!dbgen_exec(gen, schema_upgrade_qstr[version])) {
+      fprintf(stderr, "Failed to upgrade level database from schema version %d, recreate it from schema.sql\n", version);
+      dbgen_exec(gen, "ROLLBACK");
+      return false;
+    }
+  }
+  return dbgen_exec(gen, "COMMIT");
+}
+
+bool dbgen_exec(dbgen_s *gen, const char *sql) {
+  char *err = NULL;
+
+  if (sqlite3_exec(gen->db, sql, NULL, NULL, &err) != SQLITE_OK) {
+    fprintf(stderr, "Error executing %s: %s\n", sql, err);
+    sqlite3_free(err);
+    return false;
+  }
+  return true;
+}
+
+bool dbgen_prepare(dbgen_s *gen, const char *sql, sqlite3_stmt **stmt) {
+  if (sqlite3_prepare_v2(gen->db, sql, -1, stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare %s, was schema.sql loaded? %s\n", sql, sqlite3_errmsg(gen->db));
+    return false;
+  }
+  return true;
+}
+
+bool dbgen_load_cache(dbgen_s *gen) {
+  int rc;
+
+  compile_cache_free(&gen->cache);
+  if (compile_cache_init(&gen->cache)) {
+    perror("Memory allocation error in dbgen_load_cache()");
+    return false;
+  }
+  while ((rc = sqlite3_step(gen->cacheload)) == SQLITE_ROW) {
+    compile_cache_put(&gen->cache, sqlite3_column_int64(gen->cacheload, 0), 
+        sqlite3_column_int64(gen->cacheload, 1));
+  }
+  sqlite3_reset(gen->cacheload);
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Error loading compile cache: %s\n", sqlite3_errmsg(gen->db));
+    return false;
+  }
+  return true;
+}
+
+/* function: dbgen_write_row ---------------------------------------------------
+ * Rows with an owner are written along with it. Other rows are skipped if 
+ * their hash is cached, otherwise they are written and cached. 
+ */
+bool dbgen_write_row(dbgen_s *gen, p_row_s *row) {
+  if (row->owner) {
+    if (row->owner->cached)
+      return true;
+    return dbgen_insert(gen, row);
+  }
+  if (row->cached || compile_cache_get(&gen->cache, row->hash, &row->id)) {
+    row->cached = true;
+    return true;
+  }
+  if (row->type == P_ROW_LEVEL) {
+    if (!dbgen_replace_level(gen, row))
+      return false;
+  }
+  else if (!dbgen_insert(gen, row)) {
+    return false;
+  }
+  /* identical objects later in the same file reuse this row */
+  compile_cache_put(&gen->cache, row->hash, row->id);
+  sqlite3_bind_int64(gen->cacheput, 1, row->hash);
+  sqlite3_bind_int(gen->cacheput, 2, row->type);
+  sqlite3_bind_int64(gen->cacheput, 3, row->id);
+  return dbgen_step(gen, gen->cacheput);
+}
+
+/* function: dbgen_replace_level -----------------------------------------------
+ * A level that already exists under the same name keeps its id, its 
+ * instances, cells, ranges and lazy instances are deleted so the new ones 
+ * can be written in their place.
+ */
+bool dbgen_replace_level(dbgen_s *gen, p_row_s *row) {
+  int rc;
+
+  rc = dbgen_bind_literal(gen->levelbyname, 1, row->values[0].text.buffer);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_step(gen->levelbyname);
+  if (rc != SQLITE_ROW) {
+    sqlite3_reset(gen->levelbyname);
+    if (rc != SQLITE_DONE) {
+      fprintf(stderr, "Error looking up level: %s\n", sqlite3_errmsg(gen->db));
+      return false;
+    }
+    return dbgen_insert(gen, row);
+  }
+  row->id = sqlite3_column_int64(gen->levelbyname, 0);
+  sqlite3_reset(gen->levelbyname);
+
+  sqlite3_bind_int64(gen->deletelazy, 1, row->id);
+  sqlite3_bind_int64(gen->deleteranges, 1, row->id);
+  sqlite3_bind_int64(gen->deleteinstances, 1, row->id);
+  sqlite3_bind_int64(gen->deletecells, 1, row->id);
+  sqlite3_bind_int(gen->uncachelevel, 1, P_ROW_LEVEL);
+  sqlite3_bind_int64(gen->uncachelevel, 2, row->id);
+  if (!dbgen_step(gen, gen->deletelazy) || !dbgen_step(gen, gen->deleteranges) 
+      || !dbgen_step(gen, gen->deleteinstances) || !dbgen_step(gen, gen->deletecells)
+      || !dbgen_step(gen, gen->uncachelevel))
+    return false;
+
+  rc = dbgen_bind_row(gen->levelupdate, row);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int64(gen->levelupdate, row->nvalues + 1, row->id);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Error binding level: %s\n", sqlite3_errmsg(gen->db));
+    sqlite3_clear_bindings(gen->levelupdate);
+    return false;
+  }
+  return dbgen_step(gen, gen->levelupdate);
+}
+
+/* 
+ * Runs a statement that returns no rows, then resets it for the next use.
+ */
+bool dbgen_step(dbgen_s *gen, sqlite3_stmt *stmt) {
+  int rc = sqlite3_step(stmt);
+
+  if (rc != SQLITE_DONE)
+    fprintf(stderr, "Error writing level database: %s\n", sqlite3_errmsg(gen->db));
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return rc == SQLITE_DONE;
+}
+
+int dbgen_bind_row(sqlite3_stmt *stmt, p_row_s *row) {
+  int i, rc = SQLITE_OK;
+
+  for (i = 0; i < row->nvalues && rc == SQLITE_OK; i++) {
+    p_value_s *value = &row->values[i];
+    switch (value->type) {
+      case P_VAL_NULL:
+        rc = sqlite3_bind_null(stmt, i + 1);
+        break;
+      case P_VAL_LITERAL:
+        rc = dbgen_bind_literal(stmt, i + 1, value->text.buffer);
+        break;
+      case P_VAL_TEXT:
+        rc = sqlite3_bind_text(stmt, i + 1, value->text.buffer, -1, SQLITE_STATIC);
+        break;
+      case P_VAL_REF:
+        rc = sqlite3_bind_int64(stmt, i + 1, value->ref->id);
+        break;
+      case P_VAL_BLOB:
+        rc = sqlite3_bind_blob(stmt, i + 1, value->text.buffer, value->text.size, SQLITE_STATIC);
+        break;
+    }
+  }
+  return rc;
+}
+
+bool dbgen_insert(dbgen_s *gen, p_row_s *row) {
+  sqlite3_stmt *stmt = gen->insert[row->type];
+  int rc = dbgen_bind_row(stmt, row);
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+      row->id = sqlite3_last_insert_rowid(gen->db);
+      rc = SQLITE_OK;
+    }
+  }
+  if (rc != SQLITE_OK)
+    fprintf(stderr, "Error inserting row: %s\n", sqlite3_errmsg(gen->db));
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return rc == SQLITE_OK;
+}
+
+/* 
+ * Binds a literal as the text backend would have written it. Quoted strings 
+ * lose their quotes, numbers are bound as text and converted by the column's 
+ * affinity just like a numeric literal in an INSERT.
+ */
+int dbgen_bind_literal(sqlite3_stmt *stmt, int index, const char *literal) {
+  size_t len = strlen(literal);
+  char *unquoted;
+  size_t i, j;
+
+  if (len < 2 || literal[0] != '"' || literal[len - 1] != '"')
+    return sqlite3_bind_text(stmt, index, literal, len, SQLITE_STATIC);
+
+  unquoted = malloc(len);
+  if (!unquoted)
+    return SQLITE_NOMEM;
+  for (i = 1, j = 0; i < len - 1; i++) {
+    unquoted[j++] = literal[i];
+    if (literal[i] == '"' && literal[i + 1] == '"')
+      i++;
+  }
+  return sqlite3_bind_text(stmt, index, unquoted, j, free);
+}
@@ -0,0 +1,37 @@
+#ifndef __dbgen_h__
+#define __dbgen_h__
+
+#include "parse.h"
+#include <sqlite3.h>
+
+typedef struct dbgen_s dbgen_s;
+
+/*
+ * Backend writing compiled levels straight into a level database instead 
+ * of emitting SQL text. Statements are prepared once and reused for every 
+ * file, each file is written in its own transaction.
+ *
+ * cache mirrors the compile_cache table. Objects whose content hash is 
+ * already in it are not written again, levels that changed are replaced in 
+ * place under their old id.
+ */
+struct dbgen_s {
+  sqlite3 *db;
+  sqlite3_stmt *insert[P_ROW_COUNT];
+  sqlite3_stmt *cacheput;
+  sqlite3_stmt *cacheload;
+  sqlite3_stmt *uncachelevel;
+  sqlite3_stmt *levelbyname;
+  sqlite3_stmt *levelupdate;
+  sqlite3_stmt *deletelazy;
+  sqlite3_stmt *deleteranges;
+  sqlite3_stmt *deleteinstances;
+  sqlite3_stmt *deletecells;
+  compile_cache_s cache;
+};
+
+extern dbgen_s *dbgen_open(const char *path);
+extern bool dbgen_write(dbgen_s *gen, p_context_s *context);
+extern void dbgen_close(dbgen_s *gen);
+
+#endif
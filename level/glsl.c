@@ -0,0 +1,196 @@
+#include "glsl.h"
+#include "../common/constants.h"
+#include "../common/data-structures.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Just enough of a GLSL scanner to find top level uniform declarations:
+ * comments and preprocessor lines are skipped, everything else is read
+ * as identifiers and single punctuation characters.
+ */
+
+static const char *glsl_skip(const char *p);
+static size_t glsl_word(const char *p);
+static bool glsl_word_is(const char *p, size_t len, const char *word);
+static const char *glsl_block_end(const char *p);
+static CharBuf glsl_normalize(const char *start, const char *end);
+
+/* function: glsl_frame_block --------------------------------------------------
+ * Returns a copy of src declaring the engine's per-frame uniform block. A
+ * "uniform mat4 camera;" declaration is replaced with the block, a block
+ * already declared has to match it exactly. Returns NULL and sets error
+ * if it doesn't.
+ */
+char *glsl_frame_block(const char *src, const char **error) {
+  static const char frame[] = BOB_FRAME_BLOCK_LAYOUT " " BOB_FRAME_BLOCK;
+  const char *p = src, *q, *layout = NULL, *layoutend = NULL,
+             *decl = NULL, *declend = NULL, *block = NULL;
+  size_t len, srclen = strlen(src);
+  char *result;
+
+  *error = NULL;
+  while (*(p = glsl_skip(p))) {
+    len = glsl_word(p);
+    if (!len) {
+      p++;
+    }
+    else if (glsl_word_is(p, len, "layout")) {
+      layout = p;
+      layoutend = strchr(p, ')');
+      if (!layoutend)
+        break;
+      p = ++layoutend;
+    }
+    else if (glsl_word_is(p, len, "uniform")) {
+      q = glsl_skip(p + len);
+      len = glsl_word(q);
+      if (glsl_word_is(q, len, "mat4")) {
+        q = glsl_skip(q + len);
+        len = glsl_word(q);
+        if (glsl_word_is(q, len, "camera") && *(q = glsl_skip(q + len)) == ';') {
+          decl = p;
+          declend = q + 1;
+        }
+      }
+      else if (glsl_word_is(q, len, BOB_FRAME_BLOCK_NAME)) {
+        declend = glsl_block_end(q);
+        if (!layout || glsl_skip(layoutend) != p || !declend) {
+          *error = "Shader declares uniform block " BOB_FRAME_BLOCK_NAME " without " BOB_FRAME_BLOCK_LAYOUT;
+          return NULL;
+        }
+        CharBuf have = glsl_normalize(layout, declend),
+                want = glsl_normalize(frame, frame + sizeof frame - 1);
+        bool match = have.size == want.size && !memcmp(have.buffer, want.buffer, have.size);
+        char_buf_free(&have);
+        char_buf_free(&want);
+        if (!match) {
+          *error = "Shader declares uniform block " BOB_FRAME_BLOCK_NAME " differently from the engine: "
+            BOB_FRAME_BLOCK_LAYOUT " " BOB_FRAME_BLOCK;
+          return NULL;
+        }
+        block = layout;
+        p = declend;
+        continue;
+      }
+      p = q;
+    }
+    else {
+      p += len;
+    }
+  }
+  if (block && decl) {
+    *error = "Shader declares both uniform mat4 camera and the " BOB_FRAME_BLOCK_NAME " block";
+    return NULL;
+  }
+  if (!decl) {
+    result = malloc(srclen + 1);
+    if (result)
+      memcpy(result, src, srclen + 1);
+    else
+      *error = "Memory allocation error in glsl_frame_block()";
+    return result;
+  }
+  len = decl - src;
+  result = malloc(srclen - (declend - decl) + sizeof frame);
+  if (!result) {
+    *error = "Memory allocation error in glsl_frame_block()";
+    return NULL;
+  }
+  memcpy(result, src, len);
+  memcpy(result + len, frame, sizeof frame - 1);
+  strcpy(result + len + sizeof frame - 1, declend);
+  return result;
+}
+
+/*
+ * Skips whitespace, comments and preprocessor lines.
+ */
+const char *glsl_skip(const char *p) {
+  for (;;) {
+    if (isspace((unsigned char)*p)) {
+      p++;
+    }
+    else if (p[0] == '/' && p[1] == '/') {
+      while (*p && *p != '\n')
+        p++;
+    }
+    else if (p[0] == '/' && p[1] == '*') {
+      p += 2;
+      while (*p && !(p[0] == '*' && p[1] == '/'))
+        p++;
+      if (*p)
+        p += 2;
+    }
+    else if (*p == '#') {
+      while (*p && (*p != '\n' || p[-1] == '\\'))
+        p++;
+    }
+    else {
+      return p;
+    }
+  }
+}
+
+size_t glsl_word(const char *p) {
+  size_t len = 0;
+
+  if (isalpha((unsigned char)*p) || *p == '_') {
+    while (isalnum((unsigned char)p[len]) || p[len] == '_')
+      len++;
+  }
+  return len;
+}
+
+bool glsl_word_is(const char *p, size_t len, const char *word) {
+  return len == strlen(word) && !strncmp(p, word, len);
+}
+
+/*
+ * Returns the end of a uniform block starting at its name, just past the
+ * ';' following the closing brace.
+ */
+const char *glsl_block_end(const char *p) {
+  p = strchr(p, '}');
+  if (!p)
+    return NULL;
+  p = glsl_skip(p + 1);
+  return *p == ';' ? p + 1 : NULL;
+}
+
+/*
+ * Tokens of the source between start and end, separated by a space only
+ * where two identifiers or numbers would otherwise run together.
+ */
+CharBuf glsl_normalize(const char *start, const char *end) {
+  CharBuf b;
+  const char *p = start;
+  size_t len;
+  char tok[2] = {0};
+  bool lastword = false;
+
+  char_buf_init(&b);
+  while ((p = glsl_skip(p)) < end && *p) {
+    len = glsl_word(p);
+    if (!len && isdigit((unsigned char)*p)) {
+      while (isalnum((unsigned char)p[len]) || p[len] == '.')
+        len++;
+    }
+    if (len) {
+      if (lastword)
+        char_add_s(&b, " ");
+      while (len--) {
+        tok[0] = *p++;
+        char_add_s(&b, tok);
+      }
+      lastword = true;
+    }
+    else {
+      tok[0] = *p++;
+      char_add_s(&b, tok);
+      lastword = false;
+    }
+  }
+  return b;
+}
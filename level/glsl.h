@@ -0,0 +1,6 @@
+#ifndef __glsl_h__
+#define __glsl_h__
+
+extern char *glsl_frame_block(const char *src, const char **error);
+
+#endif
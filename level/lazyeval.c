@@ -0,0 +1,136 @@
+#include "lazyeval.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LAZY_NUM_LEN 64
+
+typedef struct lazy_eval_s lazy_eval_s;
+
+/*
+ * Evaluates lazy instance expressions the same way the runtime engine in 
+ * lazy_instance_engine.c does, down to its float arithmetic and unary minus 
+ * applying to the whole rest of the expression, so baked instances land 
+ * exactly where the runtime would have put them. Anything the runtime 
+ * would report as an error fails the evaluation instead.
+ */
+struct lazy_eval_s {
+  const char *ptr;
+  const char *end;
+  const lazy_scope_s *scope;
+  bool error;
+};
+
+static char lazy_peek(lazy_eval_s *e);
+static float lazy_expression(lazy_eval_s *e);
+static float lazy_term(lazy_eval_s *e);
+static float lazy_factor(lazy_eval_s *e);
+
+bool lazy_eval(const char *src, size_t len, const lazy_scope_s *scope, float *result) {
+  lazy_eval_s e = {src, src + len, scope, false};
+
+  *result = lazy_expression(&e);
+  return !e.error && !lazy_peek(&e);
+}
+
+/* 
+ * Skips whitespace and returns the next character, '\0' at the end. Any 
+ * character the runtime lexer doesn't know fails the evaluation.
+ */
+char lazy_peek(lazy_eval_s *e) {
+  while (e->ptr < e->end && isspace((unsigned char)*e->ptr))
+    e->ptr++;
+  if (e->ptr == e->end)
+    return '\0';
+  if (!strchr("+-*/()", *e->ptr) && !isalnum((unsigned char)*e->ptr)) {
+    e->error = true;
+    return '\0';
+  }
+  return *e->ptr;
+}
+
+float lazy_expression(lazy_eval_s *e) {
+  float val, term;
+  char c = lazy_peek(e);
+
+  if (c == '+' || c == '-') {
+    e->ptr++;
+    val = lazy_expression(e);
+    return c == '-' ? -val : val;
+  }
+  val = lazy_term(e);
+  while ((c = lazy_peek(e)) == '+' || c == '-') {
+    e->ptr++;
+    term = lazy_term(e);
+    if (c == '+')
+      val += term;
+    else
+      val -= term;
+  }
+  return val;
+}
+
+float lazy_term(lazy_eval_s *e) {
+  float val, factor;
+  char c;
+
+  val = lazy_factor(e);
+  while ((c = lazy_peek(e)) == '*' || c == '/') {
+    e->ptr++;
+    factor = lazy_factor(e);
+    if (c == '*')
+      val = val * factor;
+    else
+      val = val / factor;
+  }
+  return val;
+}
+
+float lazy_factor(lazy_eval_s *e) {
+  char num[LAZY_NUM_LEN];
+  const char *start;
+  const lazy_scope_s *scope;
+  float value;
+  char c = lazy_peek(e);
+
+  if (isdigit((unsigned char)c)) {
+    start = e->ptr;
+    while (e->ptr < e->end && isdigit((unsigned char)*e->ptr))
+      e->ptr++;
+    if (e->ptr < e->end && *e->ptr == '.') {
+      e->ptr++;
+      while (e->ptr < e->end && isdigit((unsigned char)*e->ptr))
+        e->ptr++;
+    }
+    if (e->ptr - start >= LAZY_NUM_LEN) {
+      e->error = true;
+      return 0.0;
+    }
+    memcpy(num, start, e->ptr - start);
+    num[e->ptr - start] = '\0';
+    value = atof(num);
+    return value;
+  }
+  if (isalpha((unsigned char)c)) {
+    for (scope = e->scope; scope && scope->var != c; scope = scope->parent);
+    while (e->ptr < e->end && isalpha((unsigned char)*e->ptr))
+      e->ptr++;
+    if (!scope) {
+      e->error = true;
+      return 0.0;
+    }
+    return (float)scope->currval;
+  }
+  if (c == '(') {
+    e->ptr++;
+    value = lazy_expression(e);
+    if (lazy_peek(e) != ')') {
+      e->error = true;
+      return 0.0;
+    }
+    e->ptr++;
+    return value;
+  }
+  e->error = true;
+  return 0.0;
+}
@@ -0,0 +1,28 @@
+#ifndef __lazyeval_h__
+#define __lazyeval_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct lazy_scope_s lazy_scope_s;
+
+/*
+ * A range being emitted, linked to the ranges enclosing it. Holds the 
+ * iterator state used to evaluate lazy instance expressions at compile 
+ * time and the counts reported once the range's instances are emitted.
+ * steps is -1 when it isn't an integer constant.
+ */
+struct lazy_scope_s {
+  char var;
+  int steps;
+  int currval;
+  bool cached;
+  bool bake;
+  size_t nbaked;
+  size_t nlazy;
+  lazy_scope_s *parent;
+};
+
+extern bool lazy_eval(const char *src, size_t len, const lazy_scope_s *scope, float *result);
+
+#endif
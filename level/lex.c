@@ -5,25 +5,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-static void add_token(toklist_s *list, char *lexeme, size_t len, unsigned lineno, toktype_e type);
-static int tok_keyword(char *ptr);
+static char lex_peek(const char *p, const char *end);
+static int map_source(toklist_s *list, const char *file_name);
+static void add_token(toklist_s *list, const char *lexeme, size_t len, unsigned lineno, toktype_e type);
+static int tok_keyword(const char *ptr, size_t len);
 static void report_lexical_error(const char *message, char c, unsigned lineno);
 
+/*
+ * The source is mapped read only and never modified. Every lexeme is 
+ * copied once into a single arena sized for the worst case of one token
+ * per source character, so no allocation happens per token and lexeme 
+ * pointers stay valid while the token array grows.
+ */
 toklist_s lex(const char *file_name) {
-	int result;
 	unsigned lineno = 1;
-	char *fptr, *bptr, bck;
-	CharBuf src;
-	toklist_s list = {NULL, NULL};
+	const char *fptr, *bptr, *end;
+	toklist_s list = {NULL, 0, 0, NULL, 0, NULL, 0};
 
-	result = char_buf_from_file(&src, file_name);
-	if (result != STATUS_OK) {
+	if (map_source(&list, file_name) != STATUS_OK) {
 		fprintf(stderr, "Error Reading file: %s\n", file_name);
-		return (toklist_s) { NULL, NULL};
+		toklist_free(&list);
+		return list;
 	}
-	fptr = src.buffer;
-	while (*fptr) {
+	list.lexemes = malloc(2 * list.src_size + 2);
+	list.cap = list.src_size / 4 + 16;
+	list.head = malloc(list.cap * sizeof *list.head);
+	if (!list.lexemes || !list.head) {
+		perror("failure on malloc in lex()");
+		exit(EXIT_FAILURE);
+	}
+	fptr = list.src;
+	end = list.src + list.src_size;
+	while (fptr < end) {
 		switch (*fptr) {
 			case '\n':
 				lineno++;
@@ -34,116 +52,96 @@ toklist_s lex(const char *file_name) {
 				fptr++;
 				break;
 			case '(':
-				add_token(&list, "(", 1, lineno, TOK_LPAREN);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_LPAREN);
 				break;
 			case ')':
-				add_token(&list, ")", 1, lineno, TOK_RPAREN);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_RPAREN);
 				break;
 			case '{':
-				add_token(&list, "{", 1, lineno, TOK_LBRACE);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_LBRACE);
 				break;
 			case '}':
-				add_token(&list, "}", 1, lineno, TOK_RBRACE);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_RBRACE);
 				break;
 			case '[':
-				add_token(&list, "[", 1, lineno, TOK_LBRACK);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_LBRACK);
 				break;
 			case ']':
-				add_token(&list, "]", 1, lineno, TOK_RBRACK);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_RBRACK);
 				break;
 			case ',':
-				add_token(&list, ",", 1, lineno, TOK_COMMA);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_COMMA);
 				break;
 			case ':':
-				if (*(fptr + 1) == '=') {
-					add_token(&list, ":=", 2, lineno, TOK_ASSIGN);
+				if (lex_peek(fptr + 1, end) == '=') {
+					add_token(&list, fptr, 2, lineno, TOK_ASSIGN);
 					fptr += 2;
 				}
 				else {
-					add_token(&list, ":", 1, lineno, TOK_COLON);
-					fptr++;
+					add_token(&list, fptr++, 1, lineno, TOK_COLON);
 				}
 				break;
 			case ';':
-				add_token(&list, ";", 1, lineno, TOK_SEMICOLON);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_SEMICOLON);
 				break;
 			case '.':
-				add_token(&list, ".", 1, lineno, TOK_DOT);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_DOT);
 				break;
 			case '+':
-				add_token(&list, "+", 1, lineno, TOK_ADDOP);
-				fptr++;
-				break;
 			case '-':
-				add_token(&list, "-", 1, lineno, TOK_ADDOP);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_ADDOP);
 				break;
 			case '*':
-				add_token(&list, "*", 1, lineno, TOK_MULOP);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_MULOP);
 				break;
 			case '/':
-				if(*(fptr + 1) == '/') {
+				if (lex_peek(fptr + 1, end) == '/') {
 					fptr++;
-					while(*fptr && *fptr != '\n')
+					while (fptr < end && *fptr != '\n')
 						fptr++;	
 				}
-				else if(*(fptr + 1) == '*') {
-					while(*fptr) {
-						if(*fptr == '*' && *(fptr + 1) == '/') {
+				else if (lex_peek(fptr + 1, end) == '*') {
+					while (fptr < end) {
+						if (*fptr == '*' && lex_peek(fptr + 1, end) == '/') {
 							fptr += 2;
 							break;
 						}
-            else if (*fptr == '\n') {
-              lineno++;
-            }
+						else if (*fptr == '\n') {
+							lineno++;
+						}
 						fptr++;
 					}
 				}
 				else {
-					add_token(&list, "/", 1, lineno, TOK_MULOP);
-					fptr++;
+					add_token(&list, fptr++, 1, lineno, TOK_MULOP);
 				}
 				break;
 			case '$':
-				add_token(&list, "$", 1, lineno, TOK_GENERIC_DEC);
-				fptr++;
+				add_token(&list, fptr++, 1, lineno, TOK_GENERIC_DEC);
 				break;
 			case '"':
 				bptr = fptr;
 				fptr++;
-				while (*fptr && *fptr != '"') {
+				while (fptr < end && *fptr != '"') {
 					if (*fptr == '\\') {
-            char c = *(fptr + 1);
+						char c = lex_peek(fptr + 1, end);
 						if (c) {
-              if (c == '\n')
-                lineno++;
+							if (c == '\n')
+								lineno++;
 							fptr += 2;
-            }
+						}
 						else
 							fptr++;
 					}
 					else {
-            if (*fptr == '\n')
-              lineno++;
+						if (*fptr == '\n')
+							lineno++;
 						fptr++;
 					}
 				}
-				if (*fptr) {
+				if (fptr < end) {
 					fptr++;
-					bck = *fptr;
-					*fptr = '\0';
 					add_token(&list, bptr, fptr - bptr, lineno, TOK_STRING);
-					*fptr = bck;
 				}
 				else {
 					report_lexical_error("unterminated string literal", '"', lineno);
@@ -153,56 +151,39 @@ toklist_s lex(const char *file_name) {
 				if (isalpha(*fptr)) {
 					toktype_e type;
 					bptr = fptr;
-					while (isalnum(*++fptr));
-					bck = *fptr;
-					*fptr = '\0';
-					type = tok_keyword(bptr);
+					while (isalnum(lex_peek(++fptr, end)));
+					type = tok_keyword(bptr, fptr - bptr);
 					if (type == TOK_NONE)
 						add_token(&list, bptr, fptr - bptr, lineno, TOK_IDENTIFIER);
 					else
 						add_token(&list, bptr, fptr - bptr, lineno, type);
-					*fptr = bck;
 				}
-				else if(isdigit(*fptr)) {
+				else if (isdigit(*fptr)) {
+					toktype_e type = TOK_INTEGER;
 					bptr = fptr;
-					while (isdigit(*++fptr));
-					if (*fptr == '.') {
+					while (isdigit(lex_peek(++fptr, end)));
+					if (lex_peek(fptr, end) == '.') {
 						fptr++;
-						if (isdigit(*fptr)) {
-							while (isdigit(*++fptr));	
-              if (*fptr == 'e' || *fptr == 'E') {
-                fptr++;
-                if (*fptr == '-' || *fptr == '+')
-                  fptr++;
-                while(isdigit(*++fptr));
-              }
-							bck = *fptr;	
-							*fptr = '\0';
-							add_token(&list, bptr, fptr - bptr, lineno, TOK_FLOAT);
-							*fptr = bck;
+						if (!isdigit(lex_peek(fptr, end))) {
+							report_lexical_error("invalid number form", lex_peek(fptr, end), lineno);
+							fptr++;
+							break;
 						}
-						else {
-							report_lexical_error("invalid number form", *fptr, lineno);
+						while (isdigit(lex_peek(++fptr, end)));	
+						type = TOK_FLOAT;
+					}
+					if (lex_peek(fptr, end) == 'e' || lex_peek(fptr, end) == 'E') {
+						fptr++;
+						if (lex_peek(fptr, end) == '-' || lex_peek(fptr, end) == '+')
 							fptr++;
+						if (!isdigit(lex_peek(fptr, end))) {
+							report_lexical_error("invalid number form", lex_peek(fptr, end), lineno);
+							break;
 						}
-					} else if (*fptr == 'e' || *fptr == 'E') {
-            fptr++;
-            if (*fptr == '-' || *fptr == '+')
-              fptr++;
-            if (isdigit(*fptr)) {
-							while (isdigit(*++fptr));	
-							bck = *fptr;	
-							*fptr = '\0';
-							add_token(&list, bptr, fptr - bptr, lineno, TOK_FLOAT);
-							*fptr = bck;
-            }
-          }
-					else {
-						bck = *fptr;	
-						*fptr = '\0';
-						add_token(&list, bptr, fptr - bptr, lineno, TOK_INTEGER);
-						*fptr = bck;
+						while (isdigit(lex_peek(++fptr, end)));	
+						type = TOK_FLOAT;
 					}
+					add_token(&list, bptr, fptr - bptr, lineno, type);
 				}
 				else {
 					report_lexical_error("invalid character", *fptr, lineno);
@@ -215,64 +196,129 @@ toklist_s lex(const char *file_name) {
 	return list;
 }
 
-void add_token(toklist_s *list, char *lexeme, size_t len, unsigned lineno, toktype_e type) {
-	tok_s *t = malloc(sizeof(*t) + len + 1);
-	if (!t) {
-		perror("failure on malloc in add_token()");
-		exit(EXIT_FAILURE);
+/* character at p, or '\0' past the end of the unterminated source */
+char lex_peek(const char *p, const char *end) {
+	return p < end ? *p : '\0';
+}
+
+int map_source(toklist_s *list, const char *file_name) {
+	struct stat st;
+	int fd = open(file_name, O_RDONLY);
+
+	if (fd < 0)
+		return STATUS_FILE_IO_ERR;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return STATUS_FILE_IO_ERR;
+	}
+	list->src_size = st.st_size;
+	if (list->src_size) {
+		void *src = mmap(NULL, list->src_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (src == MAP_FAILED) {
+			list->src_size = 0;
+			close(fd);
+			return STATUS_FILE_IO_ERR;
+		}
+		madvise(src, list->src_size, MADV_SEQUENTIAL);
+		list->src = src;
+	}
+	else {
+		list->src = "";
 	}
+	close(fd);
+	return STATUS_OK;
+}
+
+void add_token(toklist_s *list, const char *lexeme, size_t len, unsigned lineno, toktype_e type) {
+	tok_s *t;
+
+	if (list->size == list->cap) {
+		list->cap *= 2;
+		t = realloc(list->head, list->cap * sizeof *t);
+		if (!t) {
+			perror("failure on realloc in add_token()");
+			exit(EXIT_FAILURE);
+		}
+		list->head = t;
+	}
+	t = &list->head[list->size++];
 	t->type = type;
 	t->lineno = lineno;
-	t->next = NULL;
-	strcpy(t->lexeme, lexeme);
-	if (!list->head) 
-		list->head = t;
-	else
-		list->tail->next = t;
-	list->tail = t;
+	t->offset = type == TOK_EOF ? list->src_size : (size_t)(lexeme - list->src);
+	t->length = len;
+	t->lexeme = &list->lexemes[list->lexemes_used];
+	memcpy(t->lexeme, lexeme, len);
+	t->lexeme[len] = '\0';
+	list->lexemes_used += len + 1;
 }
 
-int tok_keyword(char *ptr) {
-	if(!strcmp(ptr, "Shader"))
-		return TOK_SHADER_DEC;
-	else if(!strcmp(ptr, "Texture"))
-		return TOK_TEXTURE_DEC;
-	else if(!strcmp(ptr, "Program"))
-		return TOK_PROGRAM_DEC;
-	else if(!strcmp(ptr, "Model"))
-		return TOK_MODEL_DEC;
-	else if(!strcmp(ptr, "Mesh"))
-		return TOK_MESH_DEC;
-	else if(!strcmp(ptr, "Instance"))
-		return TOK_INSTANCE_DEC;
-  else if(!strcmp(ptr, "LazyInstance"))
-    return TOK_LAZY_INSTANCE_DEC;
-  else if(!strcmp(ptr, "Range"))
-    return TOK_RANGE_DEC;
-	else if(!strcmp(ptr, "Level"))
-		return TOK_LEVEL_DEC;
-	else if(!strcmp(ptr, "Float"))
-		return TOK_FLOAT_DEC;
-	else if(!strcmp(ptr, "Int"))
-		return TOK_INT_DEC;
-	else if(!strcmp(ptr, "String"))
-		return TOK_STRING_DEC;
-	else if(!strcmp(ptr, "Dict"))
-		return TOK_DICT_DEC;
-	else
-		return TOK_NONE;
+int tok_keyword(const char *ptr, size_t len) {
+	switch (len) {
+		case 3:
+			if (!memcmp(ptr, "Int", 3))
+				return TOK_INT_DEC;
+			break;
+		case 4:
+			if (!memcmp(ptr, "Mesh", 4))
+				return TOK_MESH_DEC;
+			if (!memcmp(ptr, "Dict", 4))
+				return TOK_DICT_DEC;
+			break;
+		case 5:
+			if (!memcmp(ptr, "Model", 5))
+				return TOK_MODEL_DEC;
+			if (!memcmp(ptr, "Range", 5))
+				return TOK_RANGE_DEC;
+			if (!memcmp(ptr, "Level", 5))
+				return TOK_LEVEL_DEC;
+			if (!memcmp(ptr, "Float", 5))
+				return TOK_FLOAT_DEC;
+			break;
+		case 6:
+			if (!memcmp(ptr, "Shader", 6))
+				return TOK_SHADER_DEC;
+			if (!memcmp(ptr, "String", 6))
+				return TOK_STRING_DEC;
+			break;
+		case 7:
+			if (!memcmp(ptr, "Texture", 7))
+				return TOK_TEXTURE_DEC;
+			if (!memcmp(ptr, "Program", 7))
+				return TOK_PROGRAM_DEC;
+			break;
+		case 8:
+			if (!memcmp(ptr, "Instance", 8))
+				return TOK_INSTANCE_DEC;
+			break;
+		case 12:
+			if (!memcmp(ptr, "LazyInstance", 12))
+				return TOK_LAZY_INSTANCE_DEC;
+			break;
+	}
+	return TOK_NONE;
+}
+
+void toklist_free(toklist_s *list) {
+	if (list->src && list->src_size)
+		munmap((void *)list->src, list->src_size);
+	free(list->head);
+	free(list->lexemes);
+	list->head = NULL;
+	list->lexemes = NULL;
+	list->src = NULL;
+	list->size = 0;
+	list->cap = 0;
 }
 
 void toklist_print(toklist_s *list) {
-	tok_s *t = list->head;
+	size_t i;
 
-	while (t) {
+	for (i = 0; i < list->size; i++) {
+		tok_s *t = &list->head[i];
 		printf("token: %s at line %u of type %d\n", t->lexeme, t->lineno, t->type);
-		t = t->next;
 	}
 }
 
 void report_lexical_error(const char *message, char c, unsigned lineno) {
 	fprintf(stderr, "Lexical Error at line %u, character '%c': %s\n", lineno, c, message);
 }
-
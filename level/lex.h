@@ -42,19 +42,32 @@ typedef enum {
 	TOK_EOF
 } toktype_e;
 
+/*
+ * Tokens are stored contiguously in their toklist_s, so the token after
+ * t is t + 1 and the last token is always TOK_EOF. offset and length 
+ * locate the token in the source; lexeme is a NUL terminated copy that
+ * lives in the list's lexeme arena.
+ */
 struct tok_s {
 	toktype_e type;
 	unsigned lineno;
-	tok_s *next;
-	char lexeme[];
+	size_t offset;
+	size_t length;
+	char *lexeme;
 };
 
 struct toklist_s {
 	tok_s *head;
-	tok_s *tail;
+	size_t size;
+	size_t cap;
+	char *lexemes;
+	size_t lexemes_used;
+	const char *src;
+	size_t src_size;
 };
 
 extern toklist_s lex(const char *file_name);
+extern void toklist_free(toklist_s *list);
 
 extern void toklist_print(toklist_s *list);
 
@@ -1,25 +1,57 @@
 #include "lex.h"
 #include "parse.h"
+#include "dbgen.h"
+#include "threadpool.h"
+#include <stdlib.h>
+#include <string.h>
 //#include "tree.h"
 
 int main(int argc, char *argv[]) {
 	int i;	
+	unsigned nthreads = tpool_default_threads();
+	size_t bakelimit = P_DEFAULT_BAKE_LIMIT;
+	const char *dbpath = NULL;
 	p_context_s context;
+	tpool_s *pool;
+	dbgen_s *gen = NULL;
 
+	while (argc > 2 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-j"))
+			nthreads = atoi(argv[2]);
+		else if (!strcmp(argv[1], "-d"))
+			dbpath = argv[2];
+		else if (!strcmp(argv[1], "-t"))
+			bakelimit = strtoul(argv[2], NULL, 10);
+		else
+			break;
+		argv += 2;
+		argc -= 2;
+	}
 	if (argc < 2) {
-		fprintf(stderr, "Usage: level <path-to-source-file> [,...]\n");
+		fprintf(stderr, "Usage: level [-j threads] [-d level-database] [-t bake-limit] <path-to-source-file> [,...]\n");
+		return 1;
+	}
+	if (dbpath) {
+		gen = dbgen_open(dbpath);
+		if (!gen)
+			return 1;
 	}
-	else {
-		for (i = 1; i < argc; i++) {
-			toklist_s tokens = lex(argv[i]);
-			if (tokens.head) {
-				context = parse(&tokens);
-        gen_code(&context, stdout);
-				//tree_walk(&context);
-			}
+	pool = nthreads > 1 ? tpool_new(nthreads) : NULL;
+	for (i = 1; i < argc; i++) {
+		toklist_s tokens = lex(argv[i]);
+		if (tokens.head) {
+			context = parse(&tokens, pool, gen ? &gen->cache : NULL, bakelimit);
+			if (gen)
+				dbgen_write(gen, &context);
+			else
+				gen_code(&context, stdout);
+			emit_free(&context);
+			//tree_walk(&context);
 		}
+		toklist_free(&tokens);
 	}
+	tpool_free(pool);
+	dbgen_close(gen);
 	
 	return 0;
 }
-
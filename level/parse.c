@@ -1,13 +1,42 @@
 #include "parse.h"
+#include "glsl.h"
 #include "../common/constants.h"
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 #define M_KEY(k) ("\""k"\"")
 #define OBJ_ID_KEY "__name__"
 #define OBJ_ISGEN_KEY "__isgen__"
 
+typedef struct mesh_data_s mesh_data_s;
+typedef struct cell_entry_s cell_entry_s;
+
+/* 
+ * Vertices of a mesh handed to the thread pool, owned by the job. When 
+ * compiling straight into a database the job fills in the data, indices 
+ * and vertexCount values of row instead of writing SQL text.
+ */
+struct mesh_data_s {
+  double *data;
+  size_t nvertices;
+  bool indexed;
+  p_row_s *row;
+};
+
+/*
+ * An instance of a level sorted by the cell containing it, so instances 
+ * of the same cell end up next to each other.
+ */
+struct cell_entry_s {
+  int key[3];
+  size_t index;
+  double margin;
+};
+
 /*
    typedef enum p_type_e p_type_e;
 
@@ -75,6 +104,7 @@ static tnode_list_s parse_expression_list(p_context_s *context);
 static void parse_expression_list_(p_context_s *context, tnode_list_s *list);
 static tnode_s *parse_object(p_context_s *context);
 static tnode_s *parse_array(p_context_s *context);
+static tnode_s *parse_packed_array(p_context_s *context, tok_s *array);
 static void parse_next_tok(p_context_s *context);
 static bool typecheck_assignment(p_context_s *context, tnode_s *typenode, tnode_s *expression);
 static bool typecheck_basic_assignment(p_context_s *context, p_nodetype_e declared, p_nodetype_e expression);
@@ -105,21 +135,47 @@ static tnode_s *tnode_create_copy(tnode_s *tnode);
 static char *make_label(p_context_s *context, char *prefix);
 static void tnode_list_init(tnode_list_s *list);
 static int tnode_list_add(tnode_list_s *list, tnode_s *node);
+static tnode_list_s *tnode_array_list(tnode_s *arr);
 static void emit_code(const char *code, CharBuf *segment);
+static bool emit_deferred(p_context_s *context, CharBuf *section, tpool_fn fn, void *data);
+static void emit_mesh_data(void *arg);
+static p_row_s *emit_row(p_context_s *context, p_rowtype_e type, const char *name);
+static p_value_s *row_value(p_row_s *row, p_valtype_e type, const char *text);
+static void row_null(p_row_s *row);
+static void row_literal(p_row_s *row, const char *literal);
+static void row_text(p_row_s *row, const char *text);
+static void row_blob(p_row_s *row, const void *data, size_t size);
+static bool row_ref(p_context_s *context, p_row_s *row, const char *name);
+static void row_hash(p_row_s *row, const void *data, size_t size);
+static void emit_shader_src(void *arg);
+static size_t section_len(CharBuf *section);
+static void write_section(p_context_s *context, CharBuf *section, FILE *dest);
 static bool emit_level(p_context_s *context, tnode_s *level);
 static bool emit_instance_data(p_context_s *context, tnode_s *level, char *levelid);
 static bool emit_instances(p_context_s *context, char *levelid, tnode_s *instances);
 static void emit_instance_batch(p_context_s *context, char *levelid, tnode_list_s instances);
-static bool emit_instance(p_context_s *context, char *levelid, tnode_s *instance);
+static bool emit_cells(p_context_s *context, char *levelid, tnode_list_s instances, char **cellof, 
+    PointerVector *names);
+static bool instance_cell_entry(p_context_s *context, tnode_s *instance, cell_entry_s *entry);
+static int cell_entry_cmp(const void *a, const void *b);
+static void emit_cell(p_context_s *context, char *levelid, const char *name, cell_entry_s *first, size_t count);
+static bool tnode_number(tnode_s *node, double *val);
+static bool emit_instance(p_context_s *context, char *levelid, tnode_s *instance, const char *cellid);
 static bool emit_range_data(p_context_s *context, tnode_s *level, char *levelid);
 static bool emit_ranges(p_context_s *context, char *levelid, tnode_s *ranges);
 static void emit_range_batch(p_context_s *context, char *levelid, tnode_list_s ranges);
-static char *emit_range(p_context_s *context, char *levelid, tnode_s *range_node);
-static bool emit_lazy_instances(p_context_s *context, char *rangeid, tnode_s *lazy_instances);
-static void emit_lazy_instance_batch(p_context_s *context, char *rangeid, tnode_list_s lazy_instances);
-static bool emit_lazy_instance(p_context_s *context, char *rangeid, tnode_s *node);
+static char *emit_range(p_context_s *context, char *levelid, tnode_s *range_node, lazy_scope_s *parent);
+static void report_range_bake(p_context_s *context, const char *rangeid, lazy_scope_s *scope, size_t count);
+static bool emit_lazy_instances(p_context_s *context, char *rangeid, tnode_s *lazy_instances, lazy_scope_s *scope);
+static void emit_lazy_instance_batch(p_context_s *context, char *rangeid, tnode_list_s lazy_instances, lazy_scope_s *scope);
+static bool emit_lazy_instance(p_context_s *context, char *rangeid, tnode_s *node, lazy_scope_s *scope);
+static bool bake_lazy_instance(lazy_scope_s *scope, CharBuf *fields[], FloatBuf *baked);
+static void emit_blob(CharBuf *code, const void *data, size_t size);
 static bool emit_model(tnode_s *model, p_context_s *context);
 static bool emit_mesh(tnode_s *mesh, p_context_s *context);
+static int mesh_draw_type(tnode_s *mesh, p_context_s *context);
+static size_t *mesh_index_vertices(double *data, size_t *nvertices);
+static int level_integrator(tnode_s *level, p_context_s *context);
 static bool emit_program(tnode_s *program, p_context_s *context);
 static bool emit_shader(tnode_s *shader, bob_shader_e type, p_context_s *context);
 static bool emit_texture(tnode_s *texture, p_context_s *context);
@@ -136,7 +192,8 @@ static void tnode_print(tnode_s *tnode);
  * function:	parse	
  * -------------------------------------------------- 
  */
-p_context_s parse(toklist_s *list) {
+p_context_s parse(toklist_s *list, tpool_s *pool, compile_cache_s *cache, size_t bakelimit) {
+  int i;
   tnode_s *header = NULL,
           *body = NULL;
   p_context_s context;
@@ -144,6 +201,16 @@ p_context_s parse(toklist_s *list) {
   context.parse_errors = 0;
   context.root = NULL;
   context.labelcount = 0;
+  context.pool = pool;
+  pointer_vector_init(&context.deferred);
+  context.direct = cache != NULL;
+  context.cache = cache;
+  context.levelrow = NULL;
+  context.cellsize = 0;
+  context.bakelimit = bakelimit;
+  for (i = 0; i < P_ROW_COUNT; i++)
+    pointer_vector_init(&context.rows[i]);
+  bob_str_map_init(&context.rownames);
   char_buf_init(&context.meshcode);
   char_buf_init(&context.shadercode);
   char_buf_init(&context.programcode);
@@ -231,7 +298,7 @@ tnode_s *parse_body(p_context_s *context) {
   tnode_s *body = NULL;
   if(context->currtok->type == TOK_LBRACE) {
     tok_s *stmttok = context->currtok;
-    tnode_list_s stmtlist = {0, NULL};
+    tnode_list_s stmtlist = {0, 0, NULL};
     parse_next_tok(context);
     parse_statement_list(context, &stmtlist);	
     if(context->currtok->type != TOK_RBRACE) {
@@ -365,6 +432,7 @@ tnode_s *parse_type(p_context_s *context) {
   tnode_arraytype_val_s array;
 
   tnode_list_init(&array.arr);
+  array.packed = NULL;
   tnode_s *type = parse_basic_type(context);
   parse_opt_array(context, &array.arr);
   if (array.arr.size > 0) {
@@ -707,7 +775,7 @@ void parse_idsuffix(p_context_s *context, tnode_s **pfactor) {
  * -------------------------------------------------- 
  */
 tnode_list_s parse_expression_list(p_context_s *context) {
-  tnode_list_s list = {0, NULL};
+  tnode_list_s list = {0, 0, NULL};
   tnode_s *expression;
   switch(context->currtok->type) {
     case TOK_ADDOP:
@@ -739,12 +807,11 @@ tnode_list_s parse_expression_list(p_context_s *context) {
  * -------------------------------------------------- 
  */
 void parse_expression_list_(p_context_s *context, tnode_list_s *list) {
-  if(context->currtok->type == TOK_COMMA) {
+  while(context->currtok->type == TOK_COMMA) {
     tnode_s *expression;
     parse_next_tok(context);
     expression = parse_expression(context);
     tnode_list_add(list, expression);
-    parse_expression_list_(context, list);
   }
 }
 
@@ -786,6 +853,9 @@ tnode_s *parse_array(p_context_s *context) {
   if(context->currtok->type == TOK_LBRACK) {
     tok_s *array = context->currtok;
     parse_next_tok(context);
+    result = parse_packed_array(context, array);
+    if (result)
+      return result;
     tnode_list_s list = parse_expression_list(context);
     p_nodetype_e type = resolve_array_type(list);
     result = tnode_create_array(array, list, type);
@@ -804,13 +874,76 @@ tnode_s *parse_array(p_context_s *context) {
   return result;
 }
 
+/* 
+ * function:	parse_packed_array
+ * -------------------------------------------------- 
+ * Fast path for arrays of signed numeric literals such as mesh vertices,
+ * which are stored as one block of doubles instead of a node per element.
+ * Anything else rewinds to the first element and returns NULL so the 
+ * array is parsed as a general expression list.
+ */
+tnode_s *parse_packed_array(p_context_s *context, tok_s *array) {
+  tok_s *start = context->currtok;
+  size_t size = 0, cap = INIT_VECTOR_BUF_SIZE;
+  bool isfloat = false;
+  double *packed, sign;
+
+  if (start->type != TOK_INTEGER && start->type != TOK_FLOAT && start->type != TOK_ADDOP)
+    return NULL;
+  packed = malloc(cap * sizeof *packed);
+  if (!packed) {
+    perror("Memory allocation error in parse_packed_array()");
+    return NULL;
+  }
+  while (true) {
+    sign = 1.0;
+    if (context->currtok->type == TOK_ADDOP) {
+      if (*context->currtok->lexeme == '-')
+        sign = -1.0;
+      parse_next_tok(context);
+    }
+    if (context->currtok->type == TOK_FLOAT)
+      isfloat = true;
+    else if (context->currtok->type != TOK_INTEGER)
+      break;
+    if (size == cap) {
+      double *npacked;
+      cap *= 2;
+      npacked = realloc(packed, cap * sizeof *packed);
+      if (!npacked) {
+        perror("Memory allocation error in parse_packed_array()");
+        break;
+      }
+      packed = npacked;
+    }
+    if (context->currtok->type == TOK_FLOAT)
+      packed[size++] = sign * atof(context->currtok->lexeme);
+    else
+      packed[size++] = sign * atoi(context->currtok->lexeme);
+    parse_next_tok(context);
+    if (context->currtok->type == TOK_RBRACK) {
+      tnode_list_s list = {size, 0, NULL};
+      tnode_s *result = tnode_create_array(array, list, isfloat ? PTYPE_FLOAT : PTYPE_INT);
+      result->val.atval.packed = packed;
+      parse_next_tok(context);
+      return result;
+    }
+    if (context->currtok->type != TOK_COMMA)
+      break;
+    parse_next_tok(context);
+  }
+  free(packed);
+  context->currtok = start;
+  return NULL;
+}
+
 /* 
  * function: parse_next_tok
  * -------------------------------------------------- 
  */
 void parse_next_tok(p_context_s *context) {
   if(context->currtok->type != TOK_EOF)
-    context->currtok = context->currtok->next;
+    context->currtok++;
 }
 
 /* 
@@ -1216,7 +1349,7 @@ tnode_s *exec_access_arr(tnode_s *arr, tnode_s *index) {
         perror("error attempt to access array with non-integer valued index");
         return NULL;
       }
-      return arr->val.atval.arr.list[index->val.i];
+      return tnode_array_list(arr)->list[index->val.i];
     case PTYPE_SHADER:
     case PTYPE_TEXTURE:
     case PTYPE_PROGRAM:
@@ -1459,6 +1592,7 @@ tnode_s *tnode_create_array(tok_s *tok, tnode_list_s list, p_nodetype_e type) {
   t->tok = tok;
   t->val.atval.type = type;
   t->val.atval.arr = list;
+  t->val.atval.packed = NULL;
   return t;
 }
 
@@ -1527,6 +1661,7 @@ char *make_label(p_context_s *context, char *prefix) {
  */
 void tnode_list_init(tnode_list_s *list) {
   list->size = 0;
+  list->cap = 0;
   list->list = NULL;
 }
 
@@ -1535,20 +1670,179 @@ void tnode_list_init(tnode_list_s *list) {
  * -------------------------------------------------- 
  */
 int tnode_list_add(tnode_list_s *list, tnode_s *node) {
-  list->size++;
-  list->list = realloc(list->list, sizeof(*list->list) * list->size);
-  if (!list->list) {
-    perror("Memory allocation error with realloc().");
-    return -1;
+  if (list->size == list->cap) {
+    int cap = list->cap ? 2 * list->cap : INIT_VECTOR_BUF_SIZE;
+    tnode_s **nlist = realloc(list->list, sizeof(*list->list) * cap);
+    if (!nlist) {
+      perror("Memory allocation error with realloc().");
+      return -1;
+    }
+    list->list = nlist;
+    list->cap = cap;
   }
-  list->list[list->size - 1] = node;
+  list->list[list->size++] = node;
   return 0;
 }
 
+/* 
+ * function:	tnode_array_list
+ * -------------------------------------------------- 
+ * Returns the element nodes of an array, creating them first if the 
+ * array was parsed in packed form.
+ */
+tnode_list_s *tnode_array_list(tnode_s *arr) {
+  tnode_arraytype_val_s *atval = &arr->val.atval;
+  int i, size;
+
+  if (!atval->packed || atval->arr.list)
+    return &atval->arr;
+  size = atval->arr.size;
+  tnode_list_init(&atval->arr);
+  for (i = 0; i < size; i++) {
+    if (atval->type == PTYPE_INT)
+      tnode_list_add(&atval->arr, tnode_create_int(arr->tok, atval->packed[i]));
+    else
+      tnode_list_add(&atval->arr, tnode_create_float(arr->tok, atval->packed[i]));
+  }
+  return &atval->arr;
+}
+
 void emit_code(const char *code, CharBuf *segment) {
   char_add_s(segment, code);
 }
 
+/* function: emit_deferred -----------------------------------------------------
+ * Reserves the current end of section for code that fn formats on the thread 
+ * pool. fn is passed the p_deferred_s and takes ownership of data.
+ */
+bool emit_deferred(p_context_s *context, CharBuf *section, tpool_fn fn, void *data) {
+  p_deferred_s *job = malloc(sizeof *job);
+  if (!job) {
+    perror("Memory allocation error in emit_deferred()");
+    return false;
+  }
+  job->section = (char *)section - (char *)context;
+  job->offset = section_len(section);
+  job->data = data;
+  char_buf_init(&job->out);
+  if (pointer_vector_add(&context->deferred, job)) {
+    perror("Memory allocation error in emit_deferred()");
+    char_buf_free(&job->out);
+    free(job);
+    return false;
+  }
+  tpool_submit(context->pool, fn, job);
+  return true;
+}
+
+/* function: emit_row ----------------------------------------------------------
+ * Records a row for the direct database backend and registers it under name 
+ * so later rows can reference its id. Returns NULL when compiling to SQL 
+ * text, the row_* functions do nothing for a NULL row.
+ */
+p_row_s *emit_row(p_context_s *context, p_rowtype_e type, const char *name) {
+  p_row_s *row;
+
+  if (!context->direct)
+    return NULL;
+  row = calloc(1, sizeof *row);
+  if (!row) {
+    perror("Memory allocation error in emit_row()");
+    return NULL;
+  }
+  row->type = type;
+  row->hash = compile_hash(COMPILE_HASH_INIT, &type, sizeof type);
+  if (type == P_ROW_CELL || type == P_ROW_INSTANCE || type == P_ROW_RANGE || type == P_ROW_LAZY_INSTANCE)
+    row->owner = context->levelrow;
+  if (pointer_vector_add(&context->rows[type], row)) {
+    perror("Memory allocation error in emit_row()");
+    free(row);
+    return NULL;
+  }
+  if (name)
+    bob_str_map_insert(&context->rownames, bob_dup_str(name), row);
+  return row;
+}
+
+/* function: row_hash ----------------------------------------------------------
+ * Folds data into the hash of a row and, if it has one, of its owner.
+ */
+void row_hash(p_row_s *row, const void *data, size_t size) {
+  row->hash = compile_hash(row->hash, data, size);
+  if (row->owner)
+    row->owner->hash = compile_hash(row->owner->hash, data, size);
+}
+
+p_value_s *row_value(p_row_s *row, p_valtype_e type, const char *text) {
+  p_value_s *value = &row->values[row->nvalues++];
+  size_t len;
+
+  assert(row->nvalues <= P_ROW_MAX_VALUES);
+  row_hash(row, &type, sizeof type);
+  value->type = type;
+  value->ref = NULL;
+  value->text.size = value->text.buf_size = 0;
+  value->text.buffer = NULL;
+  if (text) {
+    len = strlen(text) + 1;
+    value->text.buffer = malloc(len);
+    if (!value->text.buffer) {
+      perror("Memory allocation error in row_value()");
+      value->type = P_VAL_NULL;
+      return value;
+    }
+    memcpy(value->text.buffer, text, len);
+    value->text.size = value->text.buf_size = len;
+    row_hash(row, text, len);
+  }
+  return value;
+}
+
+void row_null(p_row_s *row) {
+  if (row)
+    row_value(row, P_VAL_NULL, NULL);
+}
+
+void row_literal(p_row_s *row, const char *literal) {
+  if (row)
+    row_value(row, P_VAL_LITERAL, literal);
+}
+
+void row_text(p_row_s *row, const char *text) {
+  if (row)
+    row_value(row, P_VAL_TEXT, text);
+}
+
+void row_blob(p_row_s *row, const void *data, size_t size) {
+  p_value_s *value;
+
+  if (!row)
+    return;
+  value = row_value(row, P_VAL_BLOB, NULL);
+  value->text.buffer = malloc(size);
+  if (!value->text.buffer) {
+    perror("Memory allocation error in row_blob()");
+    value->type = P_VAL_NULL;
+    return;
+  }
+  memcpy(value->text.buffer, data, size);
+  value->text.size = value->text.buf_size = size;
+  row_hash(row, data, size);
+}
+
+bool row_ref(p_context_s *context, p_row_s *row, const char *name) {
+  if (!row)
+    return true;
+  p_value_s *value = row_value(row, P_VAL_REF, NULL);
+  value->ref = bob_str_map_get(&context->rownames, name);
+  if (!value->ref) {
+    report_semantics_error("Internal compiler error, no row recorded for referenced object", context);
+    return false;
+  }
+  row_hash(row, &value->ref->hash, sizeof value->ref->hash);
+  return true;
+}
+
 bool emit_level(p_context_s *context, tnode_s *level) {
   bool result;
   tnode_s *name_node = bob_str_map_get(level->val.obj, M_KEY("name"));
@@ -1563,7 +1857,7 @@ bool emit_level(p_context_s *context, tnode_s *level) {
   tnode_s *ambient_gravity_node = bob_str_map_get(level->val.obj, M_KEY("ambientGravity"));
   if (ambient_gravity_node) {
     if (ambient_gravity_node->type == PTYPE_ARRAY) {
-      tnode_list_s ambient_gravity_array = ambient_gravity_node->val.atval.arr;
+      tnode_list_s ambient_gravity_array = *tnode_array_list(ambient_gravity_node);
       if (ambient_gravity_array.size == 3) {
         tnode_s **glist = ambient_gravity_array.list;
         n_agx = glist[0];
@@ -1597,17 +1891,55 @@ bool emit_level(p_context_s *context, tnode_s *level) {
     n_agz = NULL;
   }
 
+  int integrator = level_integrator(level, context);
+  if (integrator < 0)
+    return false;
+  CharBuf integratorstr;
+  char_buf_init(&integratorstr);
+  char_add_i(&integratorstr, integrator);
+
+  tnode_s *timestep_node = bob_str_map_get(level->val.obj, M_KEY("timestep"));
+  if (timestep_node) {
+    if (timestep_node->type != PTYPE_INT && timestep_node->type != PTYPE_FLOAT) {
+      report_semantics_error("timestep must be a numeric type", context);
+      char_buf_free(&integratorstr);
+      return false;
+    }
+    if ((timestep_node->type == PTYPE_INT ? timestep_node->val.i : timestep_node->val.f) < 0) {
+      report_semantics_error("timestep must not be negative", context);
+      char_buf_free(&integratorstr);
+      return false;
+    }
+  }
+
+  /* levels with a cell size stream their static instances in by cell */
+  double cellsize = 0;
+  tnode_s *cellsize_node = bob_str_map_get(level->val.obj, M_KEY("cellSize"));
+  if (cellsize_node && (!tnode_number(cellsize_node, &cellsize) || cellsize < 0)) {
+    report_semantics_error("cellSize must be a non-negative number", context);
+    char_buf_free(&integratorstr);
+    return false;
+  }
+  CharBuf cellsizestr;
+  char_buf_init(&cellsizestr);
+  char_add_g(&cellsizestr, cellsize);
 
   emit_code("--------------------------------------------------------------------------------\n", &context->levelcode);
   emit_code("-- GENERATING LEVEL: ", &context->levelcode);
   emit_code(raw_name, &context->levelcode);
   emit_code("\n", &context->levelcode);
   emit_code("--------------------------------------------------------------------------------\n", &context->levelcode);
-  emit_code(" INSERT INTO level(name,ambientGravityX,ambientGravityY,ambientGravityZ) VALUES(", &context->levelcode);
+  p_row_s *row = emit_row(context, P_ROW_LEVEL, table_name);
+  context->levelrow = row;
+  row_literal(row, raw_name);
+  emit_code(" INSERT INTO level(name,ambientGravityX,ambientGravityY,ambientGravityZ,integrator,timestep,cellSize) VALUES(", &context->levelcode);
   emit_code(raw_name, &context->levelcode);
   emit_code(",", &context->levelcode);
   if (n_agx == NULL) {
     emit_code("0,0,0", &context->levelcode);
+    row_literal(row, "0");
+    row_literal(row, "0");
+    row_literal(row, "0");
   }
   else {
     CharBuf agx = val_to_str(n_agx);
@@ -1618,10 +1950,32 @@ bool emit_level(p_context_s *context, tnode_s *level) {
     emit_code(agy.buffer, &context->levelcode);
     emit_code(",", &context->levelcode);
     emit_code(agz.buffer, &context->levelcode);
+    row_literal(row, agx.buffer);
+    row_literal(row, agy.buffer);
+    row_literal(row, agz.buffer);
     char_buf_free(&agx);
     char_buf_free(&agy);
     char_buf_free(&agz);
   }
+  emit_code(",", &context->levelcode);
+  emit_code(integratorstr.buffer, &context->levelcode);
+  emit_code(",", &context->levelcode);
+  row_literal(row, integratorstr.buffer);
+  if (timestep_node) {
+    CharBuf timestep = val_to_str(timestep_node);
+    emit_code(timestep.buffer, &context->levelcode);
+    row_literal(row, timestep.buffer);
+    char_buf_free(&timestep);
+  }
+  else {
+    emit_code("0", &context->levelcode);
+    row_literal(row, "0");
+  }
+  emit_code(",", &context->levelcode);
+  emit_code(cellsizestr.buffer, &context->levelcode);
+  row_literal(row, cellsizestr.buffer);
+  char_buf_free(&integratorstr);
+  char_buf_free(&cellsizestr);
   emit_code(");\n", &context->levelcode);
   emit_code(" CREATE TEMP TABLE ", &context->levelcode);
   emit_code(table_name, &context->levelcode);
@@ -1630,8 +1984,11 @@ bool emit_level(p_context_s *context, tnode_s *level) {
   emit_code(table_name, &context->levelcode);
   emit_code("(id) VALUES (last_insert_rowid());\n", &context->levelcode);
   emit_code("----------------------------------------------------------------------------------\n", &context->levelcode); 
+  context->cellsize = cellsize;
   result = emit_instance_data(context, level, table_name);
 	result = emit_range_data(context, level, table_name);
+  context->levelrow = NULL;
+  context->cellsize = 0;
   free(table_name);
   return result;
 }
@@ -1704,12 +2061,31 @@ bool emit_model(tnode_s *model, p_context_s *context) {
   char_buf_init(&hasUVStr);
   char_add_i(&hasUVStr, hasUV);
 
+  /* models are opaque unless they say otherwise, transparent ones are blended and drawn last */
+  double transparent = 0;
+  tnode_s *transparentNode = bob_str_map_get(model->val.obj, M_KEY("transparent"));
+  if (transparentNode && !tnode_number(transparentNode, &transparent)) {
+    report_semantics_error("Expected number type for model transparent property", context);
+    char_buf_free(&hasUVStr);
+    return false;
+  }
+  const char *transparentStr = transparent ? "1" : "0";
+
+  p_row_s *row = emit_row(context, P_ROW_MODEL, name);
+  if (!row_ref(context, row, mesh_name) || !row_ref(context, row, program_name) 
+      || !row_ref(context, row, texture_name)) {
+    char_buf_free(&hasUVStr);
+    return false;
+  }
+  row_literal(row, hasUVStr.buffer);
+  row_literal(row, transparentStr);
+
   emit_code("--------------------------------------------------------------------------------\n", &context->modelcode);
   emit_code("-- GENERATING MODEL: ", &context->modelcode);
   emit_code(name, &context->modelcode);
   emit_code("\n", &context->modelcode);
   emit_code("--------------------------------------------------------------------------------\n", &context->modelcode);
-  emit_code(" INSERT INTO model(meshID,programID,textureID,hasUV) VALUES(\n", &context->modelcode);
+  emit_code(" INSERT INTO model(meshID,programID,textureID,hasUV,transparent) VALUES(\n", &context->modelcode);
   emit_code(" \t(SELECT id FROM ", &context->modelcode);
   emit_code(mesh_name, &context->modelcode);
   emit_code("),\n", &context->modelcode); 
@@ -1721,6 +2097,8 @@ bool emit_model(tnode_s *model, p_context_s *context) {
   emit_code("),\n", &context->modelcode); 
   emit_code(" \t", &context->modelcode); 
   emit_code(hasUVStr.buffer, &context->modelcode);
+  emit_code(",\n \t", &context->modelcode);
+  emit_code(transparentStr, &context->modelcode);
   emit_code(");\n", &context->modelcode);
   emit_code(" CREATE TEMP TABLE ", &context->modelcode);
   emit_code(name, &context->modelcode);
@@ -1735,8 +2113,9 @@ bool emit_model(tnode_s *model, p_context_s *context) {
 }
 
 bool emit_mesh(tnode_s *mesh, p_context_s *context) {
-  int i;
-  const bool *isgen;
+  int i, draw_type;
+  size_t nvertices;
+  bool indexed;
   char *name = bob_str_map_get(mesh->val.obj, OBJ_ID_KEY);
   if (!name) {
     report_semantics_error("Internal compiler error, autogenerated name not found in object", context); 
@@ -1764,57 +2143,96 @@ bool emit_mesh(tnode_s *mesh, p_context_s *context) {
     return false;
   }
   tnode_list_s vertex_array = vertices->val.atval.arr;
+  if (!vertex_array.size || vertex_array.size % BOB_VERTEX_STRIDE) {
+    report_semantics_error("Expected 5 numbers (x, y, z, u, v) per vertex in mesh", context);
+    return false;
+  }
+  nvertices = vertex_array.size / BOB_VERTEX_STRIDE;
+
+  draw_type = mesh_draw_type(mesh, context);
+  if (draw_type < 0)
+    return false;
 
-  tnode_s *tnode;
-  CharBuf vertexstr;
-  CharBuf numbuf;
-  char_buf_init(&vertexstr);
-
-  for (i = 0; i < vertex_array.size - 1; i++) {
-    tnode = vertex_array.list[i];
-    if (tnode->type == PTYPE_INT) {
-      char_buf_init(&numbuf);
-      char_add_i(&numbuf, tnode->val.i);
-      char_add_s(&vertexstr, numbuf.buffer);
-      char_buf_free(&numbuf);
-    }
-    else if (tnode->type == PTYPE_FLOAT) {
-      char_buf_init(&numbuf);
-      char_add_d(&numbuf, tnode->val.f);
-      char_add_s(&vertexstr, numbuf.buffer);
-      char_buf_free(&numbuf);
+  tnode_s *indexed_node = bob_str_map_get(mesh->val.obj, M_KEY("indexed"));
+  indexed = indexed_node && indexed_node->type == PTYPE_INT && indexed_node->val.i;
+
+  double *data = malloc(vertex_array.size * sizeof *data);
+  if (!data) {
+    perror("Memory allocation error in emit_mesh()");
+    return false;
+  }
+  if (vertices->val.atval.packed) {
+    memcpy(data, vertices->val.atval.packed, vertex_array.size * sizeof *data);
+  }
+  else {
+    for (i = 0; i < vertex_array.size; i++) {
+      tnode_s *tnode = vertex_array.list[i];
+      if (tnode->type == PTYPE_INT)
+        data[i] = tnode->val.i;
+      else if (tnode->type == PTYPE_FLOAT)
+        data[i] = tnode->val.f;
+      else {
+        fprintf(stderr, "Unknown type %d for mesh array.\n", tnode->type);
+        data[i] = 0;
+      }
     }
-    else
-      fprintf(stderr, "Unknown type %d for mesh array.\n", tnode->type);
-    char_add_s(&vertexstr, ",");
-  }
-  tnode = vertex_array.list[i];
-  if (tnode->type == PTYPE_INT) {
-    char_buf_init(&numbuf);
-    char_add_i(&numbuf, tnode->val.i);
-    char_add_s(&vertexstr, numbuf.buffer);
-    char_buf_free(&numbuf);
-  }
-  else if (tnode->type == PTYPE_FLOAT) {
-    char_buf_init(&numbuf);
-    char_add_d(&numbuf, tnode->val.f);
-    char_add_s(&vertexstr, numbuf.buffer);
-    char_buf_free(&numbuf);
   }
-  else
-    fprintf(stderr, "Unknown type %d for mesh array.\n", tnode->type);
+
+  mesh_data_s *mesh_data = malloc(sizeof *mesh_data);
+  if (!mesh_data) {
+    perror("Memory allocation error in emit_mesh()");
+    free(data);
+    return false;
+  }
+  mesh_data->data = data;
+  mesh_data->nvertices = nvertices;
+  mesh_data->indexed = indexed;
+
+  CharBuf typebuf, namebuf;
+  char_buf_init(&typebuf);
+  char_add_i(&typebuf, draw_type);
+  char_buf_init(&namebuf);
+  char_add_s(&namebuf, "\"");
+  char_add_s(&namebuf, sname);
+  char_add_s(&namebuf, "\"");
+
+  /* data, indices and vertexCount are filled in by emit_mesh_data */
+  mesh_data->row = emit_row(context, P_ROW_MESH, name);
+  row_literal(mesh_data->row, namebuf.buffer);
+  row_text(mesh_data->row, "");
+  row_null(mesh_data->row);
+  row_literal(mesh_data->row, "");
+  row_literal(mesh_data->row, typebuf.buffer);
+  char_buf_free(&namebuf);
+  /* meshes are looked up while parsing so unchanged ones are never formatted */
+  if (mesh_data->row) {
+    row_hash(mesh_data->row, &indexed, sizeof indexed);
+    row_hash(mesh_data->row, data, vertex_array.size * sizeof *data);
+    mesh_data->row->cached = compile_cache_get(context->cache, mesh_data->row->hash, &mesh_data->row->id);
+  }
 
   emit_code("--------------------------------------------------------------------------------\n", &context->meshcode);
   emit_code("-- GENERATING MESH: ", &context->meshcode);
   emit_code(name, &context->meshcode);
   emit_code("\n", &context->meshcode);
   emit_code("--------------------------------------------------------------------------------\n", &context->meshcode);
-  emit_code(" INSERT INTO mesh(name,data) VALUES(", &context->meshcode);
+  emit_code(" INSERT INTO mesh(name,data,indices,vertexCount,drawType) VALUES(", &context->meshcode);
   emit_code("\"", &context->meshcode);
   emit_code(sname, &context->meshcode);
-  emit_code("\",\"", &context->meshcode);
-  emit_code(vertexstr.buffer, &context->meshcode);
-  emit_code("\");\n", &context->meshcode);
+  emit_code("\",", &context->meshcode);
+  if (mesh_data->row && mesh_data->row->cached) {
+    free(mesh_data);
+    free(data);
+  }
+  else if (!emit_deferred(context, &context->meshcode, emit_mesh_data, mesh_data)) {
+    free(mesh_data);
+    free(data);
+    char_buf_free(&typebuf);
+    return false;
+  }
+  emit_code(",", &context->meshcode);
+  emit_code(typebuf.buffer, &context->meshcode);
+  emit_code(");\n", &context->meshcode);
   emit_code(" CREATE TEMP TABLE ", &context->meshcode);
   emit_code(name, &context->meshcode);
   emit_code("(id INTEGER PRIMARY KEY);\n", &context->meshcode);
@@ -1822,11 +2240,175 @@ bool emit_mesh(tnode_s *mesh, p_context_s *context) {
   emit_code(name, &context->meshcode);
   emit_code("(id) VALUES (last_insert_rowid());\n", &context->meshcode);
 
-  char_buf_free(&vertexstr);
+  char_buf_free(&typebuf);
   bob_str_map_update(mesh->val.obj, OBJ_ISGEN_KEY, (void *)&isgen_true);
   return true;
 }
 
+/* function: emit_mesh_data ----------------------------------------------------
+ * Thread pool job formatting the data, indices and vertexCount values of a 
+ * mesh insert, either as SQL text or into the mesh's row. Indexing is done 
+ * here as well since it's the other expensive part of emitting a mesh. If 
+ * indexing runs out of memory the mesh is emitted unindexed.
+ */
+void emit_mesh_data(void *arg) {
+  size_t i, nindices = 0;
+  p_deferred_s *job = arg;
+  mesh_data_s *mesh = job->data;
+  p_row_s *row = mesh->row;
+  size_t nvertices = mesh->nvertices;
+  size_t *indices = NULL;
+  CharBuf *vertexstr = row ? &row->values[1].text : &job->out;
+  CharBuf indexstr;
+
+  if (mesh->indexed) {
+    indices = mesh_index_vertices(mesh->data, &nvertices);
+    if (indices)
+      nindices = mesh->nvertices;
+  }
+
+  if (!row)
+    char_add_s(vertexstr, "\"");
+  for (i = 0; i < nvertices * BOB_VERTEX_STRIDE; i++) {
+    if (i)
+      char_add_s(vertexstr, ",");
+    char_add_g(vertexstr, mesh->data[i]);
+  }
+  if (indices) {
+    char_buf_init(&indexstr);
+    for (i = 0; i < nindices; i++) {
+      if (i)
+        char_add_s(&indexstr, ",");
+      char_add_g(&indexstr, indices[i]);
+    }
+  }
+
+  if (row) {
+    if (indices) {
+      row->values[2].type = P_VAL_TEXT;
+      row->values[2].text = indexstr;
+    }
+    char_add_g(&row->values[3].text, nvertices);
+  }
+  else {
+    char_add_s(&job->out, "\",");
+    if (indices) {
+      char_add_s(&job->out, "\"");
+      char_add_s(&job->out, indexstr.buffer);
+      char_add_s(&job->out, "\",");
+      char_buf_free(&indexstr);
+    }
+    else {
+      char_add_s(&job->out, "NULL,");
+    }
+    char_add_g(&job->out, nvertices);
+  }
+
+  free(indices);
+  free(mesh->data);
+  free(mesh);
+}
+
+/* function: level_integrator --------------------------------------------------
+ * Maps the optional "integrator" property of a level to a bob_integrator_e
+ * value, defaulting to semi-implicit Euler.
+ */
+int level_integrator(tnode_s *level, p_context_s *context) {
+  tnode_s *node = bob_str_map_get(level->val.obj, M_KEY("integrator"));
+  if (!node)
+    return BOB_INTEGRATOR_SEMI_IMPLICIT_EULER;
+  if (node->type != PTYPE_STRING) {
+    report_semantics_error("Expected string type for level integrator", context);
+    return -1;
+  }
+  if (!strcmp(node->val.s, M_KEY("semi_implicit_euler")))
+    return BOB_INTEGRATOR_SEMI_IMPLICIT_EULER;
+  if (!strcmp(node->val.s, M_KEY("velocity_verlet")))
+    return BOB_INTEGRATOR_VELOCITY_VERLET;
+  if (!strcmp(node->val.s, M_KEY("leapfrog")))
+    return BOB_INTEGRATOR_LEAPFROG;
+  report_semantics_error("Unknown level integrator, expected one of semi_implicit_euler, "
+      "velocity_verlet, leapfrog", context);
+  return -1;
+}
+
+/* function: mesh_draw_type ----------------------------------------------------
+ * Maps the optional "drawType" property of a mesh to a bob_draw_e value. 
+ * Meshes without the property are drawn as triangle strips.
+ */
+int mesh_draw_type(tnode_s *mesh, p_context_s *context) {
+  tnode_s *node = bob_str_map_get(mesh->val.obj, M_KEY("drawType"));
+  if (!node)
+    return BOB_DRAW_TRIANGLE_STRIP;
+  if (node->type != PTYPE_STRING) {
+    report_semantics_error("Expected string type for mesh drawType", context);
+    return -1;
+  }
+  if (!strcmp(node->val.s, M_KEY("triangle_strip")))
+    return BOB_DRAW_TRIANGLE_STRIP;
+  if (!strcmp(node->val.s, M_KEY("triangles")))
+    return BOB_DRAW_TRIANGLES;
+  if (!strcmp(node->val.s, M_KEY("triangle_fan")))
+    return BOB_DRAW_TRIANGLE_FAN;
+  if (!strcmp(node->val.s, M_KEY("lines")))
+    return BOB_DRAW_LINES;
+  if (!strcmp(node->val.s, M_KEY("line_strip")))
+    return BOB_DRAW_LINE_STRIP;
+  if (!strcmp(node->val.s, M_KEY("line_loop")))
+    return BOB_DRAW_LINE_LOOP;
+  if (!strcmp(node->val.s, M_KEY("points")))
+    return BOB_DRAW_POINTS;
+  report_semantics_error("Unknown mesh drawType, expected one of triangle_strip, "
+      "triangles, triangle_fan, lines, line_strip, line_loop, points", context);
+  return -1;
+}
+
+/* function: mesh_index_vertices -----------------------------------------------
+ * Removes duplicate vertices from data in place using an open addressing
+ * hash over the raw vertex bits. On entry *nvertices is the number of 
+ * vertices in data; on return it is the number of unique vertices. The 
+ * returned array holds one index per original vertex.
+ */
+size_t *mesh_index_vertices(double *data, size_t *nvertices) {
+  size_t i, j, h, nunique = 0, n = *nvertices, cap = 16;
+  size_t *indices, *table;
+
+  while (cap < n * 2)
+    cap *= 2;
+  indices = malloc(n * sizeof *indices);
+  table = malloc(cap * sizeof *table);
+  if (!indices || !table) {
+    perror("Memory allocation error in mesh_index_vertices()");
+    free(indices);
+    free(table);
+    return NULL;
+  }
+  for (i = 0; i < cap; i++)
+    table[i] = SIZE_MAX;
+
+  for (i = 0; i < n; i++) {
+    double *v = &data[i * BOB_VERTEX_STRIDE];
+    const unsigned char *bytes = (const unsigned char *)v;
+    uint64_t hash = 14695981039346656037ULL;
+    for (j = 0; j < BOB_VERTEX_STRIDE * sizeof *v; j++) {
+      hash ^= bytes[j];
+      hash *= 1099511628211ULL;
+    }
+    for (h = hash & (cap - 1); table[h] != SIZE_MAX; h = (h + 1) & (cap - 1)) {
+      if (!memcmp(&data[table[h] * BOB_VERTEX_STRIDE], v, BOB_VERTEX_STRIDE * sizeof *v))
+        break;
+    }
+    if (table[h] == SIZE_MAX) {
+      memmove(&data[nunique * BOB_VERTEX_STRIDE], v, BOB_VERTEX_STRIDE * sizeof *v);
+      table[h] = nunique++;
+    }
+    indices[i] = table[h];
+  }
+  free(table);
+  *nvertices = nunique;
+  return indices;
+}
+
 bool emit_program(tnode_s *program, p_context_s *context) {
   const bool *isgen;
 
@@ -1841,6 +2423,7 @@ bool emit_program(tnode_s *program, p_context_s *context) {
   emit_code("\n", &context->programcode);
   emit_code("--------------------------------------------------------------------------------\n", &context->programcode);
   emit_code(" INSERT INTO program DEFAULT VALUES;\n", &context->programcode);
+  emit_row(context, P_ROW_PROGRAM, name);
 
   emit_code(" CREATE TEMP TABLE ", &context->programcode);
   emit_code(name, &context->programcode);
@@ -1877,19 +2460,33 @@ bool emit_shader(tnode_s *shader, bob_shader_e type, p_context_s *context) {
   }
 
   char *src, *src_stripped;
+  const char *error;
   tnode_s *src_node = bob_str_map_get(shader->val.obj, M_KEY("src"));
   if (!src_node) {
     report_semantics_error("Shader missing required 'src' property", context); 
     return false;
   }
-  src = src_node->val.s;
-  src_stripped = strip_quotes(src);
+  src = strip_quotes(src_node->val.s);
+  src_stripped = glsl_frame_block(src, &error);
+  free(src);
+  if (!src_stripped) {
+    report_semantics_error(error, context);
+    return false;
+  }
 
-  CharBuf typebuf, srcbuf;
+  CharBuf typebuf, namebuf;
   char_buf_init(&typebuf);
   char_add_i(&typebuf, type);
-  
-  srcbuf = pad_quotes(src_stripped);
+  char_buf_init(&namebuf);
+  char_add_s(&namebuf, "\"");
+  char_add_s(&namebuf, sname);
+  char_add_s(&namebuf, "\"");
+
+  p_row_s *row = emit_row(context, P_ROW_SHADER, name);
+  row_literal(row, typebuf.buffer);
+  row_literal(row, namebuf.buffer);
+  row_text(row, src_stripped);
+  char_buf_free(&namebuf);
 
   emit_code("--------------------------------------------------------------------------------\n", &context->shadercode);
   emit_code("-- GENERATING SHADER: ", &context->shadercode);
@@ -1902,7 +2499,11 @@ bool emit_shader(tnode_s *shader, bob_shader_e type, p_context_s *context) {
   emit_code("\"", &context->shadercode);
   emit_code(sname, &context->shadercode);
   emit_code("\",\"", &context->shadercode);
-  emit_code(srcbuf.buffer, &context->shadercode);
+  if (!emit_deferred(context, &context->shadercode, emit_shader_src, src_stripped)) {
+    free(src_stripped);
+    char_buf_free(&typebuf);
+    return false;
+  }
   emit_code("\");\n", &context->shadercode);
   emit_code(" CREATE TEMP TABLE ", &context->shadercode);
   emit_code(name, &context->shadercode);
@@ -1912,10 +2513,20 @@ bool emit_shader(tnode_s *shader, bob_shader_e type, p_context_s *context) {
   emit_code("(id) VALUES (last_insert_rowid());\n", &context->shadercode);
   bob_str_map_update(shader->val.obj, OBJ_ISGEN_KEY, (void *)&isgen_true);
   char_buf_free(&typebuf);
-  char_buf_free(&srcbuf);
   return true;
 }
 
+/* function: emit_shader_src ---------------------------------------------------
+ * Thread pool job escaping the quotes in a shader's source.
+ */
+void emit_shader_src(void *arg) {
+  p_deferred_s *job = arg;
+
+  char_buf_free(&job->out);
+  job->out = pad_quotes(job->data);
+  free(job->data);
+}
+
 bool emit_texture(tnode_s *texture, p_context_s *context) {
   char *name = bob_str_map_get(texture->val.obj, OBJ_ID_KEY);
   if (!name) {
@@ -1935,6 +2546,9 @@ bool emit_texture(tnode_s *texture, p_context_s *context) {
   emit_code(name, &context->texturecode);
   emit_code("\n", &context->texturecode);
   emit_code("--------------------------------------------------------------------------------\n", &context->texturecode);
+  p_row_s *row = emit_row(context, P_ROW_TEXTURE, name);
+  row_literal(row, path);
+
   emit_code(" INSERT INTO texture(path) VALUES(", &context->texturecode);
   emit_code(path, &context->texturecode);
   emit_code(");\n", &context->texturecode);
@@ -1976,20 +2590,180 @@ bool emit_instances(p_context_s *context, char *levelid, tnode_s *instances) {
 
 void emit_instance_batch(p_context_s *context, char *levelid, tnode_list_s instances) {
   int i; 
-  const bool *isgen;
+  char **cellof = NULL;
+  PointerVector names;
+
+  pointer_vector_init(&names);
+  if (context->cellsize > 0) {
+    cellof = calloc(instances.size, sizeof *cellof);
+    if (!cellof)
+      perror("Memory allocation error in emit_instance_batch()");
+    else if (!emit_cells(context, levelid, instances, cellof, &names))
+      memset(cellof, 0, instances.size * sizeof *cellof);
+  }
 
-  emit_code(" INSERT INTO instance(modelID, levelID, vx, vy, vz, scalex, scaley, scalez, mass, isSubjectToGravity, isStatic) VALUES\n", &context->instancecode);
+  emit_code(" INSERT INTO instance(modelID, levelID, vx, vy, vz, scalex, scaley, scalez, mass, isSubjectToGravity, isStatic, rotx, roty, rotz, cellID) VALUES\n", &context->instancecode);
   for (i = 0; i < instances.size - 1; i++) {
     emit_code(" \t", &context->instancecode);
-    emit_instance(context, levelid, instances.list[i]);
+    emit_instance(context, levelid, instances.list[i], cellof ? cellof[i] : NULL);
     emit_code(",\n", &context->instancecode);
   }
   emit_code(" \t", &context->instancecode);
-  emit_instance(context, levelid, instances.list[i]);
+  emit_instance(context, levelid, instances.list[i], cellof ? cellof[i] : NULL);
   emit_code(";\n", &context->instancecode);
+
+  for (i = 0; i < names.size; i++)
+    free(names.buffer[i]);
+  pointer_vector_free(&names);
+  free(cellof);
+}
+
+/* function: emit_cells --------------------------------------------------------
+ * Partitions the static instances of a level into cubes of cellsize and 
+ * emits a cell for every cube holding any. The name of the cell of each 
+ * instance is stored in cellof, instances that can move or whose position 
+ * isn't a constant are left NULL and are always loaded. Names are owned by 
+ * names.
+ */
+bool emit_cells(p_context_s *context, char *levelid, tnode_list_s instances, char **cellof, 
+    PointerVector *names) {
+  size_t i, j, n = 0;
+  cell_entry_s *entries = malloc(instances.size * sizeof *entries);
+
+  if (!entries) {
+    perror("Memory allocation error in emit_cells()");
+    return false;
+  }
+  for (i = 0; i < instances.size; i++) {
+    if (instance_cell_entry(context, instances.list[i], &entries[n])) {
+      entries[n].index = i;
+      n++;
+    }
+  }
+  qsort(entries, n, sizeof *entries, cell_entry_cmp);
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && !cell_entry_cmp(&entries[i], &entries[j]); j++);
+    char *name = make_label(context, "cell");
+    if (!name || pointer_vector_add(names, name)) {
+      free(name);
+      free(entries);
+      return false;
+    }
+    emit_cell(context, levelid, name, &entries[i], j - i);
+    while (i < j)
+      cellof[entries[i++].index] = name;
+  }
+  free(entries);
+  return true;
+}
+
+/*
+ * Fills in the cell key of an instance that never moves and has a constant 
+ * position. The margin is its largest scale, which is how far a unit sized 
+ * model can stick out of the cell it's centered in.
+ */
+bool instance_cell_entry(p_context_s *context, tnode_s *instance, cell_entry_s *entry) {
+  int k;
+  double pos[3], val;
+  StrMap *obj = instance->val.obj;
+  static const char *poskeys[] = {M_KEY("x"), M_KEY("y"), M_KEY("z")};
+  static const char *scalekeys[] = {M_KEY("scalex"), M_KEY("scaley"), M_KEY("scalez")};
+  tnode_s *isStatic = bob_str_map_get(obj, M_KEY("isStatic"));
+  tnode_s *isSubjectToGravity = bob_str_map_get(obj, M_KEY("isSubjectToGravity"));
+
+  if (isStatic && (!tnode_number(isStatic, &val) || !val))
+    return false;
+  if (isSubjectToGravity && (!tnode_number(isSubjectToGravity, &val) || val))
+    return false;
+  for (k = 0; k < 3; k++) {
+    tnode_s *node = bob_str_map_get(obj, poskeys[k]);
+    if (!node || !tnode_number(node, &pos[k]))
+      return false;
+  }
+  entry->margin = 1.0;
+  for (k = 0; k < 3; k++) {
+    tnode_s *node = bob_str_map_get(obj, scalekeys[k]);
+    if (node && tnode_number(node, &val) && fabs(val) > entry->margin)
+      entry->margin = fabs(val);
+  }
+  for (k = 0; k < 3; k++)
+    entry->key[k] = (int)floor(pos[k] / context->cellsize);
+  return true;
+}
+
+int cell_entry_cmp(const void *a, const void *b) {
+  const cell_entry_s *ea = a, *eb = b;
+  int k;
+
+  for (k = 0; k < 3; k++) {
+    if (ea->key[k] != eb->key[k])
+      return ea->key[k] < eb->key[k] ? -1 : 1;
+  }
+  return 0;
+}
+
+/*
+ * Emits the cell of count sorted entries, its bounds are the cube grown by 
+ * the largest margin of its instances.
+ */
+void emit_cell(p_context_s *context, char *levelid, const char *name, cell_entry_s *first, size_t count) {
+  size_t i;
+  int k;
+  double margin = 0.0;
+  CharBuf bounds[6], countstr;
+
+  for (i = 0; i < count; i++) {
+    if (first[i].margin > margin)
+      margin = first[i].margin;
+  }
+  for (k = 0; k < 3; k++) {
+    char_buf_init(&bounds[2*k]);
+    char_add_g(&bounds[2*k], first->key[k] * context->cellsize - margin);
+    char_buf_init(&bounds[2*k + 1]);
+    char_add_g(&bounds[2*k + 1], (first->key[k] + 1) * context->cellsize + margin);
+  }
+  char_buf_init(&countstr);
+  char_add_i(&countstr, count);
+
+  p_row_s *row = emit_row(context, P_ROW_CELL, name);
+  if (row_ref(context, row, levelid)) {
+    for (k = 0; k < 6; k++)
+      row_literal(row, bounds[k].buffer);
+    row_literal(row, countstr.buffer);
+  }
+
+  emit_code(" INSERT INTO cell(levelID,minX,maxX,minY,maxY,minZ,maxZ,instances) VALUES((SELECT id FROM ", &context->instancecode);
+  emit_code(levelid, &context->instancecode);
+  emit_code(")", &context->instancecode);
+  for (k = 0; k < 6; k++) {
+    emit_code(",", &context->instancecode);
+    emit_code(bounds[k].buffer, &context->instancecode);
+    char_buf_free(&bounds[k]);
+  }
+  emit_code(",", &context->instancecode);
+  emit_code(countstr.buffer, &context->instancecode);
+  emit_code(");\n", &context->instancecode);
+  emit_code(" CREATE TEMP TABLE ", &context->instancecode);
+  emit_code(name, &context->instancecode);
+  emit_code("(id INTEGER PRIMARY KEY);\n", &context->instancecode);
+  emit_code(" INSERT INTO ", &context->instancecode);
+  emit_code(name, &context->instancecode);
+  emit_code("(id) VALUES (last_insert_rowid());\n", &context->instancecode);
+  char_buf_free(&countstr);
+}
+
+bool tnode_number(tnode_s *node, double *val) {
+  if (node->type == PTYPE_INT)
+    *val = node->val.i;
+  else if (node->type == PTYPE_FLOAT)
+    *val = node->val.f;
+  else
+    return false;
+  return true;
 }
 
-bool emit_instance(p_context_s *context, char *levelid, tnode_s *instance) {
+bool emit_instance(p_context_s *context, char *levelid, tnode_s *instance, const char *cellid) {
   bool *isgen;
   StrMap *obj = instance->val.obj;
 	//TODO: type check model
@@ -2042,6 +2816,12 @@ bool emit_instance(p_context_s *context, char *levelid, tnode_s *instance) {
 
   CharBuf isStaticbuf = get_obj_value_default(obj, M_KEY("isStatic"), "1");
 
+  CharBuf rotxbuf = get_obj_value_default(obj, M_KEY("rotx"), "0");
+
+  CharBuf rotybuf = get_obj_value_default(obj, M_KEY("roty"), "0");
+
+  CharBuf rotzbuf = get_obj_value_default(obj, M_KEY("rotz"), "0");
+
   char *model_name;
   isgen = bob_str_map_get(model->val.obj, OBJ_ISGEN_KEY);
   if (!*isgen) {
@@ -2053,6 +2833,26 @@ bool emit_instance(p_context_s *context, char *levelid, tnode_s *instance) {
     return false;
   }
 
+  p_row_s *row = emit_row(context, P_ROW_INSTANCE, NULL);
+  if (row_ref(context, row, model_name) && row_ref(context, row, levelid)) {
+    row_literal(row, xbuf.buffer);
+    row_literal(row, ybuf.buffer);
+    row_literal(row, zbuf.buffer);
+    row_literal(row, scalexbuf.buffer);
+    row_literal(row, scaleybuf.buffer);
+    row_literal(row, scalezbuf.buffer);
+    row_literal(row, massbuf.buffer);
+    row_literal(row, isSubjectToGravitybuf.buffer);
+    row_literal(row, isStaticbuf.buffer);
+    row_literal(row, rotxbuf.buffer);
+    row_literal(row, rotybuf.buffer);
+    row_literal(row, rotzbuf.buffer);
+    if (!cellid)
+      row_null(row);
+    else
+      row_ref(context, row, cellid);
+  }
+
   emit_code("((SELECT id FROM ", &context->instancecode);
   emit_code(model_name, &context->instancecode);
   emit_code("),(SELECT id FROM ", &context->instancecode);
@@ -2075,7 +2875,20 @@ bool emit_instance(p_context_s *context, char *levelid, tnode_s *instance) {
   emit_code(isSubjectToGravitybuf.buffer, &context->instancecode);
   emit_code(",", &context->instancecode);
   emit_code(isStaticbuf.buffer, &context->instancecode);
-  emit_code(")", &context->instancecode);
+  emit_code(",", &context->instancecode);
+  emit_code(rotxbuf.buffer, &context->instancecode);
+  emit_code(",", &context->instancecode);
+  emit_code(rotybuf.buffer, &context->instancecode);
+  emit_code(",", &context->instancecode);
+  emit_code(rotzbuf.buffer, &context->instancecode);
+  if (cellid) {
+    emit_code(",(SELECT id FROM ", &context->instancecode);
+    emit_code(cellid, &context->instancecode);
+    emit_code("))", &context->instancecode);
+  }
+  else {
+    emit_code(",NULL)", &context->instancecode);
+  }
   char_buf_free(&xbuf);
   char_buf_free(&ybuf);
   char_buf_free(&zbuf);
@@ -2085,6 +2898,9 @@ bool emit_instance(p_context_s *context, char *levelid, tnode_s *instance) {
   char_buf_free(&massbuf);
   char_buf_free(&isSubjectToGravitybuf);
   char_buf_free(&isStaticbuf);
+  char_buf_free(&rotxbuf);
+  char_buf_free(&rotybuf);
+  char_buf_free(&rotzbuf);
   return true;
 }
 
@@ -2117,11 +2933,13 @@ bool emit_ranges(p_context_s *context, char *levelid, tnode_s *ranges) {
 void emit_range_batch(p_context_s *context, char *levelid, tnode_list_s ranges) {
   int i;
   for (i = 0; i < ranges.size; i++) {
-    emit_range(context, levelid, ranges.list[i]);
+    emit_range(context, levelid, ranges.list[i], NULL);
   }
 }
 
-char *emit_range(p_context_s *context, char *levelid, tnode_s *range_node) {
+char *emit_range(p_context_s *context, char *levelid, tnode_s *range_node, lazy_scope_s *parent) {
+  size_t count;
+  lazy_scope_s scope, *s;
 
   StrMap *obj = range_node->val.obj;
 
@@ -2141,10 +2959,37 @@ char *emit_range(p_context_s *context, char *levelid, tnode_s *range_node) {
 
   CharBuf cachebuf = get_obj_value_default(obj, M_KEY("cache"), "1");
 
+  /* 
+   * Lazy instances are unrolled at compile time when their range and every 
+   * range enclosing it are cached and have constant steps, unless that 
+   * would produce more than bakelimit instances.
+   */
+  tnode_s *cache = bob_str_map_get(obj, M_KEY("cache"));
+  tnode_s *instances = bob_str_map_get(obj, M_KEY("instances"));
+  scope.var = var->type == PTYPE_STRING ? var->val.s[1] : '\0';
+  scope.steps = steps->type == PTYPE_INT ? steps->val.i : -1;
+  scope.currval = 0;
+  scope.nbaked = 0;
+  scope.nlazy = 0;
+  scope.parent = parent;
+  scope.cached = !cache || (cache->type == PTYPE_INT && cache->val.i == 1);
+  scope.bake = context->bakelimit > 0;
+  count = instances && instances->type == PTYPE_ARRAY ? instances->val.atval.arr.size : 0;
+  for (s = &scope; s; s = s->parent) {
+    if (!s->cached || s->steps < 0) {
+      scope.bake = false;
+      break;
+    }
+    count *= s->steps;
+  }
+  if (count > context->bakelimit)
+    scope.bake = false;
+
   //insert nested ranges
+  char *child_table = NULL;
   tnode_s *child = bob_str_map_get(obj, M_KEY("child"));
   if (child != NULL) {
-    char *child_table = emit_range(context, levelid, child);
+    child_table = emit_range(context, levelid, child, &scope);
     if (!child_table) {
       return false;
     }
@@ -2179,6 +3024,19 @@ char *emit_range(p_context_s *context, char *levelid, tnode_s *range_node) {
 
   //add temp table for range id
   char *table_name = make_label(context, "range");
+  p_row_s *row = emit_row(context, P_ROW_RANGE, table_name);
+  if (!row_ref(context, row, levelid))
+    return false;
+  row_literal(row, stepsbuf.buffer);
+  row_literal(row, varbuf.buffer);
+  row_literal(row, cachebuf.buffer);
+  if (child_table) {
+    if (!row_ref(context, row, child_table))
+      return false;
+  }
+  else {
+    row_null(row);
+  }
   emit_code(" CREATE TEMP TABLE ", &context->rangeCode);
   emit_code(table_name, &context->rangeCode);
   emit_code("(id INTEGER PRIMARY KEY);\n", &context->rangeCode);
@@ -2187,22 +3045,54 @@ char *emit_range(p_context_s *context, char *levelid, tnode_s *range_node) {
 	emit_code(" VALUES (last_insert_rowid());\n", &context->rangeCode);
 
   //insert lazy instances
-  tnode_s *instances = bob_str_map_get(obj, M_KEY("instances"));
   if (instances) {
-    emit_lazy_instances(context, table_name, instances);
+    emit_lazy_instances(context, table_name, instances, &scope);
+    report_range_bake(context, table_name, &scope, count);
   }
 
-
   return table_name;
 }
 
-bool emit_lazy_instances(p_context_s *context, char *rangeid, tnode_s *lazy_instances) {
+/* function: report_range_bake -------------------------------------------------
+ * Tells whether a range was unrolled at compile time or left to the runtime, 
+ * so the bake limit can be tuned against database size and load time.
+ */
+void report_range_bake(p_context_s *context, const char *rangeid, lazy_scope_s *scope, size_t count) {
+  size_t total = scope->nbaked + scope->nlazy;
+
+  if (scope->nbaked) {
+    count = count / total * scope->nbaked;
+    fprintf(stderr, "range %s: baked %zu lazy instances into %zu instances (%zu bytes)", 
+        rangeid, scope->nbaked, count, count * BOB_BAKED_STRIDE * sizeof(float));
+    if (scope->nlazy)
+      fprintf(stderr, ", %zu kept lazy: expression can't be evaluated at compile time", scope->nlazy);
+    fprintf(stderr, "\n");
+  }
+  else if (!total) {
+    return;
+  }
+  else if (!context->bakelimit) {
+    fprintf(stderr, "range %s: kept lazy: baking is disabled\n", rangeid);
+  }
+  else if (scope->bake) {
+    fprintf(stderr, "range %s: kept lazy: expression can't be evaluated at compile time\n", rangeid);
+  }
+  else if (count > context->bakelimit) {
+    fprintf(stderr, "range %s: kept lazy: %zu instances exceeds the bake limit of %zu\n", 
+        rangeid, count, context->bakelimit);
+  }
+  else {
+    fprintf(stderr, "range %s: kept lazy: needs cache: 1 and integer steps\n", rangeid);
+  }
+}
+
+bool emit_lazy_instances(p_context_s *context, char *rangeid, tnode_s *lazy_instances, lazy_scope_s *scope) {
   int i;
 
   if (lazy_instances->type == PTYPE_ARRAY) {
     tnode_arraytype_val_s atval = lazy_instances->val.atval;
     if (atval.type == PTYPE_OBJECT || atval.type == PTYPE_INSTANCE) {
-      emit_lazy_instance_batch(context, rangeid, atval.arr);
+      emit_lazy_instance_batch(context, rangeid, atval.arr, scope);
     } 
     else {
       report_semantics_error("Lazy Instances must be an array of objects or lazy instance types", context);
@@ -2216,22 +3106,22 @@ bool emit_lazy_instances(p_context_s *context, char *rangeid, tnode_s *lazy_inst
   return true;
 }
 
-void emit_lazy_instance_batch(p_context_s *context, char *rangeid, tnode_list_s lazy_instances) {
+void emit_lazy_instance_batch(p_context_s *context, char *rangeid, tnode_list_s lazy_instances, lazy_scope_s *scope) {
   int i; 
 
-  emit_code(" INSERT INTO lazy_instance(modelID, rangeID, vx, vy, vz, scalex, scaley, scalez, mass, isSubjectToGravity, isStatic) VALUES\n", 
+  emit_code(" INSERT INTO lazy_instance(modelID, rangeID, vx, vy, vz, scalex, scaley, scalez, mass, isSubjectToGravity, isStatic, rotx, roty, rotz, baked) VALUES\n", 
 		&context->lazyinstancecode);
   for (i = 0; i < lazy_instances.size - 1; i++) {
     emit_code(" \t", &context->lazyinstancecode);
-    emit_lazy_instance(context, rangeid, lazy_instances.list[i]);
+    emit_lazy_instance(context, rangeid, lazy_instances.list[i], scope);
     emit_code(",\n", &context->lazyinstancecode);
   }
   emit_code(" \t", &context->lazyinstancecode);
-  emit_lazy_instance(context, rangeid, lazy_instances.list[i]);
+  emit_lazy_instance(context, rangeid, lazy_instances.list[i], scope);
   emit_code(";\n", &context->lazyinstancecode);
 }
 
-bool emit_lazy_instance(p_context_s *context, char *rangeid, tnode_s *lazy_instance) {
+bool emit_lazy_instance(p_context_s *context, char *rangeid, tnode_s *lazy_instance, lazy_scope_s *scope) {
   bool *isgen;
   StrMap *obj = lazy_instance->val.obj;
   tnode_s *model = bob_str_map_get(obj, M_KEY("model"));
@@ -2279,6 +3169,12 @@ bool emit_lazy_instance(p_context_s *context, char *rangeid, tnode_s *lazy_insta
 
   CharBuf isStaticbuf = get_obj_value_default(obj, M_KEY("isStatic"), "1");
 
+  CharBuf rotxbuf = get_obj_value_default(obj, M_KEY("rotx"), "0");
+
+  CharBuf rotybuf = get_obj_value_default(obj, M_KEY("roty"), "0");
+
+  CharBuf rotzbuf = get_obj_value_default(obj, M_KEY("rotz"), "0");
+
   char *model_name;
   isgen = bob_str_map_get(model->val.obj, OBJ_ISGEN_KEY);
   if (!*isgen) {
@@ -2290,6 +3186,37 @@ bool emit_lazy_instance(p_context_s *context, char *rangeid, tnode_s *lazy_insta
     return false;
   }
 
+  FloatBuf baked;
+  CharBuf *fields[] = {&xbuf, &ybuf, &zbuf, &scalexbuf, &scaleybuf, &scalezbuf, &rotxbuf, &rotybuf, &rotzbuf};
+  float_buf_init(&baked);
+  if (scope->bake && bake_lazy_instance(scope, fields, &baked)) {
+    scope->nbaked++;
+  }
+  else {
+    baked.size = 0;
+    scope->nlazy++;
+  }
+
+  p_row_s *row = emit_row(context, P_ROW_LAZY_INSTANCE, NULL);
+  if (row_ref(context, row, model_name) && row_ref(context, row, rangeid)) {
+    row_literal(row, xbuf.buffer);
+    row_literal(row, ybuf.buffer);
+    row_literal(row, zbuf.buffer);
+    row_literal(row, scalexbuf.buffer);
+    row_literal(row, scaleybuf.buffer);
+    row_literal(row, scalezbuf.buffer);
+    row_literal(row, massbuf.buffer);
+    row_literal(row, isSubjectToGravitybuf.buffer);
+    row_literal(row, isStaticbuf.buffer);
+    row_literal(row, rotxbuf.buffer);
+    row_literal(row, rotybuf.buffer);
+    row_literal(row, rotzbuf.buffer);
+    if (baked.size)
+      row_blob(row, baked.buffer, baked.size * sizeof *baked.buffer);
+    else
+      row_null(row);
+  }
+
   emit_code("((SELECT id FROM ", &context->lazyinstancecode);
   emit_code(model_name, &context->lazyinstancecode);
   emit_code("),(SELECT id FROM ", &context->lazyinstancecode);
@@ -2312,7 +3239,19 @@ bool emit_lazy_instance(p_context_s *context, char *rangeid, tnode_s *lazy_insta
   emit_code(isSubjectToGravitybuf.buffer, &context->lazyinstancecode);
   emit_code(",", &context->lazyinstancecode);
   emit_code(isStaticbuf.buffer, &context->lazyinstancecode);
+  emit_code(",", &context->lazyinstancecode);
+  emit_code(rotxbuf.buffer, &context->lazyinstancecode);
+  emit_code(",", &context->lazyinstancecode);
+  emit_code(rotybuf.buffer, &context->lazyinstancecode);
+  emit_code(",", &context->lazyinstancecode);
+  emit_code(rotzbuf.buffer, &context->lazyinstancecode);
+  emit_code(",", &context->lazyinstancecode);
+  if (baked.size)
+    emit_blob(&context->lazyinstancecode, baked.buffer, baked.size * sizeof *baked.buffer);
+  else
+    emit_code("NULL", &context->lazyinstancecode);
   emit_code(")", &context->lazyinstancecode);
+  float_buf_free(&baked);
   char_buf_free(&xbuf);
   char_buf_free(&ybuf);
   char_buf_free(&zbuf);
@@ -2322,9 +3261,74 @@ bool emit_lazy_instance(p_context_s *context, char *rangeid, tnode_s *lazy_insta
   char_buf_free(&massbuf);
   char_buf_free(&isSubjectToGravitybuf);
   char_buf_free(&isStaticbuf);
+  char_buf_free(&rotxbuf);
+  char_buf_free(&rotybuf);
+  char_buf_free(&rotzbuf);
   return true;
 }
 
+/* function: bake_lazy_instance ------------------------------------------------
+ * Evaluates the position, scale and rotation of a lazy instance for every iteration 
+ * of its range and the ranges enclosing it, outermost range slowest, the 
+ * same order render_range walks them in. Fails if any expression can't be 
+ * evaluated at compile time.
+ */
+bool bake_lazy_instance(lazy_scope_s *scope, CharBuf *fields[], FloatBuf *baked) {
+  int i;
+  float val;
+  size_t len;
+  const char *src;
+  lazy_scope_s *s;
+
+  for (s = scope; s; s = s->parent) {
+    if (!s->steps)
+      return true;
+    s->currval = 0;
+  }
+  do {
+    for (i = 0; i < BOB_BAKED_STRIDE; i++) {
+      src = fields[i]->buffer;
+      len = strlen(src);
+      if (*src == '"') {
+        src++;
+        len -= 2;
+      }
+      if (!lazy_eval(src, len, scope, &val) || float_add_f(baked, val))
+        return false;
+    }
+    for (s = scope; s && ++s->currval == s->steps; s = s->parent)
+      s->currval = 0;
+  } while (s);
+  return true;
+}
+
+/* function: emit_blob ---------------------------------------------------------
+ * Emits data as an SQL blob literal.
+ */
+void emit_blob(CharBuf *code, const void *data, size_t size) {
+  static const char hex[] = "0123456789ABCDEF";
+  const unsigned char *bytes = data;
+  size_t i;
+  char *literal, *ptr;
+
+  literal = malloc(2 * size + 4);
+  if (!literal) {
+    perror("Memory allocation error in emit_blob()");
+    return;
+  }
+  ptr = literal;
+  *ptr++ = 'X';
+  *ptr++ = '\'';
+  for (i = 0; i < size; i++) {
+    *ptr++ = hex[bytes[i] >> 4];
+    *ptr++ = hex[bytes[i] & 0xf];
+  }
+  *ptr++ = '\'';
+  *ptr = '\0';
+  emit_code(literal, code);
+  free(literal);
+}
+
 bool check_shader(tnode_s *program, p_context_s *context, const char *shader_key, const char *programname, bob_shader_e type) {
   bool *isgen;
   tnode_s *shader = bob_str_map_get(program->val.obj, shader_key);
@@ -2338,6 +3342,11 @@ bool check_shader(tnode_s *program, p_context_s *context, const char *shader_key
       report_semantics_error("Internal compiler error, autogenerated name not found in object", context); 
       return false;
     }
+    p_row_s *row = emit_row(context, P_ROW_PROGRAM_XREF, NULL);
+    if (row)
+      row->owner = bob_str_map_get(&context->rownames, programname);
+    if (!row_ref(context, row, shadername) || !row_ref(context, row, programname))
+      return false;
     emit_code(" INSERT INTO program_xref(shaderID, programID) VALUES(\n", &context->programcode);
     emit_code(" \t(SELECT id FROM ", &context->programcode);
     emit_code(shadername, &context->programcode);
@@ -2356,7 +3365,7 @@ CharBuf val_to_str(tnode_s *val) {
     char_add_i(&buf, val->val.i);
   }
   else if (val->type == PTYPE_FLOAT) {
-    char_add_d(&buf, val->val.f);
+    char_add_g(&buf, val->val.f);
   }
   else if (val->type == PTYPE_STRING) {
     char_add_s(&buf, val->val.s);
@@ -2369,70 +3378,131 @@ CharBuf val_to_str(tnode_s *val) {
 }
 
 void gen_code(p_context_s *context, FILE *dest) {
+  tpool_wait(context->pool);
   fprintf(dest, 
     "/*********************************************************************************\n"
     "* MESHES\n"
     "*********************************************************************************/\n");
-  fprintf(dest, "%s", context->meshcode.buffer);
+  write_section(context, &context->meshcode, dest);
   fprintf(dest, "/********************************************************************************/\n");
 
   fprintf(dest, 
     "/*********************************************************************************\n"
     "* SHADERS\n"
     "*********************************************************************************/\n");
-  fprintf(dest, "%s", context->shadercode.buffer);
+  write_section(context, &context->shadercode, dest);
   fprintf(dest, "/********************************************************************************/\n");
 
   fprintf(dest, 
     "/*********************************************************************************\n"
     "* PROGRAMS\n"
     "*********************************************************************************/\n");
-  fprintf(dest, "%s", context->programcode.buffer);
+  write_section(context, &context->programcode, dest);
   fprintf(dest, "/********************************************************************************/\n");
 
   fprintf(dest, 
     "/*********************************************************************************\n"
     "* TEXTURES\n"
     "*********************************************************************************/\n");
-  fprintf(dest, "%s", context->texturecode.buffer);
+  write_section(context, &context->texturecode, dest);
   fprintf(dest, "/********************************************************************************/\n");
 
   fprintf(dest, 
     "/*********************************************************************************\n"
     "* MODELS\n"
     "*********************************************************************************/\n");
-  fprintf(dest, "%s", context->modelcode.buffer);
+  write_section(context, &context->modelcode, dest);
   fprintf(dest, "/********************************************************************************/\n");
 
   fprintf(dest, 
     "/*********************************************************************************\n"
     "* LEVELS\n"
     "*********************************************************************************/\n");
-  fprintf(dest, "%s", context->levelcode.buffer);
+  write_section(context, &context->levelcode, dest);
   fprintf(dest, "/********************************************************************************/\n");
 
   fprintf(dest, 
     "/*********************************************************************************\n"
     "* INSTANCES\n"
     "*********************************************************************************/\n");
-  fprintf(dest, "%s", context->instancecode.buffer);
+  write_section(context, &context->instancecode, dest);
   fprintf(dest, "/********************************************************************************/\n");
 
 	fprintf(dest,
     "/*********************************************************************************\n"
     "* RANGES\n"
     "*********************************************************************************/\n");
-  fprintf(dest, "%s", context->rangeCode.buffer);
+  write_section(context, &context->rangeCode, dest);
   fprintf(dest, "/********************************************************************************/\n");
 
 	fprintf(dest,
     "/*********************************************************************************\n"
     "* LAZY INSTANCES\n"
     "*********************************************************************************/\n");
-  fprintf(dest, "%s", context->lazyinstancecode.buffer);
+  write_section(context, &context->lazyinstancecode, dest);
   fprintf(dest, "/********************************************************************************/\n");
 }
 
+/* function: emit_free ---------------------------------------------------------
+ * Releases the deferred jobs and rows of a context once a backend has 
+ * written them out.
+ */
+void emit_free(p_context_s *context) {
+  size_t i, j;
+  int k;
+  StrMapEntry *entry;
+
+  tpool_wait(context->pool);
+  for (i = 0; i < context->deferred.size; i++) {
+    p_deferred_s *job = context->deferred.buffer[i];
+    char_buf_free(&job->out);
+    free(job);
+  }
+  pointer_vector_free(&context->deferred);
+
+  for (i = 0; i < P_ROW_COUNT; i++) {
+    for (j = 0; j < context->rows[i].size; j++) {
+      p_row_s *row = context->rows[i].buffer[j];
+      for (k = 0; k < row->nvalues; k++)
+        free(row->values[k].text.buffer);
+      free(row);
+    }
+    pointer_vector_free(&context->rows[i]);
+  }
+  for (k = 0; k < MAP_TABLE_SIZE; k++) {
+    for (entry = context->rownames.table[k]; entry; entry = entry->next)
+      free((char *)entry->key);
+  }
+  bob_str_map_free(&context->rownames);
+}
+
+/* function: section_len -------------------------------------------------------
+ * Length of the code in a section, not counting the terminator char_add_s 
+ * leaves at the end.
+ */
+size_t section_len(CharBuf *section) {
+  if (section->size && !section->buffer[section->size - 1])
+    return section->size - 1;
+  return section->size;
+}
+
+/* function: write_section -----------------------------------------------------
+ * Writes a section with the output of its deferred jobs spliced back in.
+ */
+void write_section(p_context_s *context, CharBuf *section, FILE *dest) {
+  size_t i, pos = 0;
+
+  for (i = 0; i < context->deferred.size; i++) {
+    p_deferred_s *job = context->deferred.buffer[i];
+    if (job->section != (char *)section - (char *)context)
+      continue;
+    fwrite(&section->buffer[pos], 1, job->offset - pos, dest);
+    fwrite(job->out.buffer, 1, section_len(&job->out), dest);
+    pos = job->offset;
+  }
+  fwrite(&section->buffer[pos], 1, section_len(section) - pos, dest);
+}
+
 char *strip_quotes(char *level_name) {
   int i;
   size_t nlen = strlen(level_name) - 1;
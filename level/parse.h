@@ -2,6 +2,9 @@
 #define __parse_h__
 
 #include "lex.h"
+#include "threadpool.h"
+#include "cache.h"
+#include "lazyeval.h"
 #include "../common/data-structures.h"
 #include <stdbool.h>
 #include <stdio.h>
@@ -11,6 +14,9 @@ typedef struct tnode_list_s tnode_list_s;
 typedef struct tnode_arraytype_val_s tnode_arraytype_val_s;
 typedef struct tnode_s tnode_s;
 typedef struct symtable_node_s symtable_node_s;
+typedef struct p_deferred_s p_deferred_s;
+typedef struct p_value_s p_value_s;
+typedef struct p_row_s p_row_s;
 
 typedef enum {
 	PTYPE_INT,
@@ -47,9 +53,50 @@ typedef enum {
 	PTYPE_LEVEL_DEC
 } p_nodetype_e;
 
+typedef enum {
+  P_ROW_MESH,
+  P_ROW_SHADER,
+  P_ROW_PROGRAM,
+  P_ROW_PROGRAM_XREF,
+  P_ROW_TEXTURE,
+  P_ROW_MODEL,
+  P_ROW_LEVEL,
+  P_ROW_CELL,
+  P_ROW_INSTANCE,
+  P_ROW_RANGE,
+  P_ROW_LAZY_INSTANCE,
+  P_ROW_COUNT
+} p_rowtype_e;
+
+typedef enum {
+  P_VAL_NULL,
+  P_VAL_LITERAL,
+  P_VAL_TEXT,
+  P_VAL_REF,
+  P_VAL_BLOB
+} p_valtype_e;
+
+/* most columns inserted by any row, lazy_instance has 15 */
+#define P_ROW_MAX_VALUES 15
+
+/* 
+ * Default for the most instances a range may be unrolled into at compile 
+ * time, 1.5MB of baked floats. 
+ */
+#define P_DEFAULT_BAKE_LIMIT 65536
+
 struct p_context_s {
 	int parse_errors;
   unsigned labelcount;
+  tpool_s *pool;
+  PointerVector deferred;
+  bool direct;
+  PointerVector rows[P_ROW_COUNT];
+  StrMap rownames;
+  compile_cache_s *cache;
+  p_row_s *levelrow;
+  double cellsize;
+  size_t bakelimit;
 	StrMap symtable;
 	tnode_s *root;
 	tok_s *currtok;
@@ -64,14 +111,65 @@ struct p_context_s {
   CharBuf rangeCode;
 };
 
+/*
+ * Code formatted on the thread pool. gen_code waits for every job and splices 
+ * out into its section at offset, in the order the jobs were deferred. The 
+ * context is returned by value from parse, so the section is kept as its 
+ * byte offset within p_context_s rather than a pointer.
+ */
+struct p_deferred_s {
+  size_t section;
+  size_t offset;
+  CharBuf out;
+  void *data;
+};
+
+/*
+ * A column of a row for the direct database backend. Literals hold the same 
+ * SQL literal the text backend emits, text and blobs are bound as is and 
+ * references take the id of another row once it has been inserted.
+ */
+struct p_value_s {
+  p_valtype_e type;
+  CharBuf text;
+  p_row_s *ref;
+};
+
+/*
+ * Rows are only recorded when compiling straight into a database. Each table 
+ * gets its rows in the order they were recorded, which is the order the text 
+ * backend writes its statements in, so both backends assign the same ids.
+ *
+ * hash covers the row's values, with references contributing the hash of 
+ * the row they point to. Rows with an owner (program_xref rows of a program, 
+ * instances and ranges of a level) also fold their values into the owner's 
+ * hash and are only written when the owner is. cached is set once the row 
+ * is known to already be in the database under id.
+ */
+struct p_row_s {
+  p_rowtype_e type;
+  long long id;
+  uint64_t hash;
+  bool cached;
+  p_row_s *owner;
+  int nvalues;
+  p_value_s values[P_ROW_MAX_VALUES];
+};
+
 struct tnode_list_s {
 	int size;
+	int cap;
 	tnode_s **list;
 };
 
+/*
+ * Arrays made up only of numeric literals are kept packed as doubles
+ * with arr.list left NULL until elements are needed as nodes.
+ */
 struct tnode_arraytype_val_s {
 	p_nodetype_e type;
 	tnode_list_s arr;
+	double *packed;
 };
 
 struct tnode_s {
@@ -92,8 +190,9 @@ struct symtable_node_s {
 	tnode_s *node;
 };
 
-extern p_context_s parse(toklist_s *list);
+extern p_context_s parse(toklist_s *list, tpool_s *pool, compile_cache_s *cache, size_t bakelimit);
 extern void gen_code(p_context_s *context, FILE *dest);
+extern void emit_free(p_context_s *context);
 
 #endif
 
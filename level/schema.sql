@@ -15,6 +15,9 @@ CREATE TABLE program_xref (
 	FOREIGN KEY(programID) REFERENCES program(id)
 );	
 
+-- covers the shaders of a program, shader rows are then read by id
+CREATE INDEX program_xref_program ON program_xref(programID, shaderID);
+
 CREATE TABLE program (
 	id INTEGER,
   PRIMARY KEY(id)
@@ -30,6 +33,9 @@ CREATE TABLE mesh (
 	id INTEGER,
 	name VARCHAR(16),
 	data TEXT,
+	indices TEXT,
+	vertexCount INTEGER,
+	drawType TINYINT DEFAULT 0,
 	PRIMARY KEY(id)
 );
 
@@ -39,6 +45,7 @@ CREATE TABLE model (
 	programID INTEGER,
 	textureID INTEGER,
   hasUV TINYINT,
+  transparent TINYINT DEFAULT 0,
 	PRIMARY KEY(id),
 	FOREIGN KEY(meshID) REFERENCES mesh(id),
 	FOREIGN KEY(programID) REFERENCES program(id),
@@ -46,6 +53,7 @@ CREATE TABLE model (
 );
 
 CREATE TABLE instance (
+	id INTEGER,
 	modelID INTEGER,
 	levelID INTEGER,
 	vx FLOAT,
@@ -57,10 +65,32 @@ CREATE TABLE instance (
 	mass FLOAT,
   isSubjectToGravity TINYINT,
   isStatic TINYINT,
+  rotx FLOAT DEFAULT 0,
+  roty FLOAT DEFAULT 0,
+  rotz FLOAT DEFAULT 0,
+  cellID INTEGER DEFAULT NULL,
+	PRIMARY KEY(id),
 	FOREIGN KEY(modelID) REFERENCES model (id),
 	FOREIGN KEY(levelID) REFERENCES level (id)
 );
 
+-- instance_level also covers listing the models of a level's cells. Most
+-- instances have no cell, so instance_cell leaves them out.
+CREATE INDEX instance_level ON instance(levelID, cellID, modelID);
+CREATE INDEX instance_cell ON instance(cellID) WHERE cellID IS NOT NULL;
+
+-- Static instances of a level with a cellSize are partitioned into cubes,
+-- cell holds the bounds of each cube for streaming them in around the camera.
+-- instance.cellID is NULL for instances that are always loaded.
+CREATE VIRTUAL TABLE cell USING rtree(
+	id,
+	minX, maxX,
+	minY, maxY,
+	minZ, maxZ,
+	+levelID INTEGER,
+	+instances INTEGER
+);
+
 CREATE TABLE lazy_instance (
 	id INTEGER,
 	modelID INTEGER,
@@ -74,11 +104,17 @@ CREATE TABLE lazy_instance (
 	mass VARCHAR(64),
   isSubjectToGravity TINYINT,
   isStatic TINYINT,
+  rotx VARCHAR(64) DEFAULT '0',
+  roty VARCHAR(64) DEFAULT '0',
+  rotz VARCHAR(64) DEFAULT '0',
+  baked BLOB,
 	PRIMARY KEY(id),
 	FOREIGN KEY(modelID) REFERENCES model (id),
   FOREIGN KEY(rangeID) REFERENCES range (id)
 );
 
+CREATE INDEX lazy_instance_range ON lazy_instance(rangeID);
+
 CREATE TABLE range (
 	id INTEGER,
 	levelID INTEGER,
@@ -91,12 +127,29 @@ CREATE TABLE range (
 	PRIMARY KEY(id)
 );
 
+CREATE INDEX range_level ON range(levelID);
+
 CREATE TABLE level (
 	id INTEGER,
 	name TEXT,
   ambientGravityX FLOAT,
   ambientGravityY FLOAT,
   ambientGravityZ FLOAT,
+  integrator TINYINT DEFAULT 0,
+  timestep FLOAT DEFAULT 0,
+  cellSize FLOAT DEFAULT 0,
 	PRIMARY KEY(id)
 );
 
+CREATE INDEX level_name ON level(name);
+
+CREATE TABLE compile_cache (
+	hash INTEGER,
+	type TINYINT,
+	rowID INTEGER,
+	PRIMARY KEY(hash)
+);
+
+-- BOB_SCHEMA_VERSION, bumped whenever the tables or indexes change. dbgen
+-- upgrades older databases it writes to, the loader refuses them.
+PRAGMA user_version = 3;
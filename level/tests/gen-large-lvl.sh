@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# Writes a large level source to stdout for timing the lexer:
+#   sh tests/gen-large-lvl.sh [meshes] [vertices-per-mesh] > tests/large.lvl
+# Each mesh is a vertex array of floats like the ones in sample1.lvl, with
+# integer constants, strings and comments mixed in so every kind of token
+# is exercised.
+
+meshes=${1:-20000}
+vertices=${2:-32}
+
+awk -v meshes="$meshes" -v vertices="$vertices" 'BEGIN {
+	srand(1)
+	print "{\n  \"name\": \"large\",\n  \"meshes\": " meshes "\n}\n{"
+	for (m = 0; m < meshes; m++) {
+		printf "  /* mesh %d of %d */\n", m, meshes
+		printf "  Int count%d := %d\n", m, vertices
+		printf "  String name%d := \"mesh-%d\"\n", m, m
+		printf "  Mesh mesh%d := {\n    \"vertices\": [\n", m
+		for (v = 0; v < vertices; v++) {
+			printf "      %f, %f, %f, %.1f, %.1f%s\n", 2 * rand() - 1, 2 * rand() - 1, 2 * rand() - 1,
+				v % 2, int(v / 2) % 2, v + 1 < vertices ? "," : ""
+		}
+		print "    ]\n  }"
+	}
+	print "}"
+}'
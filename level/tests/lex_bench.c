@@ -0,0 +1,50 @@
+#include "../lex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Lexes a file several times and reports the best run, so lexer changes 
+ * can be timed on the output of gen-large-lvl.sh:
+ *   ./tests/lex_bench tests/large.lvl [runs]
+ */
+
+#define LEX_BENCH_RUNS 10
+
+static double s_now(void);
+
+int main(int argc, char *argv[]) {
+	int i, runs;
+	double t, best = 0.0;
+	size_t tokens = 0, bytes = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: lex_bench <path-to-source-file> [runs]\n");
+		return 1;
+	}
+	runs = argc > 2 ? atoi(argv[2]) : LEX_BENCH_RUNS;
+	for (i = 0; i < runs; i++) {
+		toklist_s list;
+
+		t = s_now();
+		list = lex(argv[1]);
+		t = s_now() - t;
+		if (!list.head)
+			return 1;
+		tokens = list.size;
+		bytes = list.src_size;
+		toklist_free(&list);
+		if (!i || t < best)
+			best = t;
+	}
+	printf("%s: %zu bytes, %zu tokens, best of %d runs %.3f ms, %.1f MB/s, %.1f Mtok/s\n", argv[1], 
+			bytes, tokens, runs, 1e3 * best, bytes / best / 1e6, tokens / best / 1e6);
+	return 0;
+}
+
+double s_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,137 @@
+#include "threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void *tpool_worker(void *arg);
+
+/* function: tpool_new ---------------------------------------------------------
+ * Starts nthreads workers. Returns NULL if no thread could be started, 
+ * callers then run their jobs inline.
+ */
+tpool_s *tpool_new(unsigned nthreads) {
+  unsigned i;
+  tpool_s *pool;
+
+  if (!nthreads)
+    return NULL;
+  pool = calloc(1, sizeof *pool);
+  if (!pool) {
+    perror("Memory allocation error in tpool_new()");
+    return NULL;
+  }
+  pool->threads = malloc(nthreads * sizeof *pool->threads);
+  if (!pool->threads) {
+    perror("Memory allocation error in tpool_new()");
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->hasjob, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, tpool_worker, pool))
+      break;
+  }
+  pool->nthreads = i;
+  if (!i) {
+    fprintf(stderr, "Failed to start code generation threads, emitting serially\n");
+    tpool_free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/* function: tpool_default_threads ---------------------------------------------
+ * One worker per online processor.
+ */
+unsigned tpool_default_threads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+/* function: tpool_submit ------------------------------------------------------
+ * Queues fn(arg). With no pool, or if the job can't be queued, fn runs 
+ * immediately on the calling thread.
+ */
+void tpool_submit(tpool_s *pool, tpool_fn fn, void *arg) {
+  tpool_job_s *job;
+
+  if (!pool || !(job = malloc(sizeof *job))) {
+    fn(arg);
+    return;
+  }
+  job->fn = fn;
+  job->arg = arg;
+  job->next = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pool->pending++;
+  pthread_cond_signal(&pool->hasjob);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* function: tpool_wait --------------------------------------------------------
+ * Blocks until every submitted job has finished.
+ */
+void tpool_wait(tpool_s *pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* function: tpool_free --------------------------------------------------------
+ * Finishes queued jobs, then joins the workers.
+ */
+void tpool_free(tpool_s *pool) {
+  unsigned i;
+
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->hasjob);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+  pthread_cond_destroy(&pool->idle);
+  pthread_cond_destroy(&pool->hasjob);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+void *tpool_worker(void *arg) {
+  tpool_s *pool = arg;
+  tpool_job_s *job;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->head && !pool->shutdown)
+      pthread_cond_wait(&pool->hasjob, &pool->lock);
+    if (!pool->head)
+      break;
+    job = pool->head;
+    pool->head = job->next;
+    if (!pool->head)
+      pool->tail = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    job->fn(job->arg);
+    free(job);
+
+    pthread_mutex_lock(&pool->lock);
+    if (!--pool->pending)
+      pthread_cond_broadcast(&pool->idle);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
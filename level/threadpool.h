@@ -0,0 +1,41 @@
+#ifndef __threadpool_h__
+#define __threadpool_h__
+
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef struct tpool_job_s tpool_job_s;
+typedef struct tpool_s tpool_s;
+
+typedef void (*tpool_fn)(void *arg);
+
+struct tpool_job_s {
+  tpool_fn fn;
+  void *arg;
+  tpool_job_s *next;
+};
+
+/*
+ * Fixed set of worker threads pulling jobs off a FIFO queue. Jobs must not
+ * touch compiler state shared with the parser, they only write to memory 
+ * handed to them through arg.
+ */
+struct tpool_s {
+  pthread_mutex_t lock;
+  pthread_cond_t hasjob;
+  pthread_cond_t idle;
+  tpool_job_s *head;
+  tpool_job_s *tail;
+  unsigned pending;
+  bool shutdown;
+  unsigned nthreads;
+  pthread_t *threads;
+};
+
+extern tpool_s *tpool_new(unsigned nthreads);
+extern unsigned tpool_default_threads(void);
+extern void tpool_submit(tpool_s *pool, tpool_fn fn, void *arg);
+extern void tpool_wait(tpool_s *pool);
+extern void tpool_free(tpool_s *pool);
+
+#endif
@@ -3,22 +3,65 @@
 #include "common/opengl-util.h"
 #include "loadlevel.h" 
 #include "models.h"
+#include "collision.h"
+#include "physics.h"
 #include "meshes.h"
+#include "indirect.h"
+#include "stream.h"
+#include "occlusion.h"
+#include "lazy_instance_engine.h"
 #include "common/errcodes.h"
 #include "common/constants.h"
+#include "common/pack.h"
 #include <assert.h>
 #include <sqlite3.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <stddef.h>
 #include <GL/glew.h>
 
-#define BDB_VERTEXT_BUF 256
+/* 
+ * Read-only tuning applied to every level database: meshes and shader 
+ * sources are read through a 256MB memory map and a 16MB page cache. 
+ */
+#define BDB_PRAGMAS \
+	"PRAGMA query_only=1;" \
+	"PRAGMA mmap_size=268435456;" \
+	"PRAGMA cache_size=-16384;" \
+	"PRAGMA temp_store=MEMORY;"
+
+/* largest error allowed when storing texture coordinates as half floats */
+#define BDB_HALF_UV_EPSILON (1.0f/4096.0f)
+
+typedef struct bob_packed_vertex_s bob_packed_vertex_s;
+typedef struct bob_program_s bob_program_s;
+typedef struct bob_texture_s bob_texture_s;
+
+struct bob_packed_vertex_s {
+  GLfloat pos[3];
+  GLhalf uv[2];
+};
+
+/* 
+ * Programs and textures shared by models, with the GL object first so a
+ * model's program or texture pointer leads back to its bookkeeping. 
+ */
+struct bob_program_s {
+	GlProgram program;
+	resource_s res;
+};
+
+struct bob_texture_s {
+	GlTexture texture;
+	resource_s res;
+};
 
 struct bob_db_s {
 	sqlite3 *db;
-	sqlite3_stmt *qambientgravity;
+	sqlite3_stmt *qproperties;
 	sqlite3_stmt *qinstance;
 	sqlite3_stmt *qrange;
 	sqlite3_stmt *qlazyinstance;
@@ -26,34 +69,41 @@ struct bob_db_s {
 	sqlite3_stmt *qmesh;
 	sqlite3_stmt *qshader;
 	sqlite3_stmt *qtexture;
+	sqlite3_stmt *qcells;
+	sqlite3_stmt *qcellinstances;
+	sqlite3_stmt *qcellmodels;
+	int version;
 	IntMap models;
 	IntMap shaders;
+	IntMap programs;
+	IntMap textures;
+	resource_cache_s resources;
 };
 
-const char *level_ambient_gravity_qstr =
-"SELECT ambientGravityX, ambientGravityY, ambientGravityZ"
+const char *level_properties_qstr =
+"SELECT ambientGravityX, ambientGravityY, ambientGravityZ, integrator, timestep, id, cellSize"
 " FROM level"
 " WHERE name=?";
 const char *instance_qstr = 
-"SELECT modelID, levelID, vx, vy, vz, scalex, scaley, scalez, mass, isSubjectToGravity, isStatic"
+"SELECT modelID, levelID, vx, vy, vz, scalex, scaley, scalez, mass, isSubjectToGravity, isStatic, rotx, roty, rotz"
 " FROM level AS l JOIN instance AS i"
 " ON l.id=i.levelID"
-" WHERE l.name=?";
+" WHERE l.name=? AND i.cellID IS NULL";
 const char *range_qstr =
 "SELECT r.id, steps, var, cache, child"
 " FROM level AS l"
 " JOIN range AS r ON l.id=r.levelID"
 " WHERE l.name=?";
 const char *lazy_instance_qstr =
-"SELECT id, modelID, vx, vy, vz, scalex, scaley, scalez, mass, isSubjectToGravity, isStatic"
+"SELECT id, modelID, vx, vy, vz, scalex, scaley, scalez, mass, isSubjectToGravity, isStatic, rotx, roty, rotz, baked"
 " FROM lazy_instance"
 " WHERE rangeID=?";
 const char *model_qstr = 
-"SELECT meshID, programID, textureID, hasUV"
+"SELECT meshID, programID, textureID, hasUV, transparent"
 " FROM model"
 " WHERE id=?";
 const char *mesh_qstr =
-"SELECT name, data"
+"SELECT name, data, indices, vertexCount, drawType"
 " FROM mesh"
 " WHERE id=?";
 const char *shader_qstr = 
@@ -64,35 +114,52 @@ const char *shader_qstr =
 const char *texture_qstr =
 "SELECT path FROM texture AS t"
 " WHERE t.id=?";
+const char *cell_qstr =
+"SELECT id, minX, minY, minZ, maxX, maxY, maxZ, instances"
+" FROM cell"
+" WHERE levelID=? AND maxX>=? AND minX<=? AND maxY>=? AND minY<=? AND maxZ>=? AND minZ<=?";
+const char *cell_instance_qstr =
+"SELECT modelID, levelID, vx, vy, vz, scalex, scaley, scalez, mass, isSubjectToGravity, isStatic, rotx, roty, rotz"
+" FROM instance"
+" WHERE cellID=?";
+const char *cell_model_qstr =
+"SELECT DISTINCT modelID"
+" FROM instance"
+" WHERE levelID=? AND cellID IS NOT NULL";
 
 static sqlite3_stmt *query_level;
 
 static int prepare_queries(bob_db_s *bdb);
-static int bob_dbload_ambient_gravity(Level *lvl, bob_db_s *bdb, const char *name);
+static int bob_dbconfigure(bob_db_s *bdb);
+static int bob_dbload_properties(Level *lvl, bob_db_s *bdb, const char *name);
 static int bob_dbload_instances(Level *lvl, bob_db_s *bdb, const char *name);
+static void bob_read_instance(bob_db_s *bdb, sqlite3_stmt *stmt, Instance *inst);
 static int bob_dbload_ranges(Level *lvl, bob_db_s *bdb, const char *name);
 static int bob_dbload_lazy_instances(Level *lvl, Range *range, bob_db_s *bdb, 
 		int rangeId, PointerVector *pv);
 static Model *bob_dbload_model(bob_db_s *bdb, int modelID);
+static int bob_dbload_model_data(bob_db_s *bdb, Model *m, int modelID);
+static void bob_acquire_models(bob_db_s *bdb, Level *lvl);
+static void bob_acquire_model(bob_db_s *bdb, Level *lvl, Model *m);
+static void bob_unload_resource(void *data, resource_s *res);
 static void bob_dbload_mesh(bob_db_s *bdb, Model *m, int meshID);
 static int bob_dbload_program(bob_db_s *bdb, Model *m, int programID);
+static int bob_compile_program(bob_db_s *bdb, GlProgram *program, int programID);
 static int bob_dbload_texture(bob_db_s *bdb, Model *m, int textureID);
+static int bob_read_texture(bob_db_s *bdb, bob_texture_s *t, int textureID);
 static int bob_parse_vertices(FloatBuf *fbuf, const unsigned char *vertext);
+static int bob_parse_indices(GLuint **indices, GLsizei *count, const unsigned char *indext);
+static bool bob_uvs_fit_half(FloatBuf *fbuf, GLsizei vertexCount);
+static void bob_upload_vertices(Model *m, FloatBuf *fbuf, GLsizei vertexCount);
+static void bob_upload_indices(Model *m, GLuint *indices, GLsizei count);
 
 /** Range Partitioning **/
-static void bob_get_range_roots(PointerVector *ranges, PointerVector *result);
-static void bob_visit_range_for_model(PointerVector *rangeRoots, Range *range);
-static RangeRoot *ll_range_get_range_root(PointerVector *rangeRoots, Model *model);
-static void range_get_path(PointerVector *pv, Range *range);
-static void range_add_filtered_instances(Range *newRange, Range *oldRange, Model *m);
-static Range *createRangeClone(Range *range, Model *m, Range *parent);
-static void range_add_node_range(Range *range, Range *parent, Model *model, 
-    PointerVector *path, int index);
-static void range_add_node(RangeRoot *rangeRoot, PointerVector *path);
+static int bob_get_range_roots(Level *lvl, IntMap *rootMap, Range *range);
 /** **/
 
 /** misc **/
 static GLenum to_gl_shader(bob_shader_e shader_type);
+static GLenum to_gl_draw(bob_draw_e draw_type);
 
 
 bob_db_s *bob_loaddb(const char *path) {
@@ -106,6 +173,9 @@ bob_db_s *bob_loaddb(const char *path) {
 
 	bob_int_map_init(&bdb->models);
 	bob_int_map_init(&bdb->shaders);
+	bob_int_map_init(&bdb->programs);
+	bob_int_map_init(&bdb->textures);
+	resource_cache_init(&bdb->resources, RESOURCE_DEFAULT_BUDGET, bob_unload_resource, bdb);
 	rc = sqlite3_open_v2(path, &bdb->db, SQLITE_OPEN_READONLY, NULL);
 	if (rc != SQLITE_OK) {
 		log_error("error opening database");
@@ -113,6 +183,10 @@ bob_db_s *bob_loaddb(const char *path) {
 		return NULL;
 	}
 
+	rc = bob_dbconfigure(bdb);
+	if (rc < 0)
+		return NULL;
+
 	rc = prepare_queries(bdb);
 	if (rc) {
 		log_error("Failed to prepare queries");
@@ -121,6 +195,12 @@ bob_db_s *bob_loaddb(const char *path) {
 	return bdb;
 }
 
+/*
+ * Any number of levels can be loaded from the same database, sharing their
+ * models. Loading one binds the models' draw slots to its batches, so a 
+ * level loaded ahead of time leaves the one being played to be rebound 
+ * with indirect_bind.
+ */
 Level *bob_loadlevel(bob_db_s *bdb, const char *name) {
 	int rc, i;
 
@@ -129,10 +209,18 @@ Level *bob_loadlevel(bob_db_s *bdb, const char *name) {
 		log_error("failed to allocate memory for while loading level");
 		return NULL;
 	}
+	arena_init(&lvl->arena);
+	lvl->frameUbo = 0;
 
   lvl->renderBuffer.pos = 0;
+  lvl->renderItems = NULL;
+  lvl->nrenderItems = lvl->renderItemsCap = 0;
+  lvl->transparent = NULL;
+  lvl->ntransparent = lvl->transparentCap = 0;
+	if (phys_impulse_buffer_init(&lvl->impulses) < 0)
+		return NULL;
 
-	rc = bob_dbload_ambient_gravity(lvl, bdb, name);
+	rc = bob_dbload_properties(lvl, bdb, name);
 	if (rc < 0)
 		return NULL;
 
@@ -144,16 +232,160 @@ Level *bob_loadlevel(bob_db_s *bdb, const char *name) {
 	if (rc < 0)
 		return NULL;
 
+	lvl->stream = NULL;
+	if (lvl->cellSize > 0) {
+		if (bob_dbload_cell_models(bdb, lvl) < 0)
+			return NULL;
+		lvl->stream = stream_new(bdb, lvl);
+	}
+
+	lvl->occlusion = occlusion_new();
+
+	lvl->collisionGrid = coll_grid_new(coll_suggest_cell_size(lvl));
+	if (lvl->collisionGrid)
+		coll_grid_add_ranges(lvl->collisionGrid, lvl);
+
+	if (indirect_build(lvl) < 0)
+		log_error("failed to build indirect draw batches, drawing each model separately");
+
+	bob_acquire_models(bdb, lvl);
+	log_info("level %s uses %zu models, %zu bytes of GPU resources loaded", name, 
+			lvl->models.size, bdb->resources.bytes);
 	return lvl;
 }
 
+/*
+ * Frees a level and drops its references on models, which stay loaded for
+ * other levels until the resource budget needs their memory. The 
+ * simulation of the level must be stopped first. Instances, ranges and 
+ * the vectors holding them live in the level's arena and go with it in 
+ * one pass over its blocks; only subsystems owning GPU objects or heap 
+ * memory of their own are torn down separately.
+ */
+void bob_unloadlevel(bob_db_s *bdb, Level *lvl) {
+	size_t i;
+
+	indirect_free(lvl);
+	for (i = 0; i < lvl->models.size; i++)
+		bob_release_model(bdb, lvl->models.buffer[i]);
+	coll_grid_free(lvl->collisionGrid);
+	occlusion_free(lvl->occlusion);
+	phys_impulse_buffer_free(&lvl->impulses);
+	for (i = 0; i < lvl->ranges.size; i++) {
+		RangeRoot *rangeRoot = lvl->ranges.buffer[i];
+		free(rangeRoot->expanded);
+	}
+	free(lvl->renderItems);
+	free(lvl->transparent);
+	if (lvl->frameUbo)
+		glDeleteBuffers(1, &lvl->frameUbo);
+	log_debug("unloading level %d, %zu arena bytes", lvl->id, lvl->arena.bytes);
+	arena_free(&lvl->arena);
+	free(lvl);
+}
+
+/*
+ * Sets how much GPU memory unreferenced models, programs and textures 
+ * may keep before the least recently released ones are unloaded.
+ */
+void bob_set_resource_budget(bob_db_s *bdb, size_t bytes) {
+	resource_cache_set_budget(&bdb->resources, bytes);
+}
+
+/* GPU memory of every model, program and texture currently loaded */
+size_t bob_resource_bytes(bob_db_s *bdb) {
+	return bdb->resources.bytes;
+}
+
+/*
+ * Drops a reference taken when a level was loaded. The model stays 
+ * loaded until the budget needs its memory.
+ */
+void bob_release_model(bob_db_s *bdb, Model *m) {
+	resource_release(&bdb->resources, &m->res);
+}
+
+/*
+ * Takes one reference on every model the level can draw, including the
+ * ones only used by streamed cells which have empty groups by now.
+ */
+void bob_acquire_models(bob_db_s *bdb, Level *lvl) {
+	size_t i;
+
+	pointer_vector_init_arena(&lvl->models, &lvl->arena);
+	for (i = 0; i < lvl->instances.size; i++) {
+		InstanceGroup *ig = lvl->instances.buffer[i];
+		bob_acquire_model(bdb, lvl, ig->model);
+	}
+	for (i = 0; i < lvl->dynamics.size; i++) {
+		InstanceGroup *ig = lvl->dynamics.buffer[i];
+		bob_acquire_model(bdb, lvl, ig->model);
+	}
+	for (i = 0; i < lvl->ranges.size; i++) {
+		RangeRoot *rangeRoot = lvl->ranges.buffer[i];
+		bob_acquire_model(bdb, lvl, rangeRoot->m);
+	}
+}
+
+void bob_acquire_model(bob_db_s *bdb, Level *lvl, Model *m) {
+	size_t i;
+
+	if (!m)
+		return;
+	for (i = 0; i < lvl->models.size; i++) {
+		if (lvl->models.buffer[i] == m)
+			return;
+	}
+	resource_acquire(&bdb->resources, &m->res);
+	pointer_vector_add(&lvl->models, m);
+}
+
+/*
+ * Evicts a resource nothing references. The structs stay in the maps so 
+ * pointers to them stay valid and the next load fills them in again.
+ */
+void bob_unload_resource(void *data, resource_s *res) {
+	bob_db_s *bdb = data;
+	Model *m;
+	bob_program_s *p;
+	bob_texture_s *t;
+
+	switch (res->type) {
+		case RESOURCE_MODEL:
+			m = (Model *)((char *)res - offsetof(Model, res));
+			glDeleteVertexArrays(1, &m->vao);
+			glDeleteBuffers(1, &m->vbo);
+			glDeleteBuffers(1, &m->ebo);
+			glDeleteBuffers(1, &m->pvbo);
+			m->vao = m->vbo = m->ebo = m->pvbo = 0;
+			occluder_mesh_free(m->occluder);
+			m->occluder = NULL;
+			m->slot = NULL;
+			if (m->program)
+				resource_release(&bdb->resources, &((bob_program_s *)m->program)->res);
+			if (m->texture)
+				resource_release(&bdb->resources, &((bob_texture_s *)m->texture)->res);
+			m->program = NULL;
+			m->texture = NULL;
+			break;
+		case RESOURCE_PROGRAM:
+			p = (bob_program_s *)((char *)res - offsetof(bob_program_s, res));
+			gl_delete_program(&p->program);
+			break;
+		case RESOURCE_TEXTURE:
+			t = (bob_texture_s *)((char *)res - offsetof(bob_texture_s, res));
+			gl_delete_texture(&t->texture);
+			break;
+	}
+}
+
 int prepare_queries(bob_db_s *bdb) {
 	int rc;
 
-	rc = sqlite3_prepare_v2(bdb->db, level_ambient_gravity_qstr, -1, 
-			&bdb->qambientgravity, 0);
+	rc = sqlite3_prepare_v2(bdb->db, level_properties_qstr, -1, 
+			&bdb->qproperties, 0);
 	if (rc != SQLITE_OK) {
-		log_error("failed to prepare ambientGravity query");
+		log_error("failed to prepare level properties query");
 		return -1;
 	}
 	rc = sqlite3_prepare_v2(bdb->db, instance_qstr, -1, &bdb->qinstance, 0);
@@ -192,38 +424,88 @@ int prepare_queries(bob_db_s *bdb) {
 		return -1;
 	}
 	log_info("texture handle: %p", bdb->qtexture);
+	rc = sqlite3_prepare_v2(bdb->db, cell_qstr, -1, &bdb->qcells, 0);
+	if (rc != SQLITE_OK) {
+		log_error("failed to prepare cell query");
+		return -1;
+	}
+	rc = sqlite3_prepare_v2(bdb->db, cell_instance_qstr, -1, &bdb->qcellinstances, 0);
+	if (rc != SQLITE_OK) {
+		log_error("failed to prepare cell instance query");
+		return -1;
+	}
+	rc = sqlite3_prepare_v2(bdb->db, cell_model_qstr, -1, &bdb->qcellmodels, 0);
+	if (rc != SQLITE_OK) {
+		log_error("failed to prepare cell model query");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Applies BDB_PRAGMAS and checks the schema version. The loader's queries
+ * read columns older databases don't have, and the database is opened
+ * read only, so those are refused until level -d upgrades them.
+ */
+int bob_dbconfigure(bob_db_s *bdb) {
+	int rc;
+	sqlite3_stmt *stmt;
+
+	rc = sqlite3_exec(bdb->db, BDB_PRAGMAS, NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		log_error("failed to configure level database: %s", sqlite3_errmsg(bdb->db));
+		return -1;
+	}
+	rc = sqlite3_prepare_v2(bdb->db, "PRAGMA user_version", -1, &stmt, 0);
+	if (rc != SQLITE_OK) {
+		log_error("failed to prepare schema version query");
+		return -1;
+	}
+	bdb->version = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+	sqlite3_finalize(stmt);
+	if (bdb->version < BOB_SCHEMA_VERSION) {
+		log_error("level database has schema version %d, recompile it with level -d to upgrade to %d", 
+				bdb->version, BOB_SCHEMA_VERSION);
+		return -1;
+	}
 	return 0;
 }
 
-int bob_dbload_ambient_gravity(Level *lvl, bob_db_s *bdb, const char *name) {
+int bob_dbload_properties(Level *lvl, bob_db_s *bdb, const char *name) {
 	int rc;
 	double agx, agy, agz;
 
-	log_debug("loading ambient gravity");
+	log_debug("loading level properties");
 
-	rc = sqlite3_bind_text(bdb->qambientgravity, 1, name, -1, NULL);
+	rc = sqlite3_bind_text(bdb->qproperties, 1, name, -1, NULL);
 	if (rc != SQLITE_OK) {
 		log_error("failed to bind level name parameter to level query");
 		return -1;
 	}
-	rc = sqlite3_step(bdb->qambientgravity);
+	rc = sqlite3_step(bdb->qproperties);
 	if (rc == SQLITE_ROW) {
-		agx = sqlite3_column_double(bdb->qambientgravity, 0);
-		agy = sqlite3_column_double(bdb->qambientgravity, 1);
-		agz = sqlite3_column_double(bdb->qambientgravity, 2);
+		agx = sqlite3_column_double(bdb->qproperties, 0);
+		agy = sqlite3_column_double(bdb->qproperties, 1);
+		agz = sqlite3_column_double(bdb->qproperties, 2);
 		lvl->ambient_gravity[0] = agx;
 		lvl->ambient_gravity[1] = agy;
 		lvl->ambient_gravity[2] = agz;
+		lvl->integrator = sqlite3_column_int(bdb->qproperties, 3);
+		lvl->timestep = sqlite3_column_double(bdb->qproperties, 4);
+		lvl->id = sqlite3_column_int(bdb->qproperties, 5);
+		lvl->cellSize = sqlite3_column_double(bdb->qproperties, 6);
+		lvl->accumulator = 0.0;
 	}
 	else {
-		log_error("Databse error occurred during ambient gravity query.");
+		log_error("Databse error occurred during level properties query.");
 		return -1;
 	}
-	rc = sqlite3_step(bdb->qambientgravity);
+	rc = sqlite3_step(bdb->qproperties);
 	if (rc != SQLITE_DONE) {
-		log_error("Database in invalid format at ambient gravity query.");
+		log_error("Database in invalid format at level properties query.");
 		return -1;
 	}
+	sqlite3_reset(bdb->qproperties);
   return 0;
 }
 
@@ -238,55 +520,26 @@ int bob_dbload_instances(Level *lvl, bob_db_s *bdb, const char *name) {
 		return -1;
 	}
 
-	int modelID, levelID;
-	double vx, vy, vz, scalex, scaley, scalez, mass;
-	bool isSubjectToGravity, isStatic;
 	Instance *inst;
-	Model *model;
-	pointer_vector_init(&lvl->instances);
-	pointer_vector_init(&lvl->gravityObjects);
+	pointer_vector_init_arena(&lvl->instances, &lvl->arena);
+	pointer_vector_init_arena(&lvl->dynamics, &lvl->arena);
+	pointer_vector_init_arena(&lvl->gravityObjects, &lvl->arena);
 	while (1) {
 		rc = sqlite3_step(bdb->qinstance);
 		if (rc == SQLITE_ROW) {
-			modelID = sqlite3_column_int(bdb->qinstance, 0);
-			levelID = sqlite3_column_int(bdb->qinstance, 1);
-			vx = sqlite3_column_double(bdb->qinstance, 2);
-			vy = sqlite3_column_double(bdb->qinstance, 3);
-			vz = sqlite3_column_double(bdb->qinstance, 4);
-			scalex = sqlite3_column_double(bdb->qinstance, 5);
-			scaley = sqlite3_column_double(bdb->qinstance, 6);
-			scalez = sqlite3_column_double(bdb->qinstance, 7);
-			mass = sqlite3_column_double(bdb->qinstance, 8);
-			isSubjectToGravity = sqlite3_column_int(bdb->qinstance, 9);
-			isStatic = sqlite3_column_int(bdb->qinstance, 10);
-			model = bob_dbload_model(bdb, modelID);
-			inst = calloc(1, sizeof *inst);
+			inst = arena_calloc(&lvl->arena, sizeof *inst);
 			if (!inst) {
 				log_error("failed to allocate memory for instance");
 				return -1;
 			}
-			if (isSubjectToGravity) {
+			bob_read_instance(bdb, bdb->qinstance, inst);
+			if (inst->isSubjectToGravity) {
 				pointer_vector_add(&lvl->gravityObjects, inst);
 			}
-			inst->impulse = NULL;
-			inst->model = model;
-			inst->pos[0] = vx;
-			inst->pos[1] = vy;
-			inst->pos[2] = vz;
-			inst->scale[0] = scalex;
-			inst->scale[1] = scaley;
-			inst->scale[2] = scalez;
-			inst->mass = mass;
-			inst->isSubjectToGravity = isSubjectToGravity;
-			inst->isStatic = isStatic;
-			glm_vec3_zero(inst->velocity);
-			glm_vec3_zero(inst->acceleration);
-			glm_vec3_zero(inst->force);
-			inst->rotation[0] = 2;
-			inst->rotation[1] = 1;
-			inst->rotation[0] = 0;
-
-			instance_group_add(&lvl->instances, model, inst);
+			if (inst->isStatic)
+				instance_group_add(&lvl->instances, inst->model, inst);
+			else
+				instance_group_add(&lvl->dynamics, inst->model, inst);
 		}
 		else if (rc == SQLITE_DONE) {
 			break;
@@ -300,15 +553,140 @@ int bob_dbload_instances(Level *lvl, bob_db_s *bdb, const char *name) {
 	return 0;
 }
 
+/*
+ * Fills in inst from the current row of an instance query, both the level 
+ * and the cell queries select the same columns.
+ */
+void bob_read_instance(bob_db_s *bdb, sqlite3_stmt *stmt, Instance *inst) {
+	inst->model = bob_dbload_model(bdb, sqlite3_column_int(stmt, 0));
+	inst->pos[0] = sqlite3_column_double(stmt, 2);
+	inst->pos[1] = sqlite3_column_double(stmt, 3);
+	inst->pos[2] = sqlite3_column_double(stmt, 4);
+	inst->scale[0] = sqlite3_column_double(stmt, 5);
+	inst->scale[1] = sqlite3_column_double(stmt, 6);
+	inst->scale[2] = sqlite3_column_double(stmt, 7);
+	inst->mass = sqlite3_column_double(stmt, 8);
+	inst->isSubjectToGravity = sqlite3_column_int(stmt, 9);
+	inst->isStatic = sqlite3_column_int(stmt, 10);
+	glm_vec3_zero(inst->velocity);
+	glm_vec3_zero(inst->acceleration);
+	glm_vec3_zero(inst->force);
+	inst->rotation[0] = sqlite3_column_double(stmt, 11);
+	inst->rotation[1] = sqlite3_column_double(stmt, 12);
+	inst->rotation[2] = sqlite3_column_double(stmt, 13);
+}
+
+/*
+ * Calls visit for every cell of the level whose bounds overlap min, max.
+ */
+int bob_dbquery_cells(bob_db_s *bdb, int levelID, vec3 min, vec3 max, 
+		bob_cell_visit_fn visit, void *data) {
+	int i, rc;
+	vec3 cmin, cmax;
+
+	rc = sqlite3_bind_int(bdb->qcells, 1, levelID);
+	for (i = 0; i < 3 && rc == SQLITE_OK; i++) {
+		rc = sqlite3_bind_double(bdb->qcells, 2 + 2*i, min[i]);
+		if (rc == SQLITE_OK)
+			rc = sqlite3_bind_double(bdb->qcells, 3 + 2*i, max[i]);
+	}
+	if (rc != SQLITE_OK) {
+		log_error("failed to bind parameters to cell query");
+		sqlite3_reset(bdb->qcells);
+		return -1;
+	}
+	while ((rc = sqlite3_step(bdb->qcells)) == SQLITE_ROW) {
+		for (i = 0; i < 3; i++) {
+			cmin[i] = sqlite3_column_double(bdb->qcells, 1 + i);
+			cmax[i] = sqlite3_column_double(bdb->qcells, 4 + i);
+		}
+		visit(data, sqlite3_column_int(bdb->qcells, 0), cmin, cmax, 
+				sqlite3_column_int(bdb->qcells, 7));
+	}
+	sqlite3_reset(bdb->qcells);
+	if (rc != SQLITE_DONE) {
+		log_error("Unexpected result from database cell query: %d", rc);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Loads the instances of a cell into out. Instances are taken from pool 
+ * when it has any so unloaded cells' instances are reused, new ones are
+ * allocated in arena.
+ */
+int bob_dbload_cell(bob_db_s *bdb, int cellID, PointerVector *out, PointerVector *pool, 
+		Arena *arena) {
+	int rc;
+	Instance *inst;
+
+	rc = sqlite3_bind_int(bdb->qcellinstances, 1, cellID);
+	if (rc != SQLITE_OK) {
+		log_error("failed to bind cellID parameter to cell instance query");
+		return -1;
+	}
+	while ((rc = sqlite3_step(bdb->qcellinstances)) == SQLITE_ROW) {
+		if (pool->size) {
+			inst = pool->buffer[--pool->size];
+		}
+		else {
+			inst = arena_calloc(arena, sizeof *inst);
+			if (!inst) {
+				log_error("failed to allocate memory for instance");
+				sqlite3_reset(bdb->qcellinstances);
+				return -1;
+			}
+		}
+		bob_read_instance(bdb, bdb->qcellinstances, inst);
+		inst->isSleeping = false;
+		inst->restSteps = 0;
+		inst->collisionBody = NULL;
+		pointer_vector_add(out, inst);
+	}
+	sqlite3_reset(bdb->qcellinstances);
+	if (rc != SQLITE_DONE) {
+		log_error("Unexpected result from database cell instance query: %d", rc);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Loads every model used by the streamed instances of a level up front, 
+ * with an empty instance group each, so streaming never uploads meshes 
+ * and the models can be batched like the resident ones.
+ */
+int bob_dbload_cell_models(bob_db_s *bdb, Level *lvl) {
+	int rc;
+	Model *model;
+
+	rc = sqlite3_bind_int(bdb->qcellmodels, 1, lvl->id);
+	if (rc != SQLITE_OK) {
+		log_error("failed to bind levelID parameter to cell model query");
+		return -1;
+	}
+	while ((rc = sqlite3_step(bdb->qcellmodels)) == SQLITE_ROW) {
+		model = bob_dbload_model(bdb, sqlite3_column_int(bdb->qcellmodels, 0));
+		if (model)
+			instance_group_get(&lvl->instances, model);
+	}
+	sqlite3_reset(bdb->qcellmodels);
+	if (rc != SQLITE_DONE) {
+		log_error("Unexpected result from database cell model query: %d", rc);
+		return -1;
+	}
+	return 0;
+}
+
 int bob_dbload_ranges(Level *lvl, bob_db_s *bdb, const char *name) {
 	int i, rc;
 	int steps, modelId, rangeId, childId;
 	const unsigned char *var;
 	bool cache;
 	Range *range;
-	IntMap rangeMap;
+	IntMap rangeMap, rootMap;
 	PointerVector loadRanges;
-  PointerVector rangeRoots;
 
 	rc = sqlite3_bind_text(bdb->qrange, 1, name, -1, NULL);
 	if (rc != SQLITE_OK) {
@@ -328,7 +706,7 @@ int bob_dbload_ranges(Level *lvl, bob_db_s *bdb, const char *name) {
 			cache = sqlite3_column_int(bdb->qrange, 3);
 			childId = sqlite3_column_int(bdb->qrange, 4);
 
-			range = calloc(1, sizeof *range);
+			range = arena_calloc(&lvl->arena, sizeof *range);
 			if (!range) {
 				log_error("failed to allocate memory for range");
 				return -1;
@@ -375,23 +753,28 @@ int bob_dbload_ranges(Level *lvl, bob_db_s *bdb, const char *name) {
 	bob_int_map_free(&rangeMap);
 
 	/* Assign root ranges to ranges vector */
-  pointer_vector_init(&rangeRoots);
+	pointer_vector_init_arena(&lvl->rangeTrees, &lvl->arena);
 	for (i = 0; i < loadRanges.size; i++) {
 		Range *curr = loadRanges.buffer[i];
 		if (!curr->parent) {
-			pointer_vector_add(&rangeRoots, curr);
+			pointer_vector_add(&lvl->rangeTrees, curr);
 		}
 	}
 	pointer_vector_free(&loadRanges);
 
-  /* Partition Ranges (testing) */
-	pointer_vector_init(&lvl->ranges);
-  bob_get_range_roots(&rangeRoots, &lvl->ranges);
-  pointer_vector_free(&rangeRoots);
-
-  for (i = 0; i < lvl->ranges.size; i++) {
-    log_info("range partition: %p", lvl->ranges.buffer[i]);
-  }
+	pointer_vector_init_arena(&lvl->ranges, &lvl->arena);
+	bob_int_map_init(&rootMap);
+	for (i = 0; i < lvl->rangeTrees.size; i++) {
+		if (bob_get_range_roots(lvl, &rootMap, lvl->rangeTrees.buffer[i]) < 0) {
+			bob_int_map_free(&rootMap);
+			return -1;
+		}
+	}
+	bob_int_map_free(&rootMap);
+	if (lazy_ranges_compile(lvl) < 0)
+		return -1;
+	lazy_ranges_expand(lvl);
+	log_info("%zu range trees drawing %zu models", lvl->rangeTrees.size, lvl->ranges.size);
 
 	return 0;
 }
@@ -399,13 +782,15 @@ int bob_dbload_ranges(Level *lvl, bob_db_s *bdb, const char *name) {
 int bob_dbload_lazy_instances(Level *lvl, Range *range, bob_db_s *bdb, 
 		int rangeID, PointerVector *pv) {
 	int rc, id, modelID;
-	const unsigned char *vx, *vy, *vz, *scalex, *scaley, *scalez;
+	const unsigned char *vx, *vy, *vz, *scalex, *scaley, *scalez, *rotx, *roty, *rotz;
+	const void *baked;
+	size_t bakedsize;
 	float mass;
 	bool isSubjectToGravity, isStatic;
 	Model *model;
 	LazyInstance *li;
 
-	pointer_vector_init(&range->lazyinstances);
+	pointer_vector_init_arena(&range->lazyinstances, &lvl->arena);
 
 	rc = sqlite3_bind_int(bdb->qlazyinstance, 1, rangeID);
 	if (rc != SQLITE_OK) {
@@ -428,19 +813,37 @@ int bob_dbload_lazy_instances(Level *lvl, Range *range, bob_db_s *bdb,
 			mass = sqlite3_column_double(bdb->qlazyinstance, 8);
 			isSubjectToGravity = sqlite3_column_int(bdb->qlazyinstance, 9);
 			isStatic = sqlite3_column_int(bdb->qlazyinstance, 10);
+			rotx = sqlite3_column_text(bdb->qlazyinstance, 11);
+			roty = sqlite3_column_text(bdb->qlazyinstance, 12);
+			rotz = sqlite3_column_text(bdb->qlazyinstance, 13);
+			baked = sqlite3_column_blob(bdb->qlazyinstance, 14);
+			bakedsize = sqlite3_column_bytes(bdb->qlazyinstance, 14);
 
-			li = malloc(sizeof *li);
+			li = arena_calloc(&lvl->arena, sizeof *li);
 			if (!li) {
 				log_error("memory allocation error for new lazy instance");
 				return -1;
 			}
+			li->baked = NULL;
+			li->nbaked = bakedsize / (BOB_BAKED_STRIDE * sizeof *li->baked);
+			if (li->nbaked) {
+				li->baked = arena_alloc(&lvl->arena, bakedsize);
+				if (!li->baked) {
+					log_error("memory allocation error for baked lazy instance");
+					return -1;
+				}
+				memcpy(li->baked, baked, bakedsize);
+			}
       li->id = id;
-			li->px = bob_dup_str((const char *)vx);
-			li->py = bob_dup_str((const char *)vy);
-			li->pz = bob_dup_str((const char *)vz);
-			li->scalex = bob_dup_str((const char *)scalex);
-			li->scaley = bob_dup_str((const char *)scaley);
-			li->scalez = bob_dup_str((const char *)scalez);
+			li->px = arena_dup_str(&lvl->arena, (const char *)vx);
+			li->py = arena_dup_str(&lvl->arena, (const char *)vy);
+			li->pz = arena_dup_str(&lvl->arena, (const char *)vz);
+			li->scalex = arena_dup_str(&lvl->arena, (const char *)scalex);
+			li->scaley = arena_dup_str(&lvl->arena, (const char *)scaley);
+			li->scalez = arena_dup_str(&lvl->arena, (const char *)scalez);
+			li->rotx = arena_dup_str(&lvl->arena, (const char *)rotx);
+			li->roty = arena_dup_str(&lvl->arena, (const char *)roty);
+			li->rotz = arena_dup_str(&lvl->arena, (const char *)rotz);
 			li->mass = mass;
 			li->isSubjectToGravity = isSubjectToGravity;
 			li->isStatic = isStatic;
@@ -449,9 +852,7 @@ int bob_dbload_lazy_instances(Level *lvl, Range *range, bob_db_s *bdb,
 			glm_vec3_zero(li->velocity);
 			glm_vec3_zero(li->acceleration);
 			glm_vec3_zero(li->force);
-			li->rotation[0] = 0;
-			li->rotation[1] = 0;
-			li->rotation[2] = 0;
+			glm_vec3_zero(li->rotation);
 
       log_info("added %s", li->px);
       pointer_vector_add(&range->lazyinstances, li);
@@ -469,28 +870,55 @@ int bob_dbload_lazy_instances(Level *lvl, Range *range, bob_db_s *bdb,
 	return 0;
 }
 
+/*
+ * Returns the model, loading it if it was never loaded or was evicted 
+ * since. Evicted models are reloaded into the same struct.
+ */
 Model *bob_dbload_model(bob_db_s *bdb, int modelID) {
-	int rc;
 	Model *m;
 
 	m = bob_int_map_get(&bdb->models, modelID);
-	if (m)
+	if (m && m->res.resident)
 		return m;
-	m = malloc(sizeof *m);
 	if (!m) {
-		log_error("Error allocating memory for model");
-		return NULL;
+		m = malloc(sizeof *m);
+		if (!m) {
+			log_error("Error allocating memory for model");
+			return NULL;
+		}
+		resource_init(&m->res, RESOURCE_MODEL, modelID);
+		bob_int_map_insert(&bdb->models, modelID, m);
 	}
+	if (bob_dbload_model_data(bdb, m, modelID) < 0)
+		return NULL;
+	resource_loaded(&bdb->resources, &m->res);
+	return m;
+}
+
+int bob_dbload_model_data(bob_db_s *bdb, Model *m, int modelID) {
+	int rc;
 
+	m->program = NULL;
+	m->texture = NULL;
+	m->vao = m->vbo = m->ebo = m->pvbo = 0;
 	m->drawType = GL_TRIANGLE_STRIP;
-	//m->drawType = GL_LINE_LOOP;
+	m->vertexStride = 0;
+	m->slot = NULL;
+	m->occluder = NULL;
+	m->transparent = false;
+	m->nearest = 0;
+	m->lastNearest = 0;
 	m->drawStart = 0;
-	m->drawCount = 6*2*3;
+	m->drawCount = 0;
+	m->indexType = GL_NONE;
+	m->res.bytes = 0;
+	glm_vec3_zero(m->bboxMin);
+	glm_vec3_zero(m->bboxMax);
 	log_debug("loading model %d", modelID);
 	rc = sqlite3_bind_int(bdb->qmodel, 1, modelID);
 	if (rc != SQLITE_OK) {
 		log_error("failed to bind modelID parameter to model query");
-		return NULL;
+		return -1;
 	}
 
 	int meshID, programID, textureID, hasUV;
@@ -500,6 +928,7 @@ Model *bob_dbload_model(bob_db_s *bdb, int modelID) {
 		programID = sqlite3_column_int(bdb->qmodel, 1);
 		textureID = sqlite3_column_int(bdb->qmodel, 2);
 		hasUV = sqlite3_column_int(bdb->qmodel, 3);
+		m->transparent = sqlite3_column_int(bdb->qmodel, 4);
 		bob_dbload_program(bdb, m, programID);
 		bob_dbload_mesh(bdb, m, meshID);
 		bob_dbload_texture(bdb, m, textureID);
@@ -507,67 +936,84 @@ Model *bob_dbload_model(bob_db_s *bdb, int modelID) {
 	rc = sqlite3_step(bdb->qmodel);
 	if (rc != SQLITE_DONE) {
 		log_error("Database in invalid format");
-		return NULL;
+		return -1;
 	}
 	sqlite3_reset(bdb->qmodel);
-	bob_int_map_insert(&bdb->models, modelID, m);
-	return m;
+	return 0;
 }
 
 void bob_dbload_mesh(bob_db_s *bdb, Model *m, int meshID) {
 	int rc;
-	GLint handle;
-	CharBuf mbuf;   
+	GLsizei vertexCount, indexCount;
+	GLuint *indices = NULL;
 	FloatBuf fbuf;
 
 	log_debug("Loading mesh %d", meshID);
-	char_buf_init(&mbuf);
 
 	rc = sqlite3_bind_int(bdb->qmesh, 1, meshID);
 	if (rc != SQLITE_OK) {
 		log_error("failed to bind meshID parameter to mesh query");
 		return;
 	}
-	const unsigned char *name, *data;
+	const unsigned char *name, *data, *indext;
 	rc = sqlite3_step(bdb->qmesh);
 	if (rc == SQLITE_ROW) {
 		name = sqlite3_column_text(bdb->qmesh, 0);
 		data = sqlite3_column_text(bdb->qmesh, 1);
-		log_info("loaded mesh of name %s with data %s", name, data);
+		indext = sqlite3_column_text(bdb->qmesh, 2);
+		vertexCount = sqlite3_column_int(bdb->qmesh, 3);
+		m->drawType = to_gl_draw(sqlite3_column_int(bdb->qmesh, 4));
+		log_info("loaded mesh of name %s", name);
 		bob_parse_vertices(&fbuf, data);
 
-		glGenBuffers(1, &m->vbo);
-		glGenVertexArrays(1, &m->vao);
+		if (fbuf.size % BOB_VERTEX_STRIDE) {
+			log_error("mesh %s has %zu floats, which is not a multiple of %d", 
+					name, fbuf.size, BOB_VERTEX_STRIDE);
+		}
+		if (vertexCount <= 0 || vertexCount * BOB_VERTEX_STRIDE > fbuf.size) {
+			if (vertexCount > 0) {
+				log_error("mesh %s declares %d vertices but only has data for %zu", 
+						name, vertexCount, fbuf.size / BOB_VERTEX_STRIDE);
+			}
+			vertexCount = fbuf.size / BOB_VERTEX_STRIDE;
+		}
+		m->drawCount = vertexCount;
+		model_compute_bounds(m, fbuf.buffer, vertexCount);
 
+		glGenVertexArrays(1, &m->vao);
 		glBindVertexArray(m->vao);
-		glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
-		glBufferData(GL_ARRAY_BUFFER, fbuf.size * sizeof(GLfloat), fbuf.buffer, 
-				GL_STATIC_DRAW);
 
-		handle = gl_shader_attrib(m->program, "vert");
-		glEnableVertexAttribArray(handle);
-		glVertexAttribPointer(handle, 3, GL_FLOAT, GL_FALSE, 5*sizeof(GLfloat), 
-				NULL);
-
-		handle = gl_shader_attrib(m->program, "vertexCoord");
-		glEnableVertexAttribArray(handle);
-		glVertexAttribPointer(handle, 2, GL_FLOAT, GL_TRUE, 5*sizeof(GLfloat), 
-				(const GLvoid *)(3*sizeof(GLfloat)));
+		bob_upload_vertices(m, &fbuf, vertexCount);
+
+		if (indext && *indext) {
+			rc = bob_parse_indices(&indices, &indexCount, indext);
+			if (!rc) {
+				rc = 0;
+				for (GLsizei i = 0; i < indexCount; i++) {
+					if (indices[i] >= vertexCount) {
+						log_error("mesh %s has index %u out of range", name, indices[i]);
+						rc = -1;
+						break;
+					}
+				}
+				if (!rc) {
+					bob_upload_indices(m, indices, indexCount);
+				}
+			}
+		}
+		m->occluder = occluder_mesh_new(fbuf.buffer, BOB_VERTEX_STRIDE, vertexCount, 
+				m->ebo ? indices : NULL, m->drawType, m->drawStart, m->drawCount);
+		free(indices);
 
+    /* storage is only allocated once the model is drawn directly, counted up front */
     glGenBuffers(1, &m->pvbo);
+    m->res.bytes += RENDER_BUFFER_SIZE * sizeof(InstanceAttrib);
     glBindBuffer(GL_ARRAY_BUFFER, m->pvbo);
-    handle = gl_shader_attrib(m->program, "pos");
-    glEnableVertexAttribArray(handle);
-    glVertexAttribPointer(handle, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-    glVertexAttribDivisor(handle, 1);
-
-    handle = gl_shader_attrib(m->program, "scale");
-    glEnableVertexAttribArray(handle);
-    glVertexAttribPointer(handle, 3, GL_FLOAT, GL_FALSE, 0, (void *)(RENDER_BUFFER_SIZE * sizeof(vec3)));
-    glVertexAttribDivisor(handle, 1);
+    bob_instance_attribs(m->program);
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
+		float_buf_free(&fbuf);
 	}
 	rc = sqlite3_step(bdb->qmesh);
 	if (rc != SQLITE_DONE) {
@@ -575,16 +1021,198 @@ void bob_dbload_mesh(bob_db_s *bdb, Model *m, int meshID) {
 		return;
 	}
 	sqlite3_reset(bdb->qmesh);
-	//bob_int_map_insert(&bdb->models, meshID, m);
-	char_buf_free(&mbuf);
-	float_buf_free(&fbuf);
 }
 
-//TODO: deal with memory leaks
+/*
+ * Uploads the interleaved x,y,z,u,v data of a mesh. Texture coordinates
+ * are stored as half floats when that doesn't lose precision, which 
+ * shrinks each vertex from 20 to 16 bytes.
+ */
+void bob_upload_vertices(Model *m, FloatBuf *fbuf, GLsizei vertexCount) {
+	GLsizei i;
+
+	glGenBuffers(1, &m->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, m->vbo);
+
+	if (bob_uvs_fit_half(fbuf, vertexCount)) {
+		bob_packed_vertex_s *packed = malloc(vertexCount * sizeof *packed);
+		if (!packed) {
+			log_error("failed to allocate memory for packed mesh");
+			return;
+		}
+		for (i = 0; i < vertexCount; i++) {
+			GLfloat *v = &fbuf->buffer[i * BOB_VERTEX_STRIDE];
+			packed[i].pos[0] = v[0];
+			packed[i].pos[1] = v[1];
+			packed[i].pos[2] = v[2];
+			packed[i].uv[0] = pack_half(v[3]);
+			packed[i].uv[1] = pack_half(v[4]);
+		}
+		glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof *packed, packed, 
+				GL_STATIC_DRAW);
+		free(packed);
+		m->res.bytes += vertexCount * sizeof *packed;
+
+		m->vertexStride = sizeof(bob_packed_vertex_s);
+	}
+	else {
+		glBufferData(GL_ARRAY_BUFFER, vertexCount * BOB_VERTEX_STRIDE * sizeof(GLfloat), 
+				fbuf->buffer, GL_STATIC_DRAW);
+		m->res.bytes += vertexCount * BOB_VERTEX_STRIDE * sizeof(GLfloat);
+		m->vertexStride = BOB_VERTEX_STRIDE * sizeof(GLfloat);
+	}
+	bob_vertex_attribs(m->program, m->vertexStride);
+}
+
+/*
+ * Points the mesh attributes of program at the vertex buffer bound to 
+ * GL_ARRAY_BUFFER. Vertices of stride sizeof(bob_packed_vertex_s) have
+ * half float texture coordinates.
+ */
+void bob_vertex_attribs(GlProgram *program, GLsizei stride) {
+	GLint handle;
+
+	handle = gl_shader_attrib(program, "vert");
+	glEnableVertexAttribArray(handle);
+	glVertexAttribPointer(handle, 3, GL_FLOAT, GL_FALSE, stride, NULL);
+
+	handle = gl_shader_attrib(program, "vertexCoord");
+	glEnableVertexAttribArray(handle);
+	if (stride == sizeof(bob_packed_vertex_s)) {
+		glVertexAttribPointer(handle, 2, GL_HALF_FLOAT, GL_FALSE, stride, 
+				(const GLvoid *)offsetof(bob_packed_vertex_s, uv));
+	}
+	else {
+		glVertexAttribPointer(handle, 2, GL_FLOAT, GL_TRUE, stride, 
+				(const GLvoid *)(3*sizeof(GLfloat)));
+	}
+}
+
+/*
+ * Points the per-instance attributes of program at the InstanceAttrib 
+ * buffer bound to GL_ARRAY_BUFFER.
+ */
+void bob_instance_attribs(GlProgram *program) {
+	GLint handle;
+
+	handle = gl_shader_attrib(program, "pos");
+	glEnableVertexAttribArray(handle);
+	glVertexAttribPointer(handle, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceAttrib), 
+			(void *)offsetof(InstanceAttrib, pos));
+	glVertexAttribDivisor(handle, 1);
+
+	handle = gl_shader_attrib(program, "scale");
+	glEnableVertexAttribArray(handle);
+	glVertexAttribPointer(handle, 3, GL_HALF_FLOAT, GL_FALSE, sizeof(InstanceAttrib), 
+			(void *)offsetof(InstanceAttrib, scale));
+	glVertexAttribDivisor(handle, 1);
+
+	/* shaders written before instances could be rotated don't declare it */
+	handle = glGetAttribLocation(program->handle, "rotation");
+	if (handle != -1) {
+		glEnableVertexAttribArray(handle);
+		glVertexAttribPointer(handle, 3, GL_SHORT, GL_TRUE, sizeof(InstanceAttrib), 
+				(void *)offsetof(InstanceAttrib, rotation));
+		glVertexAttribDivisor(handle, 1);
+	}
+}
+
+/*
+ * Creates the element buffer for an indexed mesh; must be called with
+ * the model's vertex array bound so the binding is recorded in it.
+ * Indices are narrowed to 16 bits whenever every index fits.
+ */
+void bob_upload_indices(Model *m, GLuint *indices, GLsizei count) {
+	GLsizei i;
+	GLuint max = 0;
+
+	for (i = 0; i < count; i++) {
+		if (indices[i] > max)
+			max = indices[i];
+	}
+
+	glGenBuffers(1, &m->ebo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ebo);
+	if (max <= 0xffff) {
+		GLushort *shorts = malloc(count * sizeof *shorts);
+		if (!shorts) {
+			log_error("failed to allocate memory for mesh indices");
+			glDeleteBuffers(1, &m->ebo);
+			m->ebo = 0;
+			return;
+		}
+		for (i = 0; i < count; i++)
+			shorts[i] = indices[i];
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * sizeof *shorts, shorts, 
+				GL_STATIC_DRAW);
+		free(shorts);
+		m->indexType = GL_UNSIGNED_SHORT;
+		m->res.bytes += count * sizeof(GLushort);
+	}
+	else {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, count * sizeof *indices, indices, 
+				GL_STATIC_DRAW);
+		m->indexType = GL_UNSIGNED_INT;
+		m->res.bytes += count * sizeof(GLuint);
+	}
+	m->drawCount = count;
+}
+
+bool bob_uvs_fit_half(FloatBuf *fbuf, GLsizei vertexCount) {
+	GLsizei i;
+
+	for (i = 0; i < vertexCount; i++) {
+		GLfloat *uv = &fbuf->buffer[i * BOB_VERTEX_STRIDE + 3];
+		if (fabsf(unpack_half(pack_half(uv[0])) - uv[0]) > BDB_HALF_UV_EPSILON)
+			return false;
+		if (fabsf(unpack_half(pack_half(uv[1])) - uv[1]) > BDB_HALF_UV_EPSILON)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Points m at its program, compiling it if no loaded model uses it yet. 
+ * Models sharing a program share its GlProgram so they can be batched, 
+ * and each holds a reference on it.
+ */
 int bob_dbload_program(bob_db_s *bdb, Model *m, int programID) {
+	bool created = false;
+	bob_program_s *p;
+
+	p = bob_int_map_get(&bdb->programs, programID);
+	if (!p) {
+		p = malloc(sizeof *p);
+		if (!p) {
+			log_error("failed to allocate memory for program");
+			return -1;
+		}
+		resource_init(&p->res, RESOURCE_PROGRAM, programID);
+		created = true;
+	}
+	if (!p->res.resident) {
+		if (bob_compile_program(bdb, &p->program, programID) < 0) {
+			if (created)
+				free(p);
+			return -1;
+		}
+		resource_loaded(&bdb->resources, &p->res);
+	}
+	if (created)
+		bob_int_map_insert(&bdb->programs, programID, p);
+	resource_acquire(&bdb->resources, &p->res);
+	m->program = &p->program;
+	return 0;
+}
+
+/*
+ * Compiles and links the shaders of a program. The shader objects are 
+ * deleted once linked, the program keeps what it needs of them.
+ */
+int bob_compile_program(bob_db_s *bdb, GlProgram *program, int programID) {
 	int rc;
+	size_t i;
 	GlShader *shader;
-	GlProgram *program = malloc(sizeof *program);
 	PointerVector pv;
 
 	rc = sqlite3_bind_int(bdb->qshader, 1, programID);
@@ -613,32 +1241,69 @@ int bob_dbload_program(bob_db_s *bdb, Model *m, int programID) {
 			rc = gl_load_shader(shader, gl_type, src, (const char *)name);
 			if (rc != STATUS_OK) {
 				log_error("failed to load shader: %s.", name);
-				return -1;
+				free(shader);
+				rc = -1;
+				break;
 			}
 			log_info("ready %s - %d - %s", name, gl_type, src);
 			pointer_vector_add(&pv, shader);
 		}
 		else if (rc == SQLITE_DONE) {
-			gl_create_program(program, pv);
-			m->program = program;
+			rc = gl_create_program(program, pv) == STATUS_OK ? 0 : -1;
 			break;
 		}
 		else {
 			log_error("Unexpected result from database shader query: %d\n", rc);
-			return -1;
+			rc = -1;
+			break;
 		}
 	}
 	sqlite3_reset(bdb->qshader);
+	for (i = 0; i < pv.size; i++) {
+		shader = pv.buffer[i];
+		gl_delete_shader(shader);
+		free(shader);
+	}
 	pointer_vector_free(&pv);
-	return 0;
+	return rc;
 }
 
-
-//TODO: deal with memory leaks
+/*
+ * Points m at its texture, reading it if no loaded model uses it yet.
+ */
 int bob_dbload_texture(bob_db_s *bdb, Model *m, int textureID) {
+	bool created = false;
+	bob_texture_s *t;
+
+	t = bob_int_map_get(&bdb->textures, textureID);
+	if (!t) {
+		t = malloc(sizeof *t);
+		if (!t) {
+			log_error("memory allocation error");
+			return -1;
+		}
+		resource_init(&t->res, RESOURCE_TEXTURE, textureID);
+		created = true;
+	}
+	if (!t->res.resident) {
+		if (bob_read_texture(bdb, t, textureID) < 0) {
+			if (created)
+				free(t);
+			return -1;
+		}
+		resource_loaded(&bdb->resources, &t->res);
+	}
+	if (created)
+		bob_int_map_insert(&bdb->textures, textureID, t);
+	resource_acquire(&bdb->resources, &t->res);
+	m->texture = &t->texture;
+	return 0;
+}
+
+int bob_read_texture(bob_db_s *bdb, bob_texture_s *t, int textureID) {
 	int rc;
-	GlTexture *texture;
 	const unsigned char *path;
+	Png *png = &t->texture.png;
 
 	rc = sqlite3_bind_int(bdb->qtexture, 1, textureID);
 	if (rc != SQLITE_OK) {
@@ -649,15 +1314,16 @@ int bob_dbload_texture(bob_db_s *bdb, Model *m, int textureID) {
 	if (rc == SQLITE_ROW) {
 		path = sqlite3_column_text(bdb->qtexture, 0);
 		log_info("selected path: %s using id: %d", path, textureID);
-		texture = malloc(sizeof *texture);
-		if (!texture) {
-			log_error("memory allocation error");
+		if (gl_load_texture(&t->texture, (const char *)path) != STATUS_OK) {
+			sqlite3_reset(bdb->qtexture);
+			return -1;
 		}
-		gl_load_texture(texture, (const char *)path);
-		m->texture = texture;
+		t->res.bytes = (size_t)png->width * png->height * 
+			(png->color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4 : 3);
 	}
 	else {
 		log_error("unexpected result from texture query: %d", rc);
+		sqlite3_reset(bdb->qtexture);
 		return -1;
 	}
 	rc = sqlite3_step(bdb->qtexture);
@@ -670,9 +1336,8 @@ int bob_dbload_texture(bob_db_s *bdb, Model *m, int textureID) {
 }
 
 int bob_parse_vertices(FloatBuf *fbuf, const unsigned char *vertext) {
-	unsigned char buf[BDB_VERTEXT_BUF], 
-								*bptr = buf;
-	const unsigned char *fptr = vertext;
+	const char *fptr = (const char *)vertext;
+	char *end;
 	GLfloat num;
 
 	float_buf_init(fbuf);
@@ -682,49 +1347,15 @@ int bob_parse_vertices(FloatBuf *fbuf, const unsigned char *vertext) {
 			case '\t':
 			case '\n':
 			case '\r':
-				fptr++;
-				break;
 			case ',':
 				fptr++;
 				break;
 			default:
-				if (*fptr == '-')
-					*bptr++ = *fptr++;
-				if (isdigit(*fptr)) {
-					do {
-						if (bptr - buf < BDB_VERTEXT_BUF - 1) {
-							*bptr++ = *fptr++;
-						}
-						else {
-							log_error("Number in mesh vertices too long");
-							return -1;
-						}
-					} while (isdigit(*fptr));
-
-					if (*fptr == '.') {
-						if (bptr - buf < BDB_VERTEXT_BUF - 1) {
-							*bptr++ = *fptr++;
-							if (isdigit(*fptr)) {
-								do {
-									if (bptr - buf < BDB_VERTEXT_BUF - 1) {
-										*bptr++ = *fptr++;
-									}
-									else {
-										log_error("Number in mesh vertices too long");
-										return -1;
-									}
-								} while (isdigit(*fptr));
-							}
-						}
-						else {
-							log_error("Number in mesh vertices too long");
-							return -1;
-						}
-					}
-					*bptr = '\0';
-					num = atof((const char*)buf);
+				/* the compiler writes the shortest round-trip form, which may use an exponent */
+				num = strtof(fptr, &end);
+				if (end != fptr) {
 					float_add_f(fbuf, num);
-					bptr = buf;
+					fptr = end;
 				}
 				else {
 					log_error("invalid character in mesh data: %c", *fptr);
@@ -736,126 +1367,75 @@ int bob_parse_vertices(FloatBuf *fbuf, const unsigned char *vertext) {
 	return 0;
 }
 
-void bob_get_range_roots(PointerVector *ranges, PointerVector *result) {
-  int i, j;
-  for (i = 0; i < ranges->size; i++) {
-    Range *currRange = ranges->buffer[i];
-	  bob_visit_range_for_model(result, currRange);
-  }
-}
+int bob_parse_indices(GLuint **indices, GLsizei *count, const unsigned char *indext) {
+	const char *fptr = (const char *)indext;
+	char *end;
+	size_t size = 0, buf_size = INIT_VECTOR_BUF_SIZE;
+	GLuint *buffer = malloc(buf_size * sizeof *buffer);
 
-void bob_visit_range_for_model(PointerVector *rangeRoots, Range *range) {
-	size_t i;
-	for (i = 0; i < range->lazyinstances.size; i++) {
-		LazyInstance *li = range->lazyinstances.buffer[i];
-    Model *model = li->model;
-    PointerVector rangePath;
-    RangeRoot *rangeRoot = ll_range_get_range_root(rangeRoots, li->model);
-    if (!rangeRoot) {
-      log_debug("creating new range root for model: %p", li->model);
-      rangeRoot = malloc(sizeof *rangeRoot);
-      if (!rangeRoot) {
-        log_error("error allocating memory for Rangeroot");
-        return;
-      }
-      rangeRoot->m = model;
-      pointer_vector_init(&rangeRoot->ranges);
-      pointer_vector_add(rangeRoots, rangeRoot);
-    } 	
-    pointer_vector_init(&rangePath);
-    range_get_path(&rangePath, range);
-    range_add_node(rangeRoot, &rangePath);
-    pointer_vector_free(&rangePath);
-  }
-	if (range->child) {
-		bob_visit_range_for_model(rangeRoots, range->child);
+	if (!buffer) {
+		log_error("failed to allocate memory for mesh indices");
+		return -1;
 	}
+	while (*fptr) {
+		if (isdigit(*fptr)) {
+			if (size == buf_size) {
+				buf_size *= 2;
+				GLuint *nbuffer = realloc(buffer, buf_size * sizeof *buffer);
+				if (!nbuffer) {
+					log_error("failed to allocate memory for mesh indices");
+					free(buffer);
+					return -1;
+				}
+				buffer = nbuffer;
+			}
+			buffer[size++] = strtoul(fptr, &end, 10);
+			fptr = end;
+		}
+		else if (*fptr == ',' || isspace(*fptr)) {
+			fptr++;
+		}
+		else {
+			log_error("invalid character in mesh indices: %c", *fptr);
+			free(buffer);
+			return -1;
+		}
+	}
+	*indices = buffer;
+	*count = size;
+	return 0;
 }
 
-RangeRoot *ll_range_get_range_root(PointerVector *rangeRoots, Model *model) {
+/*
+ * Points every lazy instance of a range tree at the range root of its 
+ * model, creating range roots as new models are found. The tree itself is
+ * shared by all of its models and expanded once for them.
+ */
+int bob_get_range_roots(Level *lvl, IntMap *rootMap, Range *range) {
 	size_t i;
-	for (i = 0; i < rangeRoots->size; i++) {
-		RangeRoot *rangeRoot = rangeRoots->buffer[i];
-		if (rangeRoot->m == model)
-			return rangeRoot;
-	}
-	return NULL;
-}
-
-/** TODO: reconsider the need for this **/
-void range_get_path(PointerVector *pv, Range *range) {
-  while (range) {
-    pointer_vector_add(pv, range);
-    range = range->parent;
-  }
-}
-
-void range_add_filtered_instances(Range *newRange, Range *oldRange, Model *m) {
-  int i;
-
-  pointer_vector_init(&newRange->lazyinstances);
-  for (i = 0; i < oldRange->lazyinstances.size; i++) {
-    LazyInstance *li = oldRange->lazyinstances.buffer[i];
-    if (m == li->model) {
-      pointer_vector_add(&newRange->lazyinstances, li);
-    }
-  }
-}
-
-Range *createRangeClone(Range *range, Model *m, Range *parent) {
-  Range *rangeClone = malloc(sizeof *rangeClone);
-  if (!rangeClone) {
-    log_error("memory allocation error while cloning range");
-    return NULL;
-  }
-  rangeClone->id = range->id;
-  rangeClone->parent = parent;
-  if (parent) {
-    parent->child = rangeClone;
-  }
-  rangeClone->steps = range->steps;
-  rangeClone->currval = range->currval;
-  rangeClone->var = range->var;
-  rangeClone->cache = range->cache;
-  range_add_filtered_instances(rangeClone, range, m);
-  rangeClone->child = NULL;
-  return rangeClone;
-}
-
-void range_add_node_range(Range *range, Range *parent, Model *model, PointerVector *path, int index) {
-  if (index < 0)
-    return;
-  Range *currPathRange = path->buffer[index];
-  if (!range) {
-    range = createRangeClone(currPathRange, model, parent);
-    range_add_node_range(range->child, range, model, path, index - 1);
-  }
-  if (range->id == currPathRange->id) {
-    range_add_node_range(range->child, range, model, path, index - 1); 
-  } else {
-    log_error("Invalid State: got range id of %d, but expected %d", range->id, currPathRange->id);
-  }
-}
-
-void range_add_node(RangeRoot *rangeRoot, PointerVector *path) {
-  int i;
-  int j = path->size - 1;
-  Range *currPathRange = path->buffer[j];
-  Model *model = rangeRoot->m;
-
-  for (i = 0; i < rangeRoot->ranges.size; i++) {
-    Range *currRange = rangeRoot->ranges.buffer[i];
-    if (currRange->id == currPathRange->id) {
-      range_add_node_range(currRange->child, currRange, model, path, j - 1);
-      return;
-    }
-  }
-  if (i == rangeRoot->ranges.size) {
-    Range *newRange = createRangeClone(currPathRange, rangeRoot->m, NULL);
-    range_add_node_range(newRange->child, newRange, model, path, j - 1);
-    pointer_vector_add(&rangeRoot->ranges, newRange);
-  }
-}   
+
+	for (; range; range = range->child) {
+		for (i = 0; i < range->lazyinstances.size; i++) {
+			LazyInstance *li = range->lazyinstances.buffer[i];
+			RangeRoot *rangeRoot = bob_int_map_get(rootMap, li->model->res.id);
+			if (!rangeRoot) {
+				rangeRoot = arena_calloc(&lvl->arena, sizeof *rangeRoot);
+				if (!rangeRoot) {
+					log_error("error allocating memory for Rangeroot");
+					return -1;
+				}
+				rangeRoot->m = li->model;
+				pointer_vector_init_arena(&rangeRoot->baked, &lvl->arena);
+				bob_int_map_insert(rootMap, li->model->res.id, rangeRoot);
+				pointer_vector_add(&lvl->ranges, rangeRoot);
+			}
+			li->root = rangeRoot;
+			if (li->baked)
+				pointer_vector_add(&rangeRoot->baked, li);
+		}
+	}
+	return 0;
+}
 
 GLenum to_gl_shader(bob_shader_e shader_type) {
 	switch(shader_type) {
@@ -878,3 +1458,26 @@ GLenum to_gl_shader(bob_shader_e shader_type) {
 	return -1;
 }
 
+GLenum to_gl_draw(bob_draw_e draw_type) {
+	switch(draw_type) {
+		case BOB_DRAW_TRIANGLE_STRIP:
+			return GL_TRIANGLE_STRIP;
+		case BOB_DRAW_TRIANGLES:
+			return GL_TRIANGLES;
+		case BOB_DRAW_TRIANGLE_FAN:
+			return GL_TRIANGLE_FAN;
+		case BOB_DRAW_LINES:
+			return GL_LINES;
+		case BOB_DRAW_LINE_STRIP:
+			return GL_LINE_STRIP;
+		case BOB_DRAW_LINE_LOOP:
+			return GL_LINE_LOOP;
+		case BOB_DRAW_POINTS:
+			return GL_POINTS;
+		default:
+			log_error("unknown draw type: %d", draw_type);
+			break;
+	}
+	return GL_TRIANGLE_STRIP;
+}
+
@@ -6,8 +6,22 @@
 
 typedef struct bob_db_s bob_db_s;
 
+/* called with the id, bounds and instance count of each cell found */
+typedef void (*bob_cell_visit_fn)(void *data, int id, vec3 min, vec3 max, int count);
+
 extern bob_db_s *bob_loaddb(const char *path);
 extern Level *bob_loadlevel(bob_db_s *bdb, const char *name);
+extern void bob_unloadlevel(bob_db_s *bdb, Level *lvl);
+extern void bob_set_resource_budget(bob_db_s *bdb, size_t bytes);
+extern size_t bob_resource_bytes(bob_db_s *bdb);
+extern void bob_release_model(bob_db_s *bdb, Model *m);
+extern void bob_vertex_attribs(GlProgram *program, GLsizei stride);
+extern void bob_instance_attribs(GlProgram *program);
+extern int bob_dbquery_cells(bob_db_s *bdb, int levelID, vec3 min, vec3 max, 
+		bob_cell_visit_fn visit, void *data);
+extern int bob_dbload_cell(bob_db_s *bdb, int cellID, PointerVector *out, PointerVector *pool, 
+		Arena *arena);
+extern int bob_dbload_cell_models(bob_db_s *bdb, Level *lvl);
 
 #endif
 
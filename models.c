@@ -1,7 +1,10 @@
 #include "common/log.h"
 #include "models.h"
 #include "meshes.h"
+#include "common/constants.h"
+#include "common/pack.h"
 #include <GL/glew.h>
+#include <math.h>
 
 static PointerVector get_basic_shaders1(void);
 
@@ -52,9 +55,16 @@ Model *get_model_test1(void) {
 
 	gl_load_texture(texture, "textures/pge_icon.png");
 	m->texture = texture;
+	m->ebo = 0;
+	m->indexType = GL_NONE;
 	m->drawType = GL_TRIANGLE_STRIP;
 	m->drawStart = 0;
 	m->drawCount = 6*2*3;
+	m->occluder = NULL;
+	m->transparent = false;
+	m->nearest = 0;
+	m->lastNearest = 0;
+	model_compute_bounds(m, test_mesh1, m->drawCount);
 
 	return m;
 }
@@ -122,31 +132,156 @@ void instance_rotate(Instance *i, float x, float y, float z) {
 }
 
 void instance_get_matrix(Instance *i, mat4 m4) {
+	versor q;
+
+	euler_to_quat(i->rotation, q);
 	glm_mat4_identity(m4);	
 	glm_translate(m4, i->pos);
+	glm_quat_rotate(m4, q, m4);
 	glm_scale(m4, i->scale);
 }
 
-void instance_group_add(PointerVector *igs, Model *m, void *ptr) {
+/*
+ * Axis aligned bounds of an instance in world space.
+ */
+void instance_get_aabb(Instance *i, vec3 min, vec3 max) {
+	versor q;
+
+	euler_to_quat(i->rotation, q);
+	model_get_aabb(i->model, i->pos, i->scale, q, min, max);
+}
+
+/*
+ * Rotation about x, then y, then z by the given angles in radians. 
+ */
+void euler_to_quat(vec3 angles, versor q) {
+	float cx, sx, cy, sy, cz, sz;
+
+	if (!angles[0] && !angles[1] && !angles[2]) {
+		glm_vec4_copy((vec4){0, 0, 0, 1}, q);
+		return;
+	}
+	cx = cosf(angles[0] * 0.5f);
+	sx = sinf(angles[0] * 0.5f);
+	cy = cosf(angles[1] * 0.5f);
+	sy = sinf(angles[1] * 0.5f);
+	cz = cosf(angles[2] * 0.5f);
+	sz = sinf(angles[2] * 0.5f);
+	q[0] = sx * cy * cz - cx * sy * sz;
+	q[1] = cx * sy * cz + sx * cy * sz;
+	q[2] = cx * cy * sz - sx * sy * cz;
+	q[3] = cx * cy * cz + sx * sy * sz;
+}
+
+/*
+ * World space bounds of a model scaled, rotated by q and then moved to 
+ * pos, the order the vertex shader applies them in. The local box is 
+ * rotated as a center and extents, so the result stays tight for boxes 
+ * that are only turned a little.
+ */
+void model_get_aabb(Model *m, vec3 pos, vec3 scale, versor q, vec3 min, vec3 max) {
+	int j, k;
+	float x = q[0], y = q[1], z = q[2], w = q[3];
+	vec3 c, e;
+	float r[3][3] = {
+		{1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w)},
+		{2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w)},
+		{2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y)}
+	};
+
+	for (k = 0; k < 3; k++) {
+		c[k] = (m->bboxMin[k] + m->bboxMax[k]) * 0.5f * scale[k];
+		e[k] = fabsf((m->bboxMax[k] - m->bboxMin[k]) * 0.5f * scale[k]);
+	}
+	for (k = 0; k < 3; k++) {
+		float center = pos[k], extent = 0;
+		for (j = 0; j < 3; j++) {
+			center += r[k][j] * c[j];
+			extent += fabsf(r[k][j]) * e[j];
+		}
+		min[k] = center - extent;
+		max[k] = center + extent;
+	}
+}
+
+/*
+ * Quantizes the staged instances into their vertex attribute layout: 
+ * rotations to normalized shorts with a positive w, scales to halves.
+ */
+void instance_attrib_pack(InstanceAttrib *out, vec3 *position, vec3 *scale, 
+    versor *rotation, size_t n) {
+	size_t i;
+	int k;
+
+	for (i = 0; i < n; i++) {
+		float sign = rotation[i][3] < 0 ? -32767.0f : 32767.0f;
+		for (k = 0; k < 3; k++) {
+			out[i].pos[k] = position[i][k];
+			out[i].rotation[k] = (GLshort)lrintf(rotation[i][k] * sign);
+			out[i].scale[k] = pack_half(scale[i][k]);
+		}
+	}
+}
+
+/*
+ * Returns the group of instances of m, creating an empty one if there is 
+ * none yet. Groups of a vector backed by an arena are allocated in it.
+ */
+InstanceGroup *instance_group_get(PointerVector *igs, Model *m) {
   int i;
 
   for (i = 0; i < igs->size; i++) {
     InstanceGroup *ig = igs->buffer[i];
-    if (ig->model == m) {
-      pointer_vector_add(&ig->instances, ptr);
-      return;
-    }
+    if (ig->model == m)
+      return ig;
   }
-  InstanceGroup *ig = malloc(sizeof *ig);
+  InstanceGroup *ig = igs->arena ? arena_alloc(igs->arena, sizeof *ig) : malloc(sizeof *ig);
   if (!ig) {
     log_error("Failed to allocate memory for new instance group");
-    return;
+    return NULL;
   }
   ig->model = m;
-  pointer_vector_init(&ig->instances);
-  pointer_vector_add(&ig->instances, ptr);
+  if (igs->arena)
+    pointer_vector_init_arena(&ig->instances, igs->arena);
+  else
+    pointer_vector_init(&ig->instances);
   log_debug("adding instance group %p with model %p", ig, m);
   pointer_vector_add(igs, ig);
+  return ig;
+}
+
+void instance_group_add(PointerVector *igs, Model *m, void *ptr) {
+  InstanceGroup *ig = instance_group_get(igs, m);
+
+  if (ig)
+    pointer_vector_add(&ig->instances, ptr);
+}
+
+void model_draw_instanced(Model *m, GLsizei instances) {
+  if (m->ebo) {
+    glDrawElementsInstanced(m->drawType, m->drawCount, m->indexType, 
+        (const GLvoid *)(m->drawStart * (m->indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint))), 
+        instances);
+  }
+  else {
+    glDrawArraysInstanced(m->drawType, m->drawStart, m->drawCount, instances);
+  }
 }
 
 
+void model_compute_bounds(Model *m, const GLfloat *data, GLsizei vertexCount) {
+  GLsizei i;
+
+  if (vertexCount <= 0) {
+    glm_vec3_zero(m->bboxMin);
+    glm_vec3_zero(m->bboxMax);
+    return;
+  }
+  glm_vec3_copy((vec3){data[0], data[1], data[2]}, m->bboxMin);
+  glm_vec3_copy(m->bboxMin, m->bboxMax);
+  for (i = 1; i < vertexCount; i++) {
+    const GLfloat *v = &data[i * BOB_VERTEX_STRIDE];
+    glm_vec3_minv(m->bboxMin, (vec3){v[0], v[1], v[2]}, m->bboxMin);
+    glm_vec3_maxv(m->bboxMax, (vec3){v[0], v[1], v[2]}, m->bboxMax);
+  }
+}
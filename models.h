@@ -4,6 +4,8 @@
 #include "glprogram.h"
 #include "camera.h"
 #include "common/data-structures.h"
+#include "common/constants.h"
+#include "resource.h"
 #include <cglm/cglm.h>
 #include <GL/glew.h>
 
@@ -15,7 +17,13 @@ typedef struct LazyInstance LazyInstance;
 typedef struct InstanceGroup InstanceGroup;
 typedef struct Range Range;
 typedef struct RangeRoot RangeRoot;
+typedef struct InstanceAttrib InstanceAttrib;
 typedef struct RenderBuffer RenderBuffer;
+typedef struct RenderItem RenderItem;
+typedef struct TransparentInstance TransparentInstance;
+typedef struct DrawSlot DrawSlot;
+typedef struct FrameBlock FrameBlock;
+typedef struct ImpulseBuffer ImpulseBuffer;
 typedef struct Level Level;
 
 struct Model {
@@ -23,13 +31,29 @@ struct Model {
 	GlTexture *texture;
 	GLuint vbo;
 	GLuint vao;
+  GLuint ebo;
   GLuint pvbo;
   GLuint pvao;
   GLuint svbo;
   GLuint svao;
 	GLenum drawType;
+  GLenum indexType;
 	GLint drawStart;
 	GLint drawCount;
+	GLsizei vertexStride;
+	vec3 bboxMin;
+	vec3 bboxMax;
+	/* where instances are staged when the model is drawn indirectly, else NULL */
+	DrawSlot *slot;
+	/* CPU copy of the mesh if it's small enough to occlude, else NULL */
+	struct occluder_mesh_s *occluder;
+	/* blended and drawn back to front after everything opaque */
+	bool transparent;
+	/* squared distance to the nearest instance drawn this frame and the frame before */
+	float nearest;
+	float lastNearest;
+	/* refcount and GPU memory of the model, the loader reloads it once evicted */
+	resource_s res;
 };
 
 struct Instance {
@@ -37,6 +61,8 @@ struct Instance {
 	float mass;
 	bool isSubjectToGravity;
 	bool isStatic;
+	bool isSleeping;
+	int restSteps;
 	vec3 pos;
 	vec3 velocity;
 	vec3 acceleration;
@@ -45,7 +71,9 @@ struct Instance {
 	vec3 rotation;
 	PointerVector *collision_space;
 	PointerVector *gravity_space;
-	PointerList *impulse;
+	struct coll_body_s *collisionBody;
+	/* cell the instance was streamed in with, NULL if it's always loaded */
+	struct stream_cell_s *cell;
 };
 
 struct LazyInstance {
@@ -63,10 +91,21 @@ struct LazyInstance {
 	char *scalex;
 	char *scaley;
 	char *scalez;
+	char *rotx;
+	char *roty;
+	char *rotz;
 	vec3 rotation;
 	PointerVector *collision_space;
 	PointerVector *gravity_space;
-	PointerList *impulse;
+	/* position, scale and rotation of every iteration, unrolled by the level compiler */
+	float *baked;
+	size_t nbaked;
+	/* range root of the instance's model, which its iterations are expanded into */
+	RangeRoot *root;
+	/* first of the instance's iterations in root->expanded */
+	size_t first;
+	/* px through rotz, as nodes of its range's DAG */
+	int fields[BOB_BAKED_STRIDE];
 };
 
 struct InstanceGroup {
@@ -86,26 +125,128 @@ struct Range {
 		int childId;
 	};
 	PointerVector lazyinstances;
+	/* subexpressions of the lazy instances, NULL when they're all baked */
+	struct lazy_dag_s *dag;
 };
 
+/*
+ * Everything the level's ranges draw with one model. Ranges are expanded
+ * once for all models into expanded, in the same position, scale and 
+ * rotation layout as baked instances. Iteration counts are fixed, so every
+ * lazy instance owns a slice of it laid out when the level is loaded.
+ */
 struct RangeRoot {
 	Model *m;
-	PointerVector ranges;
+	PointerVector baked;
+	float *expanded;
+	size_t nexpanded;
+};
+
+/*
+ * Per-instance vertex attributes, 24 bytes. The rotation is a unit 
+ * quaternion with w >= 0, so only x, y and z are stored as snorm16 and 
+ * the vertex shader rebuilds w. Scale is stored as half floats.
+ */
+struct InstanceAttrib {
+  GLfloat pos[3];
+  GLshort rotation[3];
+  GLhalf scale[3];
 };
 
+/*
+ * Instances are staged unpacked and quantized a whole batch at a time 
+ * when the buffer is flushed.
+ */
 struct RenderBuffer {
   int pos;
-  vec3 buffer[2*RENDER_BUFFER_SIZE];
+  vec3 position[RENDER_BUFFER_SIZE];
+  vec3 scale[RENDER_BUFFER_SIZE];
+  versor rotation[RENDER_BUFFER_SIZE];
+  InstanceAttrib packed[RENDER_BUFFER_SIZE];
+};
+
+/*
+ * A group of instances or a range root to draw, opaque ones are drawn 
+ * front to back by how near their model's instances were last frame.
+ */
+struct RenderItem {
+  Model *model;
+  InstanceGroup *group;
+  RangeRoot *rangeRoot;
+};
+
+/*
+ * A visible instance of a transparent model, kept until everything opaque 
+ * is drawn and then sorted back to front by its squared distance.
+ */
+struct TransparentInstance {
+  Model *model;
+  float dist;
+  vec3 pos;
+  vec3 scale;
+  versor rotation;
+};
+
+/*
+ * Contents of the per-frame uniform block, laid out to match std140: 
+ * cglm's mat4 and vec4 are already 16 byte aligned columns.
+ */
+struct FrameBlock {
+  mat4 view;
+  mat4 projection;
+  mat4 viewproj;
+  vec4 cameraPos;
+  float time;
+  float pad[3];
+};
+
+/*
+ * Pending impulses of a level stored as parallel arrays, entry i pushes
+ * target[i] with force[i] for another dt[i] seconds. Storage is kept
+ * between frames so adding an impulse doesn't allocate once warmed up.
+ */
+struct ImpulseBuffer {
+  size_t size;
+  size_t buf_size;
+  Instance **target;
+  vec3 *force;
+  double *dt;
 };
 
 struct Level {
+	int id;
+	/* everything the level allocates that doesn't hold GPU objects */
+	Arena arena;
 	double t0;
 	Camera camera;
 	vec3 ambient_gravity;
+	bob_integrator_e integrator;
+	double timestep;
+	double accumulator;
+	float cellSize;
 	PointerVector instances;
+	/* groups of the instances that move, owned by the simulation thread */
+	PointerVector dynamics;
+	/* range roots, one per model drawn by ranges */
 	PointerVector ranges;
+	/* outermost ranges, whose trees are expanded into the range roots */
+	PointerVector rangeTrees;
 	PointerVector gravityObjects;
+	/* every model drawn by the level, each holding one reference */
+	PointerVector models;
   RenderBuffer renderBuffer;
+  RenderItem *renderItems;
+  size_t nrenderItems;
+  size_t renderItemsCap;
+  TransparentInstance *transparent;
+  size_t ntransparent;
+  size_t transparentCap;
+  PointerVector batches;
+  GLuint frameUbo;
+  ImpulseBuffer impulses;
+  struct coll_grid_s *collisionGrid;
+  struct stream_s *stream;
+  struct occlusion_s *occlusion;
 };
 
 extern Model *get_model_test1(void);
@@ -116,8 +257,17 @@ extern PointerVector gen_instances_test1(void);
 extern void instance_update_position(Instance *i, float dt);
 extern void instance_rotate(Instance *i, float x, float y, float z);
 extern void instance_get_matrix(Instance *i, mat4 m4);
+extern void instance_get_aabb(Instance *i, vec3 min, vec3 max);
+extern void euler_to_quat(vec3 angles, versor q);
+extern void model_get_aabb(Model *m, vec3 pos, vec3 scale, versor q, vec3 min, vec3 max);
+extern void instance_attrib_pack(InstanceAttrib *out, vec3 *position, vec3 *scale, 
+    versor *rotation, size_t n);
 
+extern InstanceGroup *instance_group_get(PointerVector *igs, Model *m);
 extern void instance_group_add(PointerVector *igs, Model *m, void *ptr);
 
+extern void model_draw_instanced(Model *m, GLsizei instances);
+extern void model_compute_bounds(Model *m, const GLfloat *data, GLsizei vertexCount);
+
 
 #endif
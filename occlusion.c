@@ -0,0 +1,477 @@
+#include "occlusion.h"
+#include "common/log.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static void s_occlusion_candidate(occlusion_s *occ, Camera *camera, Model *m,
+		float *pos, float *scale, float *rotation);
+static int s_occlusion_cmp(const void *a, const void *b);
+static int s_occlusion_clip(vec4 in[3], vec4 out[4]);
+static void s_occlusion_triangle(occlusion_s *occ, vec4 v0, vec4 v1, vec4 v2);
+static void s_occlusion_project(vec4 clip, vec3 screen);
+static double s_occlusion_now(void);
+
+/*
+ * Copies the positions of a mesh and unrolls the primitives drawn, first
+ * and count being in indices for indexed meshes. Returns NULL for meshes
+ * too large to rasterize on the CPU or that aren't made of triangles.
+ */
+occluder_mesh_s *occluder_mesh_new(const GLfloat *vertices, GLsizei stride,
+		GLsizei vertexCount, const GLuint *indices, GLenum drawType, GLint first, GLint count) {
+	GLint i, ntriangles;
+	GLuint *out;
+	occluder_mesh_s *mesh;
+
+	if (vertexCount <= 0 || vertexCount > OCCLUSION_MAX_OCCLUDER_VERTICES || count < 3)
+		return NULL;
+	switch (drawType) {
+		case GL_TRIANGLES:
+			ntriangles = count / 3;
+			break;
+		case GL_TRIANGLE_STRIP:
+		case GL_TRIANGLE_FAN:
+			ntriangles = count - 2;
+			break;
+		default:
+			return NULL;
+	}
+
+	mesh = malloc(sizeof *mesh);
+	if (!mesh) {
+		log_error("failed to allocate memory for occluder mesh");
+		return NULL;
+	}
+	mesh->nvertices = vertexCount;
+	mesh->nindices = ntriangles * 3;
+	mesh->vertices = malloc(vertexCount * sizeof *mesh->vertices);
+	mesh->indices = malloc(mesh->nindices * sizeof *mesh->indices);
+	if (!mesh->vertices || !mesh->indices) {
+		log_error("failed to allocate memory for occluder mesh");
+		free(mesh->vertices);
+		free(mesh->indices);
+		free(mesh);
+		return NULL;
+	}
+	for (i = 0; i < vertexCount; i++)
+		glm_vec3_copy((vec3){vertices[i * stride], vertices[i * stride + 1], vertices[i * stride + 2]},
+				mesh->vertices[i]);
+
+	out = mesh->indices;
+	for (i = 0; i < ntriangles; i++) {
+		switch (drawType) {
+			case GL_TRIANGLES:
+				out[0] = first + i * 3;
+				out[1] = first + i * 3 + 1;
+				out[2] = first + i * 3 + 2;
+				break;
+			case GL_TRIANGLE_STRIP:
+				out[0] = first + i;
+				out[1] = first + i + 1;
+				out[2] = first + i + 2;
+				break;
+			case GL_TRIANGLE_FAN:
+				out[0] = first;
+				out[1] = first + i + 1;
+				out[2] = first + i + 2;
+				break;
+		}
+		out += 3;
+	}
+	if (indices) {
+		for (i = 0; i < mesh->nindices; i++)
+			mesh->indices[i] = indices[mesh->indices[i]];
+	}
+	for (i = 0; i < mesh->nindices; i++) {
+		if (mesh->indices[i] >= vertexCount) {
+			free(mesh->vertices);
+			free(mesh->indices);
+			free(mesh);
+			return NULL;
+		}
+	}
+	return mesh;
+}
+
+void occluder_mesh_free(occluder_mesh_s *mesh) {
+	if (!mesh)
+		return;
+	free(mesh->vertices);
+	free(mesh->indices);
+	free(mesh);
+}
+
+void occlusion_free(occlusion_s *occ) {
+	if (!occ)
+		return;
+	free(occ->depth);
+	free(occ->candidates);
+	free(occ);
+}
+
+occlusion_s *occlusion_new(void) {
+	int w = OCCLUSION_WIDTH, h = OCCLUSION_HEIGHT;
+	size_t size = 0;
+	occlusion_s *occ = calloc(1, sizeof *occ);
+
+	if (!occ) {
+		log_error("failed to allocate memory for occlusion culler");
+		return NULL;
+	}
+	for (;;) {
+		occ->width[occ->nlevels] = w;
+		occ->height[occ->nlevels] = h;
+		occ->offset[occ->nlevels] = size;
+		occ->nlevels++;
+		size += (size_t)w * h;
+		if ((w == 1 && h == 1) || occ->nlevels == OCCLUSION_MAX_LEVELS)
+			break;
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+	occ->depth = malloc(size * sizeof *occ->depth);
+	if (!occ->depth) {
+		log_error("failed to allocate memory for occlusion depth buffer");
+		free(occ);
+		return NULL;
+	}
+	return occ;
+}
+
+/*
+ * Clears the depth buffer for occluders seen through viewproj.
+ */
+void occlusion_begin(occlusion_s *occ, mat4 viewproj) {
+	glm_mat4_copy(viewproj, occ->viewproj);
+	memset(occ->depth, 0, (size_t)OCCLUSION_WIDTH * OCCLUSION_HEIGHT * sizeof *occ->depth);
+	occ->ready = false;
+}
+
+void occlusion_rasterize(occlusion_s *occ, occluder_mesh_s *mesh, mat4 model) {
+	size_t i;
+	int j, n;
+	mat4 mvp;
+	vec4 tri[3], clipped[4];
+
+	glm_mat4_mul(occ->viewproj, model, mvp);
+	for (i = 0; i < mesh->nindices; i += 3) {
+		for (j = 0; j < 3; j++) {
+			float *v = mesh->vertices[mesh->indices[i + j]];
+			glm_mat4_mulv(mvp, (vec4){v[0], v[1], v[2], 1.0f}, tri[j]);
+		}
+		n = s_occlusion_clip(tri, clipped);
+		for (j = 2; j < n; j++)
+			s_occlusion_triangle(occ, clipped[0], clipped[j - 1], clipped[j]);
+	}
+	occ->occluders++;
+}
+
+/*
+ * Reduces the depth buffer into the rest of the pyramid. A texel covers
+ * the texels of the level below at twice its coordinates, clamped for the
+ * odd sizes.
+ */
+void occlusion_end(occlusion_s *occ) {
+	int l, x, y, x1, y1;
+
+	for (l = 1; l < occ->nlevels; l++) {
+		float *src = occ->depth + occ->offset[l - 1], *dst = occ->depth + occ->offset[l];
+		int sw = occ->width[l - 1], sh = occ->height[l - 1];
+		for (y = 0; y < occ->height[l]; y++) {
+			y1 = y * 2 + 1 < sh ? y * 2 + 1 : y * 2;
+			for (x = 0; x < occ->width[l]; x++) {
+				x1 = x * 2 + 1 < sw ? x * 2 + 1 : x * 2;
+				dst[y * occ->width[l] + x] = fminf(
+						fminf(src[y * 2 * sw + x * 2], src[y * 2 * sw + x1]),
+						fminf(src[y1 * sw + x * 2], src[y1 * sw + x1]));
+			}
+		}
+	}
+	occ->ready = true;
+}
+
+/*
+ * True if the box is behind the occluders everywhere it covers the screen.
+ * Boxes crossing the near plane or outside the screen are never hidden,
+ * the frustum test deals with the latter.
+ */
+bool occlusion_box_hidden(occlusion_s *occ, vec3 min, vec3 max) {
+	int i, l, x, y, x0, x1, y0, y1;
+	float nearest = 0.0f, farthest;
+	vec3 smin = {INFINITY, INFINITY, 0}, smax = {-INFINITY, -INFINITY, 0}, screen;
+	vec4 clip;
+	bool hidden = false;
+	double start;
+
+	if (!occ || !occ->ready)
+		return false;
+	start = s_occlusion_now();
+	occ->tested++;
+
+	for (i = 0; i < 8; i++) {
+		vec4 corner = {i & 1 ? max[0] : min[0], i & 2 ? max[1] : min[1], i & 4 ? max[2] : min[2], 1.0f};
+		glm_mat4_mulv(occ->viewproj, corner, clip);
+		if (clip[3] < OCCLUSION_NEAR_W)
+			goto done;
+		s_occlusion_project(clip, screen);
+		glm_vec3_minv(smin, screen, smin);
+		glm_vec3_maxv(smax, screen, smax);
+		nearest = fmaxf(nearest, screen[2]);
+	}
+	x0 = smin[0] < 0 ? 0 : (int)smin[0];
+	y0 = smin[1] < 0 ? 0 : (int)smin[1];
+	x1 = smax[0] >= OCCLUSION_WIDTH ? OCCLUSION_WIDTH - 1 : (int)smax[0];
+	y1 = smax[1] >= OCCLUSION_HEIGHT ? OCCLUSION_HEIGHT - 1 : (int)smax[1];
+	if (smax[0] < 0 || smax[1] < 0 || x0 > x1 || y0 > y1)
+		goto done;
+
+	for (l = 0; l < occ->nlevels - 1 && ((x1 >> l) - (x0 >> l) > 3 || (y1 >> l) - (y0 >> l) > 3); l++)
+		;
+	farthest = INFINITY;
+	for (y = y0 >> l; y <= y1 >> l; y++) {
+		for (x = x0 >> l; x <= x1 >> l; x++)
+			farthest = fminf(farthest, occ->depth[occ->offset[l] + y * occ->width[l] + x]);
+	}
+	hidden = nearest * (1.0f + OCCLUSION_DEPTH_BIAS) < farthest;
+	if (hidden)
+		occ->culled++;
+
+done:
+	occ->testTime += s_occlusion_now() - start;
+	return hidden;
+}
+
+/*
+ * Builds the frame's pyramid from the largest static instances and range
+ * instances, expanded or baked, in view. Runs once per frame after the 
+ * camera moved, and logs the statistics of the frame before.
+ */
+void occlusion_update(occlusion_s *occ, Level *level) {
+	int i;
+	size_t j;
+	mat4 model;
+	versor q;
+	double start;
+
+	if (!occ)
+		return;
+	if (occ->tested) {
+		log_debug("occlusion: %zu occluders, culled %zu of %zu (%.1f%%) in %.3fms + %.3fms",
+				occ->occluders, occ->culled, occ->tested, 100.0 * occ->culled / occ->tested,
+				occ->buildTime * 1e3, occ->testTime * 1e3);
+	}
+	occ->occluders = occ->tested = occ->culled = 0;
+	occ->testTime = 0;
+	start = s_occlusion_now();
+
+	camera_update(&level->camera);
+	occ->ncandidates = 0;
+	for (i = 0; i < level->instances.size; i++) {
+		InstanceGroup *ig = level->instances.buffer[i];
+		if (!ig->model->occluder)
+			continue;
+		for (j = 0; j < ig->instances.size; j++) {
+			Instance *inst = ig->instances.buffer[j];
+			if (inst->isStatic)
+				s_occlusion_candidate(occ, &level->camera, ig->model, inst->pos, inst->scale, inst->rotation);
+		}
+	}
+	for (i = 0; i < level->ranges.size; i++) {
+		RangeRoot *rangeRoot = level->ranges.buffer[i];
+		if (!rangeRoot->m->occluder)
+			continue;
+		for (j = 0; j < rangeRoot->nexpanded; j++) {
+			float *expanded = &rangeRoot->expanded[j * BOB_BAKED_STRIDE];
+			s_occlusion_candidate(occ, &level->camera, rangeRoot->m, expanded, expanded + 3, expanded + 6);
+		}
+		for (j = 0; j < rangeRoot->baked.size; j++) {
+			LazyInstance *li = rangeRoot->baked.buffer[j];
+			size_t k;
+			for (k = 0; k < li->nbaked; k++) {
+				float *baked = &li->baked[k * BOB_BAKED_STRIDE];
+				s_occlusion_candidate(occ, &level->camera, rangeRoot->m, baked, baked + 3, baked + 6);
+			}
+		}
+	}
+	qsort(occ->candidates, occ->ncandidates, sizeof *occ->candidates, s_occlusion_cmp);
+
+	occlusion_begin(occ, level->camera.viewproj);
+	for (j = 0; j < occ->ncandidates && j < OCCLUSION_MAX_OCCLUDERS; j++) {
+		occluder_s *o = &occ->candidates[j];
+		euler_to_quat(o->rotation, q);
+		glm_translate_make(model, o->pos);
+		glm_quat_rotate(model, q, model);
+		glm_scale(model, o->scale);
+		occlusion_rasterize(occ, o->mesh, model);
+	}
+	occlusion_end(occ);
+	occ->buildTime = s_occlusion_now() - start;
+}
+
+/*
+ * Queues an instance as an occluder if it's large enough and in view. Its
+ * score is the area of its two largest sides over its squared distance,
+ * roughly how much of the screen it covers.
+ */
+void s_occlusion_candidate(occlusion_s *occ, Camera *camera, Model *m,
+		float *pos, float *scale, float *rotation) {
+	int k;
+	float ext[3], t, dist2 = 0;
+	vec3 min, max;
+	versor q;
+
+	for (k = 0; k < 3; k++)
+		ext[k] = fabsf((m->bboxMax[k] - m->bboxMin[k]) * scale[k]);
+	if (ext[0] < ext[1]) { t = ext[0]; ext[0] = ext[1]; ext[1] = t; }
+	if (ext[1] < ext[2]) { t = ext[1]; ext[1] = ext[2]; ext[2] = t; }
+	if (ext[0] < ext[1]) { t = ext[0]; ext[0] = ext[1]; ext[1] = t; }
+	if (ext[1] < OCCLUSION_MIN_OCCLUDER_SIZE)
+		return;
+
+	euler_to_quat(rotation, q);
+	model_get_aabb(m, pos, scale, q, min, max);
+	if (!camera_box_visible(camera, min, max))
+		return;
+	for (k = 0; k < 3; k++) {
+		t = (min[k] + max[k]) * 0.5f - camera->pos[k];
+		dist2 += t * t;
+	}
+
+	if (occ->ncandidates == occ->candidatesCap) {
+		size_t cap = occ->candidatesCap ? occ->candidatesCap * 2 : OCCLUSION_MAX_OCCLUDERS;
+		occluder_s *candidates = realloc(occ->candidates, cap * sizeof *candidates);
+		if (!candidates) {
+			log_error("failed to allocate memory for occluders");
+			return;
+		}
+		occ->candidates = candidates;
+		occ->candidatesCap = cap;
+	}
+	occluder_s *o = &occ->candidates[occ->ncandidates++];
+	o->mesh = m->occluder;
+	o->pos = pos;
+	o->scale = scale;
+	o->rotation = rotation;
+	o->score = ext[0] * ext[1] / (dist2 + 1.0f);
+}
+
+int s_occlusion_cmp(const void *a, const void *b) {
+	const occluder_s *oa = a, *ob = b;
+
+	return (oa->score < ob->score) - (oa->score > ob->score);
+}
+
+/*
+ * Clips a triangle against w = OCCLUSION_NEAR_W, returning the vertex count
+ * of the resulting polygon, 0, 3 or 4.
+ */
+int s_occlusion_clip(vec4 in[3], vec4 out[4]) {
+	int i, n = 0;
+
+	for (i = 0; i < 3; i++) {
+		float *a = in[i], *b = in[(i + 1) % 3];
+		bool ain = a[3] >= OCCLUSION_NEAR_W, bin = b[3] >= OCCLUSION_NEAR_W;
+		if (ain)
+			glm_vec4_copy(a, out[n++]);
+		if (ain != bin) {
+			float t = (OCCLUSION_NEAR_W - a[3]) / (b[3] - a[3]);
+			glm_vec4_lerp(a, b, t, out[n++]);
+		}
+	}
+	return n;
+}
+
+/*
+ * Rasterizes a triangle, keeping the nearest depth at every pixel whose
+ * center it covers. Both windings are drawn.
+ */
+void s_occlusion_triangle(occlusion_s *occ, vec4 v0, vec4 v1, vec4 v2) {
+	int k, x, y, xmin, xmax, ymin, ymax;
+	float area, dzdx, dzdy, z0;
+	float ea[3], eb[3], ec[3];
+	vec3 p[3], t;
+
+	s_occlusion_project(v0, p[0]);
+	s_occlusion_project(v1, p[1]);
+	s_occlusion_project(v2, p[2]);
+	area = (p[1][0] - p[0][0]) * (p[2][1] - p[0][1]) - (p[2][0] - p[0][0]) * (p[1][1] - p[0][1]);
+	if (fabsf(area) < 1e-8f)
+		return;
+	if (area < 0) {
+		glm_vec3_copy(p[1], t);
+		glm_vec3_copy(p[2], p[1]);
+		glm_vec3_copy(t, p[2]);
+		area = -area;
+	}
+
+	xmin = (int)fmaxf(0.0f, floorf(fminf(p[0][0], fminf(p[1][0], p[2][0]))));
+	ymin = (int)fmaxf(0.0f, floorf(fminf(p[0][1], fminf(p[1][1], p[2][1]))));
+	xmax = (int)fminf(OCCLUSION_WIDTH - 1, ceilf(fmaxf(p[0][0], fmaxf(p[1][0], p[2][0]))));
+	ymax = (int)fminf(OCCLUSION_HEIGHT - 1, ceilf(fmaxf(p[0][1], fmaxf(p[1][1], p[2][1]))));
+	if (xmin > xmax || ymin > ymax)
+		return;
+
+	/* edge k runs from vertex k to the next, positive inside */
+	for (k = 0; k < 3; k++) {
+		float *a = p[k], *b = p[(k + 1) % 3];
+		ea[k] = a[1] - b[1];
+		eb[k] = b[0] - a[0];
+		ec[k] = -(ea[k] * a[0] + eb[k] * a[1]);
+	}
+	dzdx = ((p[1][2] - p[0][2]) * (p[2][1] - p[0][1]) - (p[2][2] - p[0][2]) * (p[1][1] - p[0][1])) / area;
+	dzdy = ((p[2][2] - p[0][2]) * (p[1][0] - p[0][0]) - (p[1][2] - p[0][2]) * (p[2][0] - p[0][0])) / area;
+	z0 = p[0][2] - dzdx * p[0][0] - dzdy * p[0][1];
+
+	/* rows are walked 4 pixels at a time from a multiple of 4, the edges mask what's outside */
+	xmin &= ~3;
+	for (y = ymin; y <= ymax; y++) {
+		float *row = occ->depth + y * OCCLUSION_WIDTH;
+		float py = y + 0.5f;
+#ifdef __SSE2__
+		__m128 zero = _mm_setzero_ps();
+		__m128 e0 = _mm_set1_ps(eb[0] * py + ec[0]), a0 = _mm_set1_ps(ea[0]);
+		__m128 e1 = _mm_set1_ps(eb[1] * py + ec[1]), a1 = _mm_set1_ps(ea[1]);
+		__m128 e2 = _mm_set1_ps(eb[2] * py + ec[2]), a2 = _mm_set1_ps(ea[2]);
+		__m128 zr = _mm_set1_ps(dzdy * py + z0), zx = _mm_set1_ps(dzdx);
+		for (x = xmin; x <= xmax; x += 4) {
+			__m128 px = _mm_add_ps(_mm_set1_ps((float)x), _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f));
+			__m128 in = _mm_and_ps(
+					_mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), e0), zero),
+						_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), e1), zero)),
+					_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), e2), zero));
+			__m128 d = _mm_loadu_ps(row + x);
+			__m128 z = _mm_max_ps(d, _mm_add_ps(_mm_mul_ps(zx, px), zr));
+			_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(in, z), _mm_andnot_ps(in, d)));
+		}
+#else
+		for (x = xmin; x <= xmax; x++) {
+			float px = x + 0.5f;
+			if (ea[0] * px + eb[0] * py + ec[0] >= 0 && ea[1] * px + eb[1] * py + ec[1] >= 0 &&
+					ea[2] * px + eb[2] * py + ec[2] >= 0)
+				row[x] = fmaxf(row[x], dzdx * px + dzdy * py + z0);
+		}
+#endif
+	}
+}
+
+/*
+ * Clip space to depth buffer pixels, z becomes 1/w.
+ */
+void s_occlusion_project(vec4 clip, vec3 screen) {
+	float iw = 1.0f / clip[3];
+
+	screen[0] = (clip[0] * iw * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+	screen[1] = (clip[1] * iw * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+	screen[2] = iw;
+}
+
+double s_occlusion_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,87 @@
+#ifndef __occlusion_h__
+#define __occlusion_h__
+
+#include "models.h"
+
+/* resolution of the software depth buffer, the width must be a multiple of 4 */
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 192
+#define OCCLUSION_MAX_LEVELS 16
+/* meshes with more vertices than this are never rasterized as occluders */
+#define OCCLUSION_MAX_OCCLUDER_VERTICES 64
+/* static instances occlude when their two largest extents are at least this big */
+#define OCCLUSION_MIN_OCCLUDER_SIZE 8.0f
+/* most occluders rasterized a frame, the ones likely to cover the most screen first */
+#define OCCLUSION_MAX_OCCLUDERS 64
+/* occluder vertices closer than this in clip space w are clipped away */
+#define OCCLUSION_NEAR_W 1e-3f
+/* relative depth bias, keeps occluders from culling themselves */
+#define OCCLUSION_DEPTH_BIAS 1e-3f
+
+typedef struct occluder_mesh_s occluder_mesh_s;
+typedef struct occluder_s occluder_s;
+typedef struct occlusion_s occlusion_s;
+
+/*
+ * CPU copy of a mesh small enough to be rasterized as an occluder, its
+ * primitives unrolled into a triangle list.
+ */
+struct occluder_mesh_s {
+	size_t nvertices;
+	vec3 *vertices;
+	size_t nindices;
+	GLuint *indices;
+};
+
+/* an occluder in view this frame, rotation is in euler angles */
+struct occluder_s {
+	occluder_mesh_s *mesh;
+	float *pos;
+	float *scale;
+	float *rotation;
+	float score;
+};
+
+/*
+ * Software occlusion culler. Every frame the largest occluders in view are
+ * rasterized into a low resolution depth buffer which is then reduced into
+ * a pyramid, each level keeping the farthest depth of the four texels below
+ * it. Boxes are tested against the finest level where they cover at most
+ * 4x4 texels. Depths are stored as 1/w, which interpolates linearly in screen
+ * space and keeps its precision far from the camera, so larger is nearer.
+ *
+ * Nothing here touches OpenGL, occlusion_begin, occlusion_rasterize and
+ * occlusion_end build the pyramid from any scene. occlusion_update does it
+ * for a level.
+ */
+struct occlusion_s {
+	float *depth;
+	int nlevels;
+	int width[OCCLUSION_MAX_LEVELS];
+	int height[OCCLUSION_MAX_LEVELS];
+	size_t offset[OCCLUSION_MAX_LEVELS];
+	mat4 viewproj;
+	bool ready;
+	size_t ncandidates;
+	size_t candidatesCap;
+	occluder_s *candidates;
+	/* statistics of the current frame */
+	size_t occluders;
+	size_t tested;
+	size_t culled;
+	double buildTime;
+	double testTime;
+};
+
+extern occluder_mesh_s *occluder_mesh_new(const GLfloat *vertices, GLsizei stride,
+		GLsizei vertexCount, const GLuint *indices, GLenum drawType, GLint first, GLint count);
+extern void occluder_mesh_free(occluder_mesh_s *mesh);
+extern occlusion_s *occlusion_new(void);
+extern void occlusion_free(occlusion_s *occ);
+extern void occlusion_begin(occlusion_s *occ, mat4 viewproj);
+extern void occlusion_rasterize(occlusion_s *occ, occluder_mesh_s *mesh, mat4 model);
+extern void occlusion_end(occlusion_s *occ);
+extern bool occlusion_box_hidden(occlusion_s *occ, vec3 min, vec3 max);
+extern void occlusion_update(occlusion_s *occ, Level *level);
+
+#endif
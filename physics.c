@@ -1,115 +1,356 @@
 #include "physics.h"
+#include "collision.h"
 #include "common/log.h"
 #include <math.h>
 #include <assert.h>
-#include <GLFW/glfw3.h>
 
 const double GRAV_G = 6.67430E-11;
 
+static void s_phys_substep(Level *level, double h);
+static void s_phys_compute_acceleration(Level *level, double h);
 static void s_phys_compute_point_gravity_instances(Level *level);
 static void s_phys_compute_point_gravity(vec3 result, Instance *i1, Instance *i2);
-static void s_phys_compute_impulse(Level *level);
+static void s_phys_compute_impulse(Level *level, double h);
+static size_t s_phys_partition_awake(PointerVector *pv);
+static void s_phys_kick(Level *level, double h);
+static void s_phys_drift(Level *level, double h, double ah2);
+static void s_phys_update_sleep(Level *level, double h);
+static bool s_phys_is_supported(Level *level, Instance *inst, double h);
 
-phys_impulse_s *phys_impulse_new(double dt) {
-	phys_impulse_s *imp = malloc(sizeof *imp);
-	if (!imp) {
-		log_error("error allocating impulse object");
-		exit(1);
+int phys_impulse_buffer_init(ImpulseBuffer *ib) {
+	ib->size = 0;
+	ib->buf_size = PHYS_INIT_IMPULSE_BUF_SIZE;
+	ib->target = malloc(ib->buf_size * sizeof *ib->target);
+	ib->force = malloc(ib->buf_size * sizeof *ib->force);
+	ib->dt = malloc(ib->buf_size * sizeof *ib->dt);
+	if (!ib->target || !ib->force || !ib->dt) {
+		log_error("error allocating impulse buffer");
+		phys_impulse_buffer_free(ib);
+		return -1;
 	}
-	imp->dt = dt;
-	return imp;
+	return 0;
 }
 
-void phys_add_impulse(Instance *inst, phys_impulse_s *impulse) {
-	PointerList *pl = malloc(sizeof *pl);
-	if (pl == NULL) {
-		log_error("memory allocation error");
-		exit(1);
+void phys_impulse_buffer_free(ImpulseBuffer *ib) {
+	free(ib->target);
+	free(ib->force);
+	free(ib->dt);
+	ib->target = NULL;
+	ib->force = NULL;
+	ib->dt = NULL;
+	ib->size = 0;
+	ib->buf_size = 0;
+}
+
+int phys_add_impulse(Level *level, Instance *inst, vec3 force, double dt) {
+	ImpulseBuffer *ib = &level->impulses;
+
+	if (ib->size == ib->buf_size) {
+		size_t nsize = ib->buf_size ? 2 * ib->buf_size : PHYS_INIT_IMPULSE_BUF_SIZE;
+		Instance **target = realloc(ib->target, nsize * sizeof *target);
+		if (!target) {
+			log_error("error growing impulse buffer");
+			return -1;
+		}
+		ib->target = target;
+		vec3 *nforce = realloc(ib->force, nsize * sizeof *nforce);
+		if (!nforce) {
+			log_error("error growing impulse buffer");
+			return -1;
+		}
+		ib->force = nforce;
+		double *ndt = realloc(ib->dt, nsize * sizeof *ndt);
+		if (!ndt) {
+			log_error("error growing impulse buffer");
+			return -1;
+		}
+		ib->dt = ndt;
+		ib->buf_size = nsize;
+	}
+	ib->target[ib->size] = inst;
+	glm_vec3_copy(force, ib->force[ib->size]);
+	ib->dt[ib->size] = dt;
+	ib->size++;
+	phys_wake(inst);
+	return 0;
+}
+
+/*
+ * Advances the level by dt seconds. With a fixed timestep configured the
+ * frame time is accumulated and consumed in whole steps, otherwise one
+ * step of the frame time is taken.
+ */
+void phys_step(Level *level, double dt) {
+	int steps = 0;
+
+	if (level->timestep <= 0.0) {
+		s_phys_substep(level, dt);
+		return;
 	}
-	pl->ptr = impulse;
-	pl->next = inst->impulse;
-	inst->impulse = pl;
+	level->accumulator += dt;
+	while (level->accumulator >= level->timestep) {
+		if (steps == PHYS_MAX_SUBSTEPS) {
+			/* can't keep up, drop the backlog rather than fall further behind */
+			level->accumulator = 0.0;
+			break;
+		}
+		s_phys_substep(level, level->timestep);
+		level->accumulator -= level->timestep;
+		steps++;
+	}
+}
+
+/*
+ * Velocity Verlet and leapfrog reuse the acceleration left over from the 
+ * previous step, so each still evaluates forces once per step.
+ */
+void s_phys_substep(Level *level, double h) {
+	switch (level->integrator) {
+		case BOB_INTEGRATOR_VELOCITY_VERLET:
+			s_phys_drift(level, h, 0.5 * h * h);
+			s_phys_kick(level, 0.5 * h);
+			s_phys_compute_acceleration(level, h);
+			s_phys_kick(level, 0.5 * h);
+			break;
+		case BOB_INTEGRATOR_LEAPFROG:
+			s_phys_kick(level, 0.5 * h);
+			s_phys_drift(level, h, 0.0);
+			s_phys_compute_acceleration(level, h);
+			s_phys_kick(level, 0.5 * h);
+			break;
+		case BOB_INTEGRATOR_SEMI_IMPLICIT_EULER:
+		default:
+			s_phys_compute_acceleration(level, h);
+			s_phys_kick(level, h);
+			s_phys_drift(level, h, 0.0);
+			break;
+	}
+	coll_update(level);
+	s_phys_update_sleep(level, h);
 }
 
-void phys_compute_force(Level *level) {
+void s_phys_compute_acceleration(Level *level, double h) {
+	size_t i, j;
+	PointerVector *pv = &level->dynamics;
+
 	s_phys_compute_point_gravity_instances(level);
-	s_phys_compute_impulse(level);
+	s_phys_compute_impulse(level, h);
+
+  for (i = 0; i < pv->size; i++) {
+    InstanceGroup *ig = pv->buffer[i];
+    for (j = 0; j < ig->instances.size; j++) {
+      Instance *inst = ig->instances.buffer[j];
+      if (!inst->isStatic && !inst->isSleeping) {
+        glm_vec3_divs(inst->force, inst->mass, inst->acceleration);
+        glm_vec3_add(inst->acceleration, level->ambient_gravity, inst->acceleration);
+      }
+      glm_vec3_zero(inst->force);
+    }
+  }
 }
 
+/*
+ * Only awake bodies receive gravity. Awake bodies are moved to the front
+ * of gravityObjects so sleeping and static bodies are visited as sources
+ * only, and pairs of them are never visited at all.
+ */
 void s_phys_compute_point_gravity_instances(Level *level) {
-	size_t i, j;
+	size_t i, j, nawake;
 	vec3 gvec;
 	PointerVector *pv = &level->gravityObjects;
 
-	for (i = 0; i < pv->size; i++) {
+	nawake = s_phys_partition_awake(pv);
+	for (i = 0; i < nawake; i++) {
 		Instance *i1 = pv->buffer[i];
 		for (j = i + 1; j < pv->size; j++) {
 			Instance *i2 = pv->buffer[j];
 			s_phys_compute_point_gravity(gvec, i1, i2);
 			glm_vec3_add(i1->force, gvec, i1->force);
-			glm_vec3_negate(gvec);
-			glm_vec3_add(i2->force, gvec, i2->force);
+			if (j < nawake) {
+				glm_vec3_negate(gvec);
+				glm_vec3_add(i2->force, gvec, i2->force);
+			}
+		}
+	}
+}
+
+size_t s_phys_partition_awake(PointerVector *pv) {
+	size_t i, nawake = 0;
+
+	for (i = 0; i < pv->size; i++) {
+		Instance *inst = pv->buffer[i];
+		if (!inst->isStatic && !inst->isSleeping) {
+			pv->buffer[i] = pv->buffer[nawake];
+			pv->buffer[nawake++] = inst;
+		}
+	}
+	return nawake;
+}
+
+/*
+ * Applies every pending impulse in one pass; expired entries are replaced 
+ * by the last entry so the arrays stay dense.
+ */
+void s_phys_compute_impulse(Level *level, double h) {
+	size_t i = 0;
+	ImpulseBuffer *ib = &level->impulses;
+
+	while (i < ib->size) {
+		Instance *inst = ib->target[i];
+		glm_vec3_add(inst->force, ib->force[i], inst->force);
+		ib->dt[i] -= h;
+		if (ib->dt[i] <= 0.0) {
+			ib->size--;
+			ib->target[i] = ib->target[ib->size];
+			glm_vec3_copy(ib->force[ib->size], ib->force[i]);
+			ib->dt[i] = ib->dt[ib->size];
+		}
+		else {
+			i++;
 		}
 	}
 }
 
-void s_phys_compute_impulse(Level *level) {
-	int i, j;
-	double currtime = glfwGetTime();
-	double dt = currtime - level->t0;
+/* v += a*h for every awake body */
+void s_phys_kick(Level *level, double h) {
+	size_t i, j;
+	vec3 accum;
+	PointerVector *pv = &level->dynamics;
 
-	for (i = 0; i < level->instances.size; i++) {
-    InstanceGroup *ig = level->instances.buffer[i];
+  for (i = 0; i < pv->size; i++) {
+    InstanceGroup *ig = pv->buffer[i];
     for (j = 0; j < ig->instances.size; j++) {
       Instance *inst = ig->instances.buffer[j];
-      PointerList *prev = inst->impulse, *curr = prev, *bck;
-      while (curr) {
-        phys_impulse_s *imp = curr->ptr;
-        glm_vec3_add(inst->force, imp->force, inst->force);
-        imp->dt -= dt;
-        if (imp->dt <= 0.0) {
-          bck = curr;
-          if (curr == prev) {
-            prev = curr->next;
-            inst->impulse = prev;
-          } else {
-            prev->next = curr->next;
-          }
-          curr = curr->next;
-          free(bck);
-        } else {
-          prev = curr;
-          curr = curr->next;
-        }
+      if (!inst->isStatic && !inst->isSleeping) {
+        glm_vec3_scale(inst->acceleration, h, accum);
+        glm_vec3_add(inst->velocity, accum, inst->velocity);
       }
     }
   }
 }
 
-void phys_update_position(Level *level) {
+/* x += v*h + a*ah2 for every awake body */
+void s_phys_drift(Level *level, double h, double ah2) {
 	size_t i, j;
-	double currtime = glfwGetTime();
-	double dt = currtime - level->t0;
 	vec3 accum;
-	PointerVector *pv = &level->instances;
+	PointerVector *pv = &level->dynamics;
 
   for (i = 0; i < pv->size; i++) {
     InstanceGroup *ig = pv->buffer[i];
     for (j = 0; j < ig->instances.size; j++) {
-      Instance *inst = ig->instances.buffer[i];
-      if (!inst->isStatic) {
-        glm_vec3_divs(inst->force, inst->mass, inst->acceleration);
-        glm_vec3_zero(inst->force);
-        glm_vec3_add(inst->acceleration, level->ambient_gravity, inst->acceleration);
-        glm_vec3_scale(inst->acceleration, dt, accum);
-        glm_vec3_add(inst->velocity, accum, inst->velocity);
-        glm_vec3_scale(inst->velocity, dt, accum);
+      Instance *inst = ig->instances.buffer[j];
+      if (!inst->isStatic && !inst->isSleeping) {
+        glm_vec3_scale(inst->velocity, h, accum);
         glm_vec3_add(inst->pos, accum, inst->pos);
+        if (ah2 != 0.0) {
+          glm_vec3_scale(inst->acceleration, ah2, accum);
+          glm_vec3_add(inst->pos, accum, inst->pos);
+        }
       }
     }
   }
 }
 
+/*
+ * Runs after collisions are resolved. Awake bodies that stayed slow with
+ * little acceleration for PHYS_SLEEP_STEPS steps go to sleep; awake bodies
+ * that are still moving wake their broadphase neighbours. Ambient gravity
+ * is only discounted for supported bodies, a slow body in free fall is
+ * still accelerating.
+ */
+void s_phys_update_sleep(Level *level, double h) {
+	size_t i, j, k;
+	vec3 accel;
+	PointerVector *pv = &level->dynamics;
+
+	for (i = 0; i < pv->size; i++) {
+		InstanceGroup *ig = pv->buffer[i];
+		for (j = 0; j < ig->instances.size; j++) {
+			Instance *inst = ig->instances.buffer[j];
+			if (inst->isStatic || inst->isSleeping)
+				continue;
+			if (s_phys_is_supported(level, inst, h))
+				glm_vec3_sub(inst->acceleration, level->ambient_gravity, accel);
+			else
+				glm_vec3_copy(inst->acceleration, accel);
+			if (glm_vec3_norm(inst->velocity) < PHYS_SLEEP_VELOCITY
+					&& glm_vec3_norm(accel) < PHYS_SLEEP_ACCELERATION) {
+				if (++inst->restSteps >= PHYS_SLEEP_STEPS) {
+					inst->isSleeping = true;
+					glm_vec3_zero(inst->velocity);
+				}
+			}
+			else {
+				inst->restSteps = 0;
+				if (inst->gravity_space) {
+					for (k = 0; k < inst->gravity_space->size; k++)
+						phys_wake(inst->gravity_space->buffer[k]);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * A body is held up against ambient gravity when it touches something
+ * that doesn't move below it, or when collisions with range geometry,
+ * which has no instance, kept it from gaining speed along gravity this
+ * step. A body falling freely gains |g| * h every step.
+ */
+bool s_phys_is_supported(Level *level, Instance *inst, double h) {
+	size_t k;
+	vec3 d;
+	float g = glm_vec3_norm(level->ambient_gravity);
+
+	if (g == 0.0f)
+		return true;
+	if (inst->collision_space) {
+		for (k = 0; k < inst->collision_space->size; k++) {
+			Instance *other = inst->collision_space->buffer[k];
+			glm_vec3_sub(other->pos, inst->pos, d);
+			if ((other->isStatic || other->isSleeping) && glm_vec3_dot(d, level->ambient_gravity) > 0.0f)
+				return true;
+		}
+	}
+	return glm_vec3_dot(inst->velocity, level->ambient_gravity) / g < 0.5 * g * h;
+}
+
+void phys_wake(Instance *inst) {
+	inst->isSleeping = false;
+	inst->restSteps = 0;
+}
+
+/*
+ * Kinetic plus potential energy of the level, from mutual gravity and 
+ * from the ambient field. Conserved up to integration error when no 
+ * impulses or collisions act, which makes it a handy drift measure.
+ */
+double phys_total_energy(Level *level) {
+	size_t i, j;
+	double energy = 0.0;
+	PointerVector *pv = &level->dynamics;
+
+	for (i = 0; i < pv->size; i++) {
+		InstanceGroup *ig = pv->buffer[i];
+		for (j = 0; j < ig->instances.size; j++) {
+			Instance *inst = ig->instances.buffer[j];
+			if (inst->isStatic)
+				continue;
+			energy += 0.5 * inst->mass * glm_vec3_dot(inst->velocity, inst->velocity);
+			energy -= inst->mass * glm_vec3_dot(level->ambient_gravity, inst->pos);
+		}
+	}
+	pv = &level->gravityObjects;
+	for (i = 0; i < pv->size; i++) {
+		Instance *i1 = pv->buffer[i];
+		for (j = i + 1; j < pv->size; j++) {
+			Instance *i2 = pv->buffer[j];
+			energy -= GRAV_G * i1->mass * i2->mass / glm_vec3_distance(i1->pos, i2->pos);
+		}
+	}
+	return energy;
+}
+
 void s_phys_compute_point_gravity(vec3 result, Instance *i1, Instance *i2) {
 	vec3 diff;
 	double r12 = glm_vec3_distance(i2->pos, i1->pos);
@@ -4,17 +4,20 @@
 #include "game.h"
 #include "models.h"
 
-typedef struct phys_impulse_s phys_impulse_s;
+#define PHYS_INIT_IMPULSE_BUF_SIZE 64
+/* a body resting below both thresholds for PHYS_SLEEP_STEPS steps sleeps */
+#define PHYS_SLEEP_VELOCITY 0.05
+#define PHYS_SLEEP_ACCELERATION 0.05
+#define PHYS_SLEEP_STEPS 60
+/* most fixed timesteps run per frame before the backlog is dropped */
+#define PHYS_MAX_SUBSTEPS 8
 
-struct phys_impulse_s {
-	double dt;
-	vec3 force;
-};
-
-extern phys_impulse_s *phys_impulse_new(double dt);
-extern void phys_add_impulse(Instance *inst, phys_impulse_s *impulse);
-extern void phys_compute_force(Level *level);
-extern void phys_update_position(Level *level);
+extern int phys_impulse_buffer_init(ImpulseBuffer *ib);
+extern void phys_impulse_buffer_free(ImpulseBuffer *ib);
+extern int phys_add_impulse(Level *level, Instance *inst, vec3 force, double dt);
+extern void phys_step(Level *level, double dt);
+extern void phys_wake(Instance *inst);
+extern double phys_total_energy(Level *level);
 
 #endif
 
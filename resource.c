@@ -0,0 +1,101 @@
+#include "resource.h"
+#include "common/log.h"
+
+static void s_resource_unlink(resource_cache_s *cache, resource_s *res);
+static void s_resource_trim(resource_cache_s *cache);
+
+void resource_cache_init(resource_cache_s *cache, size_t budget,
+		resource_unload_fn unload, void *data) {
+	cache->budget = budget;
+	cache->bytes = 0;
+	cache->evictions = 0;
+	cache->lru = NULL;
+	cache->mru = NULL;
+	cache->trimming = false;
+	cache->unload = unload;
+	cache->data = data;
+}
+
+void resource_cache_set_budget(resource_cache_s *cache, size_t budget) {
+	cache->budget = budget;
+	s_resource_trim(cache);
+}
+
+void resource_init(resource_s *res, resource_type_e type, int id) {
+	res->type = type;
+	res->id = id;
+	res->refs = 0;
+	res->bytes = 0;
+	res->resident = false;
+	res->prev = NULL;
+	res->next = NULL;
+}
+
+/*
+ * Counts a resource that was just (re)loaded. It isn't evictable until
+ * it has been acquired and released, so the loader can acquire it first.
+ */
+void resource_loaded(resource_cache_s *cache, resource_s *res) {
+	res->resident = true;
+	cache->bytes += res->bytes;
+	s_resource_trim(cache);
+}
+
+void resource_acquire(resource_cache_s *cache, resource_s *res) {
+	if (res->refs++ == 0 && res->resident)
+		s_resource_unlink(cache, res);
+}
+
+void resource_release(resource_cache_s *cache, resource_s *res) {
+	if (res->refs <= 0) {
+		log_error("resource %d of type %d released more often than acquired", res->id, res->type);
+		return;
+	}
+	if (--res->refs || !res->resident)
+		return;
+	res->prev = cache->mru;
+	res->next = NULL;
+	if (cache->mru)
+		cache->mru->next = res;
+	else
+		cache->lru = res;
+	cache->mru = res;
+	s_resource_trim(cache);
+}
+
+void s_resource_unlink(resource_cache_s *cache, resource_s *res) {
+	if (res->prev)
+		res->prev->next = res->next;
+	else if (cache->lru == res)
+		cache->lru = res->next;
+	else
+		return;
+	if (res->next)
+		res->next->prev = res->prev;
+	else
+		cache->mru = res->prev;
+	res->prev = NULL;
+	res->next = NULL;
+}
+
+/*
+ * Evicting a model releases its program and texture, which may put them
+ * on the list too; they're evicted by the same loop rather than
+ * recursively.
+ */
+void s_resource_trim(resource_cache_s *cache) {
+	if (cache->trimming)
+		return;
+	cache->trimming = true;
+	while (cache->bytes > cache->budget && cache->lru) {
+		resource_s *res = cache->lru;
+		s_resource_unlink(cache, res);
+		res->resident = false;
+		cache->bytes -= res->bytes;
+		cache->evictions++;
+		log_debug("evicting resource %d of type %d, %zu bytes", res->id, res->type, res->bytes);
+		cache->unload(cache->data, res);
+		res->bytes = 0;
+	}
+	cache->trimming = false;
+}
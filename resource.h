@@ -0,0 +1,62 @@
+#ifndef __resource_h__
+#define __resource_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* bytes of GPU memory kept by unreferenced resources before they're evicted */
+#define RESOURCE_DEFAULT_BUDGET (256 * 1024 * 1024)
+
+typedef struct resource_s resource_s;
+typedef struct resource_cache_s resource_cache_s;
+
+/* frees the GPU objects of an evicted resource, which stays allocated for reloading */
+typedef void (*resource_unload_fn)(void *data, resource_s *res);
+
+typedef enum {
+	RESOURCE_MODEL,
+	RESOURCE_PROGRAM,
+	RESOURCE_TEXTURE
+} resource_type_e;
+
+/*
+ * Bookkeeping embedded in every GPU resource. bytes is filled in by the
+ * loader before resource_loaded. Resources with no references are kept
+ * loaded on the cache's LRU list until the budget needs their memory.
+ */
+struct resource_s {
+	resource_type_e type;
+	int id;
+	int refs;
+	size_t bytes;
+	bool resident;
+	resource_s *prev;
+	resource_s *next;
+};
+
+/*
+ * Tracks the memory of every loaded resource. Whenever it goes over
+ * budget, unreferenced resources are evicted least recently released
+ * first. Referenced resources are never evicted, so the budget can be
+ * exceeded by what's in use.
+ */
+struct resource_cache_s {
+	size_t budget;
+	size_t bytes;
+	size_t evictions;
+	resource_s *lru;
+	resource_s *mru;
+	bool trimming;
+	resource_unload_fn unload;
+	void *data;
+};
+
+extern void resource_cache_init(resource_cache_s *cache, size_t budget,
+		resource_unload_fn unload, void *data);
+extern void resource_cache_set_budget(resource_cache_s *cache, size_t budget);
+extern void resource_init(resource_s *res, resource_type_e type, int id);
+extern void resource_loaded(resource_cache_s *cache, resource_s *res);
+extern void resource_acquire(resource_cache_s *cache, resource_s *res);
+extern void resource_release(resource_cache_s *cache, resource_s *res);
+
+#endif
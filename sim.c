@@ -0,0 +1,286 @@
+#include "sim.h"
+#include "physics.h"
+#include "common/log.h"
+#include <GLFW/glfw3.h>
+#include <stdlib.h>
+#include <time.h>
+
+static void *s_sim_run(void *data);
+static void s_sim_tick(sim_s *sim, double tick, double time);
+static void s_sim_drain(sim_s *sim);
+static void s_sim_spawn(Level *level, sim_event_s *event);
+static void s_sim_snapshot_begin(sim_snapshot_s *snap, Level *level);
+static void s_sim_snapshot_end(sim_snapshot_s *snap, Level *level);
+static int s_sim_snapshot_reserve(sim_snapshot_s *snap, size_t count);
+static void s_sim_publish(sim_s *sim);
+static void s_sim_sleep(double seconds);
+
+sim_s *sim_new(Level *level) {
+	sim_s *sim = calloc(1, sizeof *sim);
+	if (!sim) {
+		log_error("failed to allocate memory for simulation");
+		return NULL;
+	}
+	sim->level = level;
+	if (pthread_mutex_init(&sim->lock, NULL)) {
+		log_error("failed to create simulation lock");
+		free(sim);
+		return NULL;
+	}
+	atomic_init(&sim->running, false);
+	atomic_init(&sim->head, 0);
+	atomic_init(&sim->tail, 0);
+	sim->back = 0;
+	atomic_init(&sim->middle, 1);
+	sim->front = 2;
+	return sim;
+}
+
+int sim_start(sim_s *sim) {
+	atomic_store(&sim->running, true);
+	if (pthread_create(&sim->thread, NULL, s_sim_run, sim)) {
+		log_error("failed to start simulation thread");
+		atomic_store(&sim->running, false);
+		return -1;
+	}
+	return 0;
+}
+
+void sim_stop(sim_s *sim) {
+	if (!atomic_exchange(&sim->running, false))
+		return;
+	pthread_join(sim->thread, NULL);
+	log_debug("simulation stopped after %zu ticks", sim->ticks);
+}
+
+/*
+ * Stops the simulation if it's still running and frees it. The level is
+ * left alone.
+ */
+void sim_free(sim_s *sim) {
+	int i;
+
+	sim_stop(sim);
+	for (i = 0; i < 3; i++) {
+		free(sim->snapshots[i].prevPos);
+		free(sim->snapshots[i].pos);
+		free(sim->snapshots[i].scale);
+		free(sim->snapshots[i].rotation);
+		free(sim->snapshots[i].runs);
+	}
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+}
+
+void sim_lock(sim_s *sim) {
+	pthread_mutex_lock(&sim->lock);
+}
+
+void sim_unlock(sim_s *sim) {
+	pthread_mutex_unlock(&sim->lock);
+}
+
+/*
+ * Queues an event for the next tick, called from the render thread only.
+ * Returns false and drops the event if the queue is full.
+ */
+bool sim_push(sim_s *sim, const sim_event_s *event) {
+	size_t head = atomic_load_explicit(&sim->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&sim->tail, memory_order_acquire);
+
+	if (head - tail == SIM_QUEUE_SIZE)
+		return false;
+	sim->events[head & (SIM_QUEUE_SIZE - 1)] = *event;
+	atomic_store_explicit(&sim->head, head + 1, memory_order_release);
+	return true;
+}
+
+/*
+ * Returns the latest published snapshot, called from the render thread
+ * only. The snapshot stays valid until the next call.
+ */
+const sim_snapshot_s *sim_acquire(sim_s *sim) {
+	if (atomic_load(&sim->middle) & SIM_SNAPSHOT_FRESH)
+		sim->front = atomic_exchange(&sim->middle, sim->front) & ~SIM_SNAPSHOT_FRESH;
+	return &sim->snapshots[sim->front];
+}
+
+/*
+ * Ticks on a fixed schedule. When the thread falls more than
+ * PHYS_MAX_SUBSTEPS ticks behind the backlog is dropped rather than
+ * simulated.
+ */
+void *s_sim_run(void *data) {
+	sim_s *sim = data;
+	double tick = sim->level->timestep > 0.0 ? sim->level->timestep : SIM_TICK;
+	double next = glfwGetTime() + tick;
+
+	while (atomic_load(&sim->running)) {
+		double now = glfwGetTime();
+		if (now < next) {
+			s_sim_sleep(next - now);
+			continue;
+		}
+		if (now - next > PHYS_MAX_SUBSTEPS * tick)
+			next = now;
+		s_sim_tick(sim, tick, next);
+		next += tick;
+	}
+	return NULL;
+}
+
+void s_sim_tick(sim_s *sim, double tick, double time) {
+	Level *level = sim->level;
+	sim_snapshot_s *snap = &sim->snapshots[sim->back];
+
+	pthread_mutex_lock(&sim->lock);
+	s_sim_drain(sim);
+	s_sim_snapshot_begin(snap, level);
+	phys_step(level, tick);
+	s_sim_snapshot_end(snap, level);
+	pthread_mutex_unlock(&sim->lock);
+
+	snap->time = time;
+	snap->tick = tick;
+	s_sim_publish(sim);
+	sim->ticks++;
+}
+
+void s_sim_drain(sim_s *sim) {
+	size_t tail = atomic_load_explicit(&sim->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&sim->head, memory_order_acquire);
+
+	for (; tail != head; tail++) {
+		sim_event_s *event = &sim->events[tail & (SIM_QUEUE_SIZE - 1)];
+		switch (event->type) {
+			case SIM_EVENT_SPAWN:
+				s_sim_spawn(sim->level, event);
+				break;
+		}
+	}
+	atomic_store_explicit(&sim->tail, tail, memory_order_release);
+}
+
+/*
+ * Throws an instance of the level's first model from event->pos along
+ * event->dir.
+ */
+void s_sim_spawn(Level *level, sim_event_s *event) {
+	vec3 force;
+	Instance *inst;
+	InstanceGroup *template;
+
+	if (!level->instances.size)
+		return;
+	template = level->instances.buffer[0];
+	inst = arena_calloc(&level->arena, sizeof *inst);
+	if (!inst) {
+		log_error("failed to allocate memory for spawned instance");
+		return;
+	}
+	glm_vec3_copy(event->pos, inst->pos);
+	inst->mass = 10;
+	glm_vec3_fill(inst->scale, 10);
+	inst->isSubjectToGravity = true;
+	inst->isStatic = false;
+	inst->model = template->model;
+
+	glm_vec3_scale(event->dir, 1E4, force);
+	phys_add_impulse(level, inst, force, 0.01);
+
+	instance_group_add(&level->dynamics, inst->model, inst);
+	pointer_vector_add(&level->gravityObjects, inst);
+}
+
+/*
+ * Copies everything but the positions the tick ends at, which are filled
+ * in by s_sim_snapshot_end in the same order.
+ */
+void s_sim_snapshot_begin(sim_snapshot_s *snap, Level *level) {
+	size_t i, j;
+
+	snap->count = 0;
+	snap->nruns = 0;
+	for (i = 0; i < level->dynamics.size; i++) {
+		InstanceGroup *ig = level->dynamics.buffer[i];
+		if (!ig->instances.size)
+			continue;
+		if (s_sim_snapshot_reserve(snap, snap->count + ig->instances.size) < 0)
+			return;
+		if (snap->nruns == snap->runsCap) {
+			size_t cap = snap->runsCap ? snap->runsCap * 2 : 8;
+			sim_run_s *runs = realloc(snap->runs, cap * sizeof *runs);
+			if (!runs) {
+				log_error("failed to allocate memory for snapshot");
+				return;
+			}
+			snap->runs = runs;
+			snap->runsCap = cap;
+		}
+		sim_run_s *run = &snap->runs[snap->nruns++];
+		run->model = ig->model;
+		run->first = snap->count;
+		run->count = ig->instances.size;
+		for (j = 0; j < ig->instances.size; j++) {
+			Instance *inst = ig->instances.buffer[j];
+			glm_vec3_copy(inst->pos, snap->prevPos[snap->count]);
+			glm_vec3_copy(inst->scale, snap->scale[snap->count]);
+			glm_vec3_copy(inst->rotation, snap->rotation[snap->count]);
+			snap->count++;
+		}
+	}
+}
+
+void s_sim_snapshot_end(sim_snapshot_s *snap, Level *level) {
+	size_t i, j, k;
+
+	for (i = 0; i < snap->nruns; i++) {
+		sim_run_s *run = &snap->runs[i];
+		InstanceGroup *ig = instance_group_get(&level->dynamics, run->model);
+		for (j = 0, k = run->first; j < run->count; j++, k++) {
+			Instance *inst = ig->instances.buffer[j];
+			glm_vec3_copy(inst->pos, snap->pos[k]);
+		}
+	}
+}
+
+int s_sim_snapshot_reserve(sim_snapshot_s *snap, size_t count) {
+	size_t cap;
+	vec3 *prevPos, *pos, *scale, *rotation;
+
+	if (count <= snap->cap)
+		return 0;
+	cap = snap->cap ? snap->cap : 64;
+	while (cap < count)
+		cap *= 2;
+	prevPos = realloc(snap->prevPos, cap * sizeof *prevPos);
+	if (prevPos)
+		snap->prevPos = prevPos;
+	pos = realloc(snap->pos, cap * sizeof *pos);
+	if (pos)
+		snap->pos = pos;
+	scale = realloc(snap->scale, cap * sizeof *scale);
+	if (scale)
+		snap->scale = scale;
+	rotation = realloc(snap->rotation, cap * sizeof *rotation);
+	if (rotation)
+		snap->rotation = rotation;
+	if (!prevPos || !pos || !scale || !rotation) {
+		log_error("failed to allocate memory for snapshot");
+		return -1;
+	}
+	snap->cap = cap;
+	return 0;
+}
+
+void s_sim_publish(sim_s *sim) {
+	sim->back = atomic_exchange(&sim->middle, sim->back | SIM_SNAPSHOT_FRESH) & ~SIM_SNAPSHOT_FRESH;
+}
+
+void s_sim_sleep(double seconds) {
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)seconds;
+	ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+	nanosleep(&ts, NULL);
+}
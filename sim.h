@@ -0,0 +1,96 @@
+#ifndef __sim_h__
+#define __sim_h__
+
+#include "models.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* seconds between ticks when the level has no fixed timestep */
+#define SIM_TICK (1.0 / 120.0)
+/* pending input events, must be a power of two */
+#define SIM_QUEUE_SIZE 64
+/* set on the published snapshot index until the render thread takes it */
+#define SIM_SNAPSHOT_FRESH 4
+
+typedef struct sim_event_s sim_event_s;
+typedef struct sim_run_s sim_run_s;
+typedef struct sim_snapshot_s sim_snapshot_s;
+typedef struct sim_s sim_s;
+
+typedef enum {
+	SIM_EVENT_SPAWN
+} sim_event_e;
+
+/* input handed from the render thread to the simulation thread */
+struct sim_event_s {
+	sim_event_e type;
+	vec3 pos;
+	vec3 dir;
+};
+
+/* instances [first, first + count) of a snapshot all draw model */
+struct sim_run_s {
+	Model *model;
+	size_t first;
+	size_t count;
+};
+
+/*
+ * State of every moving instance after a tick, in parallel arrays with the
+ * instances of a model next to each other. prevPos holds the positions the
+ * tick started from so the render thread can interpolate between them.
+ * Rotations and scales are never changed by physics and are copied as is.
+ */
+struct sim_snapshot_s {
+	/* time the tick ended at and its length, in glfwGetTime seconds */
+	double time;
+	double tick;
+	size_t count;
+	size_t cap;
+	vec3 *prevPos;
+	vec3 *pos;
+	vec3 *scale;
+	vec3 *rotation;
+	size_t nruns;
+	size_t runsCap;
+	sim_run_s *runs;
+};
+
+/*
+ * Runs physics on its own thread in fixed ticks. Every tick is published
+ * as a snapshot into a triple buffer: the simulation thread fills back,
+ * swaps it with middle and flags it fresh, and the render thread swaps
+ * middle with front whenever it's fresh, so neither ever waits on the
+ * other. Input reaches the simulation thread through a single producer,
+ * single consumer ring of events.
+ *
+ * lock is held for a whole tick and guards the structure of the level
+ * shared by both threads: its instance groups and collision grid. The
+ * render thread takes it only while streaming cells in and out.
+ */
+struct sim_s {
+	Level *level;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	atomic_bool running;
+	sim_event_s events[SIM_QUEUE_SIZE];
+	/* next event written by the render thread and read by the simulation thread */
+	atomic_size_t head;
+	atomic_size_t tail;
+	sim_snapshot_s snapshots[3];
+	atomic_int middle;
+	int back;
+	int front;
+	size_t ticks;
+};
+
+extern sim_s *sim_new(Level *level);
+extern int sim_start(sim_s *sim);
+extern void sim_stop(sim_s *sim);
+extern void sim_free(sim_s *sim);
+extern void sim_lock(sim_s *sim);
+extern void sim_unlock(sim_s *sim);
+extern bool sim_push(sim_s *sim, const sim_event_s *event);
+extern const sim_snapshot_s *sim_acquire(sim_s *sim);
+
+#endif
@@ -0,0 +1,222 @@
+#include "stream.h"
+#include "collision.h"
+#include "common/log.h"
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+
+static void s_stream_visit(void *data, int id, vec3 min, vec3 max, int count);
+static float s_stream_dist(stream_cell_s *cell, vec3 center);
+static int s_stream_cmp(const void *a, const void *b);
+static bool s_stream_evict(stream_s *stream, stream_cell_s *cell);
+static void s_stream_load(stream_s *stream, Level *level, stream_cell_s *cell);
+static void s_stream_release(stream_s *stream, Level *level);
+static double s_stream_now(void);
+
+stream_s *stream_new(bob_db_s *bdb, Level *level) {
+	stream_s *stream = arena_calloc(&level->arena, sizeof *stream);
+	if (!stream) {
+		log_error("failed to allocate memory for level stream");
+		return NULL;
+	}
+	stream->bdb = bdb;
+	stream->arena = &level->arena;
+	stream->levelID = level->id;
+	stream->radius = level->cellSize * STREAM_RADIUS_CELLS;
+	pointer_vector_init_arena(&stream->cells, stream->arena);
+	pointer_vector_init_arena(&stream->pending, stream->arena);
+	pointer_vector_init_arena(&stream->freeCells, stream->arena);
+	pointer_vector_init_arena(&stream->freeInstances, stream->arena);
+	return stream;
+}
+
+/*
+ * Runs once per frame after the camera moved: unloads cells that fell out
+ * of range, then loads the nearest cells that came into range within the
+ * time and instance budgets.
+ */
+void stream_update(stream_s *stream, Level *level) {
+	size_t i;
+	vec3 min, max, center;
+	double start;
+
+	if (!stream)
+		return;
+	start = s_stream_now();
+	glm_vec3_copy(level->camera.pos, center);
+
+	for (i = 0; i < stream->cells.size; i++) {
+		stream_cell_s *cell = stream->cells.buffer[i];
+		cell->dist = s_stream_dist(cell, center);
+		if (cell->dist > stream->radius * STREAM_UNLOAD_SLACK) {
+			cell->resident = false;
+			stream->resident -= cell->instances.size;
+		}
+	}
+
+	glm_vec3_subs(center, stream->radius, min);
+	glm_vec3_adds(center, stream->radius, max);
+	stream->pending.size = 0;
+	bob_dbquery_cells(stream->bdb, stream->levelID, min, max, s_stream_visit, stream);
+	for (i = 0; i < stream->pending.size; i++) {
+		stream_cell_s *cell = stream->pending.buffer[i];
+		cell->dist = s_stream_dist(cell, center);
+	}
+	qsort(stream->pending.buffer, stream->pending.size, sizeof *stream->pending.buffer, s_stream_cmp);
+
+	for (i = 0; i < stream->pending.size; i++) {
+		stream_cell_s *cell = stream->pending.buffer[i];
+		if (s_stream_now() - start > STREAM_FRAME_BUDGET || !s_stream_evict(stream, cell))
+			break;
+		s_stream_load(stream, level, cell);
+	}
+	for (; i < stream->pending.size; i++)
+		pointer_vector_add(&stream->freeCells, stream->pending.buffer[i]);
+
+	s_stream_release(stream, level);
+}
+
+/*
+ * Queues a cell in range unless it's already loaded.
+ */
+void s_stream_visit(void *data, int id, vec3 min, vec3 max, int count) {
+	size_t i;
+	stream_s *stream = data;
+	stream_cell_s *cell;
+
+	for (i = 0; i < stream->cells.size; i++) {
+		cell = stream->cells.buffer[i];
+		if (cell->id == id)
+			return;
+	}
+	if (stream->freeCells.size) {
+		cell = stream->freeCells.buffer[--stream->freeCells.size];
+	}
+	else {
+		cell = arena_calloc(stream->arena, sizeof *cell);
+		if (!cell) {
+			log_error("failed to allocate memory for stream cell");
+			return;
+		}
+		pointer_vector_init_arena(&cell->instances, stream->arena);
+	}
+	cell->id = id;
+	cell->count = count;
+	cell->resident = false;
+	glm_vec3_copy(min, cell->min);
+	glm_vec3_copy(max, cell->max);
+	pointer_vector_add(&stream->pending, cell);
+}
+
+/*
+ * Distance from center to the closest point of the cell's bounds.
+ */
+float s_stream_dist(stream_cell_s *cell, vec3 center) {
+	int k;
+	float d, dist2 = 0.0f;
+
+	for (k = 0; k < 3; k++) {
+		d = fmaxf(cell->min[k] - center[k], fmaxf(0.0f, center[k] - cell->max[k]));
+		dist2 += d * d;
+	}
+	return sqrtf(dist2);
+}
+
+int s_stream_cmp(const void *a, const void *b) {
+	const stream_cell_s *ca = *(stream_cell_s * const *)a, *cb = *(stream_cell_s * const *)b;
+
+	return (ca->dist > cb->dist) - (ca->dist < cb->dist);
+}
+
+/*
+ * Makes room for cell within the instance budget by unloading loaded cells
+ * farther away than it. Returns false if there isn't enough room.
+ */
+bool s_stream_evict(stream_s *stream, stream_cell_s *cell) {
+	size_t i;
+
+	while (stream->resident + cell->count > STREAM_MAX_INSTANCES) {
+		stream_cell_s *farthest = NULL;
+		for (i = 0; i < stream->cells.size; i++) {
+			stream_cell_s *c = stream->cells.buffer[i];
+			if (c->resident && c->dist > cell->dist && (!farthest || c->dist > farthest->dist))
+				farthest = c;
+		}
+		if (!farthest)
+			return false;
+		farthest->resident = false;
+		stream->resident -= farthest->instances.size;
+	}
+	return true;
+}
+
+void s_stream_load(stream_s *stream, Level *level, stream_cell_s *cell) {
+	size_t i;
+
+	cell->instances.size = 0;
+	if (bob_dbload_cell(stream->bdb, cell->id, &cell->instances, &stream->freeInstances, 
+				stream->arena) < 0) {
+		pointer_vector_add(&stream->freeCells, cell);
+		return;
+	}
+	for (i = 0; i < cell->instances.size; i++) {
+		Instance *inst = cell->instances.buffer[i];
+		inst->cell = cell;
+		instance_group_add(&level->instances, inst->model, inst);
+	}
+	cell->resident = true;
+	stream->resident += cell->instances.size;
+	pointer_vector_add(&stream->cells, cell);
+}
+
+/*
+ * Unloads the cells no longer resident: their instances are dropped from
+ * the instance groups and the collision grid in one pass and returned to
+ * the pool.
+ */
+void s_stream_release(stream_s *stream, Level *level) {
+	size_t i, j, k, released = 0;
+
+	for (i = 0; i < stream->cells.size; i++) {
+		stream_cell_s *cell = stream->cells.buffer[i];
+		if (!cell->resident)
+			released++;
+	}
+	if (!released)
+		return;
+
+	for (i = 0; i < level->instances.size; i++) {
+		InstanceGroup *ig = level->instances.buffer[i];
+		for (j = k = 0; j < ig->instances.size; j++) {
+			Instance *inst = ig->instances.buffer[j];
+			if (!inst->cell || inst->cell->resident)
+				ig->instances.buffer[k++] = inst;
+		}
+		ig->instances.size = k;
+	}
+
+	for (i = k = 0; i < stream->cells.size; i++) {
+		stream_cell_s *cell = stream->cells.buffer[i];
+		if (cell->resident) {
+			stream->cells.buffer[k++] = cell;
+			continue;
+		}
+		for (j = 0; j < cell->instances.size; j++) {
+			Instance *inst = cell->instances.buffer[j];
+			coll_remove_instance(level->collisionGrid, inst);
+			inst->cell = NULL;
+			pointer_vector_add(&stream->freeInstances, inst);
+		}
+		cell->instances.size = 0;
+		pointer_vector_add(&stream->freeCells, cell);
+	}
+	stream->cells.size = k;
+	log_debug("unloaded %zu cells, %zu streamed instances loaded", released, stream->resident);
+}
+
+double s_stream_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
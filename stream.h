@@ -0,0 +1,55 @@
+#ifndef __stream_h__
+#define __stream_h__
+
+#include "models.h"
+#include "loadlevel.h"
+
+/* cells within this many cell sizes of the camera are loaded */
+#define STREAM_RADIUS_CELLS 4
+/* loaded cells are kept until this much farther out, so cells on the edge don't thrash */
+#define STREAM_UNLOAD_SLACK 1.5f
+/* seconds of a frame spent loading cells */
+#define STREAM_FRAME_BUDGET 0.002
+/* most streamed instances loaded at once */
+#define STREAM_MAX_INSTANCES 65536
+
+typedef struct stream_cell_s stream_cell_s;
+typedef struct stream_s stream_s;
+
+/*
+ * A cell of static instances. Cells are recycled once unloaded, their
+ * instances go back to the stream's pool.
+ */
+struct stream_cell_s {
+	int id;
+	int count;
+	float dist;
+	bool resident;
+	vec3 min;
+	vec3 max;
+	PointerVector instances;
+};
+
+/*
+ * Loads the cells of a level around the camera. Cells in range that aren't
+ * loaded yet are collected in pending every frame and loaded nearest first
+ * until the frame's time budget is spent. When the instance budget is full,
+ * the farthest loaded cells make room for nearer ones. The stream, its 
+ * cells and their instances live in the level's arena.
+ */
+struct stream_s {
+	bob_db_s *bdb;
+	Arena *arena;
+	int levelID;
+	float radius;
+	size_t resident;
+	PointerVector cells;
+	PointerVector pending;
+	PointerVector freeCells;
+	PointerVector freeInstances;
+};
+
+extern stream_s *stream_new(bob_db_s *bdb, Level *level);
+extern void stream_update(stream_s *stream, Level *level);
+
+#endif
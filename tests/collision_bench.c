@@ -0,0 +1,158 @@
+#include "common/log.h"
+#include "collision.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Times the spatial hash broadphase against testing every pair of boxes
+ * and checks that both find the same overlapping pairs. Every instance is
+ * dynamic, so the narrowphase never pushes one out of another and the
+ * boxes stay put while both are run.
+ */
+
+#define BENCH_INSTANCES 4000
+#define BENCH_STEPS 8
+#define BENCH_EXTENT 160.0f
+
+static double s_now(void);
+static float s_rand(float lo, float hi);
+static size_t s_brute_pairs(Instance *insts, size_t n, unsigned char *overlaps);
+static int s_grid_check(Instance *insts, size_t n, const unsigned char *overlaps, size_t *npairs);
+
+int main(int argc, char *argv[]) {
+	size_t i, n = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_INSTANCES;
+	size_t step, brutePairs, gridPairs;
+	double t, bruteTime = 0.0, gridTime = 0.0;
+	Model m = {0};
+	Level level = {0};
+	Instance *insts = calloc(n, sizeof *insts);
+	unsigned char *overlaps = malloc(n * n);
+
+	if (!insts || !overlaps) {
+		fprintf(stderr, "failed to allocate %zu instances\n", n);
+		return 1;
+	}
+	log_init(stderr);
+	srand(1);
+	glm_vec3_copy((vec3){-0.5f, -0.5f, -0.5f}, m.bboxMin);
+	glm_vec3_copy((vec3){0.5f, 0.5f, 0.5f}, m.bboxMax);
+	pointer_vector_init(&level.instances);
+	pointer_vector_init(&level.dynamics);
+	for (i = 0; i < n; i++) {
+		Instance *inst = &insts[i];
+		inst->model = &m;
+		inst->mass = 1.0f;
+		glm_vec3_copy((vec3){s_rand(0.5f, 4.0f), s_rand(0.5f, 4.0f), s_rand(0.5f, 4.0f)}, inst->scale);
+		glm_vec3_copy((vec3){s_rand(0.0f, 3.14f), s_rand(0.0f, 3.14f), 0.0f}, inst->rotation);
+		instance_group_add(&level.dynamics, &m, inst);
+	}
+	/* a few large boxes that overflow the cell span and go through the oversized list */
+	for (i = 0; i < n / 500; i++)
+		glm_vec3_copy((vec3){BENCH_EXTENT / 2.0f, 2.0f, 2.0f}, insts[i].scale);
+	level.collisionGrid = coll_grid_new(coll_suggest_cell_size(&level));
+	if (!level.collisionGrid)
+		return 1;
+
+	for (step = 0; step < BENCH_STEPS; step++) {
+		for (i = 0; i < n; i++)
+			glm_vec3_copy((vec3){s_rand(0.0f, BENCH_EXTENT), s_rand(0.0f, BENCH_EXTENT), s_rand(0.0f, BENCH_EXTENT)}, insts[i].pos);
+
+		t = s_now();
+		brutePairs = s_brute_pairs(insts, n, overlaps);
+		bruteTime += s_now() - t;
+
+		t = s_now();
+		coll_update(&level);
+		gridTime += s_now() - t;
+
+		if (s_grid_check(insts, n, overlaps, &gridPairs) < 0)
+			return 1;
+		if (gridPairs != brutePairs) {
+			fprintf(stderr, "FAIL: step %zu, grid found %zu pairs, brute force %zu\n", step, gridPairs, brutePairs);
+			return 1;
+		}
+		printf("step %zu: %zu pairs, %zu grid tests against %zu brute force tests\n",
+				step, gridPairs, level.collisionGrid->tests, n * (n - 1) / 2);
+	}
+	printf("%zu instances: brute force %.3f ms/step, grid %.3f ms/step, %.1fx\n", n,
+			1e3 * bruteTime / BENCH_STEPS, 1e3 * gridTime / BENCH_STEPS, bruteTime / gridTime);
+
+	coll_grid_free(level.collisionGrid);
+	free(overlaps);
+	free(insts);
+	log_end();
+	return 0;
+}
+
+double s_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+float s_rand(float lo, float hi) {
+	return lo + (hi - lo) * (float)rand() / RAND_MAX;
+}
+
+/*
+ * The brute force loop marks every overlapping pair, so the grid result
+ * can be checked pair by pair afterwards.
+ */
+size_t s_brute_pairs(Instance *insts, size_t n, unsigned char *overlaps) {
+	size_t i, j, count = 0;
+	int k;
+	vec3 *min = malloc(n * sizeof *min), *max = malloc(n * sizeof *max);
+
+	for (i = 0; i < n; i++)
+		instance_get_aabb(&insts[i], min[i], max[i]);
+	memset(overlaps, 0, n * n);
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			for (k = 0; k < 3; k++) {
+				if (max[i][k] < min[j][k] || min[i][k] > max[j][k])
+					break;
+			}
+			if (k == 3) {
+				overlaps[i * n + j] = overlaps[j * n + i] = 1;
+				count++;
+			}
+		}
+	}
+	free(min);
+	free(max);
+	return count;
+}
+
+/*
+ * Every broadphase pair lands in the gravity space of both instances, so
+ * each instance's space must hold exactly the instances it overlaps, once.
+ */
+int s_grid_check(Instance *insts, size_t n, const unsigned char *overlaps, size_t *npairs) {
+	size_t i, j, found = 0;
+	unsigned char *seen = calloc(n, 1);
+
+	for (i = 0; i < n; i++) {
+		PointerVector *space = insts[i].gravity_space;
+		for (j = 0; j < space->size; j++) {
+			size_t other = (Instance *)space->buffer[j] - insts;
+			if (!overlaps[i * n + other] || seen[other]) {
+				fprintf(stderr, "FAIL: instance %zu paired with %zu %s\n", i, other,
+						seen[other] ? "twice" : "without overlapping");
+				free(seen);
+				return -1;
+			}
+			seen[other] = 1;
+			if (i < other)
+				found++;
+		}
+		for (j = 0; j < space->size; j++)
+			seen[(Instance *)space->buffer[j] - insts] = 0;
+	}
+	free(seen);
+	*npairs = found;
+	return 0;
+}
@@ -0,0 +1,112 @@
+#include "common/log.h"
+#include "physics.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Steps two bodies on circular orbits around a heavy one with each
+ * integrator and fails if the total energy ever drifts further from its
+ * starting value than the integrator's bound. All three integrators are
+ * symplectic, so their error should oscillate rather than grow.
+ */
+
+#define DRIFT_STEPS 10000
+#define DRIFT_TIMESTEP 0.01
+#define DRIFT_SUN_MASS 1e13
+
+extern const double GRAV_G;
+
+static void s_orbit(Instance *inst, Instance *sun, vec3 offset, vec3 axis);
+static double s_drift(bob_integrator_e integrator);
+
+static const struct {
+	bob_integrator_e integrator;
+	const char *name;
+	double bound;
+} s_cases[] = {
+	{BOB_INTEGRATOR_SEMI_IMPLICIT_EULER, "semi-implicit euler", 5e-4},
+	{BOB_INTEGRATOR_VELOCITY_VERLET, "velocity verlet", 1e-4},
+	{BOB_INTEGRATOR_LEAPFROG, "leapfrog", 1e-4}
+};
+
+int main(void) {
+	size_t i;
+	int failed = 0;
+
+	log_init(stderr);
+	for (i = 0; i < sizeof s_cases / sizeof *s_cases; i++) {
+		double drift = s_drift(s_cases[i].integrator);
+		bool ok = drift <= s_cases[i].bound;
+		printf("%s: max relative energy drift %g over %d steps (bound %g) %s\n", s_cases[i].name,
+				drift, DRIFT_STEPS, s_cases[i].bound, ok ? "ok" : "FAIL");
+		if (!ok)
+			failed = 1;
+	}
+	log_end();
+	return failed;
+}
+
+/*
+ * Largest |E - E0| / |E0| seen over the run.
+ */
+double s_drift(bob_integrator_e integrator) {
+	size_t i;
+	int step;
+	double e0, drift = 0.0;
+	Model m = {0};
+	Level level = {0};
+	Instance bodies[3] = {{0}};
+
+	level.integrator = integrator;
+	pointer_vector_init(&level.instances);
+	pointer_vector_init(&level.dynamics);
+	pointer_vector_init(&level.gravityObjects);
+	phys_impulse_buffer_init(&level.impulses);
+
+	bodies[0].mass = DRIFT_SUN_MASS;
+	s_orbit(&bodies[1], &bodies[0], (vec3){10.0f, 0.0f, 0.0f}, (vec3){0.0f, 1.0f, 0.0f});
+	s_orbit(&bodies[2], &bodies[0], (vec3){0.0f, 0.0f, 25.0f}, (vec3){1.0f, 0.0f, 0.0f});
+	for (i = 0; i < 3; i++) {
+		bodies[i].model = &m;
+		bodies[i].isSubjectToGravity = true;
+		glm_vec3_fill(bodies[i].scale, 1.0f);
+		instance_group_add(&level.dynamics, &m, &bodies[i]);
+		pointer_vector_add(&level.gravityObjects, &bodies[i]);
+	}
+
+	e0 = phys_total_energy(&level);
+	for (step = 0; step < DRIFT_STEPS; step++) {
+		phys_step(&level, DRIFT_TIMESTEP);
+		drift = fmax(drift, fabs(phys_total_energy(&level) - e0) / fabs(e0));
+	}
+
+	for (i = 0; i < level.dynamics.size; i++) {
+		InstanceGroup *ig = level.dynamics.buffer[i];
+		pointer_vector_free(&ig->instances);
+		free(ig);
+	}
+	phys_impulse_buffer_free(&level.impulses);
+	pointer_vector_free(&level.gravityObjects);
+	pointer_vector_free(&level.dynamics);
+	return drift;
+}
+
+/*
+ * Puts inst of unit mass on a circular orbit around sun, the sun taking
+ * the opposite momentum so the system stays at rest.
+ */
+void s_orbit(Instance *inst, Instance *sun, vec3 offset, vec3 axis) {
+	float r = glm_vec3_norm(offset);
+	float speed = sqrt(GRAV_G * sun->mass / r);
+	vec3 momentum;
+
+	inst->mass = 1.0f;
+	glm_vec3_add(sun->pos, offset, inst->pos);
+	glm_vec3_cross(axis, offset, inst->velocity);
+	glm_vec3_normalize(inst->velocity);
+	glm_vec3_scale(inst->velocity, speed, inst->velocity);
+	glm_vec3_scale(inst->velocity, -inst->mass / sun->mass, momentum);
+	glm_vec3_add(sun->velocity, momentum, sun->velocity);
+}
@@ -0,0 +1,118 @@
+#include "common/log.h"
+#include "physics.h"
+#include "collision.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Drops a body from rest under weak ambient gravity with each integrator
+ * and checks it is still falling after 10 seconds, at z = g t^2 / 2. Slow
+ * bodies whose only acceleration is ambient gravity used to look at rest
+ * and fall asleep in mid-air. A body lying on a static floor has to fall
+ * asleep still.
+ */
+
+#define FALL_TIMESTEP (1.0 / 120.0)
+#define FALL_STEPS 1200
+/* relative error allowed in the distance fallen */
+#define FALL_TOLERANCE 1e-2
+
+static int s_fall(bob_integrator_e integrator, float g, bool floor);
+
+static const struct {
+	bob_integrator_e integrator;
+	const char *name;
+} s_integrators[] = {
+	{BOB_INTEGRATOR_SEMI_IMPLICIT_EULER, "semi-implicit euler"},
+	{BOB_INTEGRATOR_VELOCITY_VERLET, "velocity verlet"},
+	{BOB_INTEGRATOR_LEAPFROG, "leapfrog"}
+};
+
+int main(void) {
+	size_t i, j;
+	int failed = 0;
+	const float gravities[] = {0.1f, 0.05f};
+
+	log_init(stderr);
+	for (i = 0; i < sizeof s_integrators / sizeof *s_integrators; i++) {
+		for (j = 0; j < sizeof gravities / sizeof *gravities; j++) {
+			printf("%s, g = %g: ", s_integrators[i].name, gravities[j]);
+			failed |= s_fall(s_integrators[i].integrator, gravities[j], false);
+			printf("%s, g = %g, on a floor: ", s_integrators[i].name, gravities[j]);
+			failed |= s_fall(s_integrators[i].integrator, gravities[j], true);
+		}
+	}
+	log_end();
+	return failed;
+}
+
+/*
+ * Without a floor the body must be awake and where free fall puts it at
+ * the end, with one the body must be asleep on top of it.
+ */
+int s_fall(bob_integrator_e integrator, float g, bool floor) {
+	size_t i;
+	int step, result = 0;
+	float expected = 0.5f * g * (FALL_STEPS * FALL_TIMESTEP) * (FALL_STEPS * FALL_TIMESTEP);
+	Model m = {0};
+	Level level = {0};
+	Instance body = {0}, ground = {0};
+
+	level.integrator = integrator;
+	glm_vec3_copy((vec3){0.0f, 0.0f, g}, level.ambient_gravity);
+	pointer_vector_init(&level.instances);
+	pointer_vector_init(&level.dynamics);
+	pointer_vector_init(&level.gravityObjects);
+	phys_impulse_buffer_init(&level.impulses);
+	glm_vec3_copy((vec3){-0.5f, -0.5f, -0.5f}, m.bboxMin);
+	glm_vec3_copy((vec3){0.5f, 0.5f, 0.5f}, m.bboxMax);
+
+	body.model = &m;
+	body.mass = 1.0f;
+	body.isSubjectToGravity = true;
+	glm_vec3_fill(body.scale, 1.0f);
+	instance_group_add(&level.dynamics, &m, &body);
+	if (floor) {
+		ground.model = &m;
+		ground.mass = 1.0f;
+		ground.isStatic = true;
+		glm_vec3_copy((vec3){0.0f, 0.0f, 1.0f}, ground.pos);
+		glm_vec3_copy((vec3){100.0f, 100.0f, 1.0f}, ground.scale);
+		instance_group_add(&level.instances, &m, &ground);
+	}
+	level.collisionGrid = coll_grid_new(coll_suggest_cell_size(&level));
+
+	for (step = 0; step < FALL_STEPS; step++)
+		phys_step(&level, FALL_TIMESTEP);
+
+	if (floor) {
+		printf("z = %f, %s %s\n", body.pos[2], body.isSleeping ? "asleep" : "awake",
+				body.isSleeping ? "ok" : "FAIL");
+		result = !body.isSleeping;
+	}
+	else {
+		bool ok = !body.isSleeping && fabsf(body.pos[2] - expected) <= FALL_TOLERANCE * expected;
+		printf("z = %f, expected %f, %s %s\n", body.pos[2], expected, body.isSleeping ? "asleep" : "awake",
+				ok ? "ok" : "FAIL");
+		result = !ok;
+	}
+
+	coll_grid_free(level.collisionGrid);
+	for (i = 0; i < level.dynamics.size; i++) {
+		InstanceGroup *ig = level.dynamics.buffer[i];
+		pointer_vector_free(&ig->instances);
+		free(ig);
+	}
+	for (i = 0; i < level.instances.size; i++) {
+		InstanceGroup *ig = level.instances.buffer[i];
+		pointer_vector_free(&ig->instances);
+		free(ig);
+	}
+	phys_impulse_buffer_free(&level.impulses);
+	pointer_vector_free(&level.gravityObjects);
+	pointer_vector_free(&level.instances);
+	pointer_vector_free(&level.dynamics);
+	return result;
+}
@@ -0,0 +1,135 @@
+#include "common/log.h"
+#include "loadlevel.h"
+#include "indirect.h"
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Loads and unloads a level over and over, with a second copy of it
+ * resident half of the time, and reports the load and unload latency.
+ * With a resource budget of 0 every model, program and texture is
+ * unloaded as soon as the last level using it is, so GPU memory has to be
+ * back to nothing after each round; the process must not grow either once
+ * the allocator has warmed up. Needs a GL context, so run it where the
+ * game runs, from the top of the tree:
+ *   ./tests/level_churn [database] [level] [rounds]
+ */
+
+#define CHURN_ROUNDS 200
+#define CHURN_WARMUP 10
+/* resident memory a round may leave behind on average */
+#define CHURN_MAX_GROWTH 4096
+
+static double s_now(void);
+static long s_resident_bytes(void);
+
+int main(int argc, char *argv[]) {
+	const char *path = argc > 1 ? argv[1] : "level/test.db";
+	const char *name = argc > 2 ? argv[2] : "hello";
+	int i, rounds = argc > 3 ? atoi(argv[3]) : CHURN_ROUNDS;
+	long rss0 = 0, growth;
+	double t, loadTime = 0.0, unloadTime = 0.0, maxLoad = 0.0, maxUnload = 0.0;
+	size_t loads = 0, unloads = 0;
+	GLFWwindow *window;
+	bob_db_s *bdb;
+
+	log_init(stderr);
+	if (!glfwInit())
+		return 1;
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	window = glfwCreateWindow(64, 64, "level churn", NULL, NULL);
+	if (!window) {
+		glfwTerminate();
+		return 1;
+	}
+	glfwMakeContextCurrent(window);
+	if (glewInit() != GLEW_OK)
+		return 1;
+
+	bdb = bob_loaddb(path);
+	if (!bdb)
+		return 1;
+	bob_set_resource_budget(bdb, 0);
+
+	for (i = 0; i < rounds; i++) {
+		Level *levels[2] = {NULL, NULL};
+		int k, n = i % 2 ? 2 : 1;
+
+		for (k = 0; k < n; k++) {
+			t = s_now();
+			levels[k] = bob_loadlevel(bdb, name);
+			t = s_now() - t;
+			if (!levels[k]) {
+				fprintf(stderr, "FAIL: round %d, couldn't load %s from %s\n", i, name, path);
+				return 1;
+			}
+			loadTime += t;
+			maxLoad = t > maxLoad ? t : maxLoad;
+			loads++;
+		}
+		/* switch to the level loaded first, then drop the others under it */
+		indirect_bind(levels[0]);
+		for (k = n - 1; k >= 0; k--) {
+			t = s_now();
+			bob_unloadlevel(bdb, levels[k]);
+			t = s_now() - t;
+			unloadTime += t;
+			maxUnload = t > maxUnload ? t : maxUnload;
+			unloads++;
+		}
+
+		if (bob_resource_bytes(bdb)) {
+			fprintf(stderr, "FAIL: round %d, %zu bytes of GPU resources still loaded\n",
+					i, bob_resource_bytes(bdb));
+			return 1;
+		}
+		if (glGetError() != GL_NO_ERROR) {
+			fprintf(stderr, "FAIL: round %d, OpenGL error\n", i);
+			return 1;
+		}
+		if (i == CHURN_WARMUP)
+			rss0 = s_resident_bytes();
+	}
+
+	printf("%zu loads: %.3f ms average, %.3f ms worst\n", loads, 1e3 * loadTime / loads, 1e3 * maxLoad);
+	printf("%zu unloads: %.3f ms average, %.3f ms worst\n", unloads, 1e3 * unloadTime / unloads, 1e3 * maxUnload);
+	if (rounds > CHURN_WARMUP + 1) {
+		growth = s_resident_bytes() - rss0;
+		printf("resident memory grew %ld bytes over %d rounds\n", growth, rounds - CHURN_WARMUP - 1);
+		if (growth > (long)CHURN_MAX_GROWTH * (rounds - CHURN_WARMUP - 1)) {
+			fprintf(stderr, "FAIL: resident memory keeps growing\n");
+			return 1;
+		}
+	}
+
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	log_end();
+	return 0;
+}
+
+double s_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+long s_resident_bytes(void) {
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
@@ -0,0 +1,67 @@
+#include "common/log.h"
+#include "occlusion.h"
+
+#include <stdio.h>
+
+/*
+ * Rasterizes a single wall in front of a camera at the origin looking down
+ * -z and checks which boxes the pyramid reports as hidden. The wall spans
+ * [-3, 3] in x and y at z = -10, so at z = -21 it hides |x|, |y| < 6.3.
+ */
+
+static int failed;
+
+static void s_expect(occlusion_s *occ, const char *what, vec3 min, vec3 max, bool hidden);
+
+int main(void) {
+	occlusion_s *occ;
+	occluder_mesh_s *wall;
+	mat4 viewproj, model;
+	const GLfloat quad[] = {
+		-1.0f, -1.0f, 0.0f,
+		1.0f, -1.0f, 0.0f,
+		1.0f, 1.0f, 0.0f,
+		-1.0f, 1.0f, 0.0f
+	};
+
+	log_init(stderr);
+	occ = occlusion_new();
+	wall = occluder_mesh_new(quad, 3, 4, NULL, GL_TRIANGLE_FAN, 0, 4);
+	if (!occ || !wall) {
+		fprintf(stderr, "FAIL: couldn't create the occlusion culler or the wall\n");
+		return 1;
+	}
+	glm_perspective(glm_rad(60.0f), (float)OCCLUSION_WIDTH / OCCLUSION_HEIGHT, 0.1f, 1000.0f, viewproj);
+
+	/* nothing is hidden before there's a pyramid */
+	s_expect(occ, "box before the pyramid is built", (vec3){-1, -1, -22}, (vec3){1, 1, -20}, false);
+
+	occlusion_begin(occ, viewproj);
+	glm_translate_make(model, (vec3){0.0f, 0.0f, -10.0f});
+	glm_scale(model, (vec3){3.0f, 3.0f, 1.0f});
+	occlusion_rasterize(occ, wall, model);
+	occlusion_end(occ);
+
+	s_expect(occ, "box behind the wall", (vec3){-1, -1, -22}, (vec3){1, 1, -20}, true);
+	s_expect(occ, "small box far behind the wall", (vec3){-5, -5, -110}, (vec3){5, 5, -100}, true);
+	s_expect(occ, "box in front of the wall", (vec3){-1, -1, -6}, (vec3){1, 1, -5}, false);
+	s_expect(occ, "box intersecting the wall", (vec3){-1, -1, -11}, (vec3){1, 1, -9}, false);
+	s_expect(occ, "box beside the wall", (vec3){8, -1, -22}, (vec3){10, 1, -20}, false);
+	s_expect(occ, "box straddling the wall's edge", (vec3){4, -1, -22}, (vec3){8, 1, -20}, false);
+	s_expect(occ, "box crossing the near plane", (vec3){-1, -1, -22}, (vec3){1, 1, 1}, false);
+	s_expect(occ, "box behind the camera", (vec3){-1, -1, 5}, (vec3){1, 1, 6}, false);
+	printf("%zu boxes tested, %zu hidden\n", occ->tested, occ->culled);
+
+	occluder_mesh_free(wall);
+	occlusion_free(occ);
+	log_end();
+	return failed;
+}
+
+void s_expect(occlusion_s *occ, const char *what, vec3 min, vec3 max, bool hidden) {
+	bool result = occlusion_box_hidden(occ, min, max);
+
+	printf("%s: %s %s\n", what, result ? "hidden" : "visible", result == hidden ? "ok" : "FAIL");
+	if (result != hidden)
+		failed = 1;
+}
@@ -0,0 +1,131 @@
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Builds an empty level database from level/schema.sql and explains every
+ * query the loader prepares, failing if any of them scans a whole table
+ * instead of using an index. R*Tree lookups are reported as scans of the
+ * virtual table and are fine. Run from the top of the tree:
+ *   ./tests/query_plans [path-to-schema.sql]
+ */
+
+#define QUERY_PLANS_SCHEMA "level/schema.sql"
+
+extern const char *level_properties_qstr;
+extern const char *instance_qstr;
+extern const char *range_qstr;
+extern const char *lazy_instance_qstr;
+extern const char *model_qstr;
+extern const char *mesh_qstr;
+extern const char *shader_qstr;
+extern const char *texture_qstr;
+extern const char *cell_qstr;
+extern const char *cell_instance_qstr;
+extern const char *cell_model_qstr;
+
+static char *s_read_file(const char *path);
+static int s_check_plan(sqlite3 *db, const char *name, const char *query);
+
+int main(int argc, char *argv[]) {
+	int rc, failed = 0;
+	char *schema, *err = NULL;
+	sqlite3 *db;
+	const struct {
+		const char *name;
+		const char *query;
+	} queries[] = {
+		{"level properties", level_properties_qstr},
+		{"instance", instance_qstr},
+		{"range", range_qstr},
+		{"lazy instance", lazy_instance_qstr},
+		{"model", model_qstr},
+		{"mesh", mesh_qstr},
+		{"shader", shader_qstr},
+		{"texture", texture_qstr},
+		{"cell", cell_qstr},
+		{"cell instance", cell_instance_qstr},
+		{"cell model", cell_model_qstr}
+	};
+	size_t i;
+
+	schema = s_read_file(argc > 1 ? argv[1] : QUERY_PLANS_SCHEMA);
+	if (!schema)
+		return 1;
+	rc = sqlite3_open(":memory:", &db);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "failed to open database: %s\n", sqlite3_errmsg(db));
+		return 1;
+	}
+	rc = sqlite3_exec(db, schema, NULL, NULL, &err);
+	free(schema);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "failed to create schema: %s\n", err);
+		sqlite3_free(err);
+		sqlite3_close(db);
+		return 1;
+	}
+
+	for (i = 0; i < sizeof queries / sizeof *queries; i++) {
+		if (s_check_plan(db, queries[i].name, queries[i].query) < 0)
+			failed = 1;
+	}
+	sqlite3_close(db);
+	return failed;
+}
+
+char *s_read_file(const char *path) {
+	long size;
+	char *buf;
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	buf = malloc(size + 1);
+	if (!buf || fread(buf, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "failed to read %s\n", path);
+		free(buf);
+		fclose(f);
+		return NULL;
+	}
+	buf[size] = '\0';
+	fclose(f);
+	return buf;
+}
+
+int s_check_plan(sqlite3 *db, const char *name, const char *query) {
+	int rc, scans = 0;
+	char *sql;
+	const char *detail;
+	sqlite3_stmt *plan;
+
+	sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", query);
+	if (!sql) {
+		fprintf(stderr, "failed to allocate memory for query plan\n");
+		return -1;
+	}
+	rc = sqlite3_prepare_v2(db, sql, -1, &plan, 0);
+	sqlite3_free(sql);
+	if (rc != SQLITE_OK) {
+		fprintf(stderr, "FAIL: %s query doesn't prepare: %s\n", name, sqlite3_errmsg(db));
+		return -1;
+	}
+	while (sqlite3_step(plan) == SQLITE_ROW) {
+		detail = (const char *)sqlite3_column_text(plan, 3);
+		if (detail && !strncmp(detail, "SCAN ", 5) && !strstr(detail, "VIRTUAL TABLE")) {
+			fprintf(stderr, "FAIL: %s query does a full scan (%s)\n", name, detail);
+			scans++;
+		}
+		else if (detail) {
+			printf("%s: %s\n", name, detail);
+		}
+	}
+	sqlite3_finalize(plan);
+	return scans ? -1 : 0;
+}